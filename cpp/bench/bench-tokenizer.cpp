@@ -0,0 +1,156 @@
+// Tokenizer benchmark: tokenize/detokenize throughput and heap allocations of the vocab of a model
+//
+// usage: bench-tokenizer model.gguf [repetitions]
+//
+// Only the vocab is loaded (vocab_only), on rnllama::bench_tokenizer_samples. Run it once per vocab to cover each
+// tokenizer type, e.g. with the llama.cpp/models/ggml-vocab-*.gguf files. The allocations are counted by replacing the
+// global operator new, which is why this is an executable and not part of the library. Build it against the library,
+// e.g.:
+//
+//   g++ -std=c++17 -O2 -Icpp cpp/bench/bench-tokenizer.cpp libllms.a -pthread -o bench-tokenizer
+
+#include "rn-llama.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <new>
+#include <string>
+#include <vector>
+
+static std::atomic<uint64_t> g_n_alloc{0};
+static std::atomic<uint64_t> g_n_alloc_bytes{0};
+
+static void * bench_alloc(size_t size) {
+    g_n_alloc.fetch_add(1, std::memory_order_relaxed);
+    g_n_alloc_bytes.fetch_add(size, std::memory_order_relaxed);
+    void * ptr = std::malloc(size ? size : 1);
+    if (ptr == nullptr) {
+        throw std::bad_alloc();
+    }
+    return ptr;
+}
+
+void * operator new  (size_t size) { return bench_alloc(size); }
+void * operator new[](size_t size) { return bench_alloc(size); }
+void * operator new  (size_t size, const std::nothrow_t &) noexcept { try { return bench_alloc(size); } catch (...) { return nullptr; } }
+void * operator new[](size_t size, const std::nothrow_t &) noexcept { try { return bench_alloc(size); } catch (...) { return nullptr; } }
+void operator delete  (void * ptr) noexcept { std::free(ptr); }
+void operator delete[](void * ptr) noexcept { std::free(ptr); }
+void operator delete  (void * ptr, size_t) noexcept { std::free(ptr); }
+void operator delete[](void * ptr, size_t) noexcept { std::free(ptr); }
+void operator delete  (void * ptr, const std::nothrow_t &) noexcept { std::free(ptr); }
+void operator delete[](void * ptr, const std::nothrow_t &) noexcept { std::free(ptr); }
+
+struct alloc_count {
+    uint64_t n;
+    uint64_t bytes;
+};
+
+static alloc_count alloc_count_now() {
+    return { g_n_alloc.load(std::memory_order_relaxed), g_n_alloc_bytes.load(std::memory_order_relaxed) };
+}
+
+int main(int argc, char ** argv) {
+    if (argc < 2) {
+        fprintf(stderr, "usage: %s model.gguf [repetitions]\n", argv[0]);
+        return 1;
+    }
+
+    const char * path_model = argv[1];
+    const int nr = argc > 2 ? std::max(1, atoi(argv[2])) : 10;
+
+    llama_log_set([](lm_ggml_log_level, const char *, void *) {}, nullptr);
+
+    llama_model_params model_params = llama_model_default_params();
+    model_params.vocab_only = true;
+
+    llama_model * model = llama_model_load_from_file(path_model, model_params);
+    if (model == nullptr) {
+        fprintf(stderr, "%s: failed to load vocab from '%s'\n", __func__, path_model);
+        return 1;
+    }
+    const llama_vocab * vocab = llama_model_get_vocab(model);
+
+    char model_desc[128];
+    llama_model_desc(model, model_desc, sizeof(model_desc));
+
+    printf("%s: %s, vocab type %d, %d tokens, %d repetitions\n\n", path_model, model_desc,
+            (int) llama_vocab_type(vocab), llama_vocab_n_tokens(vocab), nr);
+    printf("| %-8s | %8s | %8s | %12s | %8s | %12s | %10s | %10s | %12s | %12s |\n",
+            "sample", "bytes", "tokens", "tok t/s", "tok MB/s", "detok t/s", "detok MB/s",
+            "tok allocs", "tok bytes", "detok allocs");
+    printf("|%s|%s|%s|%s|%s|%s|%s|%s|%s|%s|\n",
+            "----------", "----------", "----------", "--------------", "----------", "--------------", "------------",
+            "------------", "--------------", "--------------");
+
+    int ret = 0;
+
+    for (const auto & sample : rnllama::bench_tokenizer_samples) {
+        std::string text;
+        while (text.size() < 64*1024) {
+            text += sample.second;
+        }
+
+        // the buffers are sized once, so that only the allocations of the tokenizer are counted
+        std::vector<llama_token> tokens(text.size() + 2);
+        std::string detokenized(2*text.size() + 64, '\0');
+
+        int32_t n_tokens = 0;
+        double t_tokenize = 0;
+        double t_detokenize = 0;
+        alloc_count a_tokenize   = { 0, 0 };
+        alloc_count a_detokenize = { 0, 0 };
+
+        for (int i = 0; i < nr; i++) {
+            const alloc_count a0 = alloc_count_now();
+            const int64_t t0 = llama_time_us();
+            n_tokens = llama_tokenize(vocab, text.data(), text.size(), tokens.data(), tokens.size(), false, false);
+            const int64_t t1 = llama_time_us();
+            const alloc_count a1 = alloc_count_now();
+
+            if (n_tokens < 0) {
+                fprintf(stderr, "%s: llama_tokenize() failed for sample '%s'\n", __func__, sample.first.c_str());
+                ret = 1;
+                break;
+            }
+
+            const int32_t n_chars = llama_detokenize(vocab, tokens.data(), n_tokens, &detokenized[0], detokenized.size(), false, false);
+            const int64_t t2 = llama_time_us();
+            const alloc_count a2 = alloc_count_now();
+
+            if (n_chars < 0) {
+                fprintf(stderr, "%s: llama_detokenize() failed for sample '%s'\n", __func__, sample.first.c_str());
+                ret = 1;
+                n_tokens = -1;
+                break;
+            }
+
+            t_tokenize   += (t1 - t0) / 1000000.0;
+            t_detokenize += (t2 - t1) / 1000000.0;
+
+            a_tokenize   = { a1.n - a0.n, a1.bytes - a0.bytes };
+            a_detokenize = { a2.n - a1.n, a2.bytes - a1.bytes };
+        }
+
+        if (n_tokens < 0) {
+            continue;
+        }
+
+        const double mb = text.size() * nr / (1024.0 * 1024.0);
+
+        // the allocations are those of the last repetition, the first one may fill caches of the vocab
+        printf("| %-8s | %8zu | %8d | %12.0f | %8.2f | %12.0f | %10.2f | %10llu | %12llu | %12llu |\n",
+                sample.first.c_str(), text.size(), n_tokens,
+                n_tokens * nr / t_tokenize, mb / t_tokenize,
+                n_tokens * nr / t_detokenize, mb / t_detokenize,
+                (unsigned long long) a_tokenize.n, (unsigned long long) a_tokenize.bytes,
+                (unsigned long long) a_detokenize.n);
+    }
+
+    llama_model_free(model);
+
+    return ret;
+}
@@ -1072,10 +1072,16 @@ struct llama_model_params common_model_params_to_llama(common_params & params) {
     mparams.vocab_only      = params.vocab_only;
     mparams.main_gpu        = params.main_gpu;
     mparams.split_mode      = params.split_mode;
+    mparams.hugepages       = params.hugepages;
     mparams.tensor_split    = params.tensor_split;
     mparams.use_mmap        = params.use_mmap;
     mparams.use_mlock       = params.use_mlock;
     mparams.check_tensors   = params.check_tensors;
+    mparams.use_mmap_residency = params.use_mmap_residency;
+
+    if (!params.repack_cache_dir.empty()) {
+        mparams.repack_cache_dir = params.repack_cache_dir.c_str();
+    }
 
     if (params.kv_overrides.empty()) {
         mparams.kv_overrides = NULL;
@@ -1127,6 +1133,8 @@ struct llama_context_params common_context_params_to_llama(const common_params &
     cparams.offload_kqv       = !params.no_kv_offload;
     cparams.flash_attn        = params.flash_attn;
     cparams.no_perf           = params.no_perf;
+    cparams.prefault          = params.prefault;
+    cparams.hugepages         = params.hugepages;
 
     if (params.reranking) {
         cparams.embeddings    = true;
@@ -1250,24 +1258,26 @@ std::vector<llama_token> common_tokenize(
   const struct llama_context * ctx,
            const std::string & text,
                         bool   add_special,
-                        bool   parse_special) {
+                        bool   parse_special,
+                     int32_t   n_threads) {
     const llama_model * model = llama_get_model(ctx);
     const llama_vocab * vocab = llama_model_get_vocab(model);
-    return common_tokenize(vocab, text, add_special, parse_special);
+    return common_tokenize(vocab, text, add_special, parse_special, n_threads);
 }
 
 std::vector<llama_token> common_tokenize(
     const struct llama_vocab * vocab,
            const std::string & text,
                         bool   add_special,
-                        bool   parse_special) {
+                        bool   parse_special,
+                     int32_t   n_threads) {
     // upper limit for the number of tokens
     int n_tokens = text.length() + 2 * add_special;
     std::vector<llama_token> result(n_tokens);
-    n_tokens = llama_tokenize(vocab, text.data(), text.length(), result.data(), result.size(), add_special, parse_special);
+    n_tokens = llama_tokenize_parallel(vocab, text.data(), text.length(), result.data(), result.size(), add_special, parse_special, n_threads);
     if (n_tokens < 0) {
         result.resize(-n_tokens);
-        int check = llama_tokenize(vocab, text.data(), text.length(), result.data(), result.size(), add_special, parse_special);
+        int check = llama_tokenize_parallel(vocab, text.data(), text.length(), result.data(), result.size(), add_special, parse_special, n_threads);
         LM_GGML_ASSERT(check == -n_tokens);
     } else {
         result.resize(n_tokens);
@@ -247,6 +247,8 @@ struct common_params {
 
     enum llama_split_mode split_mode = LLAMA_SPLIT_MODE_LAYER; // how to split the model across GPUs
 
+    enum llama_hugepages_type hugepages = LLAMA_HUGEPAGES_TYPE_NONE; // huge pages for the weight, KV and compute buffers
+
     struct cpu_params cpuparams;
     struct cpu_params cpuparams_batch;
 
@@ -275,6 +277,7 @@ struct common_params {
     std::string input_suffix         = ""; // string to suffix user inputs with                             // NOLINT
     std::string lookup_cache_static  = ""; // path of static ngram cache file for lookup decoding           // NOLINT
     std::string lookup_cache_dynamic = ""; // path of dynamic ngram cache file for lookup decoding          // NOLINT
+    std::string repack_cache_dir     = ""; // directory of the cache files of the CPU repacked weights      // NOLINT
     std::string logits_file          = ""; // file for saving *all* logits                                  // NOLINT
 
     std::vector<std::string> in_files;   // all input files
@@ -333,6 +336,8 @@ struct common_params {
     bool no_kv_offload     = false; // disable KV offloading
     bool warmup            = true;  // warmup run
     bool check_tensors     = false; // validate tensor data
+    bool use_mmap_residency = false; // page the mapped layer weights in graph order
+    bool prefault          = false; // fault in the compute buffers at context creation
 
     bool single_turn       = false; // single turn chat conversation
 
@@ -580,17 +585,20 @@ size_t common_lcs(const llama_tokens & a, const llama_tokens & b);
 
 // tokenizes a string into a vector of tokens
 // should work similar to Python's `tokenizer.encode`
+// long texts are tokenized on up to n_threads threads
 std::vector<llama_token> common_tokenize(
   const struct llama_context * ctx,
            const std::string & text,
                         bool   add_special,
-                        bool   parse_special = false);
+                        bool   parse_special = false,
+                     int32_t   n_threads = 1);
 
 std::vector<llama_token> common_tokenize(
     const struct llama_vocab * vocab,
            const std::string & text,
                         bool   add_special,
-                        bool   parse_special = false);
+                        bool   parse_special = false,
+                     int32_t   n_threads = 1);
 
 // tokenizes a token into a piece, optionally renders special/control tokens
 // should work similar to Python's `tokenizer.id_to_piece`
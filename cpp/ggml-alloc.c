@@ -670,7 +670,7 @@ static void lm_ggml_gallocr_alloc_graph_impl(lm_ggml_gallocr_t galloc, struct lm
     }
 }
 
-bool lm_ggml_gallocr_reserve_n(lm_ggml_gallocr_t galloc, struct lm_ggml_cgraph * graph, const int * node_buffer_ids, const int * leaf_buffer_ids) {
+static void lm_ggml_gallocr_plan(lm_ggml_gallocr_t galloc, struct lm_ggml_cgraph * graph, const int * node_buffer_ids, const int * leaf_buffer_ids) {
     size_t min_hash_size = graph->n_nodes + graph->n_leafs;
     // add 25% margin to avoid hash collisions
     min_hash_size += min_hash_size / 4;
@@ -693,6 +693,24 @@ bool lm_ggml_gallocr_reserve_n(lm_ggml_gallocr_t galloc, struct lm_ggml_cgraph *
 
     // allocate in hash table
     lm_ggml_gallocr_alloc_graph_impl(galloc, graph, node_buffer_ids, leaf_buffer_ids);
+}
+
+void lm_ggml_gallocr_reserve_n_size(lm_ggml_gallocr_t galloc, struct lm_ggml_cgraph * graph, const int * node_buffer_ids, const int * leaf_buffer_ids, size_t * sizes) {
+    lm_ggml_gallocr_plan(galloc, graph, node_buffer_ids, leaf_buffer_ids);
+
+    for (int i = 0; i < galloc->n_buffers; i++) {
+        sizes[i] = lm_ggml_dyn_tallocr_max_size(galloc->buf_tallocs[i]);
+        for (int j = 0; j < i; j++) {
+            if (galloc->buf_tallocs[j] == galloc->buf_tallocs[i]) {
+                sizes[i] = 0;
+                break;
+            }
+        }
+    }
+}
+
+bool lm_ggml_gallocr_reserve_n(lm_ggml_gallocr_t galloc, struct lm_ggml_cgraph * graph, const int * node_buffer_ids, const int * leaf_buffer_ids) {
+    lm_ggml_gallocr_plan(galloc, graph, node_buffer_ids, leaf_buffer_ids);
 
     // set the node_allocs from the hash table
     if (galloc->n_nodes < graph->n_nodes) {
@@ -931,6 +949,12 @@ size_t lm_ggml_gallocr_get_buffer_size(lm_ggml_gallocr_t galloc, int buffer_id)
     return lm_ggml_backend_buffer_get_size(galloc->buffers[buffer_id]);
 }
 
+lm_ggml_backend_buffer_t lm_ggml_gallocr_get_buffer(lm_ggml_gallocr_t galloc, int buffer_id) {
+    LM_GGML_ASSERT(buffer_id >= 0 && buffer_id < galloc->n_buffers);
+
+    return galloc->buffers[buffer_id];
+}
+
 // utils
 
 static void free_buffers(lm_ggml_backend_buffer_t ** buffers, const size_t * n_buffers) {
@@ -942,10 +966,10 @@ static void free_buffers(lm_ggml_backend_buffer_t ** buffers, const size_t * n_b
 
 static bool alloc_tensor_range(struct lm_ggml_context * ctx,
         struct lm_ggml_tensor * first, struct lm_ggml_tensor * last,
-        lm_ggml_backend_buffer_type_t buft, size_t size,
+        lm_ggml_backend_buffer_type_t buft, size_t size, bool dry,
         lm_ggml_backend_buffer_t ** buffers, size_t * n_buffers) {
 
-    lm_ggml_backend_buffer_t buffer = lm_ggml_backend_buft_alloc_buffer(buft, size);
+    lm_ggml_backend_buffer_t buffer = dry ? lm_ggml_backend_buft_alloc_dry_buffer(buft, size) : lm_ggml_backend_buft_alloc_buffer(buft, size);
     if (buffer == NULL) {
         LM_GGML_LOG_ERROR("%s: failed to allocate %s buffer of size %zu\n", __func__, lm_ggml_backend_buft_name(buft), size);
         free_buffers(buffers, n_buffers);
@@ -981,7 +1005,7 @@ static bool alloc_tensor_range(struct lm_ggml_context * ctx,
     return true;
 }
 
-lm_ggml_backend_buffer_t lm_ggml_backend_alloc_ctx_tensors_from_buft(struct lm_ggml_context * ctx, lm_ggml_backend_buffer_type_t buft) {
+static lm_ggml_backend_buffer_t lm_ggml_backend_alloc_ctx_tensors_from_buft_impl(struct lm_ggml_context * ctx, lm_ggml_backend_buffer_type_t buft, bool dry) {
     LM_GGML_ASSERT(lm_ggml_get_no_alloc(ctx) == true);
 
     size_t alignment = lm_ggml_backend_buft_get_alignment(buft);
@@ -1000,7 +1024,7 @@ lm_ggml_backend_buffer_t lm_ggml_backend_alloc_ctx_tensors_from_buft(struct lm_g
 
         if (cur_buf_size > 0 && (cur_buf_size + this_size) > max_size) {
             // allocate tensors in the current buffer
-            if (!alloc_tensor_range(ctx, first, t, buft, cur_buf_size, &buffers, &n_buffers)) {
+            if (!alloc_tensor_range(ctx, first, t, buft, cur_buf_size, dry, &buffers, &n_buffers)) {
                 return NULL;
             }
             first = t;
@@ -1012,7 +1036,7 @@ lm_ggml_backend_buffer_t lm_ggml_backend_alloc_ctx_tensors_from_buft(struct lm_g
 
     // allocate remaining tensors
     if (cur_buf_size > 0) {
-        if (!alloc_tensor_range(ctx, first, NULL, buft, cur_buf_size, &buffers, &n_buffers)) {
+        if (!alloc_tensor_range(ctx, first, NULL, buft, cur_buf_size, dry, &buffers, &n_buffers)) {
             return NULL;
         }
     }
@@ -1034,6 +1058,14 @@ lm_ggml_backend_buffer_t lm_ggml_backend_alloc_ctx_tensors_from_buft(struct lm_g
     return buffer;
 }
 
+lm_ggml_backend_buffer_t lm_ggml_backend_alloc_ctx_tensors_from_buft(struct lm_ggml_context * ctx, lm_ggml_backend_buffer_type_t buft) {
+    return lm_ggml_backend_alloc_ctx_tensors_from_buft_impl(ctx, buft, false);
+}
+
+lm_ggml_backend_buffer_t lm_ggml_backend_alloc_ctx_tensors_from_buft_dry(struct lm_ggml_context * ctx, lm_ggml_backend_buffer_type_t buft) {
+    return lm_ggml_backend_alloc_ctx_tensors_from_buft_impl(ctx, buft, true);
+}
+
 lm_ggml_backend_buffer_t lm_ggml_backend_alloc_ctx_tensors(struct lm_ggml_context * ctx, lm_ggml_backend_t backend) {
     return lm_ggml_backend_alloc_ctx_tensors_from_buft(ctx, lm_ggml_backend_get_default_buffer_type(backend));
 }
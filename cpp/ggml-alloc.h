@@ -60,16 +60,28 @@ LM_GGML_API bool lm_ggml_gallocr_reserve_n(
     const int * node_buffer_ids,
     const int * leaf_buffer_ids);
 
+// size of each buffer that lm_ggml_gallocr_reserve_n would allocate for the graph, without allocating or resizing them
+// sizes must have one element per buffer type, buffer types used more than once are counted at their first index only
+LM_GGML_API void lm_ggml_gallocr_reserve_n_size(
+    lm_ggml_gallocr_t galloc,
+    struct lm_ggml_cgraph * graph,
+    const int * node_buffer_ids,
+    const int * leaf_buffer_ids,
+    size_t * sizes);
+
 // automatic reallocation if the topology changes when using a single buffer
 // returns false if using multiple buffers and a re-allocation is needed (call lm_ggml_gallocr_reserve_n first to set the node buffers)
 LM_GGML_API bool lm_ggml_gallocr_alloc_graph(lm_ggml_gallocr_t galloc, struct lm_ggml_cgraph * graph);
 
 LM_GGML_API size_t lm_ggml_gallocr_get_buffer_size(lm_ggml_gallocr_t galloc, int buffer_id);
+LM_GGML_API lm_ggml_backend_buffer_t lm_ggml_gallocr_get_buffer(lm_ggml_gallocr_t galloc, int buffer_id);
 
 // Utils
 // Create a buffer and allocate all the tensors in a lm_ggml_context
 LM_GGML_API struct lm_ggml_backend_buffer * lm_ggml_backend_alloc_ctx_tensors_from_buft(struct lm_ggml_context * ctx, lm_ggml_backend_buffer_type_t buft);
 LM_GGML_API struct lm_ggml_backend_buffer * lm_ggml_backend_alloc_ctx_tensors(struct lm_ggml_context * ctx, lm_ggml_backend_t backend);
+// Same as lm_ggml_backend_alloc_ctx_tensors_from_buft, with dry buffers (see lm_ggml_backend_buft_alloc_dry_buffer)
+LM_GGML_API struct lm_ggml_backend_buffer * lm_ggml_backend_alloc_ctx_tensors_from_buft_dry(struct lm_ggml_context * ctx, lm_ggml_backend_buffer_type_t buft);
 
 #ifdef  __cplusplus
 }
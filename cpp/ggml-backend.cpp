@@ -44,6 +44,32 @@ lm_ggml_backend_buffer_t lm_ggml_backend_buft_alloc_buffer(lm_ggml_backend_buffe
     return buft->iface.alloc_buffer(buft, size);
 }
 
+static void * lm_ggml_backend_dry_buffer_get_base(lm_ggml_backend_buffer_t buffer) {
+    // any non-NULL address with the alignment of the buffer type, it is never dereferenced
+    return (void *) lm_ggml_backend_buft_get_alignment(buffer->buft);
+}
+
+static void lm_ggml_backend_dry_buffer_clear(lm_ggml_backend_buffer_t buffer, uint8_t value) {
+    LM_GGML_UNUSED(buffer);
+    LM_GGML_UNUSED(value);
+}
+
+static const struct lm_ggml_backend_buffer_i lm_ggml_backend_dry_buffer_i = {
+    /* .free_buffer     = */ NULL,
+    /* .get_base        = */ lm_ggml_backend_dry_buffer_get_base,
+    /* .init_tensor     = */ NULL,
+    /* .memset_tensor   = */ NULL,
+    /* .set_tensor      = */ NULL,
+    /* .get_tensor      = */ NULL,
+    /* .cpy_tensor      = */ NULL,
+    /* .clear           = */ lm_ggml_backend_dry_buffer_clear,
+    /* .reset           = */ NULL,
+};
+
+lm_ggml_backend_buffer_t lm_ggml_backend_buft_alloc_dry_buffer(lm_ggml_backend_buffer_type_t buft, size_t size) {
+    return lm_ggml_backend_buffer_init(buft, lm_ggml_backend_dry_buffer_i, NULL, size);
+}
+
 size_t lm_ggml_backend_buft_get_alignment(lm_ggml_backend_buffer_type_t buft) {
     return buft->iface.get_alignment(buft);
 }
@@ -1555,6 +1581,16 @@ bool lm_ggml_backend_sched_reserve(lm_ggml_backend_sched_t sched, struct lm_ggml
     return true;
 }
 
+void lm_ggml_backend_sched_reserve_size(lm_ggml_backend_sched_t sched, struct lm_ggml_cgraph * measure_graph, size_t * sizes) {
+    LM_GGML_ASSERT((int)sched->hash_set.size >= measure_graph->n_nodes + measure_graph->n_leafs);
+
+    lm_ggml_backend_sched_split_graph(sched, measure_graph);
+
+    lm_ggml_gallocr_reserve_n_size(sched->galloc, &sched->graph, sched->node_backend_ids, sched->leaf_backend_ids, sizes);
+
+    lm_ggml_backend_sched_reset(sched);
+}
+
 bool lm_ggml_backend_sched_alloc_graph(lm_ggml_backend_sched_t sched, struct lm_ggml_cgraph * graph) {
     LM_GGML_ASSERT((int)sched->hash_set.size >= graph->n_nodes + graph->n_leafs);
 
@@ -1625,6 +1661,13 @@ size_t lm_ggml_backend_sched_get_buffer_size(lm_ggml_backend_sched_t sched, lm_g
     return lm_ggml_gallocr_get_buffer_size(sched->galloc, backend_index);
 }
 
+lm_ggml_backend_buffer_t lm_ggml_backend_sched_get_buffer(lm_ggml_backend_sched_t sched, lm_ggml_backend_t backend) {
+    int backend_index = lm_ggml_backend_sched_backend_id(sched, backend);
+    LM_GGML_ASSERT(backend_index >= 0 && backend_index < sched->n_backends);
+
+    return lm_ggml_gallocr_get_buffer(sched->galloc, backend_index);
+}
+
 void lm_ggml_backend_sched_set_tensor_backend(lm_ggml_backend_sched_t sched, struct lm_ggml_tensor * node, lm_ggml_backend_t backend) {
     int backend_index = lm_ggml_backend_sched_backend_id(sched, backend);
     LM_GGML_ASSERT(backend_index >= 0 && backend_index < sched->n_backends);
@@ -42,6 +42,10 @@ extern "C" {
     LM_GGML_API bool                  lm_ggml_backend_buft_is_host       (lm_ggml_backend_buffer_type_t buft);
     LM_GGML_API lm_ggml_backend_dev_t    lm_ggml_backend_buft_get_device    (lm_ggml_backend_buffer_type_t buft);
 
+    // buffer of the given size without any memory behind it, for measuring: the tensors allocated in it get addresses
+    // but their data must never be accessed, clearing the buffer does nothing
+    LM_GGML_API lm_ggml_backend_buffer_t lm_ggml_backend_buft_alloc_dry_buffer(lm_ggml_backend_buffer_type_t buft, size_t size);
+
     //
     // Backend buffer
     //
@@ -190,6 +194,10 @@ extern "C" {
     typedef void                         (*lm_ggml_backend_set_n_threads_t)(lm_ggml_backend_t backend, int n_threads);
     // Get additional buffer types provided by the device (returns a NULL-terminated array)
     typedef lm_ggml_backend_buffer_type_t * (*lm_ggml_backend_dev_get_extra_bufts_t)(lm_ggml_backend_dev_t device);
+    // Name of the layout a tensor of the CPU repack buffer type is repacked to (returns NULL if it is not repacked)
+    typedef const char *                 (*lm_ggml_backend_cpu_repack_layout_t)(const struct lm_ggml_tensor * tensor);
+    // Buffer of the CPU repack buffer type over memory that already holds the repacked tensors
+    typedef lm_ggml_backend_buffer_t        (*lm_ggml_backend_cpu_repack_buffer_from_ptr_t)(void * ptr, size_t size);
     // Set the abort callback for the backend
     typedef void                         (*lm_ggml_backend_set_abort_callback_t)(lm_ggml_backend_t backend, lm_ggml_abort_callback abort_callback, void * abort_callback_data);
     // Get a list of feature flags supported by the backend (returns a NULL-terminated array)
@@ -295,6 +303,10 @@ extern "C" {
     // Initialize backend buffers from a measure graph
     LM_GGML_API bool                 lm_ggml_backend_sched_reserve(lm_ggml_backend_sched_t sched, struct lm_ggml_cgraph * measure_graph); // returns success
 
+    // Size of the buffer of each backend that lm_ggml_backend_sched_reserve would allocate for a measure graph, without allocating them
+    // sizes must have lm_ggml_backend_sched_get_n_backends elements
+    LM_GGML_API void                 lm_ggml_backend_sched_reserve_size(lm_ggml_backend_sched_t sched, struct lm_ggml_cgraph * measure_graph, size_t * sizes);
+
     LM_GGML_API int                  lm_ggml_backend_sched_get_n_backends(lm_ggml_backend_sched_t sched);
     LM_GGML_API lm_ggml_backend_t       lm_ggml_backend_sched_get_backend(lm_ggml_backend_sched_t sched, int i);
 
@@ -303,6 +315,7 @@ extern "C" {
     LM_GGML_API int                  lm_ggml_backend_sched_get_n_copies(lm_ggml_backend_sched_t sched);
 
     LM_GGML_API size_t               lm_ggml_backend_sched_get_buffer_size(lm_ggml_backend_sched_t sched, lm_ggml_backend_t backend);
+    LM_GGML_API lm_ggml_backend_buffer_t lm_ggml_backend_sched_get_buffer(lm_ggml_backend_sched_t sched, lm_ggml_backend_t backend);
 
     LM_GGML_API void                 lm_ggml_backend_sched_set_tensor_backend(lm_ggml_backend_sched_t sched, struct lm_ggml_tensor * node, lm_ggml_backend_t backend);
     LM_GGML_API lm_ggml_backend_t       lm_ggml_backend_sched_get_tensor_backend(lm_ggml_backend_sched_t sched, struct lm_ggml_tensor * node);
@@ -6339,6 +6339,26 @@ static void lm_ggml_backend_cpu_aarch64_buffer_set_tensor(lm_ggml_backend_buffer
     LM_GGML_UNUSED(buffer);
 }
 
+const char * lm_ggml_backend_cpu_aarch64_repack_layout(const struct lm_ggml_tensor * tensor) {
+    const ggml::cpu::tensor_traits * traits = lm_ggml_aarch64_get_optimal_repack_type(tensor);
+    if (traits == &ggml::cpu::aarch64::q4_0_4x4_q8_0) {
+        return "q4_0_4x4";
+    }
+    if (traits == &ggml::cpu::aarch64::q4_0_4x8_q8_0) {
+        return "q4_0_4x8";
+    }
+    if (traits == &ggml::cpu::aarch64::q4_0_8x8_q8_0) {
+        return "q4_0_8x8";
+    }
+    if (traits == &ggml::cpu::aarch64::q4_K_8x8_q8_K) {
+        return "q4_K_8x8";
+    }
+    if (traits == &ggml::cpu::aarch64::iq4_nl_4x4_q8_0) {
+        return "iq4_nl_4x4";
+    }
+    return nullptr;
+}
+
 static const char * lm_ggml_backend_cpu_aarch64_buffer_type_get_name(lm_ggml_backend_buffer_type_t buft) {
     return "CPU_AARCH64";
 
@@ -6360,6 +6380,22 @@ static lm_ggml_backend_buffer_t lm_ggml_backend_cpu_aarch64_buffer_type_alloc_bu
     return buffer;
 }
 
+lm_ggml_backend_buffer_t lm_ggml_backend_cpu_aarch64_buffer_from_ptr(void * ptr, size_t size) {
+    lm_ggml_backend_buffer_t buffer = lm_ggml_backend_cpu_buffer_from_ptr(ptr, size);
+
+    if (buffer == nullptr) {
+        return nullptr;
+    }
+
+    // the memory already holds repacked tensors, it is not written by set_tensor
+    buffer->buft              = lm_ggml_backend_cpu_aarch64_buffer_type();
+    buffer->iface.init_tensor = lm_ggml_backend_cpu_aarch64_buffer_init_tensor;
+    buffer->iface.set_tensor  = lm_ggml_backend_cpu_aarch64_buffer_set_tensor;
+    buffer->iface.get_tensor  = nullptr;
+    buffer->iface.cpy_tensor  = nullptr;
+    return buffer;
+}
+
 static size_t lm_ggml_backend_cpu_aarch64_buffer_type_get_alignment(lm_ggml_backend_buffer_type_t buft) {
     return TENSOR_ALIGNMENT;
 
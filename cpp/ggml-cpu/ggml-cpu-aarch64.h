@@ -6,3 +6,9 @@
 // GGML internal header
 
 lm_ggml_backend_buffer_type_t lm_ggml_backend_cpu_aarch64_buffer_type(void);
+
+// name of the layout the tensor is repacked to, NULL if it is not repacked
+const char * lm_ggml_backend_cpu_aarch64_repack_layout(const struct lm_ggml_tensor * tensor);
+
+// buffer of the aarch64 type over memory that already holds the repacked tensors, e.g. a mapped cache file
+lm_ggml_backend_buffer_t lm_ggml_backend_cpu_aarch64_buffer_from_ptr(void * ptr, size_t size);
@@ -606,6 +606,14 @@ static void * lm_ggml_backend_cpu_get_proc_address(lm_ggml_backend_reg_t reg, co
         lm_ggml_backend_dev_get_extra_bufts_t fct = lm_ggml_backend_cpu_device_get_extra_buffers_type;
         return (void *)fct;
     }
+    if (strcmp(name, "lm_ggml_backend_cpu_repack_layout") == 0) {
+        lm_ggml_backend_cpu_repack_layout_t fct = lm_ggml_backend_cpu_aarch64_repack_layout;
+        return (void *)fct;
+    }
+    if (strcmp(name, "lm_ggml_backend_cpu_repack_buffer_from_ptr") == 0) {
+        lm_ggml_backend_cpu_repack_buffer_from_ptr_t fct = lm_ggml_backend_cpu_aarch64_buffer_from_ptr;
+        return (void *)fct;
+    }
     if (strcmp(name, "lm_ggml_backend_get_features") == 0) {
         return (void *)lm_ggml_backend_cpu_get_features;
     }
@@ -0,0 +1,456 @@
+#include "gguf-hash.h"
+#include "ggml-impl.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <numeric>
+#include <string>
+#include <thread>
+#include <vector>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#define LM_GGUF_HASH_USE_MMAP
+#endif
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__)
+#if defined(__SHA__) && defined(__SSE4_1__)
+#include <immintrin.h>
+#define LM_GGUF_SHA256_X86
+#endif
+#elif defined(__aarch64__)
+#if defined(__ARM_FEATURE_SHA2) || defined(__ARM_FEATURE_CRYPTO)
+#include <arm_neon.h>
+#define LM_GGUF_SHA256_ARM
+#endif
+#endif
+
+// bytes hashed between two read-ahead hints, and size of the read buffer when the file is not mapped
+static constexpr size_t LM_GGUF_HASH_STEP = 16*1024*1024;
+
+alignas(16) static const uint32_t lm_gguf_sha256_k[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+//
+// SHA-256 block functions, each hashes n_blocks blocks of 64 bytes into state
+//
+
+#if defined(LM_GGUF_SHA256_X86)
+
+static void lm_gguf_sha256_blocks(uint32_t state[8], const uint8_t * data, size_t n_blocks) {
+    const __m128i mask = _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+
+    // the SHA-NI rounds work on the state as ABEF and CDGH
+    __m128i tmp = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *) &state[0]), 0xB1); // CDAB
+    __m128i s1  = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *) &state[4]), 0x1B); // EFGH
+    __m128i s0  = _mm_alignr_epi8(tmp, s1, 8);    // ABEF
+    s1          = _mm_blend_epi16(s1, tmp, 0xF0); // CDGH
+
+    for (; n_blocks > 0; --n_blocks, data += 64) {
+        const __m128i s0_save = s0;
+        const __m128i s1_save = s1;
+
+        // w[g % 4] holds the message words 4*g .. 4*g + 3
+        __m128i w[4];
+#pragma GCC unroll 16
+        for (int g = 0; g < 16; ++g) {
+            if (g < 4) {
+                w[g] = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *) (data + 16*g)), mask);
+            } else {
+                __m128i t = _mm_sha256msg1_epu32(w[g % 4], w[(g + 1) % 4]);
+                t = _mm_add_epi32(t, _mm_alignr_epi8(w[(g + 3) % 4], w[(g + 2) % 4], 4));
+                w[g % 4] = _mm_sha256msg2_epu32(t, w[(g + 3) % 4]);
+            }
+            const __m128i wk = _mm_add_epi32(w[g % 4], _mm_load_si128((const __m128i *) &lm_gguf_sha256_k[4*g]));
+            s1 = _mm_sha256rnds2_epu32(s1, s0, wk);
+            s0 = _mm_sha256rnds2_epu32(s0, s1, _mm_shuffle_epi32(wk, 0x0E));
+        }
+
+        s0 = _mm_add_epi32(s0, s0_save);
+        s1 = _mm_add_epi32(s1, s1_save);
+    }
+
+    tmp = _mm_shuffle_epi32(s0, 0x1B);       // FEBA
+    s1  = _mm_shuffle_epi32(s1, 0xB1);       // DCHG
+    s0  = _mm_blend_epi16(tmp, s1, 0xF0);    // DCBA
+    s1  = _mm_alignr_epi8(s1, tmp, 8);       // HGFE
+    _mm_storeu_si128((__m128i *) &state[0], s0);
+    _mm_storeu_si128((__m128i *) &state[4], s1);
+}
+
+#elif defined(LM_GGUF_SHA256_ARM)
+
+static void lm_gguf_sha256_blocks(uint32_t state[8], const uint8_t * data, size_t n_blocks) {
+    uint32x4_t s0 = vld1q_u32(&state[0]); // ABCD
+    uint32x4_t s1 = vld1q_u32(&state[4]); // EFGH
+
+    for (; n_blocks > 0; --n_blocks, data += 64) {
+        const uint32x4_t s0_save = s0;
+        const uint32x4_t s1_save = s1;
+
+        // w[g % 4] holds the message words 4*g .. 4*g + 3
+        uint32x4_t w[4];
+#pragma GCC unroll 16
+        for (int g = 0; g < 16; ++g) {
+            if (g < 4) {
+                w[g] = vreinterpretq_u32_u8(vrev32q_u8(vld1q_u8(data + 16*g)));
+            } else {
+                w[g % 4] = vsha256su1q_u32(vsha256su0q_u32(w[g % 4], w[(g + 1) % 4]), w[(g + 2) % 4], w[(g + 3) % 4]);
+            }
+            const uint32x4_t wk  = vaddq_u32(w[g % 4], vld1q_u32(&lm_gguf_sha256_k[4*g]));
+            const uint32x4_t tmp = s0;
+            s0 = vsha256hq_u32 (s0, s1,  wk);
+            s1 = vsha256h2q_u32(s1, tmp, wk);
+        }
+
+        s0 = vaddq_u32(s0, s0_save);
+        s1 = vaddq_u32(s1, s1_save);
+    }
+
+    vst1q_u32(&state[0], s0);
+    vst1q_u32(&state[4], s1);
+}
+
+#else
+
+static inline uint32_t lm_gguf_sha256_rotr(uint32_t x, int n) {
+    return (x >> n) | (x << (32 - n));
+}
+
+static void lm_gguf_sha256_blocks(uint32_t state[8], const uint8_t * data, size_t n_blocks) {
+    for (; n_blocks > 0; --n_blocks, data += 64) {
+        uint32_t w[64];
+        for (int i = 0; i < 16; ++i) {
+            w[i] = (uint32_t) data[4*i] << 24 | (uint32_t) data[4*i + 1] << 16 | (uint32_t) data[4*i + 2] << 8 | data[4*i + 3];
+        }
+        for (int i = 16; i < 64; ++i) {
+            const uint32_t s0 = lm_gguf_sha256_rotr(w[i - 15],  7) ^ lm_gguf_sha256_rotr(w[i - 15], 18) ^ (w[i - 15] >>  3);
+            const uint32_t s1 = lm_gguf_sha256_rotr(w[i -  2], 17) ^ lm_gguf_sha256_rotr(w[i -  2], 19) ^ (w[i -  2] >> 10);
+            w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+        }
+
+        uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+        uint32_t e = state[4], f = state[5], g = state[6], h = state[7];
+
+        for (int i = 0; i < 64; ++i) {
+            const uint32_t t1 = h + (lm_gguf_sha256_rotr(e, 6) ^ lm_gguf_sha256_rotr(e, 11) ^ lm_gguf_sha256_rotr(e, 25))
+                + ((e & f) ^ (~e & g)) + lm_gguf_sha256_k[i] + w[i];
+            const uint32_t t2 = (lm_gguf_sha256_rotr(a, 2) ^ lm_gguf_sha256_rotr(a, 13) ^ lm_gguf_sha256_rotr(a, 22))
+                + ((a & b) ^ (a & c) ^ (b & c));
+            h = g; g = f; f = e; e = d + t1;
+            d = c; c = b; b = a; a = t1 + t2;
+        }
+
+        state[0] += a; state[1] += b; state[2] += c; state[3] += d;
+        state[4] += e; state[5] += f; state[6] += g; state[7] += h;
+    }
+}
+
+#endif
+
+void lm_gguf_sha256_init(struct lm_gguf_sha256 * ctx) {
+    static const uint32_t h0[8] = {
+        0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+    };
+    memcpy(ctx->state, h0, sizeof(h0));
+    ctx->n_total = 0;
+    ctx->n_buf   = 0;
+}
+
+void lm_gguf_sha256_update(struct lm_gguf_sha256 * ctx, const void * data, size_t size) {
+    const uint8_t * p = (const uint8_t *) data;
+    ctx->n_total += size;
+
+    if (ctx->n_buf > 0) {
+        const size_t n = std::min(size, sizeof(ctx->buf) - ctx->n_buf);
+        memcpy(ctx->buf + ctx->n_buf, p, n);
+        ctx->n_buf += n;
+        p    += n;
+        size -= n;
+        if (ctx->n_buf < sizeof(ctx->buf)) {
+            return;
+        }
+        lm_gguf_sha256_blocks(ctx->state, ctx->buf, 1);
+        ctx->n_buf = 0;
+    }
+
+    // whole blocks are hashed in place
+    const size_t n_blocks = size / 64;
+    lm_gguf_sha256_blocks(ctx->state, p, n_blocks);
+    p    += n_blocks*64;
+    size -= n_blocks*64;
+
+    memcpy(ctx->buf, p, size);
+    ctx->n_buf = size;
+}
+
+void lm_gguf_sha256_final(struct lm_gguf_sha256 * ctx, uint8_t digest[LM_GGUF_HASH_SIZE]) {
+    const uint64_t n_bits = ctx->n_total*8;
+
+    uint8_t pad[128] = { 0x80 };
+    const size_t n_pad = (ctx->n_buf < 56 ? 56 : 120) - ctx->n_buf;
+    for (int i = 0; i < 8; ++i) {
+        pad[n_pad + i] = (uint8_t) (n_bits >> (56 - 8*i));
+    }
+    lm_gguf_sha256_update(ctx, pad, n_pad + 8);
+    LM_GGML_ASSERT(ctx->n_buf == 0);
+
+    for (int i = 0; i < 8; ++i) {
+        digest[4*i + 0] = (uint8_t) (ctx->state[i] >> 24);
+        digest[4*i + 1] = (uint8_t) (ctx->state[i] >> 16);
+        digest[4*i + 2] = (uint8_t) (ctx->state[i] >>  8);
+        digest[4*i + 3] = (uint8_t) (ctx->state[i] >>  0);
+    }
+}
+
+void lm_gguf_hash_to_hex(const uint8_t digest[LM_GGUF_HASH_SIZE], char * hex) {
+    static const char digits[] = "0123456789abcdef";
+    for (int i = 0; i < LM_GGUF_HASH_SIZE; ++i) {
+        hex[2*i + 0] = digits[digest[i] >> 4];
+        hex[2*i + 1] = digits[digest[i] & 0xF];
+    }
+    hex[2*LM_GGUF_HASH_SIZE] = '\0';
+}
+
+//
+// file access
+//
+
+// a read-only view of the file: a memory mapping, or the name of the file to read ranges from
+struct lm_gguf_hash_source {
+    std::string fname;
+    uint64_t    size = 0;
+    const uint8_t * addr = nullptr;
+
+    ~lm_gguf_hash_source() {
+#ifdef LM_GGUF_HASH_USE_MMAP
+        if (addr != nullptr) {
+            munmap((void *) addr, size);
+        }
+#endif
+    }
+
+    bool open(const char * path) {
+        fname = path;
+
+#ifdef LM_GGUF_HASH_USE_MMAP
+        const int fd = ::open(path, O_RDONLY);
+        if (fd < 0) {
+            return false;
+        }
+        struct stat st;
+        if (fstat(fd, &st) != 0) {
+            close(fd);
+            return false;
+        }
+        size = st.st_size;
+        if (size > 0) {
+            void * p = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+            if (p != MAP_FAILED) {
+                addr = (const uint8_t *) p;
+            }
+        }
+        close(fd);
+        if (addr != nullptr || size == 0) {
+            return true;
+        }
+#endif
+
+        FILE * file = lm_ggml_fopen(path, "rb");
+        if (file == nullptr) {
+            return false;
+        }
+        const bool ok = seek(file, 0, SEEK_END);
+        size = ok ? tell(file) : 0;
+        fclose(file);
+        return ok;
+    }
+
+    // adds the bytes [offset, offset + n) of the file to ctx, may be called from several threads
+    bool hash_range(uint64_t offset, uint64_t n, struct lm_gguf_sha256 * ctx) const {
+        if (offset > size || n > size - offset) {
+            return false;
+        }
+
+#ifdef LM_GGUF_HASH_USE_MMAP
+        if (addr != nullptr) {
+            // the page cache is read one step ahead of the hashing, so that the disk and the core both stay busy
+            will_need(offset, n);
+            for (uint64_t done = 0; done < n; done += LM_GGUF_HASH_STEP) {
+                const uint64_t step = std::min<uint64_t>(LM_GGUF_HASH_STEP, n - done);
+                if (done + step < n) {
+                    will_need(offset + done + step, std::min<uint64_t>(LM_GGUF_HASH_STEP, n - done - step));
+                }
+                lm_gguf_sha256_update(ctx, addr + offset + done, step);
+            }
+            return true;
+        }
+#endif
+
+        FILE * file = lm_ggml_fopen(fname.c_str(), "rb");
+        if (file == nullptr) {
+            return false;
+        }
+        bool ok = seek(file, offset, SEEK_SET);
+        std::vector<uint8_t> buf(std::min<uint64_t>(LM_GGUF_HASH_STEP, n));
+        for (uint64_t done = 0; ok && done < n; done += buf.size()) {
+            const size_t step = std::min<uint64_t>(buf.size(), n - done);
+            ok = fread(buf.data(), 1, step, file) == step;
+            if (ok) {
+                lm_gguf_sha256_update(ctx, buf.data(), step);
+            }
+        }
+        fclose(file);
+        return ok;
+    }
+
+private:
+    void will_need(uint64_t offset, uint64_t n) const {
+#if defined(LM_GGUF_HASH_USE_MMAP) && defined(MADV_WILLNEED)
+        static const uint64_t page_size = sysconf(_SC_PAGESIZE);
+        const uint64_t begin = offset & ~(page_size - 1);
+        madvise((void *) (addr + begin), offset + n - begin, MADV_WILLNEED);
+#else
+        LM_GGML_UNUSED(offset);
+        LM_GGML_UNUSED(n);
+#endif
+    }
+
+    static bool seek(FILE * file, uint64_t offset, int whence) {
+#ifdef _WIN32
+        return _fseeki64(file, (__int64) offset, whence) == 0;
+#else
+        return fseeko(file, (off_t) offset, whence) == 0;
+#endif
+    }
+
+    static uint64_t tell(FILE * file) {
+#ifdef _WIN32
+        return _ftelli64(file);
+#else
+        return ftello(file);
+#endif
+    }
+};
+
+// runs fn(i) for i in [0, n) on up to n_threads threads, false if any call returned false
+template <typename F>
+static bool lm_gguf_hash_parallel(size_t n, int n_threads, const F & fn) {
+    if (n_threads <= 0) {
+        n_threads = std::max(1u, std::thread::hardware_concurrency());
+    }
+    n_threads = (int) std::min<size_t>(n_threads, n);
+
+    std::atomic<size_t> next(0);
+    std::atomic<bool>   ok(true);
+
+    auto worker = [&]() {
+        for (size_t i = next++; i < n && ok; i = next++) {
+            if (!fn(i)) {
+                ok = false;
+            }
+        }
+    };
+
+    std::vector<std::thread> workers;
+    for (int i = 1; i < n_threads; ++i) {
+        workers.emplace_back(worker);
+    }
+    worker();
+    for (auto & w : workers) {
+        w.join();
+    }
+
+    return ok;
+}
+
+bool lm_gguf_hash_file(const char * fname, enum lm_gguf_hash_type type, int n_threads, uint8_t digest[LM_GGUF_HASH_SIZE]) {
+    lm_gguf_hash_source src;
+    if (!src.open(fname)) {
+        return false;
+    }
+
+    struct lm_gguf_sha256 ctx;
+    lm_gguf_sha256_init(&ctx);
+
+    switch (type) {
+        case LM_GGUF_HASH_SHA256:
+            {
+#if defined(LM_GGUF_HASH_USE_MMAP) && defined(MADV_SEQUENTIAL)
+                if (src.addr != nullptr) {
+                    madvise((void *) src.addr, src.size, MADV_SEQUENTIAL);
+                }
+#endif
+                if (!src.hash_range(0, src.size, &ctx)) {
+                    return false;
+                }
+            } break;
+        case LM_GGUF_HASH_SHA256_TREE:
+            {
+                const uint64_t n_chunks = (src.size + LM_GGUF_HASH_TREE_CHUNK_SIZE - 1) / LM_GGUF_HASH_TREE_CHUNK_SIZE;
+                std::vector<uint8_t> leaves(n_chunks*LM_GGUF_HASH_SIZE);
+
+                const bool ok = lm_gguf_hash_parallel(n_chunks, n_threads, [&](size_t i) {
+                    const uint64_t offset = i*(uint64_t) LM_GGUF_HASH_TREE_CHUNK_SIZE;
+                    struct lm_gguf_sha256 leaf;
+                    lm_gguf_sha256_init(&leaf);
+                    if (!src.hash_range(offset, std::min<uint64_t>(LM_GGUF_HASH_TREE_CHUNK_SIZE, src.size - offset), &leaf)) {
+                        return false;
+                    }
+                    lm_gguf_sha256_final(&leaf, leaves.data() + i*LM_GGUF_HASH_SIZE);
+                    return true;
+                });
+                if (!ok) {
+                    return false;
+                }
+                lm_gguf_sha256_update(&ctx, leaves.data(), leaves.size());
+            } break;
+        default:
+            LM_GGML_ABORT("invalid hash type %d", (int) type);
+    }
+
+    lm_gguf_sha256_final(&ctx, digest);
+    return true;
+}
+
+bool lm_gguf_hash_tensors(const char * fname, const struct lm_gguf_context * ctx, int n_threads, uint8_t * digests) {
+    lm_gguf_hash_source src;
+    if (!src.open(fname)) {
+        return false;
+    }
+
+    const int64_t n_tensors   = lm_gguf_get_n_tensors(ctx);
+    const size_t  data_offset = lm_gguf_get_data_offset(ctx);
+
+    // the largest tensors are started first so that no thread is left with a large one at the end
+    std::vector<int64_t> order(n_tensors);
+    std::iota(order.begin(), order.end(), 0);
+    std::stable_sort(order.begin(), order.end(), [&](int64_t a, int64_t b) {
+        return lm_gguf_get_tensor_size(ctx, a) > lm_gguf_get_tensor_size(ctx, b);
+    });
+
+    return lm_gguf_hash_parallel(order.size(), n_threads, [&](size_t i) {
+        const int64_t tensor_id = order[i];
+        struct lm_gguf_sha256 sha;
+        lm_gguf_sha256_init(&sha);
+        if (!src.hash_range(data_offset + lm_gguf_get_tensor_offset(ctx, tensor_id), lm_gguf_get_tensor_size(ctx, tensor_id), &sha)) {
+            return false;
+        }
+        lm_gguf_sha256_final(&sha, digests + tensor_id*LM_GGUF_HASH_SIZE);
+        return true;
+    });
+}
@@ -0,0 +1,65 @@
+// Hashing of model files for integrity checks.
+//
+// The file is read through a read-only memory mapping (or large reads where mmap is not available) and hashed with
+// SHA-256, using the SHA extensions of x86 (SHA-NI) or ARMv8 when the compiler targets them.
+//
+// LM_GGUF_HASH_SHA256 is the standard digest of the whole file, the same as sha256sum. SHA-256 is sequential, so
+// only the reading overlaps with the hashing.
+//
+// LM_GGUF_HASH_SHA256_TREE hashes the file in chunks of LM_GGUF_HASH_TREE_CHUNK_SIZE bytes on all threads, the digest
+// is the SHA-256 of the concatenated SHA-256 of the chunks (the last chunk may be shorter). It is not compatible with
+// sha256sum but scales with the number of cores.
+//
+// The tensors of a GGUF file can also be hashed one by one (like gguf-hash), which tells which tensors differ.
+
+#pragma once
+
+#include "ggml.h"
+#include "gguf.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define LM_GGUF_HASH_SIZE 32
+
+#define LM_GGUF_HASH_TREE_CHUNK_SIZE (4*1024*1024)
+
+#ifdef  __cplusplus
+extern "C" {
+#endif
+
+    enum lm_gguf_hash_type {
+        LM_GGUF_HASH_SHA256      = 0,
+        LM_GGUF_HASH_SHA256_TREE = 1,
+    };
+
+    // incremental SHA-256
+    struct lm_gguf_sha256 {
+        uint32_t state[8];
+        uint64_t n_total; // bytes hashed so far
+        uint8_t  buf[64];
+        size_t   n_buf;   // bytes pending in buf
+    };
+
+    LM_GGML_API void lm_gguf_sha256_init  (struct lm_gguf_sha256 * ctx);
+    LM_GGML_API void lm_gguf_sha256_update(struct lm_gguf_sha256 * ctx, const void * data, size_t size);
+    LM_GGML_API void lm_gguf_sha256_final (struct lm_gguf_sha256 * ctx, uint8_t digest[LM_GGUF_HASH_SIZE]);
+
+    // hash of the whole file, n_threads <= 0 uses all cores (only the tree mode uses more than one thread)
+    // returns false if the file can not be read
+    LM_GGML_API bool lm_gguf_hash_file(
+            const char * fname, enum lm_gguf_hash_type type, int n_threads, uint8_t digest[LM_GGUF_HASH_SIZE]);
+
+    // SHA-256 of the data of each tensor of ctx, which must have been read from fname (e.g. with no_alloc)
+    // digests must have room for lm_gguf_get_n_tensors(ctx)*LM_GGUF_HASH_SIZE bytes, the tensors are hashed in parallel
+    // returns false if the file can not be read or is shorter than the tensor data
+    LM_GGML_API bool lm_gguf_hash_tensors(
+            const char * fname, const struct lm_gguf_context * ctx, int n_threads, uint8_t * digests);
+
+    // lower-case hex of a digest, hex must have room for 2*LM_GGUF_HASH_SIZE + 1 chars
+    LM_GGML_API void lm_gguf_hash_to_hex(const uint8_t digest[LM_GGUF_HASH_SIZE], char * hex);
+
+#ifdef  __cplusplus
+}
+#endif
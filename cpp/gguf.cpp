@@ -3,6 +3,7 @@
 #include "ggml-impl.h"
 #include "gguf.h"
 
+#include <algorithm>
 #include <cinttypes>
 #include <cstddef>
 #include <cstdint>
@@ -10,11 +11,20 @@
 #include <cstdlib>
 #include <cstring>
 #include <map>
+#include <mutex>
 #include <new>
 #include <stdexcept>
 #include <string>
+#include <utility>
 #include <vector>
 
+#if defined(__unix__) || defined(__APPLE__)
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#define LM_GGUF_USE_MMAP
+#endif
+
 template <typename T>
 struct type_to_lm_gguf_type;
 
@@ -124,7 +134,11 @@ struct lm_gguf_kv {
     enum lm_gguf_type type;
 
     std::vector<int8_t>      data;
-    std::vector<std::string> data_string;
+    mutable std::vector<std::string> data_string;
+
+    // the strings of an array parsed from a mapping of the file point into the mapping, data_string is only filled
+    // from them when NUL-terminated strings are asked for
+    std::vector<std::pair<const char *, size_t>> data_view;
 
     template <typename T>
     lm_gguf_kv(const std::string & key, const T value)
@@ -139,9 +153,13 @@ struct lm_gguf_kv {
             : key(key), is_array(true), type(type_to_lm_gguf_type<T>::value) {
         LM_GGML_ASSERT(!key.empty());
         data.resize(value.size()*sizeof(T));
-        for (size_t i = 0; i < value.size(); ++i) {
-            const T tmp = value[i];
-            memcpy(data.data() + i*sizeof(T), &tmp, sizeof(T));
+        if constexpr (std::is_same<T, bool>::value) {
+            for (size_t i = 0; i < value.size(); ++i) {
+                const T tmp = value[i];
+                memcpy(data.data() + i*sizeof(T), &tmp, sizeof(T));
+            }
+        } else if (!value.empty()) {
+            memcpy(data.data(), value.data(), value.size()*sizeof(T));
         }
     }
 
@@ -157,6 +175,18 @@ struct lm_gguf_kv {
         data_string = value;
     }
 
+    lm_gguf_kv(const std::string & key, std::vector<std::string> && value)
+            : key(key), is_array(true), type(LM_GGUF_TYPE_STRING) {
+        LM_GGML_ASSERT(!key.empty());
+        data_string = std::move(value);
+    }
+
+    lm_gguf_kv(const std::string & key, std::vector<std::pair<const char *, size_t>> && value)
+            : key(key), is_array(true), type(LM_GGUF_TYPE_STRING) {
+        LM_GGML_ASSERT(!key.empty());
+        data_view = std::move(value);
+    }
+
     const std::string & get_key() const {
         return key;
     }
@@ -167,7 +197,7 @@ struct lm_gguf_kv {
 
     size_t get_ne() const {
         if (type == LM_GGUF_TYPE_STRING) {
-            const size_t ne = data_string.size();
+            const size_t ne = data_view.empty() ? data_string.size() : data_view.size();
             LM_GGML_ASSERT(is_array || ne == 1);
             return ne;
         }
@@ -182,8 +212,9 @@ struct lm_gguf_kv {
     const T & get_val(const size_t i = 0) const {
         LM_GGML_ASSERT(type_to_lm_gguf_type<T>::value == type);
         if constexpr (std::is_same<T, std::string>::value) {
-            LM_GGML_ASSERT(data_string.size() >= i+1);
-            return data_string[i];
+            const std::vector<std::string> & strs = get_strs();
+            LM_GGML_ASSERT(strs.size() >= i+1);
+            return strs[i];
         }
         const size_t type_size = lm_gguf_type_size(type);
         LM_GGML_ASSERT(data.size() % type_size == 0);
@@ -191,6 +222,32 @@ struct lm_gguf_kv {
         return reinterpret_cast<const T *>(data.data())[i];
     }
 
+    const std::vector<std::string> & get_strs() const {
+        LM_GGML_ASSERT(type == LM_GGUF_TYPE_STRING);
+        if (data_view.empty()) {
+            return data_string;
+        }
+        static std::mutex mutex;
+        std::lock_guard<std::mutex> lock(mutex);
+        if (data_string.empty()) {
+            data_string.reserve(data_view.size());
+            for (const auto & view : data_view) {
+                data_string.emplace_back(view.first, view.second);
+            }
+        }
+        return data_string;
+    }
+
+    std::pair<const char *, size_t> get_str_view(const size_t i) const {
+        LM_GGML_ASSERT(type == LM_GGUF_TYPE_STRING);
+        if (data_view.empty()) {
+            LM_GGML_ASSERT(data_string.size() >= i+1);
+            return { data_string[i].data(), data_string[i].size() };
+        }
+        LM_GGML_ASSERT(data_view.size() >= i+1);
+        return data_view[i];
+    }
+
     void cast(const enum lm_gguf_type new_type) {
         const size_t new_type_size = lm_gguf_type_size(new_type);
         LM_GGML_ASSERT(data.size() % new_type_size == 0);
@@ -214,33 +271,64 @@ struct lm_gguf_context {
     size_t size      = 0; // size of `data` in bytes
 
     void * data = nullptr;
+
+    // the mapping of the metadata the string arrays point into, if the file was parsed from a mapping
+    void * map_addr = nullptr;
+    size_t map_size = 0;
 };
 
 struct lm_gguf_reader {
-    FILE * file;
+    FILE * file = nullptr;
+
+    // if the file is mapped into memory, read straight from the mapping instead of going through stdio
+    const uint8_t * addr = nullptr;
+    size_t          size = 0;
+    mutable size_t  pos  = 0;
 
     lm_gguf_reader(FILE * file) : file(file) {}
+    lm_gguf_reader(const void * addr, size_t size) : addr((const uint8_t *) addr), size(size) {}
+
+    // number of bytes left in the mapping, SIZE_MAX if unknown
+    size_t n_left() const {
+        if (addr == nullptr) {
+            return SIZE_MAX;
+        }
+        return pos < size ? size - pos : 0;
+    }
 
     template <typename T>
     bool read(T & dst) const {
-        return fread(&dst, 1, sizeof(dst), file) == sizeof(dst);
+        return read(&dst, sizeof(dst));
     }
 
     template <typename T>
     bool read(std::vector<T> & dst, const size_t n) const {
+        if constexpr (std::is_same<T, std::string>::value) {
+            // every string is prefixed with its 64 bit length
+            if (n > n_left()/sizeof(uint64_t)) {
+                return false;
+            }
+        } else if (n > n_left()/sizeof(T)) {
+            return false;
+        }
         dst.resize(n);
-        for (size_t i = 0; i < dst.size(); ++i) {
-            if constexpr (std::is_same<T, bool>::value) {
+        if constexpr (std::is_same<T, bool>::value) {
+            for (size_t i = 0; i < dst.size(); ++i) {
                 bool tmp;
                 if (!read(tmp)) {
                     return false;
                 }
                 dst[i] = tmp;
-            } else {
+            }
+        } else if constexpr (std::is_same<T, std::string>::value) {
+            for (size_t i = 0; i < dst.size(); ++i) {
                 if (!read(dst[i])) {
                     return false;
                 }
             }
+        } else {
+            // the remaining types are read as they are stored, one read for the whole array
+            return read(dst.data(), dst.size()*sizeof(T));
         }
         return true;
     }
@@ -277,13 +365,62 @@ struct lm_gguf_reader {
         if (!read(size)) {
             return false;
         }
+        if (addr != nullptr) {
+            if (size > n_left()) {
+                return false;
+            }
+            dst.assign((const char *) addr + pos, size);
+            pos += size;
+            return true;
+        }
         dst.resize(size);
         return fread(dst.data(), 1, dst.length(), file) == dst.length();
     }
 
+    // n strings as pointers into the mapping, without copying them
+    bool read_views(std::vector<std::pair<const char *, size_t>> & dst, const size_t n) const {
+        LM_GGML_ASSERT(addr != nullptr);
+        if (n > n_left()/sizeof(uint64_t)) {
+            return false;
+        }
+        dst.resize(n);
+        for (size_t i = 0; i < n; ++i) {
+            uint64_t size = -1;
+            if (!read(size) || size > n_left()) {
+                return false;
+            }
+            dst[i] = { (const char *) addr + pos, size };
+            pos += size;
+        }
+        return true;
+    }
+
     bool read(void * dst, const size_t size) const {
+        if (addr != nullptr) {
+            if (size > n_left()) {
+                return false;
+            }
+            memcpy(dst, addr + pos, size);
+            pos += size;
+            return true;
+        }
         return fread(dst, 1, size, file) == size;
     }
+
+    size_t tell() const {
+        if (addr != nullptr) {
+            return pos;
+        }
+        return ftell(file);
+    }
+
+    bool seek(const size_t offset) const {
+        if (addr != nullptr) {
+            pos = offset;
+            return true;
+        }
+        return fseek(file, offset, SEEK_SET) == 0;
+    }
 };
 
 struct lm_gguf_context * lm_gguf_init_empty(void) {
@@ -292,6 +429,21 @@ struct lm_gguf_context * lm_gguf_init_empty(void) {
 
 template<typename T>
 bool lm_gguf_read_emplace_helper(const struct lm_gguf_reader & gr, std::vector<struct lm_gguf_kv> & kv, const std::string & key, const bool is_array, const size_t n) {
+    if constexpr (std::is_same<T, std::string>::value) {
+        if (is_array && gr.addr != nullptr) {
+            std::vector<std::pair<const char *, size_t>> value;
+            try {
+                if (!gr.read_views(value, n)) {
+                    return false;
+                }
+            } catch (std::bad_alloc &) {
+                fprintf(stderr, "%s: encountered bad_alloc error while reading value for key '%s'\n", __func__, key.c_str());
+                return false;
+            }
+            kv.emplace_back(key, std::move(value));
+            return true;
+        }
+    }
     if (is_array) {
         std::vector<T> value;
         try {
@@ -305,7 +457,7 @@ bool lm_gguf_read_emplace_helper(const struct lm_gguf_reader & gr, std::vector<s
             fprintf(stderr, "%s: encountered bad_alloc error while reading value for key '%s'\n", __func__, key.c_str());
             return false;
         }
-        kv.emplace_back(key, value);
+        kv.emplace_back(key, std::move(value));
     } else {
         T value;
         if (!gr.read(value)) {
@@ -316,8 +468,7 @@ bool lm_gguf_read_emplace_helper(const struct lm_gguf_reader & gr, std::vector<s
     return true;
 }
 
-struct lm_gguf_context * lm_gguf_init_from_file_impl(FILE * file, struct lm_gguf_init_params params) {
-    const struct lm_gguf_reader gr(file);
+static struct lm_gguf_context * lm_gguf_init_from_reader(const struct lm_gguf_reader & gr, struct lm_gguf_init_params params) {
     struct lm_gguf_context * ctx = new lm_gguf_context;
 
     bool ok = true;
@@ -589,14 +740,14 @@ struct lm_gguf_context * lm_gguf_init_from_file_impl(FILE * file, struct lm_gguf
     LM_GGML_ASSERT(int64_t(ctx->info.size()) == n_tensors);
 
     // we require the data section to be aligned, so take into account any padding
-    if (fseek(file, LM_GGML_PAD(ftell(file), ctx->alignment), SEEK_SET) != 0) {
+    if (!gr.seek(LM_GGML_PAD(gr.tell(), ctx->alignment))) {
         fprintf(stderr, "%s: failed to seek to beginning of data section\n", __func__);
         lm_gguf_free(ctx);
         return nullptr;
     }
 
     // store the current file offset - this is where the data section starts
-    ctx->offset = ftell(file);
+    ctx->offset = gr.tell();
 
     // compute the total size of the data section, taking into account the alignment
     {
@@ -702,6 +853,11 @@ struct lm_gguf_context * lm_gguf_init_from_file_impl(FILE * file, struct lm_gguf
     return ctx;
 }
 
+struct lm_gguf_context * lm_gguf_init_from_file_impl(FILE * file, struct lm_gguf_init_params params) {
+    const struct lm_gguf_reader gr(file);
+    return lm_gguf_init_from_reader(gr, params);
+}
+
 struct lm_gguf_context * lm_gguf_init_from_file(const char * fname, struct lm_gguf_init_params params) {
     FILE * file = lm_ggml_fopen(fname, "rb");
 
@@ -710,6 +866,49 @@ struct lm_gguf_context * lm_gguf_init_from_file(const char * fname, struct lm_gg
         return nullptr;
     }
 
+#ifdef LM_GGUF_USE_MMAP
+    // parse the metadata from a read-only mapping of the file: the large arrays (vocab, scores, merges) are then
+    // copied out of the page cache in one go instead of element by element through stdio, and the string arrays are
+    // not copied at all, the context keeps the pages of the metadata mapped for them
+    {
+        struct stat st;
+        if (fstat(fileno(file), &st) == 0 && st.st_size > 0) {
+            const size_t size = st.st_size;
+            void * addr = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fileno(file), 0);
+            if (addr != MAP_FAILED) {
+#ifdef MADV_SEQUENTIAL
+                madvise(addr, size, MADV_SEQUENTIAL);
+#endif
+                const struct lm_gguf_reader gr(addr, size);
+                struct lm_gguf_context * result = lm_gguf_init_from_reader(gr, params);
+                fclose(file);
+
+                bool has_views = false;
+                for (size_t i = 0; result != nullptr && i < result->kv.size(); ++i) {
+                    has_views = has_views || !result->kv[i].data_view.empty();
+                }
+                if (!has_views) {
+                    munmap(addr, size);
+                    return result;
+                }
+
+                // the tensor data is not needed anymore, the metadata ends at the data section
+                const size_t page_size = sysconf(_SC_PAGESIZE);
+                const size_t map_size  = std::min(size, (result->offset + page_size - 1)/page_size*page_size);
+                if (map_size < size) {
+                    munmap((uint8_t *) addr + map_size, size - map_size);
+                }
+#ifdef MADV_NORMAL
+                madvise(addr, map_size, MADV_NORMAL);
+#endif
+                result->map_addr = addr;
+                result->map_size = map_size;
+                return result;
+            }
+        }
+    }
+#endif
+
     struct lm_gguf_context * result = lm_gguf_init_from_file_impl(file, params);
     fclose(file);
     return result;
@@ -719,6 +918,11 @@ void lm_gguf_free(struct lm_gguf_context * ctx) {
     if (ctx == nullptr) {
         return;
     }
+#ifdef LM_GGUF_USE_MMAP
+    if (ctx->map_addr != nullptr) {
+        munmap(ctx->map_addr, ctx->map_size);
+    }
+#endif
     delete ctx;
 }
 
@@ -784,14 +988,22 @@ const void * lm_gguf_get_arr_data(const struct lm_gguf_context * ctx, int64_t ke
 const char * lm_gguf_get_arr_str(const struct lm_gguf_context * ctx, int64_t key_id, size_t i) {
     LM_GGML_ASSERT(key_id >= 0 && key_id < lm_gguf_get_n_kv(ctx));
     LM_GGML_ASSERT(ctx->kv[key_id].get_type() == LM_GGUF_TYPE_STRING);
-    return ctx->kv[key_id].data_string[i].c_str();
+    return ctx->kv[key_id].get_val<std::string>(i).c_str();
+}
+
+const char * lm_gguf_get_arr_str_view(const struct lm_gguf_context * ctx, int64_t key_id, size_t i, size_t * len) {
+    LM_GGML_ASSERT(key_id >= 0 && key_id < lm_gguf_get_n_kv(ctx));
+    LM_GGML_ASSERT(ctx->kv[key_id].get_type() == LM_GGUF_TYPE_STRING);
+    const std::pair<const char *, size_t> view = ctx->kv[key_id].get_str_view(i);
+    *len = view.second;
+    return view.first;
 }
 
 size_t lm_gguf_get_arr_n(const struct lm_gguf_context * ctx, int64_t key_id) {
     LM_GGML_ASSERT(key_id >= 0 && key_id < lm_gguf_get_n_kv(ctx));
 
     if (ctx->kv[key_id].type == LM_GGUF_TYPE_STRING) {
-        return ctx->kv[key_id].data_string.size();
+        return ctx->kv[key_id].get_ne();
     }
 
     const size_t type_size = lm_gguf_type_size(ctx->kv[key_id].type);
@@ -1079,7 +1291,7 @@ void lm_gguf_set_kv(struct lm_gguf_context * ctx, const struct lm_gguf_context *
             case LM_GGUF_TYPE_STRING: {
                 std::vector<const char *> tmp(ne);
                 for (size_t j = 0; j < ne; ++j) {
-                    tmp[j] = kv.data_string[j].c_str();
+                    tmp[j] = kv.get_strs()[j].c_str();
                 }
                 lm_gguf_set_arr_str(ctx, kv.get_key().c_str(), tmp.data(), ne);
             } break;
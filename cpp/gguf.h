@@ -118,6 +118,10 @@ extern "C" {
     // get ith C string from array with given key_id
     LM_GGML_API const char * lm_gguf_get_arr_str (const struct lm_gguf_context * ctx, int64_t key_id, size_t i);
 
+    // get ith string from array with given key_id as a pointer and its length in *len, without copying it
+    // the string is not NUL-terminated and is valid for the lifetime of the context
+    LM_GGML_API const char * lm_gguf_get_arr_str_view(const struct lm_gguf_context * ctx, int64_t key_id, size_t i, size_t * len);
+
     LM_GGML_API int64_t        lm_gguf_get_n_tensors    (const struct lm_gguf_context * ctx);
     LM_GGML_API int64_t        lm_gguf_find_tensor      (const struct lm_gguf_context * ctx, const char * name); // returns -1 if the tensor is not found
     LM_GGML_API size_t         lm_gguf_get_tensor_offset(const struct lm_gguf_context * ctx, int64_t tensor_id);
@@ -18,7 +18,8 @@
 
 llama_context::llama_context(
         const llama_model & model,
-              llama_context_params params) :
+              llama_context_params params,
+              bool dry_run) :
     model(model) {
     LLAMA_LOG_INFO("%s: constructing llama_context\n", __func__);
 
@@ -38,7 +39,10 @@ llama_context::llama_context(
     cparams.embeddings       = params.embeddings;
     cparams.offload_kqv      = params.offload_kqv;
     cparams.flash_attn       = params.flash_attn;
+    cparams.dry_run          = dry_run;
     cparams.no_perf          = params.no_perf;
+    cparams.prefault         = params.prefault;
+    cparams.hugepages        = params.hugepages;
     cparams.pooling_type     = params.pooling_type;
     cparams.warmup           = false;
 
@@ -321,7 +325,7 @@ llama_context::llama_context(
             auto * gf = graph_init();
             graph_build(ctx_compute.get(), gf, ubatch_pp, LLM_GRAPH_TYPE_DEFAULT);
 
-            if (!lm_ggml_backend_sched_reserve(sched.get(), gf)) {
+            if (!graph_reserve(gf)) {
                 throw std::runtime_error("failed to allocate compute pp buffers");
             }
 
@@ -340,7 +344,7 @@ llama_context::llama_context(
             auto * gf = graph_init();
             graph_build(ctx_compute.get(), gf, ubatch_tg, LLM_GRAPH_TYPE_DEFAULT);
 
-            if (!lm_ggml_backend_sched_reserve(sched.get(), gf)) {
+            if (!graph_reserve(gf)) {
                 throw std::runtime_error("failed to allocate compute tg buffers");
             }
 
@@ -359,7 +363,7 @@ llama_context::llama_context(
             auto * gf = graph_init();
             graph_build(ctx_compute.get(), gf, ubatch_pp, LLM_GRAPH_TYPE_DEFAULT);
 
-            if (!lm_ggml_backend_sched_reserve(sched.get(), gf)) {
+            if (!graph_reserve(gf)) {
                 throw std::runtime_error("failed to allocate compute pp buffers");
             }
         }
@@ -369,11 +373,27 @@ llama_context::llama_context(
         for (size_t i = 0; i < backend_ptrs.size(); ++i) {
             lm_ggml_backend_t             backend = backend_ptrs[i];
             lm_ggml_backend_buffer_type_t buft    = backend_buft[i];
-            size_t size = lm_ggml_backend_sched_get_buffer_size(sched.get(), backend);
+            size_t size = cparams.dry_run ? compute_sizes_dry[i] : lm_ggml_backend_sched_get_buffer_size(sched.get(), backend);
             if (size > 1) {
-                LLAMA_LOG_INFO("%s: %10s compute buffer size = %8.2f MiB\n", __func__,
+                LLAMA_LOG_INFO("%s: %10s compute buffer size = %8.2f MiB%s\n", __func__,
                         lm_ggml_backend_buft_name(buft),
-                        size / 1024.0 / 1024.0);
+                        size / 1024.0 / 1024.0, cparams.dry_run ? " (dry run)" : "");
+            }
+            compute_size += size;
+
+            if (cparams.dry_run) {
+                continue;
+            }
+
+            // the compute buffers are allocated by the scheduler, only the policies that apply to existing memory are available
+            lm_ggml_backend_buffer_t buf = lm_ggml_backend_sched_get_buffer(sched.get(), backend);
+            if (buf && size > 1 && lm_ggml_backend_buffer_is_host(buf)) {
+                if (cparams.hugepages != LLAMA_HUGEPAGES_TYPE_NONE) {
+                    llama_advise_hugepages(lm_ggml_backend_buffer_get_base(buf), size);
+                }
+                if (cparams.prefault) {
+                    llama_prefault(lm_ggml_backend_buffer_get_base(buf), size);
+                }
             }
         }
 
@@ -932,6 +952,17 @@ void llama_context::detach_threadpool() {
     this->threadpool_batch = nullptr;
 }
 
+llama_memory_estimate llama_context::memory_breakdown() const {
+    llama_memory_estimate res = {};
+
+    res.weights = model.size();
+    res.kv      = kv_self ? kv_self->total_size() : 0;
+    res.compute = compute_size;
+    res.output  = buf_output ? lm_ggml_backend_buffer_get_size(buf_output.get()) : 0;
+
+    return res;
+}
+
 void llama_context::set_n_threads(int32_t n_threads, int32_t n_threads_batch) {
     LLAMA_LOG_DEBUG("%s: n_threads = %d, n_threads_batch = %d\n", __func__, n_threads, n_threads_batch);
 
@@ -972,6 +1003,119 @@ void llama_context::set_warmup(bool value) {
     cparams.warmup = value;
 }
 
+bool llama_context::warmup_step(lm_ggml_abort_callback step_abort_callback, void * step_abort_callback_data) {
+    // the step is interrupted by the abort callback of the context or by the one of the step,
+    // the callback of the context is installed again afterwards
+    struct abort_pair {
+        lm_ggml_abort_callback callback[2];
+        void *                 data[2];
+    } aborts = {
+        { abort_callback,      step_abort_callback      },
+        { abort_callback_data, step_abort_callback_data },
+    };
+
+    const lm_ggml_abort_callback abort_callback_org      = abort_callback;
+    void * const                 abort_callback_data_org = abort_callback_data;
+
+    set_abort_callback([](void * data) {
+        const auto * aborts = (const abort_pair *) data;
+        for (int i = 0; i < 2; ++i) {
+            if (aborts->callback[i] && aborts->callback[i](aborts->data[i])) {
+                return true;
+            }
+        }
+        return false;
+    }, &aborts);
+
+    bool more;
+    try {
+        more = warmup_step_impl();
+    } catch (...) {
+        set_abort_callback(abort_callback_org, abort_callback_data_org);
+        throw;
+    }
+
+    set_abort_callback(abort_callback_org, abort_callback_data_org);
+
+    return more;
+}
+
+bool llama_context::warmup_step_impl() {
+    const int32_t n_layer = model.hparams.n_layer;
+
+    // steps 0 .. n_layer read in the weights of a layer, then of the output
+    // layers paged in graph order are left to the paging, they may not fit in memory together
+    if (n_warmup_steps <= n_layer) {
+        if (!model.has_layer_residency() && !model.touch_weights(n_warmup_steps, abort_callback, abort_callback_data)) {
+            return true;
+        }
+        n_warmup_steps++;
+        return true;
+    }
+
+    if (n_warmup_steps > n_layer + 1) {
+        return false;
+    }
+
+    // the memory is cleared after the decode, so it is skipped once a sequence was decoded - that decode built the graph
+    bool is_empty = true;
+    if (kv_self) {
+        for (uint32_t s = 0; s < cparams.n_seq_max; ++s) {
+            is_empty = is_empty && kv_self->seq_pos_max(s) < 0;
+        }
+    }
+
+    if (is_empty) {
+        const bool warmup_org = cparams.warmup;
+        cparams.warmup = true;
+
+        const llama_vocab * vocab = &model.vocab;
+
+        // some models (e.g. T5) don't have a BOS token
+        llama_token token = llama_vocab_bos(vocab);
+        if (token == LLAMA_TOKEN_NULL) {
+            token = llama_vocab_eos(vocab);
+        }
+        if (token == LLAMA_TOKEN_NULL) {
+            token = 0;
+        }
+
+        int ret = 0;
+        if (llama_model_has_encoder(&model)) {
+            llama_batch batch = llama_batch_get_one(&token, 1);
+            ret = encode(batch);
+            const llama_token decoder_start = llama_model_decoder_start_token(&model);
+            if (decoder_start != LLAMA_TOKEN_NULL) {
+                token = decoder_start;
+            }
+        }
+        if (ret == 0 && llama_model_has_decoder(&model)) {
+            llama_batch batch = llama_batch_get_one(&token, 1);
+            ret = decode(batch);
+        }
+
+        if (kv_self) {
+            kv_self->clear();
+        }
+        synchronize();
+        perf_reset();
+
+        cparams.warmup = warmup_org;
+
+        if (ret == 2) {
+            // aborted
+            return true;
+        }
+        if (ret != 0) {
+            LLAMA_LOG_WARN("%s: warmup decode failed, ret = %d\n", __func__, ret);
+        }
+    }
+
+    n_warmup_steps++;
+
+    return false;
+}
+
 void llama_context::set_adapter_lora(
             llama_adapter_lora * adapter,
             float scale) {
@@ -1066,7 +1210,7 @@ int llama_context::encode(llama_batch & inp_batch) {
     //batch_manager->prepare(ubatch);
 
     lm_ggml_backend_sched_reset(sched.get());
-    lm_ggml_backend_sched_set_eval_callback(sched.get(), cparams.cb_eval, cparams.cb_eval_user_data);
+    graph_set_eval_cb();
 
     const auto causal_attn_org = cparams.causal_attn;
 
@@ -1308,7 +1452,7 @@ int llama_context::decode(llama_batch & inp_batch) {
         //printf("kv_self.n = %5d, kv_self.used = %5d, kv_self.head = %5d\n", kv_self->n, kv_self->used, kv_self->head);
 
         lm_ggml_backend_sched_reset(sched.get());
-        lm_ggml_backend_sched_set_eval_callback(sched.get(), cparams.cb_eval, cparams.cb_eval_user_data);
+        graph_set_eval_cb();
 
         auto * gf = graph_init();
         auto res = graph_build(ctx_compute.get(), gf, ubatch, LLM_GRAPH_TYPE_DECODER);
@@ -1521,7 +1665,7 @@ int32_t llama_context::output_reserve(int32_t n_outputs) {
         if (output_dev_host_buft) {
             buft = output_dev_host_buft;
         }
-        buf_output.reset(lm_ggml_backend_buft_alloc_buffer(buft, new_size));
+        buf_output.reset(cparams.dry_run ? lm_ggml_backend_buft_alloc_dry_buffer(buft, new_size) : lm_ggml_backend_buft_alloc_buffer(buft, new_size));
         if (buf_output == nullptr) {
             LLAMA_LOG_ERROR("%s: failed to allocate output buffer of size %.2f MiB\n", __func__, new_size / (1024.0 * 1024.0));
             return 0;
@@ -1600,6 +1744,22 @@ lm_ggml_cgraph * llama_context::graph_init() {
     return lm_ggml_new_graph_custom(ctx_compute.get(), graph_max_nodes(), false);
 }
 
+bool llama_context::graph_reserve(lm_ggml_cgraph * gf) {
+    if (!cparams.dry_run) {
+        return lm_ggml_backend_sched_reserve(sched.get(), gf);
+    }
+
+    std::vector<size_t> sizes(backend_ptrs.size());
+    lm_ggml_backend_sched_reserve_size(sched.get(), gf, sizes.data());
+
+    compute_sizes_dry.resize(sizes.size());
+    for (size_t i = 0; i < sizes.size(); ++i) {
+        compute_sizes_dry[i] = std::max(compute_sizes_dry[i], sizes[i]);
+    }
+
+    return true;
+}
+
 llm_graph_result_ptr llama_context::graph_build(
             lm_ggml_context * ctx,
              lm_ggml_cgraph * gf,
@@ -1683,6 +1843,46 @@ llm_graph_cb llama_context::graph_get_cb() const {
     };
 }
 
+void llama_context::graph_set_eval_cb() {
+    if (model.has_layer_residency()) {
+        lm_ggml_backend_sched_set_eval_callback(sched.get(), graph_eval_cb, this);
+    } else {
+        lm_ggml_backend_sched_set_eval_callback(sched.get(), cparams.cb_eval, cparams.cb_eval_user_data);
+    }
+}
+
+bool llama_context::graph_eval_cb(lm_ggml_tensor * t, bool ask, void * user_data) {
+    auto * lctx = (llama_context *) user_data;
+    const auto & cparams = lctx->cparams;
+
+    // the graph is split after the output of each layer, so that the weights can be paged in graph order
+    const bool is_layer_out = strncmp(t->name, "l_out-", 6) == 0;
+
+    if (ask) {
+        const bool need = cparams.cb_eval && cparams.cb_eval(t, true, cparams.cb_eval_user_data);
+        if (is_layer_out) {
+            // the answer is kept for the evaluation of the node, the user callback is asked only once
+            if (need) {
+                lctx->eval_cb_wanted.insert(t);
+            } else {
+                lctx->eval_cb_wanted.erase(t);
+            }
+        }
+        return need || is_layer_out;
+    }
+
+    if (is_layer_out) {
+        lctx->model.layer_done(atoi(t->name + 6));
+
+        // the scheduler asked for this node on our behalf, the user callback may not want it
+        if (lctx->eval_cb_wanted.erase(t) == 0) {
+            return true;
+        }
+    }
+
+    return cparams.cb_eval(t, false, cparams.cb_eval_user_data);
+}
+
 //
 // state save/load
 //
@@ -2218,6 +2418,7 @@ llama_context_params llama_context_default_params() {
         /*.rope_scaling_type           =*/ LLAMA_ROPE_SCALING_TYPE_UNSPECIFIED,
         /*.pooling_type                =*/ LLAMA_POOLING_TYPE_UNSPECIFIED,
         /*.attention_type              =*/ LLAMA_ATTENTION_TYPE_UNSPECIFIED,
+        /*.hugepages                   =*/ LLAMA_HUGEPAGES_TYPE_NONE,
         /*.rope_freq_base              =*/ 0.0f,
         /*.rope_freq_scale             =*/ 0.0f,
         /*.yarn_ext_factor             =*/ -1.0f,
@@ -2235,6 +2436,7 @@ llama_context_params llama_context_default_params() {
         /*.offload_kqv                 =*/ true,
         /*.flash_attn                  =*/ false,
         /*.no_perf                     =*/ true,
+        /*.prefault                    =*/ false,
         /*.abort_callback              =*/ nullptr,
         /*.abort_callback_data         =*/ nullptr,
     };
@@ -2242,22 +2444,16 @@ llama_context_params llama_context_default_params() {
     return result;
 }
 
-llama_context * llama_init_from_model(
-                 llama_model * model,
-        llama_context_params   params) {
-    if (!model) {
-        LLAMA_LOG_ERROR("%s: model cannot be NULL\n", __func__);
-        return nullptr;
-    }
-
+// validate the parameters of a new context, adjusting the ones that the model does not support
+static bool llama_context_params_check(const llama_model * model, llama_context_params & params) {
     if (params.n_batch == 0 && params.n_ubatch == 0) {
         LLAMA_LOG_ERROR("%s: n_batch and n_ubatch cannot both be zero\n", __func__);
-        return nullptr;
+        return false;
     }
 
     if (params.n_ctx == 0 && model->hparams.n_ctx_train == 0) {
         LLAMA_LOG_ERROR("%s: n_ctx and model->hparams.n_ctx_train cannot both be zero\n", __func__);
-        return nullptr;
+        return false;
     }
 
     if (params.flash_attn && model->arch == LLM_ARCH_GROK) {
@@ -2267,6 +2463,26 @@ llama_context * llama_init_from_model(
 
     if (lm_ggml_is_quantized(params.type_v) && !params.flash_attn) {
         LLAMA_LOG_ERROR("%s: V cache quantization requires flash_attn\n", __func__);
+        return false;
+    }
+
+    return true;
+}
+
+llama_context * llama_init_from_model(
+                 llama_model * model,
+        llama_context_params   params) {
+    if (!model) {
+        LLAMA_LOG_ERROR("%s: model cannot be NULL\n", __func__);
+        return nullptr;
+    }
+
+    if (model->params.meta_only) {
+        LLAMA_LOG_ERROR("%s: model was loaded with meta_only\n", __func__);
+        return nullptr;
+    }
+
+    if (!llama_context_params_check(model, params)) {
         return nullptr;
     }
 
@@ -2280,6 +2496,64 @@ llama_context * llama_init_from_model(
     return nullptr;
 }
 
+bool llama_model_measure_memory(
+        const llama_model * model,
+        llama_context_params params,
+        llama_memory_estimate * res) {
+    if (model->params.meta_only) {
+        LLAMA_LOG_ERROR("%s: model was loaded with meta_only, only llama_model_estimate_memory is available\n", __func__);
+        return false;
+    }
+
+    if (!llama_context_params_check(model, params)) {
+        return false;
+    }
+
+    try {
+        llama_context ctx(*model, params, /*dry_run =*/ true);
+        *res = ctx.memory_breakdown();
+    } catch (const std::exception & err) {
+        LLAMA_LOG_ERROR("%s: failed to measure the context: %s\n", __func__, err.what());
+        return false;
+    }
+
+    return true;
+}
+
+uint32_t llama_model_fit_n_ctx(
+        const llama_model * model,
+        llama_context_params params,
+        uint64_t budget) {
+    const uint32_t n_ctx_max = params.n_ctx == 0 ? model->hparams.n_ctx_train : params.n_ctx;
+
+    auto fits = [&](uint32_t n_ctx) {
+        params.n_ctx = n_ctx;
+
+        llama_memory_estimate mem;
+        if (model->params.meta_only) {
+            mem = llama_model_estimate_memory(model, params);
+        } else if (!llama_model_measure_memory(model, params, &mem)) {
+            return false;
+        }
+
+        return mem.weights + mem.kv + mem.compute + mem.output <= budget;
+    };
+
+    // the memory grows with n_ctx: binary search the largest n_ctx that fits
+    uint32_t lo = 0;
+    uint32_t hi = n_ctx_max;
+    while (lo < hi) {
+        const uint32_t mid = hi - (hi - lo)/2;
+        if (fits(mid)) {
+            lo = mid;
+        } else {
+            hi = mid - 1;
+        }
+    }
+
+    return lo;
+}
+
 // deprecated
 llama_context * llama_new_context_with_model(
                  llama_model * model,
@@ -2362,6 +2636,10 @@ void llama_set_warmup(llama_context * ctx, bool warmup) {
     ctx->set_warmup(warmup);
 }
 
+bool llama_warmup_step(llama_context * ctx, lm_ggml_abort_callback abort_callback, void * abort_callback_data) {
+    return ctx->warmup_step(abort_callback, abort_callback_data);
+}
+
 void llama_synchronize(llama_context * ctx) {
     ctx->synchronize();
 }
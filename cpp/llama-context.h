@@ -9,6 +9,7 @@
 #include "ggml-cpp.h"
 
 #include <map>
+#include <unordered_set>
 #include <vector>
 
 struct llama_model;
@@ -19,9 +20,11 @@ class llama_io_write_i;
 
 struct llama_context {
     // init scheduler and compute buffers, reserve worst-case graphs
+    // with dry_run, the KV cache, output and compute buffers are sized but have no memory - the context can only be measured
     llama_context(
             const llama_model & model,
-                  llama_context_params params);
+                  llama_context_params params,
+                  bool dry_run = false);
 
     ~llama_context();
 
@@ -58,6 +61,9 @@ struct llama_context {
 
     void detach_threadpool();
 
+    // bytes of the weights, the KV cache, the compute and the output buffers
+    llama_memory_estimate memory_breakdown() const;
+
     void set_n_threads(int32_t n_threads, int32_t n_threads_batch);
 
     void set_abort_callback(bool (*abort_callback)(void * data), void * abort_callback_data);
@@ -66,6 +72,9 @@ struct llama_context {
     void set_causal_attn(bool value);
     void set_warmup(bool value);
 
+    // one step of llama_warmup_step, false once the warmup is done
+    bool warmup_step(lm_ggml_abort_callback step_abort_callback, void * step_abort_callback_data);
+
     void set_adapter_lora(
             llama_adapter_lora * adapter,
             float scale);
@@ -156,6 +165,9 @@ private:
       const llama_ubatch & ubatch,
           llm_graph_type   gtype);
 
+    // reserve the compute buffers for a worst-case graph, in a dry run only measure them
+    bool graph_reserve(lm_ggml_cgraph * gf);
+
     // returns the result of lm_ggml_backend_sched_graph_compute_async execution
     lm_ggml_status graph_compute(
             lm_ggml_cgraph * gf,
@@ -163,6 +175,11 @@ private:
 
     llm_graph_cb graph_get_cb() const;
 
+    // installs cb_eval in the scheduler, chained with the layer residency of the model if enabled
+    void graph_set_eval_cb();
+
+    static bool graph_eval_cb(lm_ggml_tensor * t, bool ask, void * user_data);
+
     // used by kv_self_update()
     lm_ggml_tensor * build_rope_shift(
         lm_ggml_context * ctx0,
@@ -225,6 +242,9 @@ private:
 
     lm_ggml_backend_sched_ptr sched;
 
+    // l_out-* nodes that cb_eval asked for, graph_eval_cb asks for all of them for the layer residency
+    std::unordered_set<const lm_ggml_tensor *> eval_cb_wanted;
+
     lm_ggml_backend_t backend_cpu = nullptr;
     std::vector<lm_ggml_backend_ptr> backends;
 
@@ -236,6 +256,11 @@ private:
     lm_ggml_abort_callback abort_callback      = nullptr;
     void *              abort_callback_data = nullptr;
 
+    int32_t n_warmup_steps = 0; // steps of warmup_step() done
+
+    // warmup_step with the abort callback of the step installed
+    bool warmup_step_impl();
+
     std::vector<std::pair<lm_ggml_backend_t, lm_ggml_backend_set_n_threads_t>> set_n_threads_fns;
 
     // buffer types used for the compute buffer of each backend
@@ -245,6 +270,12 @@ private:
     // memory buffers used to evaluate the model
     std::vector<uint8_t> buf_compute_meta;
 
+    // total size of the compute buffers of all the backends
+    size_t compute_size = 0;
+
+    // in a dry run, the largest compute buffer of each backend measured by graph_reserve
+    std::vector<size_t> compute_sizes_dry;
+
     // host buffer for the model output (logits and embeddings)
     lm_ggml_backend_buffer_ptr buf_output;
 
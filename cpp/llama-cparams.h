@@ -30,8 +30,11 @@ struct llama_cparams {
     bool flash_attn;
     bool no_perf;
     bool warmup;
+    bool prefault;
+    bool dry_run;         // buffers without memory, only to measure the context
 
-    enum llama_pooling_type pooling_type;
+    enum llama_pooling_type   pooling_type;
+    enum llama_hugepages_type hugepages;
 
     lm_ggml_backend_sched_eval_callback cb_eval;
     void * cb_eval_user_data;
@@ -4,9 +4,17 @@
 #include "llama-vocab.h"
 #include "llama-sampling.h"
 
+#include <atomic>
 #include <cmath>
 #include <algorithm>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
 #include <stdexcept>
+#include <thread>
 
 //
 // helpers
@@ -29,10 +37,11 @@ static std::pair<uint32_t, const char *> decode_utf8(const char * src) {
 }
 
 static std::pair<std::vector<uint32_t>, llama_partial_utf8> decode_utf8(
-        const std::string & src,
+        std::string_view src,
         llama_partial_utf8 partial_start) {
     static const int      lookup[] = { 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 2, 2, 3, 4 };
-    const char          * pos      = src.c_str();
+    const char          * pos      = src.data();
+    const char          * end      = src.data() + src.size();
     std::vector<uint32_t> code_points;
 
     // common english strings have the same number of codepoints and bytes. `+ 1` for the terminating 0.
@@ -41,7 +50,7 @@ static std::pair<std::vector<uint32_t>, llama_partial_utf8> decode_utf8(
     int      n_remain = partial_start.n_remain;
 
     // continue previous decode, if applicable
-    while (*pos != 0 && n_remain > 0) {
+    while (pos < end && *pos != 0 && n_remain > 0) {
         uint8_t next_byte = static_cast<uint8_t>(*pos);
         if ((next_byte >> 6) != 2) {
             // invalid sequence, abort
@@ -58,7 +67,25 @@ static std::pair<std::vector<uint32_t>, llama_partial_utf8> decode_utf8(
     }
 
     // decode any subsequent utf-8 sequences, which may end in an incomplete one
-    while (*pos != 0) {
+    while (pos < end && *pos != 0) {
+        // ASCII fast path: 8 bytes at a time while there is neither a multi-byte sequence nor the terminating 0
+        while (end - pos >= 8) {
+            uint64_t chunk;
+            memcpy(&chunk, pos, sizeof(chunk));
+            if ((chunk | ((chunk - 0x0101010101010101ull) & ~chunk)) & 0x8080808080808080ull) {
+                break;
+            }
+            for (int i = 0; i < 8; ++i) {
+                code_points.push_back(static_cast<uint8_t>(pos[i]));
+            }
+            pos     += 8;
+            value    = static_cast<uint8_t>(pos[-1]);
+            n_remain = 0;
+        }
+        if (pos == end || *pos == 0) {
+            break;
+        }
+
         uint8_t first_byte = static_cast<uint8_t>(*pos);
         uint8_t highbits   = first_byte >> 4;
         n_remain   = lookup[highbits] - 1;
@@ -74,7 +101,7 @@ static std::pair<std::vector<uint32_t>, llama_partial_utf8> decode_utf8(
         value = first_byte & mask;
 
         ++pos;
-        while (*pos != 0 && n_remain > 0) {
+        while (pos < end && *pos != 0 && n_remain > 0) {
             value = (value << 6) + (static_cast<uint8_t>(*pos) & 0x3F);
             ++pos;
             --n_remain;
@@ -585,8 +612,8 @@ void llama_grammar_parser::print(FILE * file) {
     }
 }
 
-llama_grammar_stack llama_grammar_parser::c_rules() const {
-    llama_grammar_stack ret;
+std::vector<const llama_grammar_element *> llama_grammar_parser::c_rules() const {
+    std::vector<const llama_grammar_element *> ret;
     ret.reserve(rules.size());
     for (const auto & rule : rules) {
         ret.push_back(rule.data());
@@ -594,6 +621,764 @@ llama_grammar_stack llama_grammar_parser::c_rules() const {
     return ret;
 }
 
+//
+// llama_grammar_stack_arena
+//
+
+static size_t llama_grammar_stack_hash(llama_grammar_stack parent, const llama_grammar_element * pos) {
+    uint64_t h = (uint64_t) reinterpret_cast<uintptr_t>(pos) ^ ((uint64_t) parent * 0x9E3779B97F4A7C15ull);
+    h ^= h >> 31;
+    h *= 0xBF58476D1CE4E5B9ull;
+    h ^= h >> 29;
+    return (size_t) h;
+}
+
+void llama_grammar_stack_arena::clear(const llama_grammar_stack_arena * base_arena) {
+    base   = base_arena;
+    n_base = base ? base->size() : 0;
+
+    nodes.clear();
+    if (base == nullptr) {
+        // node 0 is the empty stack, it is never looked up so it is not in the table
+        nodes.push_back({ nullptr, LLAMA_GRAMMAR_STACK_EMPTY });
+    }
+
+    if (table.empty()) {
+        table.resize(64);
+    } else {
+        std::fill(table.begin(), table.end(), 0);
+    }
+
+    // marks from previous passes stay below the current epoch, so they do not need to be reset
+    marks.resize(size(), 0);
+}
+
+bool llama_grammar_stack_arena::find(llama_grammar_stack parent, const llama_grammar_element * pos, llama_grammar_stack & id) const {
+    // a node with a local parent cannot be in the base arena
+    if (base != nullptr && parent < n_base && base->find(parent, pos, id)) {
+        return true;
+    }
+
+    const size_t mask = table.size() - 1;
+    for (size_t i = llama_grammar_stack_hash(parent, pos) & mask; table[i] != 0; i = (i + 1) & mask) {
+        const auto & node = nodes[table[i] - 1];
+        if (node.parent == parent && node.pos == pos) {
+            id = n_base + table[i] - 1;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+void llama_grammar_stack_arena::insert(uint32_t idx) {
+    const size_t mask = table.size() - 1;
+
+    size_t i = llama_grammar_stack_hash(nodes[idx].parent, nodes[idx].pos) & mask;
+    while (table[i] != 0) {
+        i = (i + 1) & mask;
+    }
+    table[i] = idx + 1;
+}
+
+void llama_grammar_stack_arena::rehash(size_t n_slots) {
+    table.assign(n_slots, 0);
+    for (uint32_t idx = 0; idx < nodes.size(); ++idx) {
+        if (nodes[idx].pos != nullptr) {
+            insert(idx);
+        }
+    }
+}
+
+llama_grammar_stack llama_grammar_stack_arena::push(llama_grammar_stack parent, const llama_grammar_element * pos) {
+    llama_grammar_stack id;
+    if (find(parent, pos, id)) {
+        return id;
+    }
+
+    nodes.push_back({ pos, parent });
+
+    // keep the load factor at or below 1/2
+    if (2*nodes.size() > table.size()) {
+        rehash(2*table.size());
+    } else {
+        insert(nodes.size() - 1);
+    }
+
+    return size() - 1;
+}
+
+void llama_grammar_stack_arena::begin_visit() {
+    if (++epoch == 0) {
+        std::fill(marks.begin(), marks.end(), 0);
+        epoch = 1;
+    }
+}
+
+bool llama_grammar_stack_arena::visit(llama_grammar_stack id) {
+    if (id >= marks.size()) {
+        marks.resize(size(), 0);
+    }
+    if (marks[id] == epoch) {
+        return false;
+    }
+    marks[id] = epoch;
+    return true;
+}
+
+void llama_grammar_stack_arena::collect(llama_grammar_stacks & stacks) {
+    LM_GGML_ASSERT(base == nullptr);
+
+    if (nodes.size() < n_collect) {
+        return;
+    }
+
+    // mark the nodes reachable from the live stacks (the empty stack is always kept)
+    begin_visit();
+    visit(LLAMA_GRAMMAR_STACK_EMPTY);
+    for (const auto stack : stacks) {
+        for (auto id = stack; visit(id); id = nodes[id].parent) {
+        }
+    }
+
+    // a node is always created after its parent, so compacting in order keeps the parents
+    // remapped before their children
+    std::vector<llama_grammar_stack> remap(nodes.size());
+    uint32_t n_live = 0;
+    for (uint32_t id = 0; id < nodes.size(); ++id) {
+        if (marks[id] == epoch) {
+            remap[id] = n_live;
+            nodes[n_live++] = { nodes[id].pos, remap[nodes[id].parent] };
+        }
+    }
+    nodes.resize(n_live);
+    marks.resize(n_live);
+
+    size_t n_slots = 64;
+    while (n_slots < 2*nodes.size()) {
+        n_slots *= 2;
+    }
+    rehash(n_slots);
+
+    for (auto & stack : stacks) {
+        stack = remap[stack];
+    }
+
+    n_collect = std::max<size_t>(4096, 2*nodes.size());
+}
+
+void llama_grammar_stack_arena::rebase(const llama_grammar_rules & src, const llama_grammar_rules & dst) {
+    LM_GGML_ASSERT(base == nullptr);
+
+    for (auto & node : nodes) {
+        if (node.pos == nullptr) {
+            continue;
+        }
+        for (size_t ir = 0; ir < src.size(); ir++) {
+            if (node.pos >= src[ir].data() && node.pos < src[ir].data() + src[ir].size()) {
+                node.pos = dst[ir].data() + (node.pos - src[ir].data());
+                break;
+            }
+        }
+    }
+
+    rehash(table.size());
+}
+
+//
+// llama_grammar_trigger_pattern
+//
+
+#define LLAMA_GRAMMAR_TRIGGER_MAX_STATES 4096
+
+struct llama_grammar_trigger_node {
+    enum type_t {
+        BYTES,
+        CAT,
+        ALT,
+        REP,
+        GROUP,
+        BOL,
+        EOL,
+    };
+
+    type_t type;
+
+    std::bitset<256>                        bytes;    // BYTES
+    std::vector<llama_grammar_trigger_node> children; // CAT, ALT, REP and GROUP (single child)
+
+    int  min    = 0;    // REP
+    int  max    = 0;    // REP, -1 for unbounded
+    bool greedy = true; // REP
+    int  group  = -1;   // GROUP, capture index or -1 for (?:...)
+};
+
+// parses the regex syntax used by the trigger patterns: literals, escapes (\s \S \d \D \w \W \n \r \t \f
+// \v \0 \xHH and escaped punctuation), `.`, bracket classes with ranges and negation, groups (capturing
+// and `(?:...)`), alternation, `^`, `$` and the greedy and lazy quantifiers `*`, `+`, `?` and `{n,m}`
+// backreferences, lookarounds and word boundaries are not supported
+// like std::regex with char, the pattern matches bytes, which is exact for the literal UTF-8 sequences
+struct llama_grammar_trigger_parser {
+    const char * src;
+    const char * pos;
+
+    int n_groups = 0;
+
+    explicit llama_grammar_trigger_parser(const char * pattern) : src(pattern), pos(pattern) {}
+
+    [[noreturn]] void error(const char * msg) const {
+        throw std::runtime_error(std::string(msg) + " at offset " + std::to_string(pos - src) + " in trigger pattern: " + src);
+    }
+
+    static std::bitset<256> range(int lo, int hi) {
+        std::bitset<256> res;
+        for (int c = lo; c <= hi; ++c) {
+            res.set(c);
+        }
+        return res;
+    }
+
+    static std::bitset<256> space() {
+        std::bitset<256> res;
+        for (char c : std::string(" \t\n\v\f\r")) {
+            res.set((uint8_t) c);
+        }
+        return res;
+    }
+
+    static std::bitset<256> word() {
+        return range('a', 'z') | range('A', 'Z') | range('0', '9') | range('_', '_');
+    }
+
+    static int hex_value(char c) {
+        if ('0' <= c && c <= '9') {
+            return c - '0';
+        }
+        if ('a' <= c && c <= 'f') {
+            return c - 'a' + 10;
+        }
+        if ('A' <= c && c <= 'F') {
+            return c - 'A' + 10;
+        }
+        return -1;
+    }
+
+    // parses the escape sequence after a backslash, returns the set of bytes it matches
+    std::bitset<256> parse_escape() {
+        const char c = *pos++;
+        switch (c) {
+            case '\0': --pos; error("trailing backslash");
+            case 's':  return  space();
+            case 'S':  return ~space();
+            case 'd':  return  range('0', '9');
+            case 'D':  return ~range('0', '9');
+            case 'w':  return  word();
+            case 'W':  return ~word();
+            case 'n':  return  range('\n', '\n');
+            case 'r':  return  range('\r', '\r');
+            case 't':  return  range('\t', '\t');
+            case 'f':  return  range('\f', '\f');
+            case 'v':  return  range('\v', '\v');
+            case '0':  return  range(0, 0);
+            case 'x': {
+                const int hi = hex_value(pos[0]);
+                const int lo = hi < 0 ? -1 : hex_value(pos[1]);
+                if (lo < 0) {
+                    error("expecting 2 hex chars");
+                }
+                pos += 2;
+                return range(hi*16 + lo, hi*16 + lo);
+            }
+            case 'b':
+            case 'B':
+            case 'u':
+            case 'c':
+            case 'k':
+                --pos; error("unsupported escape");
+            default:
+                if ('1' <= c && c <= '9') {
+                    --pos; error("backreferences are not supported");
+                }
+                return range((uint8_t) c, (uint8_t) c);
+        }
+    }
+
+    std::bitset<256> parse_class() {
+        // pos is after the opening bracket
+        const bool negate = *pos == '^';
+        if (negate) {
+            ++pos;
+        }
+
+        std::bitset<256> res;
+        while (*pos != ']') {
+            if (*pos == '\0') {
+                error("unterminated character class");
+            }
+
+            std::bitset<256> item;
+            int lo = -1; // single byte of the item, if any, so that it can start a range
+            if (*pos == '\\') {
+                ++pos;
+                item = parse_escape();
+                if (item.count() == 1) {
+                    for (lo = 0; !item[lo]; ++lo) {
+                    }
+                }
+            } else {
+                lo = (uint8_t) *pos++;
+                item.set(lo);
+            }
+
+            if (lo >= 0 && pos[0] == '-' && pos[1] != ']' && pos[1] != '\0') {
+                ++pos;
+                int hi;
+                if (*pos == '\\') {
+                    ++pos;
+                    const auto end = parse_escape();
+                    if (end.count() != 1) {
+                        error("invalid range in character class");
+                    }
+                    for (hi = 0; !end[hi]; ++hi) {
+                    }
+                } else {
+                    hi = (uint8_t) *pos++;
+                }
+                if (hi < lo) {
+                    error("invalid range in character class");
+                }
+                item = range(lo, hi);
+            }
+
+            res |= item;
+        }
+        ++pos;
+
+        return negate ? ~res : res;
+    }
+
+    // parses a {n}, {n,} or {n,m} quantifier, leaves pos unchanged and returns false if there is none
+    bool parse_braces(int & min, int & max) {
+        const char * p = pos + 1;
+        if (!is_digit_char(*p)) {
+            return false;
+        }
+        min = 0;
+        while (is_digit_char(*p)) {
+            min = min*10 + (*p++ - '0');
+        }
+        max = min;
+        if (*p == ',') {
+            ++p;
+            if (is_digit_char(*p)) {
+                max = 0;
+                while (is_digit_char(*p)) {
+                    max = max*10 + (*p++ - '0');
+                }
+                if (max < min) {
+                    error("invalid repetition range");
+                }
+            } else {
+                max = -1;
+            }
+        }
+        if (*p != '}') {
+            return false;
+        }
+        pos = p + 1;
+        return true;
+    }
+
+    llama_grammar_trigger_node parse_atom() {
+        llama_grammar_trigger_node node;
+        node.type = llama_grammar_trigger_node::BYTES;
+
+        const char c = *pos++;
+        switch (c) {
+            case '(': {
+                node.type = llama_grammar_trigger_node::GROUP;
+                if (pos[0] == '?') {
+                    if (pos[1] != ':') {
+                        error("lookarounds and named groups are not supported");
+                    }
+                    pos += 2;
+                } else {
+                    node.group = ++n_groups;
+                }
+                node.children.push_back(parse_alt());
+                if (*pos != ')') {
+                    error("expecting ')'");
+                }
+                ++pos;
+                break;
+            }
+            case '[':
+                node.bytes = parse_class();
+                break;
+            case '.':
+                node.bytes = ~(range('\n', '\n') | range('\r', '\r'));
+                break;
+            case '^':
+                node.type = llama_grammar_trigger_node::BOL;
+                break;
+            case '$':
+                node.type = llama_grammar_trigger_node::EOL;
+                break;
+            case '\\':
+                node.bytes = parse_escape();
+                break;
+            case '*':
+            case '+':
+            case '?':
+                --pos; error("nothing to repeat");
+            default:
+                node.bytes.set((uint8_t) c);
+                break;
+        }
+
+        return node;
+    }
+
+    llama_grammar_trigger_node parse_repeat() {
+        auto atom = parse_atom();
+
+        while (true) {
+            int min;
+            int max;
+            if (*pos == '*') {
+                min = 0; max = -1; ++pos;
+            } else if (*pos == '+') {
+                min = 1; max = -1; ++pos;
+            } else if (*pos == '?') {
+                min = 0; max =  1; ++pos;
+            } else if (*pos == '{' && parse_braces(min, max)) {
+            } else {
+                return atom;
+            }
+
+            if (atom.type == llama_grammar_trigger_node::BOL || atom.type == llama_grammar_trigger_node::EOL) {
+                error("nothing to repeat");
+            }
+
+            llama_grammar_trigger_node node;
+            node.type   = llama_grammar_trigger_node::REP;
+            node.min    = min;
+            node.max    = max;
+            node.greedy = *pos != '?';
+            if (!node.greedy) {
+                ++pos;
+            }
+            node.children.push_back(std::move(atom));
+            atom = std::move(node);
+        }
+    }
+
+    llama_grammar_trigger_node parse_cat() {
+        llama_grammar_trigger_node node;
+        node.type = llama_grammar_trigger_node::CAT;
+        while (*pos != '\0' && *pos != '|' && *pos != ')') {
+            node.children.push_back(parse_repeat());
+        }
+        return node;
+    }
+
+    llama_grammar_trigger_node parse_alt() {
+        llama_grammar_trigger_node node;
+        node.type = llama_grammar_trigger_node::ALT;
+        node.children.push_back(parse_cat());
+        while (*pos == '|') {
+            ++pos;
+            node.children.push_back(parse_cat());
+        }
+        return node;
+    }
+
+    llama_grammar_trigger_node parse() {
+        auto node = parse_alt();
+        if (*pos != '\0') {
+            error("unexpected ')'");
+        }
+        return node;
+    }
+};
+
+static void llama_grammar_trigger_emit(const llama_grammar_trigger_node & node, std::vector<llama_grammar_trigger_inst> & prog) {
+    using inst = llama_grammar_trigger_inst;
+
+    auto emit = [&](inst::op_t op, int x = 0, int y = 0) {
+        prog.push_back({ op, x, y, {} });
+        return (int) prog.size() - 1;
+    };
+
+    switch (node.type) {
+        case llama_grammar_trigger_node::BYTES: {
+            const int pc = emit(inst::BYTES);
+            prog[pc].bytes = node.bytes;
+            break;
+        }
+        case llama_grammar_trigger_node::CAT:
+            for (const auto & child : node.children) {
+                llama_grammar_trigger_emit(child, prog);
+            }
+            break;
+        case llama_grammar_trigger_node::ALT: {
+            // split to each alternative in order, then jump past the remaining ones
+            std::vector<int> jmps;
+            for (size_t i = 0; i < node.children.size(); ++i) {
+                const bool last  = i + 1 == node.children.size();
+                const int  split = last ? -1 : emit(inst::SPLIT);
+                if (!last) {
+                    prog[split].x = split + 1;
+                }
+                llama_grammar_trigger_emit(node.children[i], prog);
+                if (!last) {
+                    jmps.push_back(emit(inst::JMP));
+                    prog[split].y = (int) prog.size();
+                }
+            }
+            for (const int pc : jmps) {
+                prog[pc].x = (int) prog.size();
+            }
+            break;
+        }
+        case llama_grammar_trigger_node::REP: {
+            const auto & child = node.children[0];
+            for (int i = 0; i < node.min; ++i) {
+                llama_grammar_trigger_emit(child, prog);
+            }
+
+            // the preferred branch of the split is the body for greedy quantifiers, the exit for lazy ones
+            auto set_split = [&](int pc, int body, int exit) {
+                prog[pc].x = node.greedy ? body : exit;
+                prog[pc].y = node.greedy ? exit : body;
+            };
+
+            if (node.max < 0) {
+                const int split = emit(inst::SPLIT);
+                llama_grammar_trigger_emit(child, prog);
+                emit(inst::JMP, split);
+                set_split(split, split + 1, (int) prog.size());
+            } else {
+                std::vector<int> splits;
+                for (int i = node.min; i < node.max; ++i) {
+                    splits.push_back(emit(inst::SPLIT));
+                    llama_grammar_trigger_emit(child, prog);
+                }
+                for (const int pc : splits) {
+                    set_split(pc, pc + 1, (int) prog.size());
+                }
+            }
+            break;
+        }
+        case llama_grammar_trigger_node::GROUP:
+            if (node.group >= 0) {
+                emit(inst::SAVE, 2*node.group);
+            }
+            llama_grammar_trigger_emit(node.children[0], prog);
+            if (node.group >= 0) {
+                emit(inst::SAVE, 2*node.group + 1);
+            }
+            break;
+        case llama_grammar_trigger_node::BOL:
+            emit(inst::BOL);
+            break;
+        case llama_grammar_trigger_node::EOL:
+            emit(inst::EOL);
+            break;
+    }
+}
+
+void llama_grammar_trigger_pattern::compile(const std::string & src) {
+    pattern = src;
+
+    llama_grammar_trigger_parser parser(pattern.c_str());
+    const auto root = parser.parse();
+
+    prog.clear();
+    llama_grammar_trigger_emit(root, prog);
+    prog.push_back({ llama_grammar_trigger_inst::MATCH, 0, 0, {} });
+
+    states.clear();
+    accepting.clear();
+    trans.clear();
+    state_ids.clear();
+
+    std::vector<int>  pcs;
+    std::vector<bool> seen(2*prog.size());
+    bool is_accepting = false;
+    closure(0, true, false, pcs, seen, is_accepting);
+    std::sort(pcs.begin(), pcs.end());
+
+    cur = add_state(std::move(pcs), is_accepting);
+}
+
+void llama_grammar_trigger_pattern::closure(int pc, bool at_start, bool after_eol, std::vector<int> & pcs, std::vector<bool> & seen, bool & is_accepting) const {
+    if (seen[2*pc + after_eol]) {
+        return;
+    }
+    seen[2*pc + after_eol] = true;
+
+    const auto & inst = prog[pc];
+    switch (inst.op) {
+        case llama_grammar_trigger_inst::BYTES:
+            // nothing can be consumed after the end of the text
+            if (!after_eol) {
+                pcs.push_back(pc);
+            }
+            break;
+        case llama_grammar_trigger_inst::SPLIT:
+            closure(inst.x, at_start, after_eol, pcs, seen, is_accepting);
+            closure(inst.y, at_start, after_eol, pcs, seen, is_accepting);
+            break;
+        case llama_grammar_trigger_inst::JMP:
+            closure(inst.x, at_start, after_eol, pcs, seen, is_accepting);
+            break;
+        case llama_grammar_trigger_inst::SAVE:
+            closure(pc + 1, at_start, after_eol, pcs, seen, is_accepting);
+            break;
+        case llama_grammar_trigger_inst::BOL:
+            if (at_start) {
+                closure(pc + 1, at_start, after_eol, pcs, seen, is_accepting);
+            }
+            break;
+        case llama_grammar_trigger_inst::EOL:
+            closure(pc + 1, at_start, true, pcs, seen, is_accepting);
+            break;
+        case llama_grammar_trigger_inst::MATCH:
+            // kept in the set so that matching and non-matching states are never merged
+            pcs.push_back(pc);
+            is_accepting = true;
+            break;
+    }
+}
+
+int32_t llama_grammar_trigger_pattern::add_state(std::vector<int> && pcs, bool is_accepting) {
+    const int32_t id = (int32_t) states.size();
+    state_ids.emplace(pcs, id);
+    states.push_back(std::move(pcs));
+    accepting.push_back(is_accepting);
+    trans.resize(trans.size() + 256, -1);
+    return id;
+}
+
+int32_t llama_grammar_trigger_pattern::step(int32_t state, uint8_t c) {
+    const size_t idx = 256*(size_t) state + c;
+    if (trans[idx] >= 0) {
+        return trans[idx];
+    }
+
+    std::vector<int>  pcs;
+    std::vector<bool> seen(2*prog.size());
+    bool is_accepting = false;
+    for (const int pc : states[state]) {
+        if (prog[pc].bytes[c]) {
+            closure(pc + 1, false, false, pcs, seen, is_accepting);
+        }
+    }
+    std::sort(pcs.begin(), pcs.end());
+
+    const auto it = state_ids.find(pcs);
+    const int32_t next = it != state_ids.end() ? it->second : add_state(std::move(pcs), is_accepting);
+
+    trans[idx] = next;
+    return next;
+}
+
+bool llama_grammar_trigger_pattern::feed(const std::string & piece) {
+    for (const char c : piece) {
+        if (states.size() >= LLAMA_GRAMMAR_TRIGGER_MAX_STATES) {
+            // pathological pattern: drop the cached states, keeping only the current one
+            auto pcs = std::move(states[cur]);
+            const bool is_accepting = accepting[cur];
+            states.clear();
+            accepting.clear();
+            trans.clear();
+            state_ids.clear();
+            cur = add_state(std::move(pcs), is_accepting);
+        }
+        cur = step(cur, (uint8_t) c);
+    }
+    return accepting[cur];
+}
+
+// adds a thread at pc to the list of a Pike VM, following the instructions that do not consume input
+// in priority order; start is the position saved for the first capture group
+static void llama_grammar_trigger_add_thread(
+        const std::vector<llama_grammar_trigger_inst> & prog,
+        std::vector<std::pair<int, size_t>>           & list,
+        std::vector<size_t>                           & seen,
+        int                                             pc,
+        size_t                                          start,
+        size_t                                          pos,
+        size_t                                          n) {
+    if (seen[pc] == pos) {
+        return;
+    }
+    seen[pc] = pos;
+
+    const auto & inst = prog[pc];
+    switch (inst.op) {
+        case llama_grammar_trigger_inst::SPLIT:
+            llama_grammar_trigger_add_thread(prog, list, seen, inst.x, start, pos, n);
+            llama_grammar_trigger_add_thread(prog, list, seen, inst.y, start, pos, n);
+            break;
+        case llama_grammar_trigger_inst::JMP:
+            llama_grammar_trigger_add_thread(prog, list, seen, inst.x, start, pos, n);
+            break;
+        case llama_grammar_trigger_inst::SAVE:
+            llama_grammar_trigger_add_thread(prog, list, seen, pc + 1, inst.x == 2 ? pos : start, pos, n);
+            break;
+        case llama_grammar_trigger_inst::BOL:
+            if (pos == 0) {
+                llama_grammar_trigger_add_thread(prog, list, seen, pc + 1, start, pos, n);
+            }
+            break;
+        case llama_grammar_trigger_inst::EOL:
+            if (pos == n) {
+                llama_grammar_trigger_add_thread(prog, list, seen, pc + 1, start, pos, n);
+            }
+            break;
+        case llama_grammar_trigger_inst::BYTES:
+        case llama_grammar_trigger_inst::MATCH:
+            list.emplace_back(pc, start);
+            break;
+    }
+}
+
+size_t llama_grammar_trigger_pattern::group_start(const std::string & text) const {
+    // the DFA only tells whether the text matches, the capture is resolved once, when the trigger fires,
+    // by a Pike VM whose thread priorities follow the backtracking order of std::regex
+    const size_t n = text.size();
+
+    std::vector<std::pair<int, size_t>> clist;
+    std::vector<std::pair<int, size_t>> nlist;
+    std::vector<size_t> seen(prog.size(), SIZE_MAX);
+
+    llama_grammar_trigger_add_thread(prog, clist, seen, 0, n, 0, n);
+
+    for (size_t pos = 0; !clist.empty(); ++pos) {
+        nlist.clear();
+        for (const auto & thread : clist) {
+            const auto & inst = prog[thread.first];
+            if (inst.op == llama_grammar_trigger_inst::MATCH) {
+                if (pos == n) {
+                    return thread.second;
+                }
+                continue;
+            }
+            if (pos < n && inst.bytes[(uint8_t) text[pos]]) {
+                llama_grammar_trigger_add_thread(prog, nlist, seen, thread.first + 1, thread.second, pos + 1, n);
+            }
+        }
+        if (pos == n) {
+            break;
+        }
+        std::swap(clist, nlist);
+    }
+
+    return n;
+}
+
 // returns true iff pos points to the end of one of the definitions of a rule
 static bool llama_grammar_is_end_of_sequence(const llama_grammar_element * pos) {
     switch (pos->type) {
@@ -685,18 +1470,24 @@ static bool llama_grammar_match_partial_char(
 
 // transforms a grammar pushdown stack into N possible stacks, all ending
 // at a character range (terminal element)
+// the caller starts a visit pass on the arena: stacks already visited in the pass are skipped, which
+// dedups the resulting stacks and avoids expanding the same intermediate stack once per path of an
+// ambiguous grammar
 static void llama_grammar_advance_stack(
-        const llama_grammar_rules  & rules,
-        const llama_grammar_stack  & stack,
-              llama_grammar_stacks & new_stacks) {
-    if (stack.empty()) {
-        if (std::find(new_stacks.begin(), new_stacks.end(), stack) == new_stacks.end()) {
-            new_stacks.emplace_back(stack);
-        }
+        const llama_grammar_rules       & rules,
+              llama_grammar_stack_arena & arena,
+        const llama_grammar_stack         stack,
+              llama_grammar_stacks      & new_stacks) {
+    if (!arena.visit(stack)) {
         return;
     }
 
-    const llama_grammar_element * pos = stack.back();
+    if (stack == LLAMA_GRAMMAR_STACK_EMPTY) {
+        new_stacks.push_back(stack);
+        return;
+    }
+
+    const llama_grammar_element * pos = arena.top(stack);
 
     switch (pos->type) {
         case LLAMA_GRETYPE_RULE_REF: {
@@ -704,16 +1495,16 @@ static void llama_grammar_advance_stack(
             const llama_grammar_element * subpos  = rules[rule_id].data();
             do {
                 // init new stack without the top (pos)
-                llama_grammar_stack new_stack(stack.begin(), stack.end() - 1);
+                llama_grammar_stack new_stack = arena.parent(stack);
                 if (!llama_grammar_is_end_of_sequence(pos + 1)) {
                     // if this rule ref is followed by another element, add that to stack
-                    new_stack.push_back(pos + 1);
+                    new_stack = arena.push(new_stack, pos + 1);
                 }
                 if (!llama_grammar_is_end_of_sequence(subpos)) {
                     // if alternate is nonempty, add to stack
-                    new_stack.push_back(subpos);
+                    new_stack = arena.push(new_stack, subpos);
                 }
-                llama_grammar_advance_stack(rules, new_stack, new_stacks);
+                llama_grammar_advance_stack(rules, arena, new_stack, new_stacks);
                 while (!llama_grammar_is_end_of_sequence(subpos)) {
                     // scan to end of alternate def
                     subpos++;
@@ -730,10 +1521,7 @@ static void llama_grammar_advance_stack(
         case LLAMA_GRETYPE_CHAR:
         case LLAMA_GRETYPE_CHAR_NOT:
         case LLAMA_GRETYPE_CHAR_ANY:
-            if (std::find(new_stacks.begin(), new_stacks.end(), stack) == new_stacks.end()) {
-                // only add the stack if it's not a duplicate of one we already have
-                new_stacks.emplace_back(stack);
-            }
+            new_stacks.push_back(stack);
             break;
         default:
             // end of alternate (LLAMA_GRETYPE_END, LLAMA_GRETYPE_ALT) or middle of char range
@@ -744,19 +1532,20 @@ static void llama_grammar_advance_stack(
 }
 
 static llama_grammar_candidates llama_grammar_reject_candidates(
-        const llama_grammar_rules      & rules,
-        const llama_grammar_stacks     & stacks,
-        const llama_grammar_candidates & candidates) {
+        const llama_grammar_rules       & rules,
+              llama_grammar_stack_arena & arena,
+        const llama_grammar_stacks      & stacks,
+        const llama_grammar_candidates  & candidates) {
     LM_GGML_ASSERT(!stacks.empty()); // REVIEW
 
     if (candidates.empty()) {
         return {};
     }
 
-    auto rejects = llama_grammar_reject_candidates_for_stack(rules, stacks.front(), candidates);
+    auto rejects = llama_grammar_reject_candidates_for_stack(rules, arena, stacks.front(), candidates);
 
     for (size_t i = 1, size = stacks.size(); i < size; ++i) {
-        rejects = llama_grammar_reject_candidates_for_stack(rules, stacks[i], rejects);
+        rejects = llama_grammar_reject_candidates_for_stack(rules, arena, stacks[i], rejects);
     }
 
     return rejects;
@@ -823,25 +1612,33 @@ llama_grammar_stacks & llama_grammar_get_stacks(struct llama_grammar * grammar)
     return grammar->stacks;
 }
 
+llama_grammar_stack_arena & llama_grammar_get_arena(struct llama_grammar * grammar) {
+    return grammar->arena;
+}
+
 void llama_grammar_accept(struct llama_grammar * grammar, uint32_t chr) {
+    auto & arena = grammar->arena;
+
     llama_grammar_stacks stacks_new;
     stacks_new.reserve(grammar->stacks.size());
 
-    for (const auto & stack : grammar->stacks) {
-        if (stack.empty()) {
+    arena.begin_visit();
+
+    for (const auto stack : grammar->stacks) {
+        if (stack == LLAMA_GRAMMAR_STACK_EMPTY) {
             continue;
         }
 
-        auto match = llama_grammar_match_char(stack.back(), chr);
+        auto match = llama_grammar_match_char(arena.top(stack), chr);
         if (match.first) {
             const llama_grammar_element * pos = match.second;
 
             // update top of stack to next element, if any
-            llama_grammar_stack new_stack(stack.begin(), stack.end() - 1);
+            llama_grammar_stack new_stack = arena.parent(stack);
             if (!llama_grammar_is_end_of_sequence(pos)) {
-                new_stack.push_back(pos);
+                new_stack = arena.push(new_stack, pos);
             }
-            llama_grammar_advance_stack(grammar->rules, new_stack, stacks_new);
+            llama_grammar_advance_stack(grammar->rules, arena, new_stack, stacks_new);
         }
     }
 
@@ -849,14 +1646,15 @@ void llama_grammar_accept(struct llama_grammar * grammar, uint32_t chr) {
 }
 
 llama_grammar_candidates llama_grammar_reject_candidates_for_stack(
-        const llama_grammar_rules      & rules,
-        const llama_grammar_stack      & stack,
-        const llama_grammar_candidates & candidates) {
+        const llama_grammar_rules       & rules,
+              llama_grammar_stack_arena & arena,
+        const llama_grammar_stack         stack,
+        const llama_grammar_candidates  & candidates) {
 
     llama_grammar_candidates rejects;
     rejects.reserve(candidates.size());
 
-    if (stack.empty()) {
+    if (stack == LLAMA_GRAMMAR_STACK_EMPTY) {
         for (const auto & tok : candidates) {
             if (*tok.code_points != 0 || tok.partial_utf8.n_remain != 0) {
                 rejects.push_back(tok);
@@ -865,7 +1663,7 @@ llama_grammar_candidates llama_grammar_reject_candidates_for_stack(
         return rejects;
     }
 
-    const llama_grammar_element * stack_pos = stack.back();
+    const llama_grammar_element * stack_pos = arena.top(stack);
 
     llama_grammar_candidates next_candidates;
     next_candidates.reserve(candidates.size());
@@ -885,17 +1683,22 @@ llama_grammar_candidates llama_grammar_reject_candidates_for_stack(
         }
     }
 
+    if (next_candidates.empty()) {
+        return rejects;
+    }
+
     const auto * stack_pos_after = llama_grammar_match_char(stack_pos, 0).second;
 
     // update top of stack to next element, if any
-    llama_grammar_stack stack_after(stack.begin(), stack.end() - 1);
+    llama_grammar_stack stack_after = arena.parent(stack);
     if (!llama_grammar_is_end_of_sequence(stack_pos_after)) {
-        stack_after.push_back(stack_pos_after);
+        stack_after = arena.push(stack_after, stack_pos_after);
     }
     llama_grammar_stacks next_stacks;
-    llama_grammar_advance_stack(rules, stack_after, next_stacks);
+    arena.begin_visit();
+    llama_grammar_advance_stack(rules, arena, stack_after, next_stacks);
 
-    auto next_rejects = llama_grammar_reject_candidates(rules, next_stacks, next_candidates);
+    auto next_rejects = llama_grammar_reject_candidates(rules, arena, next_stacks, next_candidates);
     for (const auto & tok : next_rejects) {
         rejects.push_back({ tok.index, tok.code_points - 1, tok.partial_utf8 });
     }
@@ -936,15 +1739,17 @@ struct llama_grammar * llama_grammar_init_impl(
     }
 
     // loop over alternates of start rule to build initial stacks
+    llama_grammar_stack_arena arena;
     llama_grammar_stacks stacks;
+    arena.begin_visit();
     pos = vec_rules[start_rule_index].data();
     do {
-        llama_grammar_stack stack;
+        llama_grammar_stack stack = LLAMA_GRAMMAR_STACK_EMPTY;
         if (!llama_grammar_is_end_of_sequence(pos)) {
             // if alternate is nonempty, add to stack
-            stack.push_back(pos);
+            stack = arena.push(stack, pos);
         }
-        llama_grammar_advance_stack(vec_rules, stack, stacks);
+        llama_grammar_advance_stack(vec_rules, arena, stack, stacks);
         while (!llama_grammar_is_end_of_sequence(pos)) {
             // scan to end of alternate def
             pos++;
@@ -957,12 +1762,13 @@ struct llama_grammar * llama_grammar_init_impl(
         }
     } while (true);
 
-    // Important: vec_rules has to be moved here, not copied, because stacks contains
+    // Important: vec_rules has to be moved here, not copied, because the stack arena contains
     // pointers to elements of vec_rules. If vec_rules were copied into llama_grammar
     // then the pointers would be invalidated when the local vec_rules goes out of scope.
     return new llama_grammar {
         vocab,
         std::move(vec_rules),
+        std::move(arena),
         std::move(stacks),
         /* .partial_utf8 = */     {},
         /* .lazy =*/              false,
@@ -1028,15 +1834,17 @@ struct llama_grammar * llama_grammar_init_impl(
     }
 
     // loop over alternates of start rule to build initial stacks
+    llama_grammar_stack_arena arena;
     llama_grammar_stacks stacks;
+    arena.begin_visit();
     pos = vec_rules[start_rule_index].data();
     do {
-        llama_grammar_stack stack;
+        llama_grammar_stack stack = LLAMA_GRAMMAR_STACK_EMPTY;
         if (!llama_grammar_is_end_of_sequence(pos)) {
             // if alternate is nonempty, add to stack
-            stack.push_back(pos);
+            stack = arena.push(stack, pos);
         }
-        llama_grammar_advance_stack(vec_rules, stack, stacks);
+        llama_grammar_advance_stack(vec_rules, arena, stack, stacks);
         while (!llama_grammar_is_end_of_sequence(pos)) {
             // scan to end of alternate def
             pos++;
@@ -1058,16 +1866,21 @@ struct llama_grammar * llama_grammar_init_impl(
     for (size_t i = 0; i < num_trigger_patterns; i++) {
         LM_GGML_ASSERT(trigger_patterns != nullptr);
         auto & trigger = vec_trigger_patterns.emplace_back();
-        trigger.pattern = trigger_patterns[i];
-        trigger.regex = std::regex(trigger.pattern);
+        try {
+            trigger.compile(trigger_patterns[i]);
+        } catch (const std::exception & err) {
+            LLAMA_LOG_ERROR("%s: %s\n", __func__, err.what());
+            return nullptr;
+        }
     }
 
-    // Important: vec_rules has to be moved here, not copied, because stacks contains
+    // Important: vec_rules has to be moved here, not copied, because the stack arena contains
     // pointers to elements of vec_rules. If vec_rules were copied into llama_grammar
     // then the pointers would be invalidated when the local vec_rules goes out of scope.
     return new llama_grammar {
         vocab,
         std::move(vec_rules),
+        std::move(arena),
         std::move(stacks),
         /* .partial_utf8 = */     {},
         /* .lazy = */             lazy,
@@ -1090,6 +1903,7 @@ struct llama_grammar * llama_grammar_clone_impl(const struct llama_grammar & gra
     auto * result = new llama_grammar {
         grammar.vocab,
         grammar.rules,
+        grammar.arena,
         grammar.stacks,
         grammar.partial_utf8,
         grammar.lazy,
@@ -1099,46 +1913,135 @@ struct llama_grammar * llama_grammar_clone_impl(const struct llama_grammar & gra
         grammar.trigger_patterns,
     };
 
-    // redirect elements in stacks to point to new rules
-    for (size_t is = 0; is < result->stacks.size(); is++) {
-        for (size_t ie = 0; ie < result->stacks[is].size(); ie++) {
-            for (size_t ir0 = 0; ir0 < grammar.rules.size(); ir0++) {
-                for (size_t ir1 = 0; ir1 < grammar.rules[ir0].size(); ir1++) {
-                    if (grammar.stacks[is][ie] == &grammar.rules[ir0][ir1]) {
-                        result->stacks[is][ie] =  &result->rules[ir0][ir1];
+    // redirect elements in the stack arena to point to new rules
+    result->arena.rebase(grammar.rules, result->rules);
+
+    return result;
+}
+
+//
+// rejection workers
+//
+
+// minimum number of candidates per chunk when splitting the rejection across threads
+#define LLAMA_GRAMMAR_REJECT_CHUNK 2048
+
+// small pool of workers shared by all grammars, used to split the candidate rejection of a token
+// the calling thread always takes part in the work, so the pool keeps one thread less than the cores
+struct llama_grammar_workers {
+    struct state {
+        std::mutex              mutex;
+        std::condition_variable cv;
+
+        std::function<void(int)> fn;
+
+        int n_jobs;
+        int n_done = 0;
+
+        std::atomic<int> next{0};
+    };
+
+    std::mutex                                     mutex;
+    std::condition_variable                        cv;
+    std::deque<std::shared_ptr<state>>             queue;
+    std::vector<std::thread>                       threads;
+    bool                                           stop = false;
+
+    llama_grammar_workers() {
+        const int n_threads = std::min<int>(8, std::max<int>(1, std::thread::hardware_concurrency())) - 1;
+        for (int i = 0; i < n_threads; ++i) {
+            threads.emplace_back([this]() {
+                while (true) {
+                    std::shared_ptr<state> st;
+                    {
+                        std::unique_lock<std::mutex> lock(mutex);
+                        cv.wait(lock, [this]() { return stop || !queue.empty(); });
+                        if (stop) {
+                            return;
+                        }
+                        st = std::move(queue.front());
+                        queue.pop_front();
                     }
+                    work(*st);
                 }
-            }
+            });
         }
     }
 
-    return result;
-}
+    ~llama_grammar_workers() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stop = true;
+        }
+        cv.notify_all();
+        for (auto & thread : threads) {
+            thread.join();
+        }
+    }
 
-void llama_grammar_apply_impl(const struct llama_grammar & grammar, llama_token_data_array * cur_p) {
-    LM_GGML_ASSERT(grammar.vocab != nullptr);
+    int n_threads() const {
+        return (int) threads.size() + 1;
+    }
 
-    if (grammar.awaiting_trigger) {
-        return;
+    static void work(state & st) {
+        for (int i = st.next++; i < st.n_jobs; i = st.next++) {
+            st.fn(i);
+
+            std::lock_guard<std::mutex> lock(st.mutex);
+            if (++st.n_done == st.n_jobs) {
+                st.cv.notify_all();
+            }
+        }
     }
 
-    bool allow_eog = false;
-    for (const auto & stack : grammar.stacks) {
-        if (stack.empty()) {
-            allow_eog = true;
-            break;
+    // calls fn(0) .. fn(n_jobs - 1) across the workers and the calling thread, returns when all are done
+    void run(int n_jobs, std::function<void(int)> fn) {
+        auto st = std::make_shared<state>();
+        st->fn     = std::move(fn);
+        st->n_jobs = n_jobs;
+
+        const int n_helpers = std::min<int>(n_jobs, n_threads()) - 1;
+        if (n_helpers > 0) {
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                for (int i = 0; i < n_helpers; ++i) {
+                    queue.push_back(st);
+                }
+            }
+            cv.notify_all();
         }
+
+        work(*st);
+
+        // helpers that pick up the state late find no jobs left and only touch the shared state
+        std::unique_lock<std::mutex> lock(st->mutex);
+        st->cv.wait(lock, [&]() { return st->n_done == st->n_jobs; });
     }
+};
+
+static llama_grammar_workers & llama_grammar_get_workers() {
+    static llama_grammar_workers workers;
+    return workers;
+}
 
+// applies the grammar to the candidates [i0, i1) of cur_p
+// ranges can be processed concurrently: each one decodes its own candidates and rejects them with its
+// own scratch arena, and only writes the logits of its range
+static void llama_grammar_apply_range(
+        const struct llama_grammar & grammar,
+            llama_token_data_array * cur_p,
+                              bool   allow_eog,
+                            size_t   i0,
+                            size_t   i1) {
     std::vector<std::pair<std::vector<uint32_t>, llama_partial_utf8>> candidates_decoded;
-    candidates_decoded.reserve(cur_p->size);
+    candidates_decoded.reserve(i1 - i0);
 
     llama_grammar_candidates candidates_grammar;
-    candidates_grammar.reserve(cur_p->size);
+    candidates_grammar.reserve(i1 - i0);
 
-    for (size_t i = 0; i < cur_p->size; ++i) {
-        const llama_token id      = cur_p->data[i].id;
-        const std::string & piece = grammar.vocab->token_to_piece(id);
+    for (size_t i = i0; i < i1; ++i) {
+        const llama_token      id    = cur_p->data[i].id;
+        const std::string_view piece = grammar.vocab->token_to_piece(id);
 
         if (grammar.vocab->is_eog(id)) {
             if (!allow_eog) {
@@ -1152,16 +2055,53 @@ void llama_grammar_apply_impl(const struct llama_grammar & grammar, llama_token_
         }
     }
 
-    const auto rejects = llama_grammar_reject_candidates(grammar.rules, grammar.stacks, candidates_grammar);
+    // the stacks built while rejecting are temporary, keep them out of the grammar arena
+    llama_grammar_stack_arena scratch;
+    scratch.clear(&grammar.arena);
+
+    const auto rejects = llama_grammar_reject_candidates(grammar.rules, scratch, grammar.stacks, candidates_grammar);
     for (const auto & reject : rejects) {
         cur_p->data[reject.index].logit = -INFINITY;
     }
 }
 
+void llama_grammar_apply_impl(const struct llama_grammar & grammar, llama_token_data_array * cur_p) {
+    LM_GGML_ASSERT(grammar.vocab != nullptr);
+
+    if (grammar.awaiting_trigger) {
+        return;
+    }
+
+    bool allow_eog = false;
+    for (const auto stack : grammar.stacks) {
+        if (stack == LLAMA_GRAMMAR_STACK_EMPTY) {
+            allow_eog = true;
+            break;
+        }
+    }
+
+    // each candidate is accepted or rejected independently of the others, so the candidates are split
+    // in contiguous ranges; small arrays (e.g. after top-k) stay on the calling thread
+    const size_t n_chunks_max = cur_p->size / LLAMA_GRAMMAR_REJECT_CHUNK;
+    const size_t n_chunks     = n_chunks_max < 2 ? 1 : std::min<size_t>(n_chunks_max, llama_grammar_get_workers().n_threads());
+    if (n_chunks < 2) {
+        llama_grammar_apply_range(grammar, cur_p, allow_eog, 0, cur_p->size);
+        return;
+    }
+
+    const size_t chunk_size = (cur_p->size + n_chunks - 1)/n_chunks;
+
+    llama_grammar_get_workers().run((int) n_chunks, [&](int ic) {
+        const size_t i0 = ic*chunk_size;
+        const size_t i1 = std::min(cur_p->size, i0 + chunk_size);
+        llama_grammar_apply_range(grammar, cur_p, allow_eog, i0, i1);
+    });
+}
+
 void llama_grammar_accept_impl(struct llama_grammar & grammar, llama_token token) {
     LM_GGML_ASSERT(grammar.vocab != nullptr);
 
-    const auto & piece = grammar.vocab->token_to_piece(token);
+    const std::string piece(grammar.vocab->token_to_piece(token));
 
     if (grammar.awaiting_trigger) {
         if (std::find(grammar.trigger_tokens.begin(), grammar.trigger_tokens.end(), token) != grammar.trigger_tokens.end()) {
@@ -1173,13 +2113,12 @@ void llama_grammar_accept_impl(struct llama_grammar & grammar, llama_token token
         } else {
             grammar.trigger_buffer += piece;
 
-            std::smatch match;
-            for (const auto & trigger_pattern : grammar.trigger_patterns) {
-                if (std::regex_match(grammar.trigger_buffer, match, trigger_pattern.regex)) {
+            // the patterns only step over the new bytes, the buffer is kept for the constrained string
+            for (auto & trigger_pattern : grammar.trigger_patterns) {
+                if (trigger_pattern.feed(piece)) {
                     grammar.awaiting_trigger = false;
                     // get from the first match to the end of the string
-                    auto constrained_str = grammar.trigger_buffer.substr(match.position(1));
-                    // std::string constrained_str(match[1].first, grammar.trigger_buffer.end());
+                    auto constrained_str = grammar.trigger_buffer.substr(trigger_pattern.group_start(grammar.trigger_buffer));
                     grammar.trigger_buffer.clear();
                     llama_grammar_accept_str(grammar, constrained_str);
                     LLAMA_LOG_DEBUG("Grammar triggered on regex: '%s'\n", constrained_str.c_str());
@@ -1192,8 +2131,8 @@ void llama_grammar_accept_impl(struct llama_grammar & grammar, llama_token token
     }
 
     if (grammar.vocab->is_eog(token)) {
-        for (const auto & stack : grammar.stacks) {
-            if (stack.empty()) {
+        for (const auto stack : grammar.stacks) {
+            if (stack == LLAMA_GRAMMAR_STACK_EMPTY) {
                 return;
             }
         }
@@ -1216,4 +2155,6 @@ void llama_grammar_accept_str(struct llama_grammar & grammar, const std::string
     if (grammar.stacks.empty()) {
         throw std::runtime_error("Unexpected empty grammar stack after accepting piece: " + piece);
     }
+
+    grammar.arena.collect(grammar.stacks);
 }
@@ -2,8 +2,8 @@
 
 #include "llama.h"
 
+#include <bitset>
 #include <map>
-#include <regex>
 #include <string>
 #include <vector>
 
@@ -55,15 +55,78 @@ struct llama_grammar_candidate {
 };
 
 using llama_grammar_rule  = std::vector<      llama_grammar_element>;
-using llama_grammar_stack = std::vector<const llama_grammar_element *>;
+
+// a stack is the id of its top node in a llama_grammar_stack_arena (see below)
+using llama_grammar_stack = uint32_t;
 
 using llama_grammar_rules      = std::vector<llama_grammar_rule>;
 using llama_grammar_stacks     = std::vector<llama_grammar_stack>;
 using llama_grammar_candidates = std::vector<llama_grammar_candidate>;
 
+// id of the empty stack, valid in every arena
+static constexpr llama_grammar_stack LLAMA_GRAMMAR_STACK_EMPTY = 0;
+
+struct llama_grammar_stack_node {
+    const llama_grammar_element * pos;    // top element of the stack
+    llama_grammar_stack           parent; // the rest of the stack
+};
+
+// pushdown stacks are stored as persistent linked lists of grammar positions
+// nodes are hash-consed: pushing the same element on the same stack always yields the same id, so
+// stacks with a common tail share its nodes and two stacks are equal iff their ids are equal
+//
+// an arena can extend a read-only base arena, which lets the candidate rejection build temporary
+// stacks without modifying the grammar
+struct llama_grammar_stack_arena {
+    const llama_grammar_stack_arena * base   = nullptr;
+    uint32_t                          n_base = 0; // ids below n_base resolve to the base arena
+
+    std::vector<llama_grammar_stack_node> nodes;
+    std::vector<uint32_t>                 table; // open addressing, local node index + 1 (0 = free)
+
+    // per-id visit marks, used to dedup stacks within one llama_grammar_advance_stack pass
+    std::vector<uint32_t> marks;
+    uint32_t              epoch = 0;
+
+    // number of nodes at which the next collect() compacts the arena
+    size_t n_collect = 4096;
+
+    llama_grammar_stack_arena() { clear(); }
+
+    void clear(const llama_grammar_stack_arena * base_arena = nullptr);
+
+    uint32_t size() const { return n_base + (uint32_t) nodes.size(); }
+
+    const llama_grammar_stack_node & node(llama_grammar_stack id) const {
+        return id < n_base ? base->node(id) : nodes[id - n_base];
+    }
+
+    const llama_grammar_element * top   (llama_grammar_stack id) const { return node(id).pos;    }
+    llama_grammar_stack           parent(llama_grammar_stack id) const { return node(id).parent; }
+
+    // returns the interned stack with pos pushed on top of parent
+    llama_grammar_stack push(llama_grammar_stack parent, const llama_grammar_element * pos);
+
+    // starts a new dedup pass; visit() returns true the first time an id is seen in the pass
+    void begin_visit();
+    bool visit(llama_grammar_stack id);
+
+    // drops the nodes that are not reachable from stacks, remapping the ids in stacks
+    void collect(llama_grammar_stacks & stacks);
+
+    // redirects the node positions from the elements of src to the same elements of dst
+    void rebase(const llama_grammar_rules & src, const llama_grammar_rules & dst);
+
+private:
+    bool find(llama_grammar_stack parent, const llama_grammar_element * pos, llama_grammar_stack & id) const;
+    void insert(uint32_t idx);
+    void rehash(size_t n_slots);
+};
+
 // TODO: remove, needed for tests atm
-const llama_grammar_rules  & llama_grammar_get_rules (const struct llama_grammar * grammar);
-      llama_grammar_stacks & llama_grammar_get_stacks(      struct llama_grammar * grammar);
+const llama_grammar_rules       & llama_grammar_get_rules (const struct llama_grammar * grammar);
+      llama_grammar_stacks      & llama_grammar_get_stacks(      struct llama_grammar * grammar);
+      llama_grammar_stack_arena & llama_grammar_get_arena (      struct llama_grammar * grammar);
 
 // takes a set of possible pushdown stacks on a grammar, which are required to
 // be positioned at a character range (see `llama_grammar_advance_stack`), and
@@ -72,16 +135,17 @@ const llama_grammar_rules  & llama_grammar_get_rules (const struct llama_grammar
 void llama_grammar_accept(struct llama_grammar * grammar, uint32_t chr);
 
 std::vector<llama_grammar_candidate> llama_grammar_reject_candidates_for_stack(
-        const llama_grammar_rules      & rules,
-        const llama_grammar_stack      & stack,
-        const llama_grammar_candidates & candidates);
+        const llama_grammar_rules       & rules,
+              llama_grammar_stack_arena & arena,
+        const llama_grammar_stack         stack,
+        const llama_grammar_candidates  & candidates);
 
 struct llama_grammar_parser {
     std::map<std::string, uint32_t> symbol_ids;
 
     llama_grammar_rules rules;
 
-    llama_grammar_stack c_rules() const;
+    std::vector<const llama_grammar_element *> c_rules() const;
 
     uint32_t get_symbol_id(const char * src, size_t len);
     uint32_t generate_symbol_id(const std::string & base_name);
@@ -106,17 +170,62 @@ struct llama_grammar_parser {
     void print(FILE * file);
 };
 
+// instruction of a compiled trigger pattern
+struct llama_grammar_trigger_inst {
+    enum op_t : uint8_t {
+        BYTES, // consume one byte in `bytes`, continue at the next instruction
+        SPLIT, // continue at x, or at y with lower priority
+        JMP,   // continue at x
+        SAVE,  // record the current position in capture slot x
+        BOL,   // assert beginning of text
+        EOL,   // assert end of text
+        MATCH,
+    };
+
+    op_t             op;
+    int              x = 0;
+    int              y = 0;
+    std::bitset<256> bytes;
+};
+
+// trigger patterns are compiled once at grammar init into a small program (a subset of the
+// ECMAScript regex syntax, see llama_grammar_trigger_parser), which is run over the generated text
+// one byte at a time as a DFA whose states are built on first use and cached
+// the match follows std::regex_match, i.e. the pattern has to match the entire generated text
 struct llama_grammar_trigger_pattern {
     std::string pattern;
-    std::regex  regex;
+
+    std::vector<llama_grammar_trigger_inst> prog;
+
+    // DFA cache: each state is the set of BYTES (and MATCH) instructions the program can be at
+    std::vector<std::vector<int>>       states;
+    std::vector<bool>                   accepting; // whether the text fed so far matches
+    std::vector<int32_t>                trans;     // 256 entries per state, -1 if not built yet
+    std::map<std::vector<int>, int32_t> state_ids;
+
+    int32_t cur = 0; // state after the text fed so far
+
+    void compile(const std::string & src);
+
+    // advances the DFA over the bytes of piece, returns true if the text fed so far matches
+    bool feed(const std::string & piece);
+
+    // position of the first capture group in the match of text, text.size() if it did not participate
+    size_t group_start(const std::string & text) const;
+
+private:
+    int32_t add_state(std::vector<int> && pcs, bool is_accepting);
+    int32_t step(int32_t state, uint8_t c);
+    void    closure(int pc, bool at_start, bool after_eol, std::vector<int> & pcs, std::vector<bool> & seen, bool & is_accepting) const;
 };
 
 struct llama_grammar {
     // note: allow null vocab for testing (not great)
     const llama_vocab * vocab;
 
-    const llama_grammar_rules  rules;  // TODO: shared ptr
-          llama_grammar_stacks stacks;
+    const llama_grammar_rules       rules;  // TODO: shared ptr
+          llama_grammar_stack_arena arena;
+          llama_grammar_stacks      stacks;
 
     // buffer for partially generated UTF-8 sequence from accepted tokens
     llama_partial_utf8 partial_utf8;
@@ -129,7 +129,7 @@ static std::string lm_gguf_data_to_str(enum lm_gguf_type type, const void * data
     }
 }
 
-std::string lm_gguf_kv_to_str(const struct lm_gguf_context * ctx_gguf, int i) {
+std::string lm_gguf_kv_to_str(const struct lm_gguf_context * ctx_gguf, int i, size_t max_len) {
     const enum lm_gguf_type type = lm_gguf_get_kv_type(ctx_gguf, i);
 
     switch (type) {
@@ -142,7 +142,7 @@ std::string lm_gguf_kv_to_str(const struct lm_gguf_context * ctx_gguf, int i) {
                 const void * data = arr_type == LM_GGUF_TYPE_STRING ? nullptr : lm_gguf_get_arr_data(ctx_gguf, i);
                 std::stringstream ss;
                 ss << "[";
-                for (int j = 0; j < arr_n; j++) {
+                for (int j = 0; j < arr_n && size_t(ss.tellp()) <= max_len; j++) {
                     if (arr_type == LM_GGUF_TYPE_STRING) {
                         std::string val = lm_gguf_get_arr_str(ctx_gguf, i, j);
                         // escape quotes
@@ -108,7 +108,9 @@ bool llama_kv_cache_unified::init(
         auto * buft = it.first;
         auto * ctx  = it.second;
 
-        lm_ggml_backend_buffer_t buf = lm_ggml_backend_alloc_ctx_tensors_from_buft(ctx, buft);
+        lm_ggml_backend_buffer_t buf = cparams.dry_run ?
+            lm_ggml_backend_alloc_ctx_tensors_from_buft_dry(ctx, buft) :
+            llama_alloc_ctx_tensors(ctx, buft, cparams.hugepages, hugetlbs);
         if (!buf) {
             LLAMA_LOG_ERROR("%s: failed to allocate buffer for kv cache\n", __func__);
             return false;
@@ -3,6 +3,7 @@
 #include "llama.h"
 #include "llama-io.h"
 #include "llama-memory.h"
+#include "llama-mmap.h"
 
 #include "ggml-cpp.h"
 
@@ -189,6 +190,7 @@ private:
     lm_ggml_type type_v = LM_GGML_TYPE_F16;
 
     std::vector<lm_ggml_context_ptr>        ctxs;
+    llama_hugetlbs                       hugetlbs; // freed after bufs
     std::vector<lm_ggml_backend_buffer_ptr> bufs;
 
     void state_write_meta(llama_io_write_i & io, const std::vector<std::pair<uint32_t, uint32_t>> & cell_ranges, llama_seq_id seq_id = -1) const;
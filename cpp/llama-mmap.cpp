@@ -3,6 +3,8 @@
 #include "llama-impl.h"
 
 #include "ggml.h"
+#include "ggml-alloc.h"
+#include "ggml-backend.h"
 
 #include <cstring>
 #include <climits>
@@ -126,6 +128,31 @@ struct llama_file::impl {
         }
     }
 
+    void read_raw_at(void * ptr, size_t len, size_t offset) const {
+        size_t bytes_read = 0;
+        while (bytes_read < len) {
+            size_t chunk_size = std::min<size_t>(len - bytes_read, 64*1024*1024);
+            OVERLAPPED overlapped = {};
+            overlapped.Offset     = (DWORD) ((offset + bytes_read) & 0xFFFFFFFF);
+            overlapped.OffsetHigh = (DWORD) ((offset + bytes_read) >> 32);
+            DWORD chunk_read = 0;
+            BOOL result = ReadFile(fp_win32, reinterpret_cast<char*>(ptr) + bytes_read, chunk_size, &chunk_read, &overlapped);
+            if (!result) {
+                throw std::runtime_error(format("read error: %s", GetErrorMessageWin32(GetLastError()).c_str()));
+            }
+            if (chunk_read == 0) {
+                throw std::runtime_error("unexpectedly reached end of file");
+            }
+
+            bytes_read += chunk_read;
+        }
+    }
+
+    void prefetch(size_t offset, size_t len) const {
+        LM_GGML_UNUSED(offset);
+        LM_GGML_UNUSED(len);
+    }
+
     uint32_t read_u32() const {
         uint32_t val;
         read_raw(&val, sizeof(val));
@@ -209,6 +236,38 @@ struct llama_file::impl {
         }
     }
 
+    void read_raw_at(void * ptr, size_t len, size_t offset) const {
+        const int fd = fileno(fp);
+        size_t bytes_read = 0;
+        while (bytes_read < len) {
+            ssize_t ret = pread(fd, (char *) ptr + bytes_read, len - bytes_read, (off_t) (offset + bytes_read));
+            if (ret < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                throw std::runtime_error(format("read error: %s", strerror(errno)));
+            }
+            if (ret == 0) {
+                throw std::runtime_error("unexpectedly reached end of file");
+            }
+            bytes_read += ret;
+        }
+    }
+
+    void prefetch(size_t offset, size_t len) const {
+#if defined(__linux__)
+        posix_fadvise(fileno(fp), (off_t) offset, (off_t) len, POSIX_FADV_WILLNEED);
+#elif defined(__APPLE__)
+        struct radvisory ra;
+        ra.ra_offset = (off_t) offset;
+        ra.ra_count  = (int) std::min<size_t>(len, INT_MAX);
+        fcntl(fileno(fp), F_RDADVISE, &ra);
+#else
+        LM_GGML_UNUSED(offset);
+        LM_GGML_UNUSED(len);
+#endif
+    }
+
     uint32_t read_u32() const {
         uint32_t ret;
         read_raw(&ret, sizeof(ret));
@@ -261,6 +320,8 @@ int llama_file::file_id() const {
 
 void llama_file::seek(size_t offset, int whence) const { pimpl->seek(offset, whence); }
 void llama_file::read_raw(void * ptr, size_t len) const { pimpl->read_raw(ptr, len); }
+void llama_file::read_raw_at(void * ptr, size_t len, size_t offset) const { pimpl->read_raw_at(ptr, len, offset); }
+void llama_file::prefetch(size_t offset, size_t len) const { pimpl->prefetch(offset, len); }
 
 uint32_t llama_file::read_u32() const { return pimpl->read_u32(); }
 
@@ -354,6 +415,38 @@ struct llama_mmap::impl {
         mapped_fragments = std::move(new_mapped_fragments);
     }
 
+    void prefetch(size_t first, size_t last) const {
+        size_t page_size = sysconf(_SC_PAGESIZE);
+        first = first & ~(page_size - 1);
+        last  = std::min(size, (last + page_size - 1) & ~(page_size - 1));
+        if (last <= first) {
+            return;
+        }
+
+        if (madvise((uint8_t *) addr + first, last - first, MADV_WILLNEED)) {
+            LLAMA_LOG_WARN("warning: madvise(.., MADV_WILLNEED) failed: %s\n", strerror(errno));
+        }
+    }
+
+    void evict(size_t first, size_t last) const {
+        // only whole pages of the range, the pages at the edges may be shared with the neighbouring tensors
+        align_range(&first, &last, sysconf(_SC_PAGESIZE));
+        if (last <= first) {
+            return;
+        }
+
+        void * ptr = (uint8_t *) addr + first;
+#ifdef MADV_COLD
+        // keeps the pages mapped, they are only reclaimed under memory pressure
+        if (madvise(ptr, last - first, MADV_COLD) == 0) {
+            return;
+        }
+#endif
+        if (madvise(ptr, last - first, MADV_DONTNEED)) {
+            LLAMA_LOG_WARN("warning: madvise(.., MADV_DONTNEED) failed: %s\n", strerror(errno));
+        }
+    }
+
     ~impl() {
         for (const auto & frag : mapped_fragments) {
             if (munmap((char *) addr + frag.first, frag.second - frag.first)) {
@@ -411,6 +504,16 @@ struct llama_mmap::impl {
         LM_GGML_UNUSED(last);
     }
 
+    void prefetch(size_t first, size_t last) const {
+        LM_GGML_UNUSED(first);
+        LM_GGML_UNUSED(last);
+    }
+
+    void evict(size_t first, size_t last) const {
+        LM_GGML_UNUSED(first);
+        LM_GGML_UNUSED(last);
+    }
+
     ~impl() {
         if (!UnmapViewOfFile(addr)) {
             LLAMA_LOG_WARN("warning: UnmapViewOfFile failed: %s\n",
@@ -432,6 +535,16 @@ struct llama_mmap::impl {
 
         throw std::runtime_error("mmap not supported");
     }
+
+    void prefetch(size_t first, size_t last) const {
+        LM_GGML_UNUSED(first);
+        LM_GGML_UNUSED(last);
+    }
+
+    void evict(size_t first, size_t last) const {
+        LM_GGML_UNUSED(first);
+        LM_GGML_UNUSED(last);
+    }
 #endif
 
     void * addr;
@@ -445,6 +558,8 @@ size_t llama_mmap::size() const { return pimpl->size; }
 void * llama_mmap::addr() const { return pimpl->addr; }
 
 void llama_mmap::unmap_fragment(size_t first, size_t last) { pimpl->unmap_fragment(first, last); }
+void llama_mmap::prefetch(size_t first, size_t last) const { pimpl->prefetch(first, last); }
+void llama_mmap::evict(size_t first, size_t last) const { pimpl->evict(first, last); }
 
 #if defined(_POSIX_MEMLOCK_RANGE) || defined(_WIN32)
 const bool llama_mmap::SUPPORTED  = true;
@@ -595,6 +710,162 @@ const bool llama_mlock::SUPPORTED = true;
 const bool llama_mlock::SUPPORTED = false;
 #endif
 
+// llama_hugetlb
+
+struct llama_hugetlb::impl {
+#if defined(__linux__) && defined(MAP_HUGETLB)
+    // the default huge page size, used by MAP_HUGETLB without an explicit size
+    static size_t huge_page_size() {
+        size_t result = 2*1024*1024;
+        FILE * f = fopen("/proc/meminfo", "r");
+        if (f) {
+            char line[128];
+            unsigned long kb = 0;
+            while (fgets(line, sizeof(line), f)) {
+                if (sscanf(line, "Hugepagesize: %lu kB", &kb) == 1) {
+                    result = (size_t) kb * 1024;
+                    break;
+                }
+            }
+            fclose(f);
+        }
+        return result;
+    }
+
+    impl(size_t size) {
+        // the length of the mapping must be a multiple of the huge page size
+        this->size = LM_GGML_PAD(size, huge_page_size());
+        addr = mmap(NULL, this->size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (addr == MAP_FAILED) {
+            throw std::runtime_error(format("mmap(MAP_HUGETLB) of %zu bytes failed: %s", this->size, strerror(errno)));
+        }
+    }
+
+    ~impl() {
+        if (munmap(addr, size)) {
+            LLAMA_LOG_WARN("warning: munmap failed: %s\n", strerror(errno));
+        }
+    }
+#else
+    impl(size_t size) {
+        LM_GGML_UNUSED(size);
+
+        throw std::runtime_error("MAP_HUGETLB not supported");
+    }
+#endif
+
+    void * addr;
+    size_t size;
+};
+
+llama_hugetlb::llama_hugetlb(size_t size) : pimpl(std::make_unique<impl>(size)) {}
+llama_hugetlb::~llama_hugetlb() = default;
+
+size_t llama_hugetlb::size() const { return pimpl->size; }
+void * llama_hugetlb::addr() const { return pimpl->addr; }
+
+#if defined(__linux__) && defined(MAP_HUGETLB)
+const bool llama_hugetlb::SUPPORTED = true;
+#else
+const bool llama_hugetlb::SUPPORTED = false;
+#endif
+
+bool llama_advise_hugepages(void * addr, size_t size) {
+#if defined(__linux__) && defined(MADV_HUGEPAGE)
+    const size_t page_size = sysconf(_SC_PAGESIZE);
+    const size_t first = LM_GGML_PAD((size_t) addr, page_size);
+    const size_t last  = ((size_t) addr + size) & ~(page_size - 1);
+    if (last <= first) {
+        return true;
+    }
+    if (madvise((void *) first, last - first, MADV_HUGEPAGE)) {
+        LLAMA_LOG_WARN("warning: madvise(.., MADV_HUGEPAGE) failed: %s\n", strerror(errno));
+        return false;
+    }
+    return true;
+#else
+    LM_GGML_UNUSED(addr);
+    LM_GGML_UNUSED(size);
+
+    return false;
+#endif
+}
+
+void llama_prefault(void * addr, size_t size) {
+    if (size == 0) {
+        return;
+    }
+#if defined(__linux__) && defined(MADV_POPULATE_WRITE)
+    {
+        // one call instead of a fault per page, the pages at the edges are shared with the neighbouring allocations
+        const size_t page_size = sysconf(_SC_PAGESIZE);
+        const size_t first = (size_t) addr & ~(page_size - 1);
+        const size_t last  = LM_GGML_PAD((size_t) addr + size, page_size);
+        if (madvise((void *) first, last - first, MADV_POPULATE_WRITE) == 0) {
+            return;
+        }
+    }
+#endif
+    // write back what is read so that the pages are private and writable, the smallest page size is enough as stride
+    volatile uint8_t * data = (volatile uint8_t *) addr;
+    for (size_t i = 0; i < size; i += 4096) {
+        data[i] = data[i];
+    }
+    data[size - 1] = data[size - 1];
+}
+
+lm_ggml_backend_buffer_t llama_alloc_ctx_tensors(
+        lm_ggml_context * ctx,
+        lm_ggml_backend_buffer_type_t buft,
+        enum llama_hugepages_type hugepages,
+        llama_hugetlbs & hugetlbs) {
+    if (hugepages == LLAMA_HUGEPAGES_TYPE_HUGETLB && buft == lm_ggml_backend_cpu_buffer_type()) {
+        // same layout as lm_ggml_backend_alloc_ctx_tensors_from_buft, in a single buffer
+        const size_t alignment = lm_ggml_backend_buft_get_alignment(buft);
+
+        size_t size = 0;
+        for (lm_ggml_tensor * t = lm_ggml_get_first_tensor(ctx); t != NULL; t = lm_ggml_get_next_tensor(ctx, t)) {
+            if (t->data == NULL && t->view_src == NULL) {
+                size += LM_GGML_PAD(lm_ggml_backend_buft_get_alloc_size(buft, t), alignment);
+            }
+        }
+
+        if (size > 0) {
+            try {
+                auto mem = std::make_unique<llama_hugetlb>(size);
+
+                lm_ggml_backend_buffer_t buf = lm_ggml_backend_cpu_buffer_from_ptr(mem->addr(), mem->size());
+                if (buf != nullptr) {
+                    lm_ggml_tallocr talloc = lm_ggml_tallocr_new(buf);
+                    for (lm_ggml_tensor * t = lm_ggml_get_first_tensor(ctx); t != NULL; t = lm_ggml_get_next_tensor(ctx, t)) {
+                        if (t->data == NULL && t->view_src == NULL) {
+                            lm_ggml_tallocr_alloc(&talloc, t);
+                        }
+                    }
+
+                    hugetlbs.emplace_back(std::move(mem));
+                    return buf;
+                }
+            } catch (const std::exception & err) {
+                LLAMA_LOG_WARN("%s: %s, using transparent huge pages instead\n", __func__, err.what());
+            }
+        }
+    }
+
+    lm_ggml_backend_buffer_t buf = lm_ggml_backend_alloc_ctx_tensors_from_buft(ctx, buft);
+    if (buf == nullptr || hugepages == LLAMA_HUGEPAGES_TYPE_NONE) {
+        return buf;
+    }
+
+    // the repack buffers are in CPU memory too, although they are not host buffers
+    auto * dev = lm_ggml_backend_buft_get_device(buft);
+    if (lm_ggml_backend_buffer_is_host(buf) || (dev && lm_ggml_backend_dev_type(dev) == LM_GGML_BACKEND_DEVICE_TYPE_CPU)) {
+        llama_advise_hugepages(lm_ggml_backend_buffer_get_base(buf), lm_ggml_backend_buffer_get_size(buf));
+    }
+
+    return buf;
+}
+
 size_t llama_path_max() {
     return PATH_MAX;
 }
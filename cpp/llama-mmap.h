@@ -1,5 +1,7 @@
 #pragma once
 
+#include "llama.h"
+
 #include <cstdint>
 #include <memory>
 #include <vector>
@@ -7,10 +9,12 @@
 struct llama_file;
 struct llama_mmap;
 struct llama_mlock;
+struct llama_hugetlb;
 
-using llama_files  = std::vector<std::unique_ptr<llama_file>>;
-using llama_mmaps  = std::vector<std::unique_ptr<llama_mmap>>;
-using llama_mlocks = std::vector<std::unique_ptr<llama_mlock>>;
+using llama_files    = std::vector<std::unique_ptr<llama_file>>;
+using llama_mmaps    = std::vector<std::unique_ptr<llama_mmap>>;
+using llama_mlocks   = std::vector<std::unique_ptr<llama_mlock>>;
+using llama_hugetlbs = std::vector<std::unique_ptr<llama_hugetlb>>;
 
 struct llama_file {
     llama_file(const char * fname, const char * mode);
@@ -24,6 +28,13 @@ struct llama_file {
     void seek(size_t offset, int whence) const;
 
     void read_raw(void * ptr, size_t len) const;
+
+    // reads at offset without using the file position, can be called from several threads
+    void read_raw_at(void * ptr, size_t len, size_t offset) const;
+
+    // asks the OS to read [offset, offset + len) into the page cache ahead of read_raw_at, best effort
+    void prefetch(size_t offset, size_t len) const;
+
     uint32_t read_u32() const;
 
     void write_raw(const void * ptr, size_t len) const;
@@ -44,6 +55,10 @@ struct llama_mmap {
 
     void unmap_fragment(size_t first, size_t last);
 
+    // paging hints for [first, last): read the pages ahead, or let the kernel reclaim them first
+    void prefetch(size_t first, size_t last) const;
+    void evict(size_t first, size_t last) const;
+
     static const bool SUPPORTED;
 
 private:
@@ -65,4 +80,34 @@ private:
     std::unique_ptr<impl> pimpl;
 };
 
+// anonymous memory from the pool of reserved huge pages
+struct llama_hugetlb {
+    llama_hugetlb(const llama_hugetlb &) = delete;
+    llama_hugetlb(size_t size);
+    ~llama_hugetlb();
+
+    size_t size() const;
+    void * addr() const;
+
+    static const bool SUPPORTED;
+
+private:
+    struct impl;
+    std::unique_ptr<impl> pimpl;
+};
+
+// asks for transparent huge pages on the whole pages of [addr, addr + size), returns false if not supported
+bool llama_advise_hugepages(void * addr, size_t size);
+
+// faults in the pages of [addr, addr + size) without changing their content
+void llama_prefault(void * addr, size_t size);
+
+// allocates the tensors of ctx in a new buffer of type buft with the given huge pages policy,
+// the memory of MAP_HUGETLB buffers is owned by hugetlbs, which must outlive the buffer
+lm_ggml_backend_buffer_t llama_alloc_ctx_tensors(
+        lm_ggml_context * ctx,
+        lm_ggml_backend_buffer_type_t buft,
+        enum llama_hugepages_type hugepages,
+        llama_hugetlbs & hugetlbs);
+
 size_t llama_path_max();
@@ -2,10 +2,15 @@
 
 #include "ggml.h"
 
+#include <algorithm>
 #include <array>
+#include <atomic>
+#include <chrono>
 #include <cinttypes>
+#include <condition_variable>
 #include <cstring>
-#include <future>
+#include <mutex>
+#include <thread>
 
 static const size_t kiB = 1024;
 static const size_t MiB = 1024*kiB;
@@ -91,6 +96,62 @@ static std::vector<std::string> llama_get_list_splits(const std::string & path,
     return paths;
 }
 
+// runs fn(i) for i in [0, n), with one thread per index up to n_threads: the shards of a split model are on their own
+// files (and possibly their own storage queues), so they are opened, parsed and read concurrently
+// the first exception thrown by fn is rethrown once all the threads are done
+template <typename F>
+static void llama_parallel_for(size_t n, size_t n_threads, const F & fn) {
+    n_threads = std::min(n_threads, n);
+    if (n_threads <= 1) {
+        for (size_t i = 0; i < n; ++i) {
+            fn(i);
+        }
+        return;
+    }
+
+    std::atomic<size_t> next{0};
+    std::exception_ptr  error;
+    std::mutex          error_mutex;
+
+    auto worker = [&]() {
+        for (size_t i = next++; i < n; i = next++) {
+            try {
+                fn(i);
+            } catch (...) {
+                std::lock_guard<std::mutex> lock(error_mutex);
+                if (!error) {
+                    error = std::current_exception();
+                }
+                next = n;
+            }
+        }
+    };
+
+    std::vector<std::thread> workers;
+    workers.reserve(n_threads - 1);
+    for (size_t i = 1; i < n_threads; ++i) {
+        workers.emplace_back(worker);
+    }
+    worker();
+    for (auto & w : workers) {
+        w.join();
+    }
+
+    if (error) {
+        std::rethrow_exception(error);
+    }
+}
+
+// at most this many shards are opened or mapped at the same time
+static const size_t LLAMA_MAX_SPLIT_THREADS = 16;
+
+// the tensors repacked for the CPU are read whole (the repack needs all of it), the staging buffers of the loader
+// threads take at most this much memory in total; a larger tensor is still loaded, while no other one is staged
+static const size_t LLAMA_LOAD_STAGING_MAX = 256u*1024*1024;
+
+// without mmap, the tensors of the other buffers are read and set in chunks of this size
+static const size_t LLAMA_LOAD_CHUNK_SIZE = 4u*1024*1024;
+
 namespace GGUFMeta {
     template <typename T, lm_gguf_type gt_, T (*gfun)(const lm_gguf_context *, const int64_t)>
     struct GKV_Base_Type {
@@ -518,36 +579,54 @@ llama_model_loader::llama_model_loader(
             LLAMA_LOG_INFO("%s: loading additional %d GGUFs\n", __func__, n_split);
         }
 
-        // load other splits
-        for (idx = 1; idx < n_split; idx++) {
-            const char * fname_split = splits[idx].c_str();
+        // open and parse the other splits concurrently, the tensors are then indexed in split order
+        struct split_meta {
+            lm_ggml_context_ptr         ctx;
+            lm_gguf_context_ptr         ctx_gguf;
+            std::unique_ptr<llama_file> file;
+        };
+        std::vector<split_meta> split_metas(n_split);
 
+        llama_parallel_for(n_split - 1, LLAMA_MAX_SPLIT_THREADS, [&](size_t i) {
+            const uint16_t split_idx = i + 1;
+            const char * fname_split = splits[split_idx].c_str();
+            auto & sm = split_metas[split_idx];
+
+            lm_ggml_context * ctx_split = nullptr;
             struct lm_gguf_init_params split_params = {
                 /*.no_alloc = */ true,
-                /*.ctx      = */ &ctx,
+                /*.ctx      = */ &ctx_split,
             };
-            lm_gguf_context_ptr ctx_gguf { lm_gguf_init_from_file(fname_split, split_params) };
-            if (!ctx_gguf) {
+            sm.ctx_gguf.reset(lm_gguf_init_from_file(fname_split, split_params));
+            sm.ctx.reset(ctx_split);
+            if (!sm.ctx_gguf) {
                 throw std::runtime_error(format("%s: failed to load GGUF split from %s\n", __func__, fname_split));
             }
 
             // check idx
             {
-                const int kid = lm_gguf_find_key(ctx_gguf.get(), kv_split_no.c_str());
+                const int kid = lm_gguf_find_key(sm.ctx_gguf.get(), kv_split_no.c_str());
                 if (kid < 0) {
                     throw std::runtime_error(format("missing key %s in GGUF split %s", kv_split_no.c_str(), fname_split));
                 }
-                int idx_gguf = lm_gguf_get_val_u16(ctx_gguf.get(), kid);
-                if (idx_gguf != idx) {
-                    throw std::runtime_error(format("invalid split file idx: %d (file: %s), expected %d", idx_gguf, fname_split, idx));
+                int idx_gguf = lm_gguf_get_val_u16(sm.ctx_gguf.get(), kid);
+                if (idx_gguf != split_idx) {
+                    throw std::runtime_error(format("invalid split file idx: %d (file: %s), expected %d", idx_gguf, fname_split, split_idx));
                 }
             }
 
-            files.emplace_back(new llama_file(fname_split, "rb"));
-            contexts.emplace_back(ctx);
+            sm.file.reset(new llama_file(fname_split, "rb"));
+        });
+
+        for (idx = 1; idx < n_split; idx++) {
+            auto & sm = split_metas[idx];
+
+            lm_ggml_context * ctx_split = sm.ctx.get();
+            files.emplace_back(std::move(sm.file));
+            contexts.emplace_back(std::move(sm.ctx));
 
             // Save tensors data offset info of the shard.
-            for (lm_ggml_tensor * cur = lm_ggml_get_first_tensor(ctx); cur; cur = lm_ggml_get_next_tensor(ctx, cur)) {
+            for (lm_ggml_tensor * cur = lm_ggml_get_first_tensor(ctx_split); cur; cur = lm_ggml_get_next_tensor(ctx_split, cur)) {
                 std::string tensor_name = std::string(cur->name);
                 // make sure there is no duplicated tensor names
                 if (weights_map.find(tensor_name) != weights_map.end()) {
@@ -555,7 +634,7 @@ llama_model_loader::llama_model_loader(
                 }
                 n_elements += lm_ggml_nelements(cur);
                 n_bytes    += lm_ggml_nbytes(cur);
-                weights_map.emplace(tensor_name, llama_tensor_weight(files.back().get(), idx, ctx_gguf.get(), cur));
+                weights_map.emplace(tensor_name, llama_tensor_weight(files.back().get(), idx, sm.ctx_gguf.get(), cur));
             }
         }
 
@@ -661,8 +740,8 @@ llama_model_loader::llama_model_loader(
                 ? format("%s[%s,%zu]", lm_gguf_type_name(type), lm_gguf_type_name(lm_gguf_get_arr_type(meta.get(), i)), lm_gguf_get_arr_n(meta.get(), i))
                 : lm_gguf_type_name(type);
 
-            std::string value          = lm_gguf_kv_to_str(meta.get(), i);
             const size_t MAX_VALUE_LEN = 40;
+            std::string value          = lm_gguf_kv_to_str(meta.get(), i, MAX_VALUE_LEN);
             if (value.size() > MAX_VALUE_LEN) {
                 value = format("%s...", value.substr(0, MAX_VALUE_LEN - 3).c_str());
             }
@@ -819,19 +898,24 @@ void llama_model_loader::done_getting_tensors() const {
 
 void llama_model_loader::init_mappings(bool prefetch, llama_mlocks * mlock_mmaps) {
     if (use_mmap) {
-        mappings.reserve(files.size());
+        auto * reg = lm_ggml_backend_dev_backend_reg(lm_ggml_backend_dev_by_type(LM_GGML_BACKEND_DEVICE_TYPE_CPU));
+        auto * is_numa_fn = (decltype(lm_ggml_is_numa) *) lm_ggml_backend_reg_get_proc_address(reg, "lm_ggml_backend_cpu_is_numa");
+        const bool numa = is_numa_fn();
+
+        // every shard is mapped (and prefetched) by its own thread, so that the shards are read in parallel
+        mappings.resize(files.size());
+        llama_parallel_for(files.size(), LLAMA_MAX_SPLIT_THREADS, [&](size_t idx) {
+            mappings[idx] = std::make_unique<llama_mmap>(files[idx].get(), prefetch ? -1 : 0, numa);
+        });
+
         mmaps_used.reserve(files.size());
-        for (const auto & file : files) {
-            auto * reg = lm_ggml_backend_dev_backend_reg(lm_ggml_backend_dev_by_type(LM_GGML_BACKEND_DEVICE_TYPE_CPU));
-            auto * is_numa_fn = (decltype(lm_ggml_is_numa) *) lm_ggml_backend_reg_get_proc_address(reg, "lm_ggml_backend_cpu_is_numa");
-            std::unique_ptr<llama_mmap> mapping = std::make_unique<llama_mmap>(file.get(), prefetch ? -1 : 0, is_numa_fn());
+        for (const auto & mapping : mappings) {
             mmaps_used.emplace_back(mapping->size(), 0);
             if (mlock_mmaps) {
                 std::unique_ptr<llama_mlock> mlock_mmap(new llama_mlock());
                 mlock_mmap->init(mapping->addr());
                 mlock_mmaps->emplace_back(std::move(mlock_mmap));
             }
-            mappings.emplace_back(std::move(mapping));
         }
     }
 
@@ -890,7 +974,22 @@ bool llama_model_loader::load_all_data(
     LM_GGML_ASSERT(size_data != 0 && "call init_mappings() first");
 
     std::vector<no_init<uint8_t>> read_buf;
-    std::vector<std::future<std::pair<lm_ggml_tensor *, bool>>> validation_result;
+
+    // tensors that end up in CPU memory are read, repacked and validated by the loader threads below
+    struct load_job {
+        lm_ggml_tensor * tensor;
+        const llama_tensor_weight * weight;
+        bool validate_only; // the tensor was already set from the mapping, only its data in the mapping is validated
+    };
+    std::vector<load_job> jobs;
+
+    auto is_cpu_buffer = [](lm_ggml_backend_buffer_t buf) {
+        if (lm_ggml_backend_buffer_is_host(buf)) {
+            return true;
+        }
+        auto * dev = lm_ggml_backend_buft_get_device(lm_ggml_backend_buffer_get_type(buf));
+        return dev && lm_ggml_backend_dev_type(dev) == LM_GGML_BACKEND_DEVICE_TYPE_CPU;
+    };
 
     // 4 staging buffers for async uploads, each sized 1MB seems to be a good default for single NVMe drives.
     // NVMe raid configurations might require more / larger buffers.
@@ -1004,12 +1103,6 @@ bool llama_model_loader::load_all_data(
             }
             uint8_t * data = (uint8_t *) mapping->addr() + weight->offs;
 
-            if (check_tensors) {
-                validation_result.emplace_back(std::async(std::launch::async, [cur, data, n_size] {
-                    return std::make_pair(cur, lm_ggml_validate_row_data(cur->type, data, n_size));
-                }));
-            }
-
             LM_GGML_ASSERT(buf_mmap || cur->data); // either we have a buffer to allocate the tensor in, or it is already allocated
             if (buf_mmap && cur->data == nullptr) {
                 lm_ggml_backend_tensor_alloc(buf_mmap, cur, data);
@@ -1021,19 +1114,25 @@ bool llama_model_loader::load_all_data(
                 auto & mmap_used = mmaps_used[weight->idx];
                 mmap_used.first  = std::min(mmap_used.first,  weight->offs);
                 mmap_used.second = std::max(mmap_used.second, weight->offs + n_size);
+
+                if (check_tensors) {
+                    jobs.push_back({ cur, weight, false });
+                    continue;
+                }
+            } else if (is_cpu_buffer(cur->buffer)) {
+                jobs.push_back({ cur, weight, false });
+                continue;
             } else {
                 lm_ggml_backend_tensor_set(cur, data, 0, n_size);
+                if (check_tensors) {
+                    jobs.push_back({ cur, weight, true });
+                }
             }
         } else {
             const auto & file = files.at(weight->idx);
-            if (lm_ggml_backend_buffer_is_host(cur->buffer)) {
-                file->seek(weight->offs, SEEK_SET);
-                file->read_raw(cur->data, n_size);
-                if (check_tensors) {
-                    validation_result.emplace_back(std::async(std::launch::async, [cur, n_size] {
-                        return std::make_pair(cur, lm_ggml_validate_row_data(cur->type, cur->data, n_size));
-                    }));
-                }
+            if (is_cpu_buffer(cur->buffer)) {
+                jobs.push_back({ cur, weight, false });
+                continue;
             } else {
                 // If upload_backend is valid load the tensor in chunks to pinned memory and upload the buffers asynchronously to the GPU.
                 if (upload_backend) {
@@ -1054,12 +1153,18 @@ bool llama_model_loader::load_all_data(
                         buffer_idx %= n_buffers;
                     }
                 } else {
-                    read_buf.resize(n_size);
+                    // whole blocks per chunk, so that each chunk can be validated on its own
+                    const size_t type_size  = lm_ggml_type_size(cur->type);
+                    const size_t chunk_size = std::max(type_size, LLAMA_LOAD_CHUNK_SIZE / type_size * type_size);
+                    read_buf.resize(std::min(n_size, chunk_size));
                     file->seek(weight->offs, SEEK_SET);
-                    file->read_raw(read_buf.data(), n_size);
-                    lm_ggml_backend_tensor_set(cur, read_buf.data(), 0, n_size);
-                    if (check_tensors && !lm_ggml_validate_row_data(cur->type, read_buf.data(), n_size)) {
-                        throw std::runtime_error(format("tensor '%s' has invalid data", lm_ggml_get_name(cur)));
+                    for (size_t offs = 0; offs < n_size; offs += chunk_size) {
+                        const size_t n_chunk = std::min(chunk_size, n_size - offs);
+                        file->read_raw(read_buf.data(), n_chunk);
+                        lm_ggml_backend_tensor_set(cur, read_buf.data(), offs, n_chunk);
+                        if (check_tensors && !lm_ggml_validate_row_data(cur->type, read_buf.data(), n_chunk)) {
+                            throw std::runtime_error(format("tensor '%s' has invalid data", lm_ggml_get_name(cur)));
+                        }
                     }
                 }
             }
@@ -1078,17 +1183,223 @@ bool llama_model_loader::load_all_data(
     }
     lm_ggml_backend_free(upload_backend);
 
-    // check validation results
-    bool validation_failed = false;
-    for (auto & future : validation_result) {
-        auto result = future.get();
-        if (!result.second) {
-            LLAMA_LOG_ERROR("%s: tensor '%s' has invalid data\n", __func__, lm_ggml_get_name(result.first));
-            validation_failed = true;
+    // each job reads a disjoint range of the file with positional reads (or copies it from the mapping),
+    // then hands it to the buffer, which repacks it if needed, and validates it
+    if (!jobs.empty()) {
+        // one queue per shard in file order: each shard has its own reader (the thread whose home it is),
+        // which reads it front to back and asks for the next tensor of the shard before loading the current one;
+        // threads whose shard is done help with the other shards
+        struct shard_queue {
+            std::vector<size_t> jobs;
+            std::atomic<size_t> next{0};
+        };
+        std::vector<shard_queue> queues(files.size());
+        for (size_t i = 0; i < jobs.size(); ++i) {
+            queues[jobs[i].weight->idx].jobs.push_back(i);
+        }
+        size_t n_shards = 0;
+        for (auto & q : queues) {
+            std::sort(q.jobs.begin(), q.jobs.end(), [&](size_t a, size_t b) {
+                return jobs[a].weight->offs < jobs[b].weight->offs;
+            });
+            n_shards += !q.jobs.empty();
+        }
+
+        const size_t n_threads = std::min<size_t>(jobs.size(),
+                std::max<size_t>({ std::min<size_t>(std::max(1u, std::thread::hardware_concurrency()), 8), std::min(n_shards, LLAMA_MAX_SPLIT_THREADS) }));
+
+        auto prefetch_job = [&](const load_job & job) {
+            const size_t offs   = job.weight->offs;
+            const size_t n_size = lm_ggml_nbytes(job.tensor);
+            if (use_mmap) {
+                mappings.at(job.weight->idx)->prefetch(offs, offs + n_size);
+            } else {
+                files.at(job.weight->idx)->prefetch(offs, n_size);
+            }
+        };
+
+        // takes the next job of the home shard, or of the next shard that still has some
+        auto next_job = [&](size_t home, size_t & job_idx) {
+            for (size_t k = 0; k < queues.size(); ++k) {
+                auto & q = queues[(home + k) % queues.size()];
+                const size_t pos = q.next++;
+                if (pos < q.jobs.size()) {
+                    job_idx = q.jobs[pos];
+                    if (pos + 1 < q.jobs.size()) {
+                        prefetch_job(jobs[q.jobs[pos + 1]]);
+                    }
+                    return true;
+                }
+            }
+            return false;
+        };
+
+        std::atomic<size_t> n_done    {0};
+        std::atomic<size_t> bytes_done{0};
+        std::atomic<bool>   stop      {false};
+        std::vector<char>   valid(jobs.size(), 1);
+        std::exception_ptr  error;
+        std::mutex          error_mutex;
+        bool                cancelled = false;
+
+        // the staging buffers of the threads, within LLAMA_LOAD_STAGING_MAX
+        size_t                  staging_used    = 0;
+        size_t                  staging_waiting = 0;
+        std::mutex              staging_mutex;
+        std::condition_variable staging_cv;
+
+        // grows buf to n_size bytes once there is room for it, returns false if the load was stopped while waiting
+        auto staging_acquire = [&](std::vector<no_init<uint8_t>> & buf, size_t n_size) {
+            if (buf.size() >= n_size) {
+                return true;
+            }
+            {
+                std::unique_lock<std::mutex> lock(staging_mutex);
+                staging_used -= buf.size();
+                std::vector<no_init<uint8_t>>().swap(buf);
+                staging_cv.notify_all();
+
+                staging_waiting++;
+                staging_cv.wait(lock, [&] {
+                    return stop || staging_used == 0 || staging_used + n_size <= LLAMA_LOAD_STAGING_MAX;
+                });
+                staging_waiting--;
+                if (stop) {
+                    return false;
+                }
+                staging_used += n_size;
+            }
+            try {
+                buf.resize(n_size);
+            } catch (...) {
+                std::lock_guard<std::mutex> lock(staging_mutex);
+                staging_used -= n_size;
+                staging_cv.notify_all();
+                throw;
+            }
+            return true;
+        };
+
+        // frees buf if another thread waits for room, or always when the thread is done
+        auto staging_release = [&](std::vector<no_init<uint8_t>> & buf, bool done) {
+            std::lock_guard<std::mutex> lock(staging_mutex);
+            if (!buf.empty() && (done || staging_waiting > 0)) {
+                staging_used -= buf.size();
+                std::vector<no_init<uint8_t>>().swap(buf);
+                staging_cv.notify_all();
+            }
+        };
+
+        auto load_tensor = [&](const load_job & job, std::vector<no_init<uint8_t>> & buf) {
+            lm_ggml_tensor * cur = job.tensor;
+            const size_t n_size = lm_ggml_nbytes(cur);
+
+            const void * data;
+            if (use_mmap) {
+                data = (const uint8_t *) mappings.at(job.weight->idx)->addr() + job.weight->offs;
+                if (job.validate_only) {
+                    return lm_ggml_validate_row_data(cur->type, data, n_size);
+                }
+            } else if (lm_ggml_backend_buffer_is_host(cur->buffer)) {
+                files.at(job.weight->idx)->read_raw_at(cur->data, n_size, job.weight->offs);
+                data = cur->data;
+            } else {
+                if (!staging_acquire(buf, n_size)) {
+                    return true;
+                }
+                files.at(job.weight->idx)->read_raw_at(buf.data(), n_size, job.weight->offs);
+                data = buf.data();
+            }
+
+            // tensors allocated in the mapping or read in place are only validated
+            if (data != cur->data) {
+                lm_ggml_backend_tensor_set(cur, data, 0, n_size);
+            }
+
+            return !check_tensors || lm_ggml_validate_row_data(cur->type, data, n_size);
+        };
+
+        auto report_progress = [&]() {
+            if (progress_callback && !cancelled) {
+                if (!progress_callback((float) (size_done + bytes_done) / size_data, progress_callback_user_data)) {
+                    cancelled = true;
+                    stop = true;
+                }
+            }
+        };
+
+        // the calling thread also loads tensors, and is the only one reporting progress
+        auto worker = [&](size_t home, bool is_main) {
+            std::vector<no_init<uint8_t>> buf;
+            size_t i;
+            while (!stop) {
+                if (!next_job(home, i)) {
+                    break;
+                }
+                try {
+                    valid[i] = load_tensor(jobs[i], buf);
+                } catch (...) {
+                    std::lock_guard<std::mutex> lock(error_mutex);
+                    if (!error) {
+                        error = std::current_exception();
+                    }
+                    stop = true;
+                    break;
+                }
+                // validate-only tensors were counted when they were set
+                if (!jobs[i].validate_only) {
+                    bytes_done += lm_ggml_nbytes(jobs[i].tensor);
+                }
+                n_done++;
+                if (is_main) {
+                    report_progress();
+                }
+                staging_release(buf, false);
+            }
+            staging_release(buf, true);
+        };
+
+        std::vector<std::thread> workers;
+        workers.reserve(n_threads - 1);
+        // the homes are spread over the shards that have jobs
+        std::vector<size_t> homes;
+        for (size_t idx = 0; idx < queues.size(); ++idx) {
+            if (!queues[idx].jobs.empty()) {
+                homes.push_back(idx);
+                prefetch_job(jobs[queues[idx].jobs.front()]);
+            }
+        }
+        for (size_t i = 1; i < n_threads; ++i) {
+            workers.emplace_back(worker, homes[i % homes.size()], false);
+        }
+        worker(homes[0], true);
+        while (!stop && n_done < jobs.size()) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+            report_progress();
+        }
+        for (auto & w : workers) {
+            w.join();
+        }
+
+        if (error) {
+            std::rethrow_exception(error);
+        }
+        if (cancelled) {
+            return false;
+        }
+
+        size_done += bytes_done;
+
+        bool validation_failed = false;
+        for (size_t i = 0; i < jobs.size(); ++i) {
+            if (!valid[i]) {
+                LLAMA_LOG_ERROR("%s: tensor '%s' has invalid data\n", __func__, lm_ggml_get_name(jobs[i].tensor));
+                validation_failed = true;
+            }
+        }
+        if (validation_failed) {
+            throw std::runtime_error("found tensors with invalid data");
         }
-    }
-    if (validation_failed) {
-        throw std::runtime_error("found tensors with invalid data");
     }
 
     // check if this is the last call and do final cleanup
@@ -12,14 +12,18 @@
 #include <algorithm>
 #include <cassert>
 #include <cmath>
+#include <cstddef>
 #include <cfloat>
 #include <cstring>
 #include <cmath>
+#include <filesystem>
 #include <functional>
 #include <map>
+#include <random>
 #include <regex>
 #include <sstream>
 #include <stdexcept>
+#include <thread>
 
 const char * llm_type_name(llm_type type) {
     switch (type) {
@@ -359,11 +363,16 @@ struct llama_model::impl {
 
     size_t n_bytes = 0;
 
+    uint32_t n_vocab = 0;
+
     std::string desc_str;
 
     // model memory mapped files
     llama_mmaps mappings;
 
+    // huge page memory of the weight buffers, freed after them
+    llama_hugetlbs hugetlbs;
+
     // objects representing data potentially being locked in memory
     llama_mlocks mlock_bufs;
     llama_mlocks mlock_mmaps;
@@ -387,6 +396,15 @@ struct llama_model::impl {
     std::vector<layer_dev> dev_layer;
 
     bool has_tensor_overrides;
+
+    struct mmap_range {
+        llama_mmap * mapping;
+        size_t first;
+        size_t last;
+    };
+
+    // per layer, the ranges of the mappings that hold its weights
+    std::vector<std::vector<mmap_range>> layer_ranges;
 };
 
 llama_model::llama_model(const llama_model_params & params) : params(params), pimpl(std::make_unique<impl>()) {
@@ -398,6 +416,9 @@ llama_model::~llama_model() {}
 void llama_model::load_stats(llama_model_loader & ml) {
     pimpl->n_elements = ml.n_elements;
     pimpl->n_bytes = ml.n_bytes;
+
+    // the vocab size is also needed when only the metadata is loaded
+    ml.get_key(LLM_KV_VOCAB_SIZE, pimpl->n_vocab, false) || ml.get_arr_n(LLM_KV_TOKENIZER_LIST, pimpl->n_vocab, false);
 }
 
 void llama_model::load_arch(llama_model_loader & ml) {
@@ -1428,6 +1449,236 @@ void llama_model::load_vocab(llama_model_loader & ml) {
     vocab.load(ml, kv);
 }
 
+//
+// cache of the weights repacked for the CPU
+//
+
+// the repacked tensors of the CPU repack buffer type are stored in one file per model and layout,
+// which is mapped on the next loads instead of reading and repacking the weights again
+// file: header, then the tensor data at the offsets computed by llama_repack_cache_init
+// name: <model id>-<key>.repack, the model id covers the tensor names, types, shapes and layouts only, so the files of
+// an older version of the same model (another key) are found and removed
+#define LLAMA_REPACK_CACHE_MAGIC   0x4b505252u // "RRPK"
+#define LLAMA_REPACK_CACHE_VERSION 2
+
+// number of bytes at each end of the tensor data that are part of the key
+#define LLAMA_REPACK_CACHE_SAMPLE_SIZE 4096
+
+struct llama_repack_cache {
+    struct header {
+        uint32_t magic;
+        uint32_t version;
+        uint64_t key;
+        uint64_t data_offset;
+        uint64_t data_size;
+        uint64_t checksum; // of the tensor data, computed when the file is written
+    };
+
+    std::string dir;
+    std::string prefix; // <model id>-
+    std::string path;
+    header hdr = {};
+
+    // the tensors and their offsets in the data
+    std::vector<std::pair<lm_ggml_tensor *, size_t>> tensors;
+};
+
+// computes the key and the layout of the cache of the tensors of ctx
+// hashing the whole model would read all of it, so the key covers the tensor names, types, shapes, repack layouts and
+// both ends of the data of each tensor, which differ between models with the same architecture
+static bool llama_repack_cache_init(
+        llama_repack_cache & cache,
+        const char * dir,
+        const llama_model_loader & ml,
+        lm_ggml_context * ctx,
+        lm_ggml_backend_buffer_type_t buft,
+        lm_ggml_backend_cpu_repack_layout_t repack_layout) {
+    uint64_t key = 0xcbf29ce484222325ull;
+    uint64_t id  = 0xcbf29ce484222325ull;
+    auto hash = [&key, &id](const void * data, size_t size, bool is_id = true) {
+        for (size_t i = 0; i < size; ++i) {
+            key ^= ((const uint8_t *) data)[i];
+            key *= 0x100000001b3ull;
+            if (is_id) {
+                id ^= ((const uint8_t *) data)[i];
+                id *= 0x100000001b3ull;
+            }
+        }
+    };
+
+    const uint32_t version = LLAMA_REPACK_CACHE_VERSION;
+    hash(&version, sizeof(version), false);
+
+    const size_t alignment = lm_ggml_backend_buft_get_alignment(buft);
+
+    std::vector<uint8_t> sample(2*LLAMA_REPACK_CACHE_SAMPLE_SIZE);
+    size_t data_size = 0;
+
+    for (auto * cur = lm_ggml_get_first_tensor(ctx); cur != nullptr; cur = lm_ggml_get_next_tensor(ctx, cur)) {
+        const auto * weight = ml.get_weight(lm_ggml_get_name(cur));
+        const char * layout = repack_layout(cur);
+        if (weight == nullptr || layout == nullptr) {
+            return false;
+        }
+
+        const size_t n_size = lm_ggml_nbytes(cur);
+
+        hash(cur->name, strlen(cur->name));
+        hash(&cur->type, sizeof(cur->type));
+        hash(cur->ne, sizeof(cur->ne));
+        hash(layout, strlen(layout));
+
+        const size_t n_sample = std::min<size_t>(n_size, LLAMA_REPACK_CACHE_SAMPLE_SIZE);
+        const auto & file = ml.files.at(weight->idx);
+        file->seek(weight->offs, SEEK_SET);
+        file->read_raw(sample.data(), n_sample);
+        file->seek(weight->offs + n_size - n_sample, SEEK_SET);
+        file->read_raw(sample.data() + n_sample, n_sample);
+        hash(sample.data(), 2*n_sample, false);
+
+        data_size = LM_GGML_PAD(data_size, alignment);
+        cache.tensors.emplace_back(cur, data_size);
+        data_size += n_size;
+    }
+
+    if (cache.tensors.empty()) {
+        return false;
+    }
+
+    cache.hdr.magic       = LLAMA_REPACK_CACHE_MAGIC;
+    cache.hdr.version     = LLAMA_REPACK_CACHE_VERSION;
+    cache.hdr.key         = key;
+    cache.hdr.data_offset = LM_GGML_PAD(sizeof(llama_repack_cache::header), alignment);
+    cache.hdr.data_size   = data_size;
+
+    cache.dir    = dir;
+    cache.prefix = format("%016llx-", (unsigned long long) id);
+    cache.path   = format("%s/%s%016llx.repack", dir, cache.prefix.c_str(), (unsigned long long) key);
+
+    return true;
+}
+
+// checksum of the tensor data of the cache, in the order of cache.tensors
+// FNV-1a on 64 bit words, it reads the data at memory bandwidth
+static uint64_t llama_repack_cache_checksum(const llama_repack_cache & cache, const uint8_t * data) {
+    uint64_t sum = 0xcbf29ce484222325ull;
+    for (const auto & it : cache.tensors) {
+        const uint8_t * src = data ? data + it.second : (const uint8_t *) it.first->data;
+        const size_t n_size = lm_ggml_nbytes(it.first);
+        size_t i = 0;
+        for (; i + sizeof(uint64_t) <= n_size; i += sizeof(uint64_t)) {
+            uint64_t w;
+            memcpy(&w, src + i, sizeof(w));
+            sum ^= w;
+            sum *= 0x100000001b3ull;
+        }
+        for (; i < n_size; ++i) {
+            sum ^= src[i];
+            sum *= 0x100000001b3ull;
+        }
+    }
+    return sum;
+}
+
+// maps the cache file and allocates the tensors in it, returns nullptr if there is no valid cache file
+static lm_ggml_backend_buffer_t llama_repack_cache_map(
+        const llama_repack_cache & cache,
+        lm_ggml_backend_cpu_repack_buffer_from_ptr_t repack_buffer_from_ptr,
+        llama_mmaps & mappings) {
+    std::unique_ptr<llama_mmap> mapping;
+    uint64_t cache_checksum = 0;
+    try {
+        llama_file file(cache.path.c_str(), "rb");
+
+        llama_repack_cache::header hdr;
+        if (file.size() != cache.hdr.data_offset + cache.hdr.data_size) {
+            LLAMA_LOG_WARN("%s: the repack cache %s is truncated, ignoring it\n", __func__, cache.path.c_str());
+            return nullptr;
+        }
+        file.read_raw(&hdr, sizeof(hdr));
+        if (memcmp(&hdr, &cache.hdr, offsetof(llama_repack_cache::header, checksum)) != 0) {
+            return nullptr;
+        }
+        cache_checksum = hdr.checksum;
+
+        mapping = std::make_unique<llama_mmap>(&file, 0);
+    } catch (const std::exception &) {
+        // no cache file yet
+        return nullptr;
+    }
+
+    uint8_t * data = (uint8_t *) mapping->addr() + cache.hdr.data_offset;
+
+    // the data is verified before it is used, a corrupted file is repacked and written again
+    if (llama_repack_cache_checksum(cache, data) != cache_checksum) {
+        LLAMA_LOG_WARN("%s: the repack cache %s is corrupted, ignoring it\n", __func__, cache.path.c_str());
+        return nullptr;
+    }
+
+    lm_ggml_backend_buffer_t buf = repack_buffer_from_ptr(data, cache.hdr.data_size);
+    if (buf == nullptr) {
+        return nullptr;
+    }
+    for (const auto & it : cache.tensors) {
+        lm_ggml_backend_tensor_alloc(buf, it.first, data + it.second);
+    }
+
+    mappings.emplace_back(std::move(mapping));
+
+    return buf;
+}
+
+// writes the repacked tensors to the cache file and removes the older files of the model
+static void llama_repack_cache_save(const llama_repack_cache & cache) {
+    // a name of its own, so that processes loading the same model at the same time do not write to the same file
+    std::random_device rd;
+    const uint64_t rnd = ((uint64_t) rd() << 32 | rd()) ^ std::hash<std::thread::id>{}(std::this_thread::get_id());
+    const std::string path_tmp = format("%s.%016llx.tmp", cache.path.c_str(), (unsigned long long) rnd);
+    try {
+        {
+            llama_repack_cache::header hdr = cache.hdr;
+            hdr.checksum = llama_repack_cache_checksum(cache, nullptr);
+
+            llama_file file(path_tmp.c_str(), "wb");
+            file.write_raw(&hdr, sizeof(hdr));
+
+            std::vector<uint8_t> padding(cache.hdr.data_offset, 0);
+            size_t offset = 0;
+            file.write_raw(padding.data(), cache.hdr.data_offset - sizeof(cache.hdr));
+            for (const auto & it : cache.tensors) {
+                file.write_raw(padding.data(), it.second - offset);
+                file.write_raw(it.first->data, lm_ggml_nbytes(it.first));
+                offset = it.second + lm_ggml_nbytes(it.first);
+            }
+        }
+        // other processes only see complete cache files
+        if (std::rename(path_tmp.c_str(), cache.path.c_str()) != 0) {
+            throw std::runtime_error(format("failed to rename %s: %s", path_tmp.c_str(), strerror(errno)));
+        }
+    } catch (const std::exception & e) {
+        LLAMA_LOG_WARN("%s: failed to write the repack cache %s: %s\n", __func__, cache.path.c_str(), e.what());
+        std::remove(path_tmp.c_str());
+        return;
+    }
+
+    // the files of the same model with another key are stale: the model file or the cache version changed
+    try {
+        std::error_code ec;
+        for (const auto & entry : std::filesystem::directory_iterator(cache.dir, ec)) {
+            const std::string name = entry.path().filename().string();
+            if (name.rfind(cache.prefix, 0) == 0 && name.size() > 7 && name.compare(name.size() - 7, 7, ".repack") == 0 &&
+                !std::filesystem::equivalent(entry.path(), cache.path, ec)) {
+                LLAMA_LOG_INFO("%s: removing the stale repack cache %s\n", __func__, entry.path().string().c_str());
+                std::filesystem::remove(entry.path(), ec);
+            }
+        }
+    } catch (const std::exception & e) {
+        LLAMA_LOG_WARN("%s: failed to remove the stale repack caches: %s\n", __func__, e.what());
+    }
+
+    LLAMA_LOG_INFO("%s: wrote the repack cache %s (%.2f MiB)\n", __func__, cache.path.c_str(), cache.hdr.data_size / 1024.0 / 1024.0);
+}
+
 bool llama_model::load_tensors(llama_model_loader & ml) {
     const auto & split_mode   = params.split_mode;
     const auto & n_gpu_layers = params.n_gpu_layers;
@@ -4086,6 +4337,20 @@ bool llama_model::load_tensors(llama_model_loader & ml) {
     const size_t n_max_backend_buffer = ctx_map.size() * ml.files.size();
     pimpl->bufs.reserve(n_max_backend_buffer);
 
+    // the weights repacked for the CPU can be cached
+    lm_ggml_backend_cpu_repack_layout_t            repack_layout          = nullptr;
+    lm_ggml_backend_cpu_repack_buffer_from_ptr_t repack_buffer_from_ptr = nullptr;
+    if (params.repack_cache_dir != nullptr) {
+        auto * cpu_reg = lm_ggml_backend_dev_backend_reg(lm_ggml_backend_dev_by_type(LM_GGML_BACKEND_DEVICE_TYPE_CPU));
+        repack_layout = (lm_ggml_backend_cpu_repack_layout_t)
+            lm_ggml_backend_reg_get_proc_address(cpu_reg, "lm_ggml_backend_cpu_repack_layout");
+        repack_buffer_from_ptr = (lm_ggml_backend_cpu_repack_buffer_from_ptr_t)
+            lm_ggml_backend_reg_get_proc_address(cpu_reg, "lm_ggml_backend_cpu_repack_buffer_from_ptr");
+    }
+    llama_repack_cache repack_cache;
+    lm_ggml_context * repack_cache_ctx = nullptr; // the context of the repacked tensors
+    bool repack_cache_hit = false;
+
     for (auto & it : ctx_map) {
         lm_ggml_backend_buffer_type_t buft = it.first;
         lm_ggml_context * ctx              = it.second;
@@ -4130,7 +4395,19 @@ bool llama_model::load_tensors(llama_model_loader & ml) {
             }
         }
         else {
-            lm_ggml_backend_buffer_t buf = lm_ggml_backend_alloc_ctx_tensors_from_buft(ctx, buft);
+            lm_ggml_backend_buffer_t buf = nullptr;
+            if (repack_layout && repack_buffer_from_ptr && strcmp(lm_ggml_backend_buft_name(buft), "CPU_AARCH64") == 0 &&
+                llama_repack_cache_init(repack_cache, params.repack_cache_dir, ml, ctx, buft, repack_layout)) {
+                repack_cache_ctx = ctx;
+                buf = llama_repack_cache_map(repack_cache, repack_buffer_from_ptr, pimpl->mappings);
+                repack_cache_hit = buf != nullptr;
+                if (repack_cache_hit) {
+                    LLAMA_LOG_INFO("%s: using the repack cache %s\n", __func__, repack_cache.path.c_str());
+                }
+            }
+            if (buf == nullptr) {
+                buf = llama_alloc_ctx_tensors(ctx, buft, params.hugepages, pimpl->hugetlbs);
+            }
             if (buf == nullptr) {
                 throw std::runtime_error(format("unable to allocate %s buffer", lm_ggml_backend_buft_name(buft)));
             }
@@ -4185,15 +4462,81 @@ bool llama_model::load_tensors(llama_model_loader & ml) {
         }
     }
 
+    // the tensors in the repack cache are already loaded
+    if (repack_cache_hit) {
+        for (const auto & it : repack_cache.tensors) {
+            ml.size_done += lm_ggml_nbytes(it.first);
+        }
+    }
+
     // load tensor data
     for (auto & it : ctx_bufs) {
         lm_ggml_context * ctx = it.first;
         auto & bufs = it.second;
+        if (repack_cache_hit && ctx == repack_cache_ctx) {
+            continue;
+        }
         if (!ml.load_all_data(ctx, bufs, use_mlock ? &pimpl->mlock_mmaps : NULL, params.progress_callback, params.progress_callback_user_data)) {
             return false;
         }
     }
 
+    if (repack_cache_ctx && !repack_cache_hit) {
+        llama_repack_cache_save(repack_cache);
+    }
+
+    if (params.use_mmap_residency && ml.use_mmap && use_mmap_buffer) {
+        auto & layer_ranges = pimpl->layer_ranges;
+        layer_ranges.resize(hparams.n_layer);
+
+        // only the tensors used in place from the mapping, offloaded and repacked ones live elsewhere
+        for (const auto & it : tensors_by_name) {
+            int il = -1;
+            if (sscanf(it.first.c_str(), "blk.%d.", &il) != 1 || il < 0 || il >= (int) hparams.n_layer) {
+                continue;
+            }
+            const auto * weight = ml.get_weight(it.first.c_str());
+            if (!weight) {
+                continue;
+            }
+            auto * mapping = ml.mappings.at(weight->idx).get();
+            if (it.second->data != (uint8_t *) mapping->addr() + weight->offs) {
+                continue;
+            }
+            layer_ranges[il].push_back({ mapping, weight->offs, weight->offs + lm_ggml_nbytes(it.second) });
+        }
+
+        const size_t alignment = lm_gguf_get_alignment(ml.meta.get());
+
+        size_t n_ranges = 0;
+        for (auto & ranges : layer_ranges) {
+            std::sort(ranges.begin(), ranges.end(), [](const impl::mmap_range & a, const impl::mmap_range & b) {
+                return a.mapping != b.mapping ? a.mapping < b.mapping : a.first < b.first;
+            });
+
+            // merge the tensors of a layer separated only by alignment padding
+            std::vector<impl::mmap_range> merged;
+            for (const auto & r : ranges) {
+                if (!merged.empty() && merged.back().mapping == r.mapping && r.first <= merged.back().last + alignment) {
+                    merged.back().last = std::max(merged.back().last, r.last);
+                } else {
+                    merged.push_back(r);
+                }
+            }
+            ranges = std::move(merged);
+            n_ranges += ranges.size();
+        }
+
+        if (n_ranges == 0) {
+            layer_ranges.clear();
+        } else {
+            LLAMA_LOG_INFO("%s: paging %zu mapped ranges of %d layers in graph order\n", __func__, n_ranges, hparams.n_layer);
+            // the first decode starts with layers 0 and 1 on their way in
+            layer_done(-2);
+            layer_done(-1);
+        }
+    }
+
     if (use_mmap_buffer) {
         for (auto & mapping : ml.mappings) {
             pimpl->mappings.emplace_back(std::move(mapping));
@@ -4363,7 +4706,9 @@ void llama_model::print_info() const {
         LLAMA_LOG_INFO("%s: expert_weights_norm  = %d\n",     __func__, hparams.expert_weights_norm);
     }
 
-    vocab.print_info();
+    if (!params.meta_only) {
+        vocab.print_info();
+    }
 }
 
 lm_ggml_backend_dev_t llama_model::dev_layer(int il) const {
@@ -4428,6 +4773,68 @@ bool llama_model::has_tensor_overrides() const {
     return pimpl->has_tensor_overrides;
 }
 
+bool llama_model::has_layer_residency() const {
+    return !pimpl->layer_ranges.empty();
+}
+
+void llama_model::layer_done(int il) const {
+    const auto & layer_ranges = pimpl->layer_ranges;
+    const int n_layer = (int) layer_ranges.size();
+    if (n_layer == 0) {
+        return;
+    }
+
+    if (il >= 0 && il < n_layer) {
+        for (const auto & r : layer_ranges[il]) {
+            r.mapping->evict(r.first, r.last);
+        }
+    }
+
+    // layer il + 1 was prefetched while layer il was computed, the next decode wraps around to layer 0
+    const int il_next = (il + 2 + n_layer) % n_layer;
+    if (il_next != il) {
+        for (const auto & r : layer_ranges[il_next]) {
+            r.mapping->prefetch(r.first, r.last);
+        }
+    }
+}
+
+bool llama_model::touch_weights(int il, lm_ggml_abort_callback abort_callback, void * abort_callback_data) const {
+    std::vector<const lm_ggml_tensor *> tensors;
+    if (il < (int) hparams.n_layer) {
+        const std::string prefix = format("blk.%d.", il);
+        for (const auto & it : tensors_by_name) {
+            if (it.first.compare(0, prefix.size(), prefix) == 0) {
+                tensors.push_back(it.second);
+            }
+        }
+    } else {
+        // output is tok_embd when the embeddings are tied, it is then read in whole by every decode
+        tensors = { output_norm, output_b, output };
+    }
+
+    // any page size is a multiple of this
+    constexpr size_t stride = 4096;
+
+    uint8_t sum = 0;
+    for (const lm_ggml_tensor * t : tensors) {
+        if (t == nullptr || t->data == nullptr || t->buffer == nullptr || !lm_ggml_backend_buffer_is_host(t->buffer)) {
+            continue;
+        }
+        if (abort_callback && abort_callback(abort_callback_data)) {
+            return false;
+        }
+        const volatile uint8_t * data = (const volatile uint8_t *) t->data;
+        const size_t n_bytes = lm_ggml_nbytes(t);
+        for (size_t i = 0; i < n_bytes; i += stride) {
+            sum += data[i];
+        }
+    }
+    LM_GGML_UNUSED(sum);
+
+    return true;
+}
+
 const lm_ggml_tensor * llama_model::get_tensor(const char * name) const {
     auto it = std::find_if(tensors_by_name.begin(), tensors_by_name.end(),
             [name](const std::pair<std::string, lm_ggml_tensor *> & it) {
@@ -12846,6 +13253,74 @@ llama_memory_i * llama_model::create_memory() const {
     return res;
 }
 
+llama_memory_estimate llama_model::estimate_memory(const llama_context_params & params) const {
+    llama_memory_estimate res = {};
+
+    res.weights = size();
+
+    // the context sizes, as resolved by the llama_context constructor
+    llama_cparams cparams = {};
+    cparams.flash_attn  = params.flash_attn && arch != LLM_ARCH_GROK;
+    cparams.causal_attn = params.attention_type == LLAMA_ATTENTION_TYPE_UNSPECIFIED ? hparams.causal_attn : params.attention_type == LLAMA_ATTENTION_TYPE_CAUSAL;
+    cparams.n_seq_max   = std::max(1u, params.n_seq_max);
+    cparams.n_ctx       = params.n_ctx == 0 ? hparams.n_ctx_train : params.n_ctx;
+
+    std::unique_ptr<llama_kv_cache_unified> kv(static_cast<llama_kv_cache_unified *>(create_memory()));
+    cparams.n_ctx = LM_GGML_PAD(cparams.n_ctx, kv->get_padding(cparams));
+
+    cparams.n_batch  = cparams.causal_attn ? std::min(cparams.n_ctx, params.n_batch) : params.n_batch;
+    cparams.n_batch  = std::max<uint32_t>(cparams.n_batch, LM_GGML_KQ_MASK_PAD);
+    cparams.n_ubatch = std::min(cparams.n_batch, params.n_ubatch == 0 ? params.n_batch : params.n_ubatch);
+
+    uint32_t     kv_size = cparams.n_ctx;
+    lm_ggml_type type_k  = params.type_k;
+    lm_ggml_type type_v  = params.type_v;
+
+    if (llama_model_is_recurrent(this)) {
+        kv_size = cparams.n_seq_max;
+        type_k  = LM_GGML_TYPE_F32;
+        type_v  = LM_GGML_TYPE_F32;
+    }
+
+    // the KV cache, laid out like llama_kv_cache_unified::init
+    uint32_t n_head_max = 0;
+    uint32_t n_ff_max   = 0;
+    uint32_t n_embd_max = hparams.n_embd;
+
+    for (uint32_t il = 0; il < hparams.n_layer; ++il) {
+        const uint32_t n_embd_k_gqa = hparams.n_embd_k_gqa(il) + hparams.n_embd_k_s();
+        const uint32_t n_embd_v_gqa = hparams.n_embd_v_gqa(il) + hparams.n_embd_v_s();
+
+        res.kv += lm_ggml_row_size(type_k, (int64_t) n_embd_k_gqa*kv_size);
+        res.kv += lm_ggml_row_size(type_v, (int64_t) n_embd_v_gqa*kv_size);
+
+        n_head_max = std::max(n_head_max, hparams.n_head(il));
+        n_ff_max   = std::max(n_ff_max,   hparams.n_ff(il));
+        n_embd_max = std::max(n_embd_max, std::max(n_embd_k_gqa, n_embd_v_gqa));
+    }
+
+    // the compute buffer holds the largest set of F32 activations alive at once for a full ubatch:
+    // the residual stream and the norms, then either the attention or the FFN of a layer, or the logits
+    const uint64_t n_tokens = cparams.n_ubatch;
+    const uint64_t n_kv     = llama_model_is_recurrent(this) ? 0 : kv_size;
+
+    const uint64_t act  = 4*(uint64_t) n_embd_max*n_tokens;
+    const uint64_t attn = (uint64_t) (hparams.n_embd_head_k + hparams.n_embd_head_v)*n_head_max*n_tokens*2 +
+        // KQ and its softmax, unless flash attention computes them in tiles
+        (cparams.flash_attn ? 0 : 2*n_kv*n_tokens*n_head_max);
+    const uint64_t ffn  = hparams.n_expert_used > 0 ?
+        3*(uint64_t) (hparams.n_ff_exp ? hparams.n_ff_exp : n_ff_max)*hparams.n_expert_used*n_tokens + (uint64_t) hparams.n_expert*n_tokens :
+        3*(uint64_t) n_ff_max*n_tokens;
+    const uint64_t out  = (uint64_t) pimpl->n_vocab*n_tokens;
+
+    res.compute = std::max(act + std::max(attn, ffn), act + out)*sizeof(float);
+
+    // the output buffer, reserved for one output per sequence
+    res.output = (uint64_t) pimpl->n_vocab*cparams.n_seq_max*sizeof(float);
+
+    return res;
+}
+
 llm_graph_result_ptr llama_model::build_graph(
         const llm_graph_params & params,
                    lm_ggml_cgraph * gf,
@@ -13124,15 +13599,19 @@ llama_model_params llama_model_default_params() {
         /*.tensor_buft_overrides       =*/ nullptr,
         /*.n_gpu_layers                =*/ 0,
         /*.split_mode                  =*/ LLAMA_SPLIT_MODE_LAYER,
+        /*.hugepages                   =*/ LLAMA_HUGEPAGES_TYPE_NONE,
         /*.main_gpu                    =*/ 0,
         /*.tensor_split                =*/ nullptr,
         /*.progress_callback           =*/ nullptr,
         /*.progress_callback_user_data =*/ nullptr,
         /*.kv_overrides                =*/ nullptr,
+        /*.repack_cache_dir            =*/ nullptr,
         /*.vocab_only                  =*/ false,
+        /*.meta_only                   =*/ false,
         /*.use_mmap                    =*/ true,
         /*.use_mlock                   =*/ false,
         /*.check_tensors               =*/ false,
+        /*.use_mmap_residency          =*/ false,
     };
 
 #ifdef LM_GGML_USE_METAL
@@ -13379,6 +13858,10 @@ bool llama_model_is_recurrent(const llama_model * model) {
     }
 }
 
+llama_memory_estimate llama_model_estimate_memory(const llama_model * model, llama_context_params params) {
+    return model->estimate_memory(params);
+}
+
 const std::vector<std::pair<std::string, lm_ggml_tensor *>> & llama_internal_get_tensor_map(const llama_model * model) {
     return model->tensors_by_name;
 }
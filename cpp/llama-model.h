@@ -392,11 +392,25 @@ struct llama_model {
 
     bool has_tensor_overrides() const;
 
+    // paging of the mapped layer weights in graph order, see use_mmap_residency
+    bool has_layer_residency() const;
+
+    // called once layer il has been computed: releases it and prefetches the layer after the next one
+    void layer_done(int il) const;
+
+    // reads the weights of layer il (the output weights for il == n_layer) that are in host memory, one byte per page,
+    // so that the pages of mapped weights are in memory before they are computed
+    // checked between tensors, abort_callback stops it early and makes it return false
+    bool touch_weights(int il, lm_ggml_abort_callback abort_callback, void * abort_callback_data) const;
+
     const struct lm_ggml_tensor * get_tensor(const char * name) const;
 
     // TODO: move this to new llm_arch_model_i interface
     llama_memory_i * create_memory() const; // TODO: params
 
+    // memory of a context with these parameters, from the hyperparameters only
+    llama_memory_estimate estimate_memory(const llama_context_params & params) const;
+
     // TODO: move this to new llm_arch_model_i interface
     llm_graph_result_ptr build_graph(
             const llm_graph_params & params,
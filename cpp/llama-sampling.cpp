@@ -1533,11 +1533,15 @@ static struct llama_sampler * llama_sampler_init_grammar_impl(
             LM_GGML_ASSERT(trigger_patterns == nullptr && num_trigger_patterns == 0);
             std::string trigger_pattern("[\\s\\S]*?(");
             for (size_t i = 0; i < num_trigger_words; ++i) {
-                static const std::regex special_chars("[.^$|()*+?\\[\\]{}\\\\]");
                 if (i > 0) {
                     trigger_pattern += "|";
                 }
-                trigger_pattern += std::regex_replace(trigger_words[i], special_chars, "\\$0");
+                for (const char * c = trigger_words[i]; *c; ++c) {
+                    if (strchr(".^$|()*+?[]{}\\", *c)) {
+                        trigger_pattern += '\\';
+                    }
+                    trigger_pattern += *c;
+                }
             }
             trigger_pattern += ")[\\s\\S]*";
             auto trigger_pattern_c = trigger_pattern.c_str();
@@ -1655,26 +1659,44 @@ static void llama_sampler_penalties_apply(struct llama_sampler * smpl, llama_tok
         return;
     }
 
-    // Apply frequency and presence penalties to the cur_p
-    for (size_t i = 0; i < cur_p->size; ++i) {
-        const auto token_iter = ctx->token_count.find(cur_p->data[i].id);
-        if (token_iter == ctx->token_count.end()) {
-            continue;
-        }
-
-        const int count = token_iter->second;
-
+    const auto penalize = [ctx](llama_token_data & cur, int count) {
         assert(count > 0 && count <= ctx->penalty_last_n);
 
         // The academic publication that described this technique actually just only divided, but that would cause tokens with negative logits to become more likely, which is obviously wrong.
         // This is common fix for this problem, which is to multiply by the penalty instead of dividing.
-        if (cur_p->data[i].logit <= 0) {
-            cur_p->data[i].logit *= ctx->penalty_repeat;
+        if (cur.logit <= 0) {
+            cur.logit *= ctx->penalty_repeat;
         } else {
-            cur_p->data[i].logit /= ctx->penalty_repeat;
+            cur.logit /= ctx->penalty_repeat;
+        }
+
+        cur.logit -= float(count) * ctx->penalty_freq + float(count > 0) * ctx->penalty_present;
+    };
+
+    // token_count is kept up to date by accept, so only the distinct tokens of the window have to be visited
+    // this works as long as the candidates have not been shuffled in the vocabulary (i.e. idx == id)
+    bool in_place = true;
+    for (const auto & tc : ctx->token_count) {
+        if (tc.first < 0 || cur_p->size <= (size_t) tc.first || cur_p->data[tc.first].id != tc.first) {
+            in_place = false;
+            break;
+        }
+    }
+
+    if (in_place) {
+        for (const auto & tc : ctx->token_count) {
+            penalize(cur_p->data[tc.first], tc.second);
         }
+    } else {
+        // Apply frequency and presence penalties to the cur_p
+        for (size_t i = 0; i < cur_p->size; ++i) {
+            const auto token_iter = ctx->token_count.find(cur_p->data[i].id);
+            if (token_iter == ctx->token_count.end()) {
+                continue;
+            }
 
-        cur_p->data[i].logit -= float(count) * ctx->penalty_freq + float(count > 0) * ctx->penalty_present;
+            penalize(cur_p->data[i], token_iter->second);
+        }
     }
 
     cur_p->sorted = false;
@@ -1698,7 +1720,8 @@ static struct llama_sampler * llama_sampler_penalties_clone(const struct llama_s
     {
         auto * result_ctx = (llama_sampler_penalties *) result->ctx;
 
-        result_ctx->prev = ctx->prev;
+        result_ctx->prev        = ctx->prev;
+        result_ctx->token_count = ctx->token_count;
     }
 
     return result;
@@ -1815,11 +1838,32 @@ struct llama_sampler_dry {
     const int32_t dry_penalty_last_n;
 
     std::unordered_multimap<llama_token, std::vector<llama_token>> dry_processed_breakers;
-    std::vector<int> dry_repeat_count;
     std::unordered_map<llama_token, int> dry_max_token_repeat;
     ring_buffer<llama_token> last_tokens;
+
+    // incremental state, updated on accept (positions count the tokens accepted since the last reset)
+    int     dry_max_tail_len;  // longest tail among dry_processed_breakers
+    int64_t dry_n_tokens;      // number of accepted tokens
+    int64_t dry_restart_pos;   // position of the head of the most recent restart sequence (-1 if none)
+    int     dry_restart_len;   // length of the longest restart sequence tail at that position
+
+    std::vector<int64_t> dry_prev_pos;                 // previous position of the same token, indexed by position % capacity
+    std::unordered_map<llama_token, int64_t> dry_last_pos; // last position of each token
+
+    // (position, length) of every suffix ending before the last token that matches a suffix of the context,
+    // in decreasing position order
+    std::vector<std::pair<int64_t, int>> dry_matches;
+    std::vector<std::pair<int64_t, int>> dry_matches_next;
 };
 
+static int llama_sampler_dry_max_tail_len(const std::unordered_multimap<llama_token, std::vector<llama_token>> & breakers) {
+    int res = 0;
+    for (const auto & it : breakers) {
+        res = std::max(res, (int) it.second.size());
+    }
+    return res;
+}
+
 // Ported from Koboldcpp, original PR: https://github.com/LostRuins/koboldcpp/pull/982 (Original author: pi6am)
 static void get_overlapping_token_sequences(const llama_vocab & vocab, const std::string& str, std::unordered_multimap<llama_token, std::vector<llama_token>>& token_sequences, int max_tail_len = -1) {
     for (llama_token token_id = 0; token_id < (llama_token) vocab.n_tokens(); token_id++) {
@@ -1873,7 +1917,84 @@ static void llama_sampler_dry_accept(struct llama_sampler * smpl, llama_token to
         return;
     }
 
+    const int64_t pos      = ctx->dry_n_tokens++;
+    const int64_t capacity = (int64_t) ctx->last_tokens.capacity;
+
     ctx->last_tokens.push_back(token);
+
+    // oldest position still held by last_tokens
+    const int64_t first = pos + 1 - (int64_t) ctx->last_tokens.size();
+
+    // Extend the repeated suffixes with the new token.
+    //
+    // If the suffix ending at position `q - 1` matched the suffix of the context with length `n`, then the suffix
+    // ending at `q` matches the new suffix with length `n + 1` when the token at `q` is the new token, and with
+    // length 0 otherwise. Only the previous occurrences of the new token have to be visited, which are linked
+    // through `dry_prev_pos`, so the cost of each token is proportional to its own repetitions instead of the
+    // length of the window.
+    {
+        ctx->dry_matches_next.clear();
+
+        const auto it_last = ctx->dry_last_pos.find(token);
+
+        int64_t q = it_last == ctx->dry_last_pos.end() ? -1 : it_last->second;
+        size_t  m = 0;
+
+        while (q >= first) {
+            while (m < ctx->dry_matches.size() && ctx->dry_matches[m].first > q - 1) {
+                ++m;
+            }
+
+            int n = 1;
+            if (m < ctx->dry_matches.size() && ctx->dry_matches[m].first == q - 1) {
+                n += ctx->dry_matches[m].second;
+            }
+
+            ctx->dry_matches_next.emplace_back(q, n);
+
+            q = ctx->dry_prev_pos[q % capacity];
+        }
+
+        std::swap(ctx->dry_matches, ctx->dry_matches_next);
+
+        ctx->dry_prev_pos[pos % capacity] = it_last == ctx->dry_last_pos.end() ? -1 : it_last->second;
+        ctx->dry_last_pos[token] = pos;
+    }
+
+    // A restart sequence of `1 + seq_len` tokens can only be completed by the new token if its head is `seq_len`
+    // tokens back, so only those heads have to be tested. The most recent complete restart sequence is kept and,
+    // for restart sequences with the same head, the longest one.
+    const int max_seq_len = std::min<int>(ctx->dry_max_tail_len, (int) ctx->last_tokens.size() - 1);
+    for (int seq_len = 0; seq_len <= max_seq_len; ++seq_len) {
+        const int64_t head_pos = pos - seq_len;
+        if (head_pos < ctx->dry_restart_pos || (head_pos == ctx->dry_restart_pos && seq_len <= ctx->dry_restart_len)) {
+            break;
+        }
+
+        auto its = ctx->dry_processed_breakers.equal_range(ctx->last_tokens.rat(seq_len));
+        for (auto it = its.first; it != its.second; ++it) {
+            if ((int) it->second.size() != seq_len) {
+                continue;
+            }
+            bool match = true;
+            for (int offset = 0; offset < seq_len; ++offset) {
+                // The -1 when indexing `last_tokens` is because we already matched the head.
+                if (it->second[offset] != ctx->last_tokens.rat(seq_len - offset - 1)) {
+                    match = false;
+                    break;
+                }
+            }
+            if (match) {
+                ctx->dry_restart_pos = head_pos;
+                ctx->dry_restart_len = seq_len;
+                break;
+            }
+        }
+
+        if (ctx->dry_restart_pos == head_pos) {
+            break;
+        }
+    }
 }
 
 // Ported from Koboldcpp, original PR: https://github.com/LostRuins/koboldcpp/pull/982 (Original author: pi6am)
@@ -1891,79 +2012,38 @@ static void llama_sampler_dry_apply(struct llama_sampler * smpl, llama_token_dat
         return;
     }
 
-    ctx->dry_repeat_count.assign(last_n_repeat, 0);
     ctx->dry_max_token_repeat.clear();
 
-    // Step 1: Look for restart sequences to limit the maximum repetition length.
-    // Work backwards through the context looking for any token that begins a restart sequence.
+    // positions of the last token and of the first token of the window
+    const int64_t last  = ctx->dry_n_tokens - 1;
+    const int64_t first = ctx->dry_n_tokens - last_n_repeat;
+
+    // Step 1: Limit the maximum repetition length with the most recent restart sequence.
     //
     // The collection `restart_sequences` is a mapping from a "head" token to all "tail"
-    // sequences that together comprise a restart sequence. This allows us to quickly check
-    // whether each token is the head of a complete sequence. Most restart sequences are actually
-    // a single token, and for these the "tail" is an empty vector.
-    //
-    // If the token is a "head", test all restart sequences that begin with this token
-    // (there will often only be one sequence for each token, but if sequences like 'aaaq1' and
-    // 'aaa1' are used as restart strings, both could start with 'aaa' when tokenized). The
-    // longest matching sequence (if any) is used to limit the maximum repetition length.
+    // sequences that together comprise a restart sequence. Most restart sequences are actually
+    // a single token, and for these the "tail" is an empty vector. Accept keeps track of the
+    // most recent head that begins a complete restart sequence, along with the longest such
+    // sequence, so only its distance from the end of the context is needed here.
     //
     // Note that in the case case of a short sequence contained in a longer one, this might fail to
     // find the smallest value for `rep_limit`. For example, if 'amniotic' and 'ni' are both used as
     // restart sequences, 'ni' will be found first, and since it's shorter it will fail to suppress
     // 'otic'. This is a minor issue since fully contained restart sequences are likely to be rare.
-    //
-    // This is theoretically worst-case O(N^2) for arbitrary restart sequences, which is why we
-    // have already clamped the maximum tail sequence length when generating `restart_sequences`.
-    // With clamping, this scan is O(N) in the context length.
 
     int rep_limit = last_n_repeat;
-    for (int i = 0; i < last_n_repeat; ++i) {
-        llama_token token = ctx->last_tokens.rat(i);
-        auto its = ctx->dry_processed_breakers.equal_range(token);
-        if (its.first == ctx->dry_processed_breakers.end()) {
-            continue;
-        }
-        int longest_match = -1;
-        for (auto it = its.first; it != its.second; ++it) {
-            // Note that (*it) does not contain the head character, so seq_len will be
-            // the restart sequence length minus 1.
-            // In the common case of a single-token restart sequence, (*it) will be empty
-            // and we will trivially match.
-            int seq_len = (int)it->second.size();
-            if (seq_len > longest_match && seq_len <= (int)i) {
-                bool match = true;
-                for (int offset = 0; offset < seq_len; ++offset) {
-                    // The -1 when indexing `last_tokens` is because we already matched the head.
-                    if (it->second[offset] != ctx->last_tokens.rat(i - offset - 1)) {
-                        match = false;
-                        break;
-                    }
-                }
-                if (match) {
-                    longest_match = seq_len;
-                }
-            }
-        }
-        if (longest_match >= 0) {
-            // We found a restart sequence starting `i` tokens from the end and continuing for
-            // `longest_match` tokens.
-            rep_limit = i - longest_match;
-            break;
-        }
+    if (ctx->dry_restart_pos >= first) {
+        // We found a restart sequence starting `last - dry_restart_pos` tokens from the end and
+        // continuing for `dry_restart_len` tokens.
+        rep_limit = (int) (last - ctx->dry_restart_pos) - ctx->dry_restart_len;
     }
     if (rep_limit < ctx->dry_allowed_length) {
         return;
     }
 
-    // Step 2: Iterate in reverse over the last N tokens of the context, using the "Z-algorithm" (in
-    // the reverse direction) to efficiently compute the positions and lengths of suffixes appearing
-    // elsewhere in the context. We limit the suffix length to `rep_limit` to respect restart sequences.
-    //
-    // This algorithm is not currently documented on Wikipedia, but there is a clear description here:
-    // https://ivanyu.me/blog/2014/10/15/z-algorithm/
-    //
-    // The code below is adapted from the public domain implementation by the same author here:
-    // https://github.com/ivanyu/string-algorithms/blob/master/z_algorithm.py
+    // Step 2: Examine the maximum repeat length that would be generated by emitting each new token
+    // that would extend a sequence. `dry_matches` holds the positions and lengths of the suffixes
+    // appearing elsewhere in the context, which are limited here to the window and to `rep_limit`.
     //
     // Example:
     // Last N tokens: a b c c b c y a b c
@@ -1971,71 +2051,21 @@ static void llama_sampler_dry_apply(struct llama_sampler * smpl, llama_token_dat
     //                    ^
     //   This `3` means that the last three tokens of the context (a b c) also appear here.
     //
-    // This step is worst case O(N) since the Z-algorithm is linear, despite the appearance of nested
-    // for/while loops. This can be seen by observing that the `lt` and `rt` bounds are set after each
-    // repeated suffix is detected (i.e. after each while loop when n > 0). These bound variables
-    // ensure that the inner while loops only examine each token in the context once as the outer
-    // for loop iterates over the context.
-
-    {
-        const int last = last_n_repeat - 1;
-        int rt = 0, lt = 0;
-
-        for (int k = 1; k < last_n_repeat; ++k) {
-            if (k > rt) {
-                // If k is outside the current Z-box, do naive computation.
-                int n = 0;
-                while (n + k < last_n_repeat && ctx->last_tokens.rat(n) == ctx->last_tokens.rat(n+k)) {
-                    ++n;
-                }
-                ctx->dry_repeat_count[last - k] = std::min(n, rep_limit);
-                if (n > 0) {
-                    lt = k;
-                    rt = k + n - 1;
-                }
-            } else {
-                // If k is inside the current Z-box, consider two cases.
-
-                int p = k - lt; // Pair index.
-                int right_part_len = rt - k + 1;
-
-                if (ctx->dry_repeat_count[last - p] < right_part_len) {
-                    int n = std::min(ctx->dry_repeat_count[last - p], rep_limit);
-                    ctx->dry_repeat_count[last - k] = n;
-                } else {
-                    int i = rt + 1;
-                    while (i < last_n_repeat && ctx->last_tokens.rat(i) == ctx->last_tokens.rat(i - k)) {
-                        i += 1;
-                    }
-
-                    int n = std::min(i - k, rep_limit);
-                    ctx->dry_repeat_count[last - k] = n;
-                    lt = k;
-                    rt = i - 1;
-                }
-            }
-        }
-    }
-
-    // Step 3: Iterate over dry_repeat_count and last_tokens, examining the maximum repeat length
-    // that would be generated by emitting each new token that would extend a sequence.
-    //
-    // Following the same example as above:
-    // Last N tokens: a b c c b c y a b c
-    // Repeat counts: 0 0 3 1 0 2 0 0 0 0
-    //
     // For each non-zero, look ahead one token. This token, if emitted, would extend the repetition.
     // c: 3 -> 4 (from `a b c` to `a b c c`)
     // b: 1 -> 2 (from `c` to `c b`)
     // y: 2 -> 3 (from `b c` to `b c y`)
 
-    for (int i = 0; i < last_n_repeat - 1; ++i) {
-        int repeat_len = ctx->dry_repeat_count[i];
+    for (const auto & match : ctx->dry_matches) {
+        if (match.first < first) {
+            break;
+        }
+        const int repeat_len = std::min(std::min(match.second, (int) (match.first - first + 1)), rep_limit);
         if (repeat_len >= ctx->dry_allowed_length) {
             // This token ends a repeat, so the next token would continue one.
             // By convention, the value of `repeat_len` only includes the tokens currently
             // in the context, not the new token that would be added.
-            llama_token token = ctx->last_tokens.rat(last_n_repeat - 2 - i);
+            llama_token token = ctx->last_tokens.rat((size_t) (last - match.first - 1));
             // Track the maximum sequence ending in this token.
             const auto& it = ctx->dry_max_token_repeat.find(token);
             if (it == ctx->dry_max_token_repeat.end() || it->second < repeat_len) {
@@ -2044,7 +2074,7 @@ static void llama_sampler_dry_apply(struct llama_sampler * smpl, llama_token_dat
         }
     }
 
-    // Step 4: Apply logit penalties based on the maximum repeat length for relevant tokens.
+    // Step 3: Apply logit penalties based on the maximum repeat length for relevant tokens.
 
     // Prevent floating point overflow in `pow(penalty_base, exponent)` by clamping to `max_exponent`.
     // Compute it from `penalty_base` and the approximate log of `std::numeric_limits<float>::max()`
@@ -2054,28 +2084,47 @@ static void llama_sampler_dry_apply(struct llama_sampler * smpl, llama_token_dat
         max_exponent = FLOAT_MAX_LOG / std::log(ctx->dry_base);
     }
 
-    for (size_t i = 0; i < cur_p->size; ++i) {
-        const auto& af_kvp = ctx->dry_max_token_repeat.find(cur_p->data[i].id);
-        if (af_kvp != ctx->dry_max_token_repeat.end()) {
-            // Check all sequence breakers starting with this token
-            auto range = ctx->dry_processed_breakers.equal_range(cur_p->data[i].id);
-            bool is_single_token_breaker = false;
-
-            for (auto it = range.first; it != range.second; ++it) {
-                if (it->second.empty()) {
-                    is_single_token_breaker = true;
-                    break;
-                }
+    const auto penalize = [ctx, max_exponent](llama_token_data & cur, int max_repeat) {
+        // Check all sequence breakers starting with this token
+        auto range = ctx->dry_processed_breakers.equal_range(cur.id);
+        bool is_single_token_breaker = false;
+
+        for (auto it = range.first; it != range.second; ++it) {
+            if (it->second.empty()) {
+                is_single_token_breaker = true;
+                break;
             }
+        }
 
-            // Apply penalty only if it's not a single-token sequence breaker
-            if (!is_single_token_breaker) {
-                int repeat_exp = af_kvp->second - ctx->dry_allowed_length;
-                if (max_exponent > 0 && repeat_exp > max_exponent) {
-                    repeat_exp = max_exponent;
-                }
-                float penalty = ctx->dry_multiplier * std::pow(ctx->dry_base, repeat_exp);
-                cur_p->data[i].logit -= penalty;
+        // Apply penalty only if it's not a single-token sequence breaker
+        if (!is_single_token_breaker) {
+            int repeat_exp = max_repeat - ctx->dry_allowed_length;
+            if (max_exponent > 0 && repeat_exp > max_exponent) {
+                repeat_exp = max_exponent;
+            }
+            float penalty = ctx->dry_multiplier * std::pow(ctx->dry_base, repeat_exp);
+            cur.logit -= penalty;
+        }
+    };
+
+    // only the repeated tokens have to be visited as long as the candidates have not been shuffled in the vocabulary (i.e. idx == id)
+    bool in_place = true;
+    for (const auto & kvp : ctx->dry_max_token_repeat) {
+        if (kvp.first < 0 || cur_p->size <= (size_t) kvp.first || cur_p->data[kvp.first].id != kvp.first) {
+            in_place = false;
+            break;
+        }
+    }
+
+    if (in_place) {
+        for (const auto & kvp : ctx->dry_max_token_repeat) {
+            penalize(cur_p->data[kvp.first], kvp.second);
+        }
+    } else {
+        for (size_t i = 0; i < cur_p->size; ++i) {
+            const auto& af_kvp = ctx->dry_max_token_repeat.find(cur_p->data[i].id);
+            if (af_kvp != ctx->dry_max_token_repeat.end()) {
+                penalize(cur_p->data[i], af_kvp->second);
             }
         }
     }
@@ -2086,8 +2135,12 @@ static void llama_sampler_dry_apply(struct llama_sampler * smpl, llama_token_dat
 static void llama_sampler_dry_reset(struct llama_sampler * smpl) {
     auto * ctx = (llama_sampler_dry *) smpl->ctx;
     ctx->last_tokens.clear();
-    ctx->dry_repeat_count.clear();
     ctx->dry_max_token_repeat.clear();
+    ctx->dry_n_tokens    = 0;
+    ctx->dry_restart_pos = -1;
+    ctx->dry_restart_len = 0;
+    ctx->dry_last_pos.clear();
+    ctx->dry_matches.clear();
 }
 
 static struct llama_sampler * llama_sampler_dry_clone(const struct llama_sampler * smpl) {
@@ -2102,9 +2155,15 @@ static struct llama_sampler * llama_sampler_dry_clone(const struct llama_sampler
     {
         auto * result_ctx = (llama_sampler_dry *) result->ctx;
         result_ctx->dry_processed_breakers = ctx->dry_processed_breakers;
-        result_ctx->dry_repeat_count = ctx->dry_repeat_count;
         result_ctx->dry_max_token_repeat = ctx->dry_max_token_repeat;
         result_ctx->last_tokens = ctx->last_tokens;
+        result_ctx->dry_max_tail_len = ctx->dry_max_tail_len;
+        result_ctx->dry_n_tokens = ctx->dry_n_tokens;
+        result_ctx->dry_restart_pos = ctx->dry_restart_pos;
+        result_ctx->dry_restart_len = ctx->dry_restart_len;
+        result_ctx->dry_prev_pos = ctx->dry_prev_pos;
+        result_ctx->dry_last_pos = ctx->dry_last_pos;
+        result_ctx->dry_matches = ctx->dry_matches;
     }
 
     return result;
@@ -2154,6 +2213,8 @@ struct llama_sampler * llama_sampler_init_dry(const struct llama_vocab * vocab,
         }
     }
 
+    const int max_tail_len = llama_sampler_dry_max_tail_len(processed_breakers);
+
     return llama_sampler_init(
         /* .iface = */ &llama_sampler_dry_i,
         /* .ctx   = */ new llama_sampler_dry {
@@ -2163,9 +2224,16 @@ struct llama_sampler * llama_sampler_init_dry(const struct llama_vocab * vocab,
             /* .dry_allowed_length     = */ dry_allowed_length,
             /* .dry_penalty_last_n     = */ dry_penalty_last_n,
             /* .dry_processed_breakers = */ std::move(processed_breakers),
-            /* .dry_repeat_count       = */ dry_enabled ? std::vector<int>(effective_dry_penalty_last_n, 0) : std::vector<int>{},
             /* .dry_max_token_repeat   = */ {},
             /* .last_tokens            = */ dry_enabled ? ring_buffer<llama_token>(effective_dry_penalty_last_n) : ring_buffer<llama_token>(0),
+            /* .dry_max_tail_len       = */ max_tail_len,
+            /* .dry_n_tokens           = */ 0,
+            /* .dry_restart_pos        = */ -1,
+            /* .dry_restart_len        = */ 0,
+            /* .dry_prev_pos           = */ dry_enabled ? std::vector<int64_t>(effective_dry_penalty_last_n, -1) : std::vector<int64_t>{},
+            /* .dry_last_pos           = */ {},
+            /* .dry_matches            = */ {},
+            /* .dry_matches_next       = */ {},
         }
     );
 }
@@ -2196,6 +2264,8 @@ struct llama_sampler * llama_sampler_init_dry_testing(int32_t context_size, floa
         }
     }
 
+    ctx->dry_max_tail_len = llama_sampler_dry_max_tail_len(ctx->dry_processed_breakers);
+
     return result;
 }
 
@@ -0,0 +1,217 @@
+#pragma once
+
+#include "llama.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cstdint>
+#include <map>
+#include <string>
+#include <utility>
+#include <vector>
+
+// tries of the token texts, used by the tokenizers in llama-vocab.cpp
+
+struct naive_trie {
+    naive_trie() : has_value(false), value(0) {
+    }
+    void insert(const char * key, size_t len, int32_t value = 0) {
+        if (len == 0) {
+            this->has_value = true;
+            this->value = value;
+            return;
+        }
+        char c = key[0];
+        auto res = children.find(c);
+        if (res != children.end()) {
+            res->second.insert(key + 1, len - 1, value);
+        } else {
+            auto res = children.insert(std::make_pair(c, naive_trie()));
+            res.first->second.insert(key + 1, len - 1, value);
+        }
+    }
+    std::pair<const char *, size_t> get_longest_prefix(const char * key, size_t len, size_t offset = 0) const {
+        if (len == 0 || offset == len) {
+            return std::make_pair(key, offset);
+        }
+        char c = key[offset];
+        auto res = children.find(c);
+        if (res != children.end()) {
+            return res->second.get_longest_prefix(key, len, offset + 1);
+        }
+
+        return std::make_pair(key, offset);
+    }
+    const struct naive_trie * traverse(const char c) const {
+        auto res = children.find(c);
+        if (res != children.end()) {
+            return &res->second;
+        }
+
+        return NULL;
+    }
+    std::map<char, struct naive_trie> children;
+    bool has_value;
+    llama_token value;
+};
+
+// double-array trie: the child of node s by byte c is node base[s] + c if check[base[s] + c] == s
+// see Jun-ichi Aoe (1989). An Efficient Digital Search Algorithm by Using a Double-Array Structure.
+struct double_array_trie {
+    static constexpr int32_t root = 0;
+
+    // builds the trie of the keys, the value of a duplicate key is the last one
+    void build(std::vector<std::pair<std::string, llama_token>> keys) {
+        std::stable_sort(keys.begin(), keys.end(), [](const auto & a, const auto & b) { return a.first < b.first; });
+
+        // the root is never free
+        nodes.assign(1, node{0, -2, LLAMA_TOKEN_NULL});
+        free_next.assign(1, -1);
+        free_prev.assign(1, -1);
+        free_head = -1;
+        free_tail = -1;
+
+        if (!keys.empty()) {
+            build(root, keys, 0, keys.size(), 0);
+        }
+
+        // trailing free slots are not needed
+        while (nodes.size() > 1 && nodes.back().check == -1) {
+            nodes.pop_back();
+        }
+        nodes.shrink_to_fit();
+        free_next = std::vector<int32_t>();
+        free_prev = std::vector<int32_t>();
+    }
+
+    // the child of the node by c, or -1
+    int32_t traverse(int32_t s, char c) const {
+        const size_t t = (size_t) nodes[s].base + (uint8_t) c;
+        if (t < nodes.size() && nodes[t].check == s) {
+            return (int32_t) t;
+        }
+        return -1;
+    }
+
+    // the value of the node, LLAMA_TOKEN_NULL if no key ends at the node
+    llama_token value(int32_t s) const {
+        return nodes[s].value;
+    }
+
+    // nodes are in [0, size())
+    size_t size() const {
+        return nodes.size();
+    }
+
+    // length of the longest prefix of key that is a path of the trie
+    size_t get_longest_prefix(const char * key, size_t len) const {
+        int32_t s = root;
+        size_t offset = 0;
+        while (offset < len && (s = traverse(s, key[offset])) >= 0) {
+            offset++;
+        }
+        return offset;
+    }
+
+private:
+    struct node {
+        int32_t     base;
+        int32_t     check; // parent node, -1 if the slot is free, -2 for the root
+        llama_token value;
+    };
+
+    // keys[lo, hi) share their first depth bytes, which lead to node s
+    void build(int32_t s, const std::vector<std::pair<std::string, llama_token>> & keys, size_t lo, size_t hi, size_t depth) {
+        while (lo < hi && keys[lo].first.size() == depth) {
+            nodes[s].value = keys[lo].second;
+            lo++;
+        }
+        if (lo == hi) {
+            return;
+        }
+
+        // the children, as (byte, first key) in increasing byte order
+        std::vector<std::pair<uint8_t, size_t>> children;
+        for (size_t i = lo; i < hi; ++i) {
+            const uint8_t c = keys[i].first[depth];
+            if (children.empty() || children.back().first != c) {
+                children.emplace_back(c, i);
+            }
+        }
+
+        const int32_t base = find_base(children);
+        nodes[s].base = base;
+        for (const auto & child : children) {
+            use(base + child.first, s);
+        }
+        for (size_t i = 0; i < children.size(); ++i) {
+            const size_t child_hi = i + 1 < children.size() ? children[i + 1].second : hi;
+            build(base + children[i].first, keys, children[i].second, child_hi, depth + 1);
+        }
+    }
+
+    // the first base at which all the children fit in free slots
+    int32_t find_base(const std::vector<std::pair<uint8_t, size_t>> & children) const {
+        const int32_t c0 = children[0].first;
+        for (int32_t t = free_head; t >= 0; t = free_next[t]) {
+            const int32_t base = t - c0;
+            bool fits = base > 0;
+            for (size_t i = 1; fits && i < children.size(); ++i) {
+                const size_t u = (size_t) base + children[i].first;
+                fits = u >= nodes.size() || nodes[u].check == -1;
+            }
+            if (fits) {
+                return base;
+            }
+        }
+        // no free slot fits, the slots past the end are free
+        return std::max<int32_t>((int32_t) nodes.size(), c0 + 1) - c0;
+    }
+
+    void use(int32_t t, int32_t parent) {
+        if ((size_t) t >= nodes.size()) {
+            // the new slots are added to the list of free slots
+            const int32_t n_old = (int32_t) nodes.size();
+            const int32_t n_new = std::max<int32_t>(t + 1, 2*n_old);
+            nodes.resize(n_new, node{0, -1, LLAMA_TOKEN_NULL});
+            free_next.resize(n_new, -1);
+            free_prev.resize(n_new, -1);
+            for (int32_t i = n_old; i < n_new; ++i) {
+                push_free(i);
+            }
+        }
+        assert(nodes[t].check == -1);
+        nodes[t].check = parent;
+
+        // unlink the slot from the free list
+        if (free_prev[t] >= 0) {
+            free_next[free_prev[t]] = free_next[t];
+        } else {
+            free_head = free_next[t];
+        }
+        if (free_next[t] >= 0) {
+            free_prev[free_next[t]] = free_prev[t];
+        } else {
+            free_tail = free_prev[t];
+        }
+    }
+
+    void push_free(int32_t t) {
+        free_next[t] = -1;
+        free_prev[t] = free_tail;
+        if (free_tail >= 0) {
+            free_next[free_tail] = t;
+        } else {
+            free_head = t;
+        }
+        free_tail = t;
+    }
+
+    std::vector<node> nodes;
+
+    // list of the free slots while building, in increasing order
+    std::vector<int32_t> free_next;
+    std::vector<int32_t> free_prev;
+    int32_t free_head = -1;
+    int32_t free_tail = -1;
+};
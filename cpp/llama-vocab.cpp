@@ -2,6 +2,7 @@
 
 #include "llama-impl.h"
 #include "llama-model-loader.h"
+#include "llama-trie.h"
 
 #include "unicode.h"
 
@@ -11,10 +12,11 @@
 #include <climits>
 #include <cstdarg>
 #include <cstring>
-#include <forward_list>
 #include <map>
+#include <mutex>
 #include <queue>
 #include <set>
+#include <thread>
 #include <unordered_map>
 #include <cctype>
 
@@ -22,47 +24,142 @@
 // helpers
 //
 
-struct naive_trie {
-    naive_trie() : has_value(false), value(0) {
+// Aho-Corasick automaton over a double-array trie, finds the occurrences of all the keys in one pass over a text
+// see Alfred V. Aho, Margaret J. Corasick (1975). Efficient String Matching: An Aid to Bibliographic Search.
+struct aho_corasick {
+    // the value of a duplicate key is the last one
+    void build(std::vector<std::pair<std::string, llama_token>> keys) {
+        std::vector<std::string> texts;
+        texts.reserve(keys.size());
+        for (const auto & key : keys) {
+            texts.push_back(key.first);
+        }
+        trie.build(std::move(keys));
+
+        // the nodes by depth
+        struct edge {
+            int32_t node;
+            int32_t parent;
+            char    c;
+        };
+        std::vector<std::vector<edge>> levels;
+        std::vector<bool> seen(trie.size(), false);
+        for (const auto & text : texts) {
+            int32_t s = double_array_trie::root;
+            for (size_t i = 0; i < text.size(); ++i) {
+                const int32_t t = trie.traverse(s, text[i]);
+                if (!seen[t]) {
+                    seen[t] = true;
+                    if (levels.size() <= i) {
+                        levels.resize(i + 1);
+                    }
+                    levels[i].push_back({t, s, text[i]});
+                }
+                s = t;
+            }
+        }
+
+        // fail: the node of the longest proper suffix, output: the node of the longest proper suffix that is a key
+        fail.assign(trie.size(), double_array_trie::root);
+        output.assign(trie.size(), -1);
+        for (const auto & level : levels) {
+            for (const auto & e : level) {
+                int32_t f = fail[e.parent];
+                if (e.parent != double_array_trie::root) {
+                    while (f != double_array_trie::root && trie.traverse(f, e.c) < 0) {
+                        f = fail[f];
+                    }
+                    const int32_t u = trie.traverse(f, e.c);
+                    f = u >= 0 ? u : double_array_trie::root;
+                }
+                fail[e.node]   = f;
+                output[e.node] = f != double_array_trie::root && trie.value(f) != LLAMA_TOKEN_NULL ? f : output[f];
+            }
+        }
     }
-    void insert(const char * key, size_t len, int32_t value = 0) {
-        if (len == 0) {
-            this->has_value = true;
-            this->value = value;
+
+    // calls on_match(end, value) for every occurrence of a key that ends at end, in increasing end order
+    template <typename F>
+    void find_all(const char * text, size_t len, F && on_match) const {
+        if (fail.empty()) {
             return;
         }
-        char c = key[0];
-        auto res = children.find(c);
-        if (res != children.end()) {
-            res->second.insert(key + 1, len - 1, value);
-        } else {
-            auto res = children.insert(std::make_pair(c, naive_trie()));
-            res.first->second.insert(key + 1, len - 1, value);
+        int32_t s = double_array_trie::root;
+        for (size_t i = 0; i < len; ++i) {
+            int32_t t;
+            while ((t = trie.traverse(s, text[i])) < 0 && s != double_array_trie::root) {
+                s = fail[s];
+            }
+            s = t >= 0 ? t : double_array_trie::root;
+            for (int32_t u = trie.value(s) != LLAMA_TOKEN_NULL ? s : output[s]; u >= 0; u = output[u]) {
+                on_match(i + 1, trie.value(u));
+            }
         }
     }
-    std::pair<const char *, size_t> get_longest_prefix(const char * key, size_t len, size_t offset = 0) const {
-        if (len == 0 || offset == len) {
-            return std::make_pair(key, offset);
-        }
-        char c = key[offset];
-        auto res = children.find(c);
-        if (res != children.end()) {
-            return res->second.get_longest_prefix(key, len, offset + 1);
+
+private:
+    double_array_trie trie;
+
+    std::vector<int32_t> fail;
+    std::vector<int32_t> output;
+};
+
+// (left, right) token pairs in a flat open-addressing table, for the BPE merges and the SPM bigrams
+struct llm_token_pairs {
+    struct entry {
+        uint64_t    key; // (left << 32) | right, UINT64_MAX if empty
+        int         rank; // unused by SPM
+        llama_token merged; // LLAMA_TOKEN_NULL if the merged text is not a token
+    };
+
+    void init(size_t n_pairs) {
+        size_t n_table = 16;
+        while (n_table < 2*n_pairs) {
+            n_table *= 2;
         }
+        table.assign(n_table, entry{UINT64_MAX, -1, LLAMA_TOKEN_NULL});
+        mask = n_table - 1;
+    }
 
-        return std::make_pair(key, offset);
+    void insert(llama_token left, llama_token right, int rank, llama_token merged) {
+        const uint64_t key = make_key(left, right);
+        for (size_t i = hash(key);; i = (i + 1) & mask) {
+            if (table[i].key == UINT64_MAX) {
+                table[i] = entry{key, rank, merged};
+                return;
+            }
+            if (table[i].key == key) {
+                return;
+            }
+        }
     }
-    const struct naive_trie * traverse(const char c) const {
-        auto res = children.find(c);
-        if (res != children.end()) {
-            return &res->second;
+
+    const entry * find(llama_token left, llama_token right) const {
+        if (table.empty()) {
+            return nullptr;
+        }
+        const uint64_t key = make_key(left, right);
+        for (size_t i = hash(key);; i = (i + 1) & mask) {
+            if (table[i].key == key) {
+                return &table[i];
+            }
+            if (table[i].key == UINT64_MAX) {
+                return nullptr;
+            }
         }
+    }
+
+private:
+    static uint64_t make_key(llama_token left, llama_token right) {
+        return ((uint64_t) (uint32_t) left << 32) | (uint32_t) right;
+    }
 
-        return NULL;
+    size_t hash(uint64_t key) const {
+        return (size_t) ((key * 0x9E3779B97F4A7C15ull) >> 32) & mask;
     }
-    std::map<char, struct naive_trie> children;
-    bool has_value;
-    llama_token value;
+
+    std::vector<entry> table;
+    size_t mask = 0;
 };
 
 //
@@ -92,34 +189,77 @@ static_assert(std::is_trivially_copyable<llm_symbol>::value, "llm_symbol is not
 
 struct llm_bigram_spm {
     struct comparator {
-        bool operator()(llm_bigram_spm & l, llm_bigram_spm & r) {
+        bool operator()(const llm_bigram_spm & l, const llm_bigram_spm & r) const {
             return (l.score < r.score) || (l.score == r.score && l.left > r.left);
         }
     };
-    using queue_storage = std::vector<llm_bigram_spm>;
-    using queue = std::priority_queue<llm_bigram_spm, queue_storage, comparator>;
     llm_symbol::index left;
     llm_symbol::index right;
     float score;
     size_t size;
+    llama_token merged;
 };
 
 struct llm_tokenizer_spm : llm_tokenizer {
-    llm_tokenizer_spm(const llama_vocab & /*vocab*/) {}
+    // every split of a token text into two tokens is a bigram that can merge into the token
+    llm_tokenizer_spm(const llama_vocab & vocab) {
+        std::vector<std::pair<llama_token, llama_token>> splits;
+        std::vector<llama_token> merged;
+        std::string part;
+        for (uint32_t id = 0; id < vocab.n_tokens(); ++id) {
+            const std::string & text = vocab.token_get_text(id);
+            // the id of duplicate texts is the one text_to_token returns
+            const llama_token token = vocab.text_to_token(text);
+            for (size_t k = 1; k < text.size(); ++k) {
+                part.assign(text, 0, k);
+                const llama_token left = vocab.text_to_token(part);
+                if (left == LLAMA_TOKEN_NULL) {
+                    continue;
+                }
+                part.assign(text, k, std::string::npos);
+                const llama_token right = vocab.text_to_token(part);
+                if (right == LLAMA_TOKEN_NULL) {
+                    continue;
+                }
+                splits.emplace_back(left, right);
+                merged.push_back(token);
+            }
+        }
+
+        bigrams.init(splits.size());
+        for (size_t i = 0; i < splits.size(); ++i) {
+            bigrams.insert(splits[i].first, splits[i].second, 0, merged[i]);
+        }
+    }
+
+    llm_token_pairs bigrams;
+};
+
+// the symbols of the SPM session carry the id of their text, so that merged symbols are not looked up again
+struct llm_symbol_spm {
+    llm_symbol::index prev;
+    llm_symbol::index next;
+    llama_token id; // LLAMA_TOKEN_NULL if the text is not a token
+    const char * text;
+    size_t n;
 };
 
 struct llm_tokenizer_spm_session {
-    llm_tokenizer_spm_session(const llama_vocab & vocab) : vocab(vocab) {}
+    llm_tokenizer_spm_session(const llama_vocab & vocab, const llm_tokenizer_spm & tokenizer) : vocab(vocab), tokenizer(tokenizer) {}
 
     void tokenize(const std::string & text, std::vector<llama_token> & output) {
+        symbols.clear();
+        work_queue.clear();
+
         // split string into utf8 chars
         int index = 0;
         size_t offs = 0;
         while (offs < text.size()) {
-            llm_symbol sym;
+            llm_symbol_spm sym;
             size_t len = unicode_len_utf8(text[offs]);
             sym.text = text.c_str() + offs;
             sym.n = std::min(len, text.size() - offs);
+            sym.id = vocab.text_to_token(std::string(sym.text, sym.n));
             offs += sym.n;
             sym.prev = index - 1;
             sym.next = offs == text.size() ? -1 : index + 1;
@@ -134,8 +274,9 @@ struct llm_tokenizer_spm_session {
 
         // keep substituting the highest frequency pairs for as long as we can.
         while (!work_queue.empty()) {
-            auto bigram = work_queue.top();
-            work_queue.pop();
+            std::pop_heap(work_queue.begin(), work_queue.end(), llm_bigram_spm::comparator());
+            const auto bigram = work_queue.back();
+            work_queue.pop_back();
 
             auto & left_sym = symbols[bigram.left];
             auto & right_sym = symbols[bigram.right];
@@ -148,6 +289,7 @@ struct llm_tokenizer_spm_session {
 
             // merge the right sym into the left one
             left_sym.n += right_sym.n;
+            left_sym.id = bigram.merged;
             right_sym.n = 0;
 
             //LLAMA_LOG_INFO("left = '%*s' size = %zu\n", (int) left_sym.n, left_sym.text, bigram.size);
@@ -163,45 +305,48 @@ struct llm_tokenizer_spm_session {
             try_add_bigram(bigram.left, left_sym.next);
         }
 
-        for (int i = 0; i != -1; i = symbols[i].next) {
-            auto & symbol = symbols[i];
-            resegment(symbol, output);
-        }
-    }
+        for (int i = symbols.empty() ? -1 : 0; i != -1; i = symbols[i].next) {
+            const auto & symbol = symbols[i];
 
-private:
-    void resegment(llm_symbol & symbol, std::vector<llama_token> & output) {
-        auto text = std::string(symbol.text, symbol.n);
-        auto token = vocab.text_to_token(text);
-
-        // Do we need to support is_unused?
-        if (token != LLAMA_TOKEN_NULL) {
-            output.push_back(token);
-            return;
-        }
-
-        const auto p = rev_merge.find(text);
+            // Do we need to support is_unused?
+            if (symbol.id != LLAMA_TOKEN_NULL) {
+                output.push_back(symbol.id);
+                continue;
+            }
 
-        if (p == rev_merge.end()) {
-            // output any symbols that did not form tokens as bytes.
+            // merged symbols are always tokens, output any symbols that did not form tokens as bytes.
             output.reserve(output.size() + symbol.n);
             for (int j = 0; j < (int)symbol.n; ++j) {
                 llama_token id = vocab.byte_to_token(symbol.text[j]);
                 output.push_back(id);
             }
-            return;
         }
-
-        resegment(symbols[p->second.first], output);
-        resegment(symbols[p->second.second], output);
     }
 
+private:
     void try_add_bigram(int left, int right) {
         if (left == -1 || right == -1) {
             return;
         }
-        const std::string text = std::string(symbols[left].text, symbols[left].n + symbols[right].n);
-        auto token = vocab.text_to_token(text);
+
+        // no token is longer than max_token_len
+        const size_t size = symbols[left].n + symbols[right].n;
+        if (size > (size_t) vocab.max_token_len()) {
+            return;
+        }
+
+        llama_token token = LLAMA_TOKEN_NULL;
+        if (symbols[left].id != LLAMA_TOKEN_NULL && symbols[right].id != LLAMA_TOKEN_NULL) {
+            // both texts are tokens, so the bigram is a token only if it is a split of one
+            const auto * entry = tokenizer.bigrams.find(symbols[left].id, symbols[right].id);
+            if (entry == nullptr) {
+                return;
+            }
+            token = entry->merged;
+        } else {
+            text_scratch.assign(symbols[left].text, size);
+            token = vocab.text_to_token(text_scratch);
+        }
 
         if (token == LLAMA_TOKEN_NULL) {
             return;
@@ -214,24 +359,23 @@ private:
         const auto & tok_data = vocab.get_token_data(token);
 
         llm_bigram_spm bigram;
-        bigram.left  = left;
-        bigram.right = right;
-        bigram.score = tok_data.score;
-        bigram.size  = text.size();
-
-        work_queue.push(bigram);
-
-        // Do we need to support is_unused?
-        rev_merge[text] = std::make_pair(left, right);
+        bigram.left   = left;
+        bigram.right  = right;
+        bigram.score  = tok_data.score;
+        bigram.size   = size;
+        bigram.merged = token;
+
+        work_queue.push_back(bigram);
+        std::push_heap(work_queue.begin(), work_queue.end(), llm_bigram_spm::comparator());
     }
 
     const llama_vocab & vocab;
-    // currently unused
-    // const llm_tokenizer_spm * spm_tokenizer;
+    const llm_tokenizer_spm & tokenizer;
 
-    std::vector<llm_symbol> symbols;
-    llm_bigram_spm::queue work_queue;
-    std::map<std::string, std::pair<int, int>> rev_merge;
+    // reused by all the fragments tokenized with the session
+    std::vector<llm_symbol_spm> symbols;
+    std::vector<llm_bigram_spm> work_queue; // heap
+    std::string text_scratch;
 };
 
 //
@@ -242,19 +386,98 @@ private:
 
 // TODO: there are a lot of common parts between spm and bpe tokenizers, should be refactored and reused
 
-template<typename T, typename Container = std::vector<T>, typename Compare = std::less<typename Container::value_type>>
-class llama_priority_queue : public std::priority_queue<T, Container, Compare> {
-public:
-    using std::priority_queue<T, Container, Compare>::priority_queue;
+// memory cap of the word -> tokens cache of the BPE tokenizer, in bytes
+#define LLAMA_BPE_WORD_CACHE_SIZE (4*1024*1024)
+
+// the tokens of recently seen pre-tokenized words, so that repeated words skip the merges
+// the cache is sharded by the hash of the word, each shard has its own lock and CLOCK eviction
+struct llm_bpe_word_cache {
+    llm_bpe_word_cache(size_t size = LLAMA_BPE_WORD_CACHE_SIZE) : shard_size(size / N_SHARDS) {}
+
+    // append the cached tokens of word to output, returns false if the word is not in the cache
+    bool find(const std::string & word, std::vector<llama_token> & output) {
+        shard & sh = shards[std::hash<std::string>{}(word) % N_SHARDS];
+
+        std::lock_guard<std::mutex> lock(sh.mutex);
+        const auto it = sh.index.find(word);
+        if (it == sh.index.end()) {
+            return false;
+        }
+        entry & e = sh.entries[it->second];
+        e.referenced = true;
+        output.insert(output.end(), e.tokens.begin(), e.tokens.end());
+        return true;
+    }
+
+    void insert(const std::string & word, const llama_token * tokens, size_t n_tokens) {
+        const size_t size = entry_size(word.size(), n_tokens);
+        if (n_tokens == 0 || size > shard_size) {
+            return;
+        }
+        shard & sh = shards[std::hash<std::string>{}(word) % N_SHARDS];
+
+        std::lock_guard<std::mutex> lock(sh.mutex);
+        if (sh.index.find(word) != sh.index.end()) {
+            return;
+        }
+
+        // evict with the CLOCK hand until the new entry fits, referenced entries get a second chance
+        while (sh.size + size > shard_size) {
+            entry & e = sh.entries[sh.hand];
+            if (e.tokens.empty()) {
+                // free slot
+            } else if (e.referenced) {
+                e.referenced = false;
+            } else {
+                sh.size -= entry_size(e.word.size(), e.tokens.size());
+                sh.index.erase(e.word);
+                e.word.clear();
+                e.word.shrink_to_fit();
+                e.tokens.clear();
+                e.tokens.shrink_to_fit();
+                sh.free.push_back(sh.hand);
+            }
+            sh.hand = (sh.hand + 1) % sh.entries.size();
+        }
+
+        size_t slot;
+        if (!sh.free.empty()) {
+            slot = sh.free.back();
+            sh.free.pop_back();
+        } else {
+            slot = sh.entries.size();
+            sh.entries.emplace_back();
+        }
+        sh.entries[slot] = entry{word, std::vector<llama_token>(tokens, tokens + n_tokens), false};
+        sh.index.emplace(word, slot);
+        sh.size += size;
+    }
+
+private:
+    static constexpr size_t N_SHARDS = 16;
+
+    struct entry {
+        std::string              word;
+        std::vector<llama_token> tokens; // empty if the slot is free
+        bool                     referenced;
+    };
+
+    struct shard {
+        std::mutex                              mutex;
+        std::vector<entry>                      entries;
+        std::vector<size_t>                     free;
+        std::unordered_map<std::string, size_t> index;
+        size_t                                  hand = 0;
+        size_t                                  size = 0;
+    };
 
-    T pop_move() {
-        T item = std::move(this->c.front());
-        std::pop_heap(this->c.begin(), this->c.end(), this->comp);
-        this->c.pop_back();
-        return item;
+    // approximate memory used by an entry, including the index node
+    static size_t entry_size(size_t n_word, size_t n_tokens) {
+        return sizeof(entry) + 2*n_word + n_tokens*sizeof(llama_token) + 64;
     }
 
-    void pop() =  delete;
+    const size_t shard_size;
+    shard shards[N_SHARDS];
 };
 
 struct llm_bigram_bpe {
@@ -264,17 +487,18 @@ struct llm_bigram_bpe {
         }
     };
 
-    using queue_storage = std::vector<llm_bigram_bpe>;
-    using queue = llama_priority_queue<llm_bigram_bpe, queue_storage, comparator>;
     llm_symbol::index left;
     llm_symbol::index right;
-    std::string text;
     int rank;
+    llama_token merged;
     size_t size;
 };
 
+// minimum number of words per thread before a text is merged on several threads
+#define LLAMA_BPE_MIN_WORDS_PER_THREAD 1024
+
 struct llm_tokenizer_bpe : llm_tokenizer {
-    llm_tokenizer_bpe(const llama_vocab & vocab) {
+    llm_tokenizer_bpe(const llama_vocab & vocab, const llm_token_pairs & merges, llm_bpe_word_cache & word_cache) : merges(merges), word_cache(word_cache) {
         LM_GGML_ASSERT(vocab.get_type() == LLAMA_VOCAB_TYPE_BPE);
         switch (vocab.get_pre_type()) {
             case LLAMA_VOCAB_PRE_TYPE_LLAMA3:
@@ -428,6 +652,17 @@ struct llm_tokenizer_bpe : llm_tokenizer {
     }
 
     std::vector<std::string> regex_exprs;
+
+    const llm_token_pairs & merges;
+    llm_bpe_word_cache   & word_cache;
+};
+
+struct llm_symbol_bpe {
+    llm_symbol::index prev;
+    llm_symbol::index next;
+    llama_token id; // LLAMA_TOKEN_NULL if the text is not a token
+    const char * text;
+    size_t n;
 };
 
 struct llm_tokenizer_bpe_session {
@@ -470,30 +705,65 @@ struct llm_tokenizer_bpe_session {
         }
     }
 
-    void tokenize(const std::string & text, std::vector<llama_token> & output) {
-        int final_prev_index = -1;
-        const auto word_collection = unicode_regex_split(text, tokenizer.regex_exprs);
+    void tokenize(const std::string & text, std::vector<llama_token> & output, int32_t n_threads = 1) {
+        const auto word_collection = unicode_regex_split(text, tokenizer.regex_exprs, n_threads);
 
-        symbols_final.clear();
+        // the words are merged independently, long texts are split in ranges of words over the threads
+        const size_t n_workers = std::min<size_t>(std::max(n_threads, 1), word_collection.size() / LLAMA_BPE_MIN_WORDS_PER_THREAD);
+        if (n_workers <= 1) {
+            tokenize_words(word_collection, 0, word_collection.size(), output);
+            return;
+        }
+
+        std::vector<std::vector<llama_token>> outputs(n_workers);
+        std::vector<std::thread> workers;
+        for (size_t t = 1; t < n_workers; ++t) {
+            workers.emplace_back([&, t]() {
+                llm_tokenizer_bpe_session session(vocab, tokenizer);
+                session.tokenize_words(word_collection, word_collection.size()*t/n_workers, word_collection.size()*(t + 1)/n_workers, outputs[t]);
+            });
+        }
+        tokenize_words(word_collection, 0, word_collection.size()/n_workers, outputs[0]);
+        for (auto & worker : workers) {
+            worker.join();
+        }
 
-        for (const auto & word : word_collection) {
-            work_queue = llm_bigram_bpe::queue();
+        for (const auto & out : outputs) {
+            output.insert(output.end(), out.begin(), out.end());
+        }
+    }
+
+private:
+    void tokenize_words(const std::vector<std::string> & word_collection, size_t i0, size_t i1, std::vector<llama_token> & output) {
+        for (size_t iw = i0; iw < i1; ++iw) {
+            const auto & word = word_collection[iw];
+
+            if (tokenizer.word_cache.find(word, output)) {
+                continue;
+            }
+            const size_t n_output = output.size();
+
+            work_queue.clear();
             symbols.clear();
 
             int index = 0;
             size_t offset = 0;
 
             //if (vocab.tokenizer_ignore_merges && vocab.token_to_id.find(word) != vocab.token_to_id.end()) {
-            if (vocab.get_ignore_merges() && vocab.text_to_token(word) != LLAMA_TOKEN_NULL) {
-                symbols.emplace_back(llm_symbol{-1, -1, word.c_str(), word.size()});
-                offset = word.size();
+            if (vocab.get_ignore_merges()) {
+                const llama_token id = vocab.text_to_token(word);
+                if (id != LLAMA_TOKEN_NULL) {
+                    symbols.emplace_back(llm_symbol_bpe{-1, -1, id, word.c_str(), word.size()});
+                    offset = word.size();
+                }
             }
 
             while (offset < word.size()) {
-                llm_symbol sym;
+                llm_symbol_bpe sym;
                 size_t char_len = std::min(word.size() - offset, (size_t) unicode_len_utf8(word[offset]));
                 sym.text = word.c_str() + offset;
                 sym.n = char_len;
+                sym.id = vocab.text_to_token(std::string(sym.text, sym.n));
                 offset += sym.n;
                 sym.prev = index - 1;
                 sym.next = offset == word.size() ? -1 : index + 1;
@@ -506,22 +776,21 @@ struct llm_tokenizer_bpe_session {
 
             // build token(s)
             while (!work_queue.empty()) {
-                auto bigram = work_queue.pop_move();
+                std::pop_heap(work_queue.begin(), work_queue.end(), llm_bigram_bpe::comparator());
+                const auto bigram = work_queue.back();
+                work_queue.pop_back();
 
                 auto & left_symbol = symbols[bigram.left];
                 auto & right_symbol = symbols[bigram.right];
 
-                if (left_symbol.n == 0 || right_symbol.n == 0) {
+                // the symbols only grow, so the bigram is outdated if either side has been merged with another symbol
+                if (left_symbol.n == 0 || right_symbol.n == 0 || left_symbol.n + right_symbol.n != bigram.size) {
                     continue;
                 }
-                std::string left_token = std::string(left_symbol.text, left_symbol.n);
-                std::string right_token = std::string(right_symbol.text, right_symbol.n);
-                if (left_token + right_token != bigram.text) {
-                    continue;  // Skip this bigram if it's outdated
-                }
 
                 // merge the right sym into the left one
                 left_symbol.n += right_symbol.n;
+                left_symbol.id = bigram.merged;
                 right_symbol.n = 0;
 
                 // remove the right sym from the chain
@@ -534,58 +803,54 @@ struct llm_tokenizer_bpe_session {
                 add_new_bigram(bigram.left, left_symbol.next);  // right side of current symbol
             }
 
-            // add the finished tokens to the final list keeping correct order for next and prev
-            for (auto & sym : symbols) {
-                if (sym.n > 0) {
-                    sym.prev = final_prev_index;
-                    sym.next = -1;
-                    if (final_prev_index != -1) {
-                        symbols_final[final_prev_index].next = symbols_final.size();
-                    }
-                    symbols_final.emplace_back(sym);
-                    final_prev_index = symbols_final.size() - 1;
-                }
-            }
-        }
-
-        symbols = symbols_final;
-
-        if (!symbols.empty()) {
-            for (int i = 0; i != -1; i = symbols[i].next) {
-                auto & symbol = symbols[i];
-                if (symbol.n == 0) {
-                    continue;
-                }
-
-                const std::string str = std::string(symbol.text, symbol.n);
-                const auto token = vocab.text_to_token(str);
+            // add the finished tokens to the output
+            for (int i = symbols.empty() ? -1 : 0; i != -1; i = symbols[i].next) {
+                const auto & symbol = symbols[i];
 
-                if (token == LLAMA_TOKEN_NULL) {
-                    for (auto j = str.begin(); j != str.end(); ++j) {
-                        std::string byte_str(1, *j);
+                if (symbol.id == LLAMA_TOKEN_NULL) {
+                    for (size_t j = 0; j < symbol.n; ++j) {
+                        std::string byte_str(1, symbol.text[j]);
                         auto token_multibyte = vocab.text_to_token(byte_str);
                         if (token_multibyte != LLAMA_TOKEN_NULL) {
                             output.push_back(token_multibyte);
                         }
                     }
                 } else {
-                    output.push_back(token);
+                    output.push_back(symbol.id);
                 }
             }
+
+            tokenizer.word_cache.insert(word, output.data() + n_output, output.size() - n_output);
         }
     }
 
-private:
     void add_new_bigram(int left, int right) {
         if (left == -1 || right == -1) {
             return;
         }
-        std::string left_token  = std::string(symbols[left].text,  symbols[left].n);
-        std::string right_token = std::string(symbols[right].text, symbols[right].n);
+
+        const auto & left_symbol  = symbols[left];
+        const auto & right_symbol = symbols[right];
 
         int rank_found = -1;
+        llama_token merged = LLAMA_TOKEN_NULL;
+
+        if (left_symbol.id != LLAMA_TOKEN_NULL && right_symbol.id != LLAMA_TOKEN_NULL) {
+            const auto * merge = tokenizer.merges.find(left_symbol.id, right_symbol.id);
+            if (merge != nullptr) {
+                rank_found = merge->rank;
+                merged     = merge->merged;
+            }
+        } else {
+            // at least one side is not a token, fall back to the merges by text
+            std::string left_token  = std::string(left_symbol.text,  left_symbol.n);
+            std::string right_token = std::string(right_symbol.text, right_symbol.n);
 
-        rank_found = vocab.find_bpe_rank(left_token, right_token);
+            rank_found = vocab.find_bpe_rank(left_token, right_token);
+            if (rank_found >= 0) {
+                merged = vocab.text_to_token(left_token + right_token);
+            }
+        }
 
         if (rank_found < 0) {
             return;
@@ -593,21 +858,22 @@ private:
 
         llm_bigram_bpe bigram;
 
-        bigram.left  = left;
-        bigram.right = right;
-        bigram.text  = left_token + right_token;
-        bigram.size  = left_token.size() + right_token.size();
-        bigram.rank  = rank_found;
+        bigram.left   = left;
+        bigram.right  = right;
+        bigram.rank   = rank_found;
+        bigram.merged = merged;
+        bigram.size   = left_symbol.n + right_symbol.n;
 
-        work_queue.push(bigram);
+        work_queue.push_back(bigram);
+        std::push_heap(work_queue.begin(), work_queue.end(), llm_bigram_bpe::comparator());
     }
 
     const llama_vocab & vocab;
     const llm_tokenizer_bpe & tokenizer;
 
-    std::vector<llm_symbol> symbols;
-    std::vector<llm_symbol> symbols_final;
-    llm_bigram_bpe::queue work_queue;
+    // reused between the words of the text
+    std::vector<llm_symbol_bpe> symbols;
+    std::vector<llm_bigram_bpe> work_queue; // binary heap ordered by llm_bigram_bpe::comparator
 };
 
 //
@@ -755,6 +1021,11 @@ struct llm_tokenizer_ugm : llm_tokenizer {
             prefix_replacements_size = precompiled_charsmap.size() - charsmap_offset;
         }
 
+        std::vector<std::pair<std::string, llama_token>> token_keys;
+        std::vector<std::pair<std::string, llama_token>> user_defined_keys;
+
+        token_scores.resize(vocab.n_tokens());
+
         for (uint32_t id = 0; id < vocab.n_tokens(); ++id) {
             const auto & token_data = vocab.get_token_data(id);
 
@@ -766,14 +1037,21 @@ struct llm_tokenizer_ugm : llm_tokenizer {
             if (vocab.is_normal(id) ||
                 vocab.is_user_defined(id) ||
                 vocab.is_unused(id)) {
-                token_matcher.insert(token_data.text.data(), token_data.text.size(), id);
+                token_keys.emplace_back(token_data.text, id);
             }
 
             if (vocab.is_user_defined(id)) {
-                user_defined_token_matcher.insert(token_data.text.data(), token_data.text.size());
+                user_defined_keys.emplace_back(token_data.text, id);
             }
+
+            // we set the user-defined token scores to 0 to make them more likely to be selected
+            // (normal token scores are log probabilities, so they are negative)
+            token_scores[id] = vocab.is_user_defined(id) ? 0.0f : token_data.score;
         }
 
+        token_matcher.build(std::move(token_keys));
+        user_defined_token_matcher.build(std::move(user_defined_keys));
+
         unknown_token_score = min_score - unknown_token_score_penalty;
     }
 
@@ -786,7 +1064,7 @@ struct llm_tokenizer_ugm : llm_tokenizer {
     const uint32_t * xcda_array = NULL;
     size_t xcda_array_size = 0;
 
-    struct naive_trie user_defined_token_matcher;
+    double_array_trie user_defined_token_matcher;
 
     float min_score = FLT_MAX;
     float max_score = -FLT_MAX;
@@ -794,7 +1072,10 @@ struct llm_tokenizer_ugm : llm_tokenizer {
     float unknown_token_score_penalty = 10.0;
     float unknown_token_score;
 
-    struct naive_trie token_matcher;
+    double_array_trie token_matcher;
+
+    // the scores used by the Viterbi search, by token id
+    std::vector<float> token_scores;
 };
 
 struct llm_tokenizer_ugm_session {
@@ -818,7 +1099,6 @@ struct llm_tokenizer_ugm_session {
         size_t output_size = output.size();
 
         // normalize the input first
-        std::string normalized;
         normalize(text, &normalized);
         size_t input_len = normalized.size();
         if (input_len == 0) {
@@ -826,7 +1106,7 @@ struct llm_tokenizer_ugm_session {
         }
 
         // initialize score_sum to -FLT_MAX so it will be always lower than sums of token scores
-        std::vector<struct best_tokenization> tokenization_results(input_len + 1, {vocab.token_unk(), 0, -FLT_MAX});
+        tokenization_results.assign(input_len + 1, {vocab.token_unk(), 0, -FLT_MAX});
         // at the beginning tokenization score is zero
         tokenization_results[0] = { vocab.token_unk(), 0, 0 };
 
@@ -838,23 +1118,20 @@ struct llm_tokenizer_ugm_session {
             // traverse the token matcher trie to find a matching token
             bool single_codepoint_token_found = false;
             const struct best_tokenization & current_best = tokenization_results[input_offset];
-            const struct naive_trie * node = tokenizer.token_matcher.traverse(normalized[prefix_offset++]);
+            int32_t node = tokenizer.token_matcher.traverse(double_array_trie::root, normalized[prefix_offset++]);
 
-            while (prefix_offset <= input_len && node != NULL) {
+            while (prefix_offset <= input_len && node >= 0) {
                 // check if we found valid token in prefix
-                if (node->has_value) {
+                const llama_token token_id = tokenizer.token_matcher.value(node);
+                if (token_id != LLAMA_TOKEN_NULL) {
                     // check if it corresponds to the whole UTF code point
                     if (prefix_offset - input_offset == n_utf8_code_units) {
                         single_codepoint_token_found = true;
                     }
-                    llama_token token_id = node->value;
-                    const auto & token_data = vocab.get_token_data(token_id);
 
-                    // we set the user-defined token scores to 0 to make them more likely to be selected
-                    // (normal token scores are log probabilities, so they are negative)
                     // score type is double here to make tokenization results exactly
                     // the same as in the HF tokenizer using SentencePiece
-                    const double token_score = vocab.is_user_defined(token_id) ? 0.0 : token_data.score;
+                    const double token_score = tokenizer.token_scores[token_id];
                     const double challenger_score = current_best.score_sum + token_score;
                     struct best_tokenization & current_champ = tokenization_results[prefix_offset];
                     if (challenger_score > current_champ.score_sum) {
@@ -862,7 +1139,7 @@ struct llm_tokenizer_ugm_session {
                         current_champ = challenger;
                     }
                 }
-                node = node->traverse(normalized[prefix_offset++]);
+                node = tokenizer.token_matcher.traverse(node, normalized[prefix_offset++]);
             }
 
             // if we didn't find a valid token corresponding to the whole UTF code point
@@ -1007,10 +1284,10 @@ private:
         }
 
         // if input prefix matches some user-defined token return this token as normalization result
-        auto user_defined_token_match =
+        const size_t user_defined_token_match =
            tokenizer.user_defined_token_matcher.get_longest_prefix(&input[input_offset], input.size() - input_offset);
-        if (user_defined_token_match.second > 0) {
-            return { &input[input_offset], user_defined_token_match.second, user_defined_token_match.second };
+        if (user_defined_token_match > 0) {
+            return { &input[input_offset], user_defined_token_match, user_defined_token_match };
         }
 
         size_t longest_prefix_length = 0;
@@ -1074,6 +1351,10 @@ private:
 
     const llama_vocab & vocab;
     const llm_tokenizer_ugm & tokenizer;
+
+    // reused by all the fragments tokenized with the session
+    std::string normalized;
+    std::vector<struct best_tokenization> tokenization_results;
 };
 
 //
@@ -1196,12 +1477,12 @@ typedef enum FRAGMENT_BUFFER_VARIANT_TYPE {
 } FRAGMENT_BUFFER_VARIANT_TYPE;
 
 struct fragment_buffer_variant {
-    fragment_buffer_variant(llama_token _token)
+    fragment_buffer_variant(llama_token _token, const std::string & _raw_text, uint64_t _offset)
     :
         type(FRAGMENT_BUFFER_VARIANT_TYPE_TOKEN),
         token(_token),
-        raw_text(_dummy),
-        offset(0),
+        raw_text(_raw_text),
+        offset(_offset),
         length(0) {}
 
     fragment_buffer_variant(const std::string & _raw_text, int64_t _offset, int64_t _length)
@@ -1218,9 +1499,8 @@ struct fragment_buffer_variant {
 
     const FRAGMENT_BUFFER_VARIANT_TYPE type;
     const llama_token token;
-    const std::string _dummy;
     const std::string & raw_text;
-    const uint64_t offset;
+    const uint64_t offset; // for tokens, the offset of the special token in the source text
     const uint64_t length;
 };
 
@@ -1267,7 +1547,14 @@ struct llama_vocab::impl {
     std::vector<token_data>                      id_to_token;
 
     std::vector<llama_token> cache_special_tokens;
-    std::vector<std::string> cache_token_to_piece; // llama_token_to_piece(special = true);
+
+    // the texts of cache_special_tokens, the values are the indices in cache_special_tokens
+    aho_corasick special_token_matcher;              // all
+    aho_corasick special_token_matcher_user_defined; // user-defined only, when parse_special == false
+    // llama_token_to_piece(special = true) of all tokens, stored back to back and each followed by a 0
+    // the piece of token id starts at cache_token_to_piece_offs[id] and ends 1 byte before cache_token_to_piece_offs[id + 1]
+    std::string           cache_token_to_piece;
+    std::vector<uint32_t> cache_token_to_piece_offs;
     struct pair_hash {
         size_t operator()(const std::pair<std::string, std::string> & p) const {
             return std::hash<std::string>{}(p.first) ^  //create some hash for pair
@@ -1276,6 +1563,12 @@ struct llama_vocab::impl {
     };
     std::unordered_map<std::pair<std::string, std::string>, int, pair_hash> bpe_ranks;
 
+    // bpe_ranks by token ids, for the merges of two tokens
+    llm_token_pairs bpe_merges;
+
+    // the tokens of recently merged words, shared by all BPE sessions
+    llm_bpe_word_cache bpe_word_cache;
+
     // set of all tokens that cause "end of generation"
     std::set<llama_token> special_eog_ids;
 
@@ -1308,7 +1601,7 @@ struct llama_vocab::impl {
 
     void init_tokenizer(enum llama_vocab_type type);
 
-    void tokenizer_st_partition(std::forward_list<fragment_buffer_variant> & buffer, bool parse_special) const;
+    void tokenizer_st_partition(const std::string & raw_text, std::vector<fragment_buffer_variant> & buffer, bool parse_special) const;
 
     std::string token_to_piece_for_cache(
                   llama_token   token,
@@ -1318,7 +1611,9 @@ struct llama_vocab::impl {
     std::vector<llama_token> tokenize(
             const std::string & raw_text,
                          bool   add_special,
-                         bool   parse_special = false) const;
+                         bool   parse_special = false,
+                      int32_t   n_threads = 1,
+            std::vector<std::pair<size_t, size_t>> * resume_points = nullptr) const;
 
     int32_t tokenize(
                    const char * text,
@@ -1337,7 +1632,7 @@ struct llama_vocab::impl {
                          bool   special) const;
 
     // use cached data
-    const std::string & token_to_piece(llama_token token) const;
+    std::string_view token_to_piece(llama_token token) const;
 
     int32_t detokenize(
             const llama_token * tokens,
@@ -1422,8 +1717,11 @@ void llama_vocab::impl::load(llama_model_loader & ml, const LLM_KV & kv) {
             }
 
             const int n_merges = lm_gguf_get_arr_n(ctx, merges_keyidx);
+            bpe_ranks.reserve(n_merges);
             for (int i = 0; i < n_merges; i++) {
-                const std::string word = lm_gguf_get_arr_str(ctx, merges_keyidx, i);
+                size_t len = 0;
+                const char * str = lm_gguf_get_arr_str_view(ctx, merges_keyidx, i, &len);
+                const std::string_view word(str, len);
                 //LM_GGML_ASSERT(unicode_cpts_from_utf8(word).size() > 0);
 
                 std::string first;
@@ -1431,7 +1729,7 @@ void llama_vocab::impl::load(llama_model_loader & ml, const LLM_KV & kv) {
 
                 const size_t pos = word.find(' ', 1);
 
-                if (pos != std::string::npos) {
+                if (pos != std::string_view::npos) {
                     first  = word.substr(0, pos);
                     second = word.substr(pos + 1);
                 }
@@ -1686,19 +1984,24 @@ void llama_vocab::impl::load(llama_model_loader & ml, const LLM_KV & kv) {
 
     uint32_t n_tokens = lm_gguf_get_arr_n(ctx, token_idx);
     id_to_token.resize(n_tokens);
+    token_to_id.reserve(n_tokens);
 
+    // id_to_token and token_to_id are built in one pass from the strings of the GGUF context, without copying them first
     for (uint32_t i = 0; i < n_tokens; i++) {
-        std::string word = lm_gguf_get_arr_str(ctx, token_idx, i);
-        if (word.empty()) {
+        auto & token_data = id_to_token[i];
+
+        size_t len = 0;
+        const char * word = lm_gguf_get_arr_str_view(ctx, token_idx, i, &len);
+        if (len == 0) {
             LLAMA_LOG_WARN("%s: empty token at index %u\n", __func__, i);
-            word = "[EMPTY_" + std::to_string(i) + "]";
+            token_data.text = "[EMPTY_" + std::to_string(i) + "]";
+        } else {
+            token_data.text.assign(word, len);
         }
 
-        token_to_id[word] = i;
-        max_token_len = std::max(max_token_len, (int) word.size());
+        token_to_id[token_data.text] = i;
+        max_token_len = std::max(max_token_len, (int) token_data.text.size());
 
-        auto & token_data = id_to_token[i];
-        token_data.text  = std::move(word);
         token_data.score = scores ? scores[i] : 0.0f;
         token_data.attr  = LLAMA_TOKEN_ATTR_NORMAL;
 
@@ -1717,6 +2020,18 @@ void llama_vocab::impl::load(llama_model_loader & ml, const LLM_KV & kv) {
     }
     LM_GGML_ASSERT(id_to_token.size() == token_to_id.size());
 
+    if (type == LLAMA_VOCAB_TYPE_BPE) {
+        bpe_merges.init(bpe_ranks.size());
+        for (const auto & it : bpe_ranks) {
+            const llama_token left  = vocab.text_to_token(it.first.first);
+            const llama_token right = vocab.text_to_token(it.first.second);
+            if (left == LLAMA_TOKEN_NULL || right == LLAMA_TOKEN_NULL) {
+                continue;
+            }
+            bpe_merges.insert(left, right, it.second, vocab.text_to_token(it.first.first + it.first.second));
+        }
+    }
+
     init_tokenizer(type);
 
     // determine the newline token: LLaMA "<0x0A>" == 10 == '\n', Falcon 193 == '\n'
@@ -2018,24 +2333,42 @@ void llama_vocab::impl::load(llama_model_loader & ml, const LLM_KV & kv) {
             }
         );
 
+        // in reverse order, so that the first of the special tokens with the same text is kept
+        std::vector<std::pair<std::string, llama_token>> keys;
+        std::vector<std::pair<std::string, llama_token>> keys_user_defined;
+        for (int32_t i = (int32_t) cache_special_tokens.size() - 1; i >= 0; --i) {
+            const auto & data = id_to_token[cache_special_tokens[i]];
+            if (data.text.empty()) {
+                continue;
+            }
+            keys.emplace_back(data.text, i);
+            if (!(data.attr & (LLAMA_TOKEN_ATTR_CONTROL | LLAMA_TOKEN_ATTR_UNKNOWN))) {
+                keys_user_defined.emplace_back(data.text, i);
+            }
+        }
+        special_token_matcher.build(std::move(keys));
+        special_token_matcher_user_defined.build(std::move(keys_user_defined));
+
         LLAMA_LOG_INFO("%s: special tokens cache size = %u\n", __func__, (uint32_t) cache_special_tokens.size());
     }
 
     // build token to piece cache
     {
-        size_t size_cache = 0;
-
-        std::vector<std::string> cache(n_tokens);
+        std::string cache;
+        std::vector<uint32_t> offs(n_tokens + 1);
 
         for (uint32_t id = 0; id < n_tokens; ++id) {
-            cache[id] = token_to_piece_for_cache(id, true);
-
-            size_cache += cache[id].size();
+            offs[id] = cache.size();
+            cache += token_to_piece_for_cache(id, true);
+            cache.push_back('\0');
         }
+        offs[n_tokens] = cache.size();
 
+        cache.shrink_to_fit();
         std::swap(cache_token_to_piece, cache);
+        std::swap(cache_token_to_piece_offs, offs);
 
-        LLAMA_LOG_INFO("%s: token to piece cache size = %.4f MB\n", __func__, size_cache / 1024.0 / 1024.0);
+        LLAMA_LOG_INFO("%s: token to piece cache size = %.4f MB\n", __func__, (cache_token_to_piece.size() - n_tokens) / 1024.0 / 1024.0);
     }
 
     // Handle per token attributes
@@ -2176,7 +2509,7 @@ void llama_vocab::impl::init_tokenizer(enum llama_vocab_type type) {
             tokenizer = std::make_unique<llm_tokenizer_spm>(vocab);
             break;
         case LLAMA_VOCAB_TYPE_BPE:
-            tokenizer = std::make_unique<llm_tokenizer_bpe>(vocab);
+            tokenizer = std::make_unique<llm_tokenizer_bpe>(vocab, bpe_merges, bpe_word_cache);
             break;
         case LLAMA_VOCAB_TYPE_WPM:
             tokenizer = std::make_unique<llm_tokenizer_wpm>(vocab);
@@ -2198,120 +2531,94 @@ void llama_vocab::impl::init_tokenizer(enum llama_vocab_type type) {
 
 // #define PRETOKENIZERDEBUG
 
-void llama_vocab::impl::tokenizer_st_partition(std::forward_list<fragment_buffer_variant> & buffer, bool parse_special) const {
-    // for each special token
-    for (const llama_token special_id : cache_special_tokens) {
-        const auto & data = vocab.get_token_data(special_id);
-        const auto & text = data.text;
-
-        if (!parse_special && (data.attr & (LLAMA_TOKEN_ATTR_CONTROL | LLAMA_TOKEN_ATTR_UNKNOWN))) {
-            // Ignore control and unknown tokens when parse_special == false
-            continue;
-            // User-defined tokens are still pre-tokenized before everything else
-            // ref: https://github.com/huggingface/tokenizers/blob/fdd26ba9a3f0c133427aab0423888cbde91362d7/tokenizers/src/tokenizer/mod.rs#L726
-            // This is mostly relevant for neox-style tokenizers (mpt, olmo, stablelm, etc.)
-        }
-
-        // for each text fragment
-        std::forward_list<fragment_buffer_variant>::iterator it = buffer.begin();
-        while (it != buffer.end()) {
-            auto & fragment = (*it);
-
-            // if a fragment is text ( not yet processed )
-            if (fragment.type == FRAGMENT_BUFFER_VARIANT_TYPE_RAW_TEXT) {
-                const auto & raw_text = fragment.raw_text;
+void llama_vocab::impl::tokenizer_st_partition(const std::string & raw_text, std::vector<fragment_buffer_variant> & buffer, bool parse_special) const {
+    if (raw_text.empty()) {
+        return;
+    }
 
-                auto raw_text_base_offset = fragment.offset;
-                auto raw_text_base_length = fragment.length;
+    // Ignore control and unknown tokens when parse_special == false
+    // User-defined tokens are still pre-tokenized before everything else
+    // ref: https://github.com/huggingface/tokenizers/blob/fdd26ba9a3f0c133427aab0423888cbde91362d7/tokenizers/src/tokenizer/mod.rs#L726
+    // This is mostly relevant for neox-style tokenizers (mpt, olmo, stablelm, etc.)
+    const auto & matcher = parse_special ? special_token_matcher : special_token_matcher_user_defined;
+
+    // all the occurrences of the special tokens, as (index in cache_special_tokens, offset)
+    std::vector<std::pair<int32_t, size_t>> matches;
+    matcher.find_all(raw_text.data(), raw_text.size(), [&](size_t end, int32_t i) {
+        matches.emplace_back(i, end - id_to_token[cache_special_tokens[i]].text.size());
+    });
+
+    if (matches.empty()) {
+        buffer.emplace_back(raw_text, 0, raw_text.size());
+        return;
+    }
 
-                // loop over the text
-                while (true) {
-                    // find the first occurrence of a given special token in this fragment
-                    //  passing offset argument only limit the "search area" but match coordinates
-                    //  are still relative to the source full raw_text
-                    //  string_view begins at pos 0 for the same reason
-                    auto match = std::string_view(raw_text.data(), raw_text_base_offset + raw_text_base_length).find(text, raw_text_base_offset);
+    // the special tokens take the text in the order of cache_special_tokens (longest first),
+    // each one from left to right in the text fragments that are left
+    std::sort(matches.begin(), matches.end());
 
-                    // no occurrences found, stop processing this fragment for a given special token
-                    if (match == std::string::npos) break;
+    // the text fragments, as offset -> end
+    std::map<size_t, size_t> fragments = {{0, raw_text.size()}};
+    std::vector<std::pair<size_t, llama_token>> tokens;
 
-#ifdef PRETOKENIZERDEBUG
-                    LLAMA_LOG_WARN("FF: (%ld %ld %ld) '%s'\n", raw_text->length(), raw_text_base_offset, raw_text_base_length, raw_text->substr(raw_text_base_offset, raw_text_base_length).c_str());
-#endif
-                    auto source = std::distance(buffer.begin(), it);
-
-                    // if match is further than base offset
-                    //  then we have some text to the left of it
-                    if (match > raw_text_base_offset) {
-                        // left
-                        const int64_t left_reminder_offset = raw_text_base_offset + 0;
-                        int64_t left_reminder_length = match - raw_text_base_offset;
-
-                        if (data.attr & LLAMA_TOKEN_ATTR_LSTRIP) {
-                            while (left_reminder_length > 0 && isspace(raw_text[left_reminder_offset + left_reminder_length - 1])) {
-                                left_reminder_length--;
-                            }
-                        }
-
-                        if (left_reminder_length > 0) {
-                            buffer.emplace_after(it, raw_text, left_reminder_offset, left_reminder_length);
-                            it++;
-                        }
-
-#ifdef PRETOKENIZERDEBUG
-                        LLAMA_LOG_WARN("FL: (%ld %ld) '%s'\n", left_reminder_offset, left_reminder_length, raw_text->substr(left_reminder_offset, left_reminder_length).c_str());
-#endif
-                    }
+    for (const auto & match : matches) {
+        const llama_token special_id = cache_special_tokens[match.first];
+        const auto & data = id_to_token[special_id];
 
-                    // special token
-                    buffer.emplace_after(it, special_id);
-                    it++;
+        const size_t offset = match.second;
+        const size_t end    = offset + data.text.size();
 
-                    // right
-                    if (match + text.length() < raw_text_base_offset + raw_text_base_length) {
-                        int64_t right_reminder_offset = match + text.length();
-                        int64_t right_reminder_length = raw_text_base_length - ((match - raw_text_base_offset) + text.length());
-
-                        if (data.attr & LLAMA_TOKEN_ATTR_RSTRIP) {
-                            while (right_reminder_length > 0 && isspace(raw_text[right_reminder_offset])) {
-                                right_reminder_offset++;
-                                right_reminder_length--;
-                            }
-                        }
+        // the match must be inside of a text fragment
+        auto it = fragments.upper_bound(offset);
+        if (it == fragments.begin() || end > std::prev(it)->second) {
+            continue;
+        }
+        --it;
+        const size_t fragment_offset = it->first;
+        const size_t fragment_end    = it->second;
+        fragments.erase(it);
 
-                        if (right_reminder_length > 0) {
-                            buffer.emplace_after(it, raw_text, right_reminder_offset, right_reminder_length);
-                            it++;
-                        }
+        // left
+        size_t left_end = offset;
+        if (data.attr & LLAMA_TOKEN_ATTR_LSTRIP) {
+            while (left_end > fragment_offset && isspace(raw_text[left_end - 1])) {
+                left_end--;
+            }
+        }
+        if (left_end > fragment_offset) {
+            fragments.emplace(fragment_offset, left_end);
+        }
 
-#ifdef PRETOKENIZERDEBUG
-                        LLAMA_LOG_WARN("FR: (%ld %ld) '%s'\n", right_reminder_offset, right_reminder_length, raw_text->substr(right_reminder_offset, right_reminder_length).c_str());
-#endif
+        // right
+        size_t right_offset = end;
+        if (data.attr & LLAMA_TOKEN_ATTR_RSTRIP) {
+            while (right_offset < fragment_end && isspace(raw_text[right_offset])) {
+                right_offset++;
+            }
+        }
+        if (right_offset < fragment_end) {
+            fragments.emplace(right_offset, fragment_end);
+        }
 
-                        if (source == 0) {
-                            buffer.erase_after(buffer.before_begin());
-                        } else {
-                            buffer.erase_after(std::next(buffer.begin(), (source - 1)));
-                        }
+        tokens.emplace_back(offset, special_id);
+    }
 
-                        // repeat for the right side
-                        raw_text_base_offset = right_reminder_offset;
-                        raw_text_base_length = right_reminder_length;
+    std::sort(tokens.begin(), tokens.end());
 
+    // merge the text fragments and the special tokens in text order
+    buffer.reserve(buffer.size() + fragments.size() + tokens.size());
+    auto it_fragment = fragments.begin();
+    auto it_token    = tokens.begin();
+    while (it_fragment != fragments.end() || it_token != tokens.end()) {
+        if (it_token == tokens.end() || (it_fragment != fragments.end() && it_fragment->first < it_token->first)) {
 #ifdef PRETOKENIZERDEBUG
-                        LLAMA_LOG_WARN("RR: (%ld %ld) '%s'\n", raw_text_base_offset, raw_text_base_length, raw_text->substr(raw_text_base_offset, raw_text_base_length).c_str());
+            LLAMA_LOG_WARN("FF: (%ld %ld) '%s'\n", it_fragment->first, it_fragment->second - it_fragment->first, raw_text.substr(it_fragment->first, it_fragment->second - it_fragment->first).c_str());
 #endif
-                    } else {
-                        if (source == 0) {
-                            buffer.erase_after(buffer.before_begin());
-                        } else {
-                            buffer.erase_after(std::next(buffer.begin(), (source - 1)));
-                        }
-                        break;
-                    }
-                }
-            }
-            it++;
+            buffer.emplace_back(raw_text, it_fragment->first, it_fragment->second - it_fragment->first);
+            ++it_fragment;
+        } else {
+            buffer.emplace_back(it_token->second, raw_text, it_token->first);
+            ++it_token;
         }
     }
 }
@@ -2364,16 +2671,15 @@ static std::string llama_decode_text(const std::string & text) {
 std::vector<llama_token> llama_vocab::impl::tokenize(
         const std::string & raw_text,
         bool add_special,
-        bool parse_special) const {
+        bool parse_special,
+        int32_t n_threads,
+        std::vector<std::pair<size_t, size_t>> * resume_points) const {
     LM_GGML_ASSERT(tokenizer && "Tokenizer not initialized. Call llama_vocab::init_tokenizer() first.");
 
     std::vector<llama_token> output;
-    std::forward_list<fragment_buffer_variant> fragment_buffer;
+    std::vector<fragment_buffer_variant> fragment_buffer;
 
-    if (!raw_text.empty()) {
-        fragment_buffer.emplace_front(raw_text, 0, raw_text.length());
-        tokenizer_st_partition(fragment_buffer, parse_special);
-    }
+    tokenizer_st_partition(raw_text, fragment_buffer, parse_special);
 
     switch (get_type()) {
         case LLAMA_VOCAB_TYPE_SPM:
@@ -2385,6 +2691,8 @@ std::vector<llama_token> llama_vocab::impl::tokenize(
 
                 bool is_prev_special = true;  // prefix with space if first token
 
+                llm_tokenizer_spm_session session(vocab, *static_cast<const llm_tokenizer_spm *>(tokenizer.get()));
+
                 if (add_special && add_bos) {
                     LM_GGML_ASSERT(special_bos_id != LLAMA_TOKEN_NULL);
                     output.push_back(special_bos_id);
@@ -2406,10 +2714,12 @@ std::vector<llama_token> llama_vocab::impl::tokenize(
                         LLAMA_LOG_WARN("TT: (%ld %ld %ld) '%s'\n", text.length(), fragment.offset, fragment.length, text.c_str());
 #endif
                         llama_escape_whitespace(text);
-                        llm_tokenizer_spm_session session(vocab);
                         session.tokenize(text, output);
                         is_prev_special = false;
                     } else { // if (fragment.type == FRAGMENT_BUFFER_VARIANT_TYPE_TOKEN)
+                        if (resume_points) {
+                            resume_points->emplace_back(fragment.offset, output.size());
+                        }
                         output.push_back(fragment.token);
                         is_prev_special = true;
                     }
@@ -2442,8 +2752,11 @@ std::vector<llama_token> llama_vocab::impl::tokenize(
 #ifdef PRETOKENIZERDEBUG
                         LLAMA_LOG_WARN("TT: (%ld %ld %ld) '%s'\n", text.length(), fragment.offset, fragment.length, text.c_str());
 #endif
-                        session.tokenize(text, output);
+                        session.tokenize(text, output, n_threads);
                     } else { // if (fragment.type == FRAGMENT_BUFFER_VARIANT_TYPE_TOKEN)
+                        if (resume_points) {
+                            resume_points->emplace_back(fragment.offset, output.size());
+                        }
                         session.append(fragment.token, output);
                     }
                 }
@@ -2471,6 +2784,9 @@ std::vector<llama_token> llama_vocab::impl::tokenize(
 #endif
                         session.tokenize(text, output);
                     } else { // if (fragment.type == FRAGMENT_BUFFER_VARIANT_TYPE_TOKEN)
+                        if (resume_points) {
+                            resume_points->emplace_back(fragment.offset, output.size());
+                        }
                         output.push_back(fragment.token);
                     }
                 }
@@ -2496,6 +2812,9 @@ std::vector<llama_token> llama_vocab::impl::tokenize(
 #endif
                         session.tokenize(text, output);
                     } else { // if (fragment.type == FRAGMENT_BUFFER_VARIANT_TYPE_TOKEN)
+                        if (resume_points) {
+                            resume_points->emplace_back(fragment.offset, output.size());
+                        }
                         output.push_back(fragment.token);
                     }
                 }
@@ -2525,6 +2844,9 @@ std::vector<llama_token> llama_vocab::impl::tokenize(
 
                         session.tokenize(text, output);
                     } else { // if (fragment.type == FRAGMENT_BUFFER_VARIANT_TYPE_TOKEN)
+                        if (resume_points) {
+                            resume_points->emplace_back(fragment.offset, output.size());
+                        }
                         output.push_back(fragment.token);
                     }
                 }
@@ -2533,6 +2855,11 @@ std::vector<llama_token> llama_vocab::impl::tokenize(
             LM_GGML_ABORT("fatal error");
     }
 
+    if (resume_points && add_special && (add_eos || get_type() == LLAMA_VOCAB_TYPE_WPM)) {
+        // a resumed tokenization would miss the special tokens added at the end
+        resume_points->clear();
+    }
+
     return output;
 }
 
@@ -2559,13 +2886,9 @@ int32_t llama_vocab::impl::token_to_piece(llama_token token, char * buf, int32_t
     };
 
     // if we have a cache - use it
-    {
-        const auto & cache = cache_token_to_piece;
-
-        if (!cache.empty()) {
-            const auto & result = cache.at(token);
-            return _try_copy(result.data(), result.size());
-        }
+    if (!cache_token_to_piece_offs.empty()) {
+        const std::string_view result = token_to_piece(token);
+        return _try_copy(result.data(), result.size());
     }
 
     if (0 <= token && token < (int32_t) id_to_token.size()) {
@@ -2621,8 +2944,12 @@ int32_t llama_vocab::impl::token_to_piece(llama_token token, char * buf, int32_t
     return 0;
 }
 
-const std::string & llama_vocab::impl::token_to_piece(llama_token token) const {
-    return cache_token_to_piece.at(token);
+std::string_view llama_vocab::impl::token_to_piece(llama_token token) const {
+    const auto & offs = cache_token_to_piece_offs;
+    if (token < 0 || (size_t) token + 1 >= offs.size()) {
+        throw std::out_of_range("token id out of range: " + std::to_string(token));
+    }
+    return std::string_view(cache_token_to_piece.data() + offs[token], offs[token + 1] - offs[token] - 1);
 }
 
 int32_t llama_vocab::impl::detokenize(
@@ -2658,17 +2985,42 @@ int32_t llama_vocab::impl::detokenize(
         }
     }
 
-    for (int32_t i = 0; i < n_tokens; ++i) {
+    if (!cache_token_to_piece_offs.empty()) {
+        // copy the cached pieces directly, once a piece does not fit only the total length is computed
+        static const int attr_special = LLAMA_TOKEN_ATTR_UNKNOWN | LLAMA_TOKEN_ATTR_CONTROL;
         LM_GGML_ASSERT(avail >= 0);
-        int32_t n_chars = token_to_piece(tokens[i], text, avail, remove_space, unparse_special);
-        remove_space = false;
-        if (n_chars < 0) {
-            avail = 0;
-            total -= n_chars;
-        } else if (n_chars > 0) {
-            avail -= n_chars;
-            text  += n_chars;
-            total += n_chars;
+        for (int32_t i = 0; i < n_tokens; ++i) {
+            if (!unparse_special && (token_get_attr(tokens[i]) & attr_special)) {
+                remove_space = false;
+                continue;
+            }
+            std::string_view piece = token_to_piece(tokens[i]);
+            if (remove_space && !piece.empty() && piece[0] == ' ') {
+                piece.remove_prefix(1);
+            }
+            remove_space = false;
+            if ((size_t) avail >= piece.size()) {
+                memcpy(text, piece.data(), piece.size());
+                avail -= piece.size();
+                text  += piece.size();
+            } else {
+                avail = 0;
+            }
+            total += piece.size();
+        }
+    } else {
+        for (int32_t i = 0; i < n_tokens; ++i) {
+            LM_GGML_ASSERT(avail >= 0);
+            int32_t n_chars = token_to_piece(tokens[i], text, avail, remove_space, unparse_special);
+            remove_space = false;
+            if (n_chars < 0) {
+                avail = 0;
+                total -= n_chars;
+            } else if (n_chars > 0) {
+                avail -= n_chars;
+                text  += n_chars;
+                total += n_chars;
+            }
         }
     }
 
@@ -3006,8 +3358,9 @@ int32_t llama_vocab::tokenize(
                  llama_token * tokens,
                      int32_t   n_tokens_max,
                         bool   add_special,
-                        bool   parse_special) const {
-    auto res = tokenize(std::string(text, text_len), add_special, parse_special);
+                        bool   parse_special,
+                     int32_t   n_threads) const {
+    auto res = tokenize(std::string(text, text_len), add_special, parse_special, n_threads);
     if (n_tokens_max < (int) res.size()) {
         // LLAMA_LOG_ERROR("%s: too many tokens\n", __func__);
         return -((int) res.size());
@@ -3023,11 +3376,22 @@ int32_t llama_vocab::tokenize(
 std::vector<llama_token> llama_vocab::tokenize(
         const std::string & raw_text,
         bool add_special,
-        bool parse_special) const {
-    return pimpl->tokenize(raw_text, add_special, parse_special);
+        bool parse_special,
+        int32_t n_threads) const {
+    return pimpl->tokenize(raw_text, add_special, parse_special, n_threads);
+}
+
+std::vector<llama_token> llama_vocab::tokenize(
+        const std::string & raw_text,
+        bool add_special,
+        bool parse_special,
+        int32_t n_threads,
+        std::vector<std::pair<size_t, size_t>> & resume_points) const {
+    resume_points.clear();
+    return pimpl->tokenize(raw_text, add_special, parse_special, n_threads, &resume_points);
 }
 
-const std::string & llama_vocab::token_to_piece(llama_token token) const {
+std::string_view llama_vocab::token_to_piece(llama_token token) const {
     return pimpl->token_to_piece(token);
 }
 
@@ -3279,6 +3643,18 @@ int32_t llama_tokenize(
     return vocab->tokenize(text, text_len, tokens, n_tokens_max, add_special, parse_special);
 }
 
+int32_t llama_tokenize_parallel(
+    const struct llama_vocab * vocab,
+                  const char * text,
+                     int32_t   text_len,
+                 llama_token * tokens,
+                     int32_t   n_tokens_max,
+                        bool   add_special,
+                        bool   parse_special,
+                     int32_t   n_threads) {
+    return vocab->tokenize(text, text_len, tokens, n_tokens_max, add_special, parse_special, n_threads);
+}
+
 int32_t llama_token_to_piece(
     const struct llama_vocab * vocab,
                  llama_token   token,
@@ -3,6 +3,7 @@
 #include "llama.h"
 
 #include <string>
+#include <string_view>
 #include <vector>
 #include <memory>
 
@@ -87,12 +88,25 @@ struct llama_vocab {
                   llama_token * tokens,
                       int32_t   n_tokens_max,
                          bool   add_special,
-                         bool   parse_special) const;
+                         bool   parse_special,
+                      int32_t   n_threads = 1) const;
 
+    // long texts are tokenized on up to n_threads threads, with the same result
     std::vector<llama_token> tokenize(
             const std::string & raw_text,
                          bool   add_special,
-                         bool   parse_special = false) const;
+                         bool   parse_special = false,
+                      int32_t   n_threads = 1) const;
+
+    // same as above, and returns the points at which the tokenization can be resumed, as (offset, n_tokens) pairs:
+    // the special token parsed at offset in raw_text is the token n_tokens of the result, and the first n_tokens tokens
+    // followed by the tokens of raw_text.substr(offset) without add_special are the tokens of raw_text
+    std::vector<llama_token> tokenize(
+            const std::string & raw_text,
+                         bool   add_special,
+                         bool   parse_special,
+                      int32_t   n_threads,
+            std::vector<std::pair<size_t, size_t>> & resume_points) const;
 
     // does not write null-terminator to buf
     int32_t token_to_piece(
@@ -103,7 +117,8 @@ struct llama_vocab {
                          bool   special) const;
 
     // use cached data
-    const std::string & token_to_piece(llama_token token) const;
+    // the cached piece of the token (special = true), valid for the lifetime of the vocab and followed by a 0
+    std::string_view token_to_piece(llama_token token) const;
 
     int32_t detokenize(
             const llama_token * tokens,
@@ -108,15 +108,22 @@ static int llama_model_load(const std::string & fname, std::vector<std::string>
         } catch(const std::exception & e) {
             throw std::runtime_error("error loading model hyperparameters: " + std::string(e.what()));
         }
-        try {
-            model.load_vocab(ml);
-        } catch(const std::exception & e) {
-            throw std::runtime_error("error loading model vocabulary: " + std::string(e.what()));
+        if (!params.meta_only) {
+            try {
+                model.load_vocab(ml);
+            } catch(const std::exception & e) {
+                throw std::runtime_error("error loading model vocabulary: " + std::string(e.what()));
+            }
         }
 
         model.load_stats(ml);
         model.print_info();
 
+        if (params.meta_only) {
+            LLAMA_LOG_INFO("%s: meta only - skipping vocab and tensors\n", __func__);
+            return 0;
+        }
+
         if (params.vocab_only) {
             LLAMA_LOG_INFO("%s: vocab only - skipping tensors\n", __func__);
             return 0;
@@ -220,6 +220,13 @@ extern "C" {
         LLAMA_SPLIT_MODE_ROW   = 2, // split layers and KV across GPUs, use tensor parallelism if supported
     };
 
+    // huge pages for the anonymous CPU buffers
+    enum llama_hugepages_type {
+        LLAMA_HUGEPAGES_TYPE_NONE    = 0, // regular pages
+        LLAMA_HUGEPAGES_TYPE_THP     = 1, // madvise(MADV_HUGEPAGE), transparent huge pages where the kernel allows them
+        LLAMA_HUGEPAGES_TYPE_HUGETLB = 2, // MAP_HUGETLB from the reserved pool, falls back to THP if it cannot provide the memory
+    };
+
     // TODO: simplify (https://github.com/ggml-org/llama.cpp/pull/9294#pullrequestreview-2286561979)
     typedef struct llama_token_data {
         llama_token id; // token id
@@ -296,6 +303,7 @@ extern "C" {
 
         int32_t n_gpu_layers; // number of layers to store in VRAM
         enum llama_split_mode split_mode; // how to split the model across multiple GPUs
+        enum llama_hugepages_type hugepages; // huge pages for the weight and repack buffers that are not mapped from the file
 
         // the GPU that is used for the entire model when split_mode is LLAMA_SPLIT_MODE_NONE
         int32_t main_gpu;
@@ -314,11 +322,17 @@ extern "C" {
         // override key-value pairs of the model meta data
         const struct llama_model_kv_override * kv_overrides;
 
+        // directory of the cache files of the weights repacked for the CPU, NULL to disable
+        // the cache files are mapped instead of repacking the weights again on the next loads
+        const char * repack_cache_dir;
+
         // Keep the booleans together to avoid misalignment during copy-by-value.
         bool vocab_only;    // only load the vocabulary, no weights
+        bool meta_only;     // only load the metadata and hyperparameters, no vocabulary and no weights - the model can not be used for a context
         bool use_mmap;      // use mmap if possible
         bool use_mlock;     // force system to keep model in RAM
         bool check_tensors; // validate model tensor data
+        bool use_mmap_residency; // page the mapped layer weights in graph order, for models larger than RAM
     };
 
     // NOTE: changing the default values of parameters marked as [EXPERIMENTAL] may cause crashes or incorrect results in certain configurations
@@ -334,6 +348,7 @@ extern "C" {
         enum llama_rope_scaling_type rope_scaling_type; // RoPE scaling type, from `enum llama_rope_scaling_type`
         enum llama_pooling_type      pooling_type;      // whether to pool (sum) embedding results by sequence id
         enum llama_attention_type    attention_type;    // attention type to use for embeddings
+        enum llama_hugepages_type    hugepages;         // huge pages for the KV cache and the compute buffers (THP only)
 
         // ref: https://github.com/ggml-org/llama.cpp/pull/2054
         float    rope_freq_base;   // RoPE base frequency, 0 = from model
@@ -358,6 +373,7 @@ extern "C" {
         bool offload_kqv; // whether to offload the KQV ops (including the KV cache) to GPU
         bool flash_attn;  // whether to use flash attention [EXPERIMENTAL]
         bool no_perf;     // whether to measure performance timings
+        bool prefault;    // fault in the pages of the compute buffers at context creation
 
         // Abort callback
         // if it returns true, execution of llama_decode() will be aborted
@@ -547,6 +563,35 @@ extern "C" {
     // Returns true if the model is recurrent (like Mamba, RWKV, etc.)
     LLAMA_API bool llama_model_is_recurrent(const struct llama_model * model);
 
+    // Memory in bytes that a context created with the given parameters would use, estimated from the hyperparameters only
+    // Works with models loaded with meta_only, n_ctx = 0 is taken from the model like in llama_init_from_model
+    struct llama_memory_estimate {
+        uint64_t weights; // same as llama_model_size
+        uint64_t kv;      // KV cache, or the recurrent state
+        uint64_t compute; // compute buffers of the largest ubatch
+        uint64_t output;  // logits and embeddings buffer
+    };
+
+    LLAMA_API struct llama_memory_estimate llama_model_estimate_memory(
+            const struct llama_model * model,
+            struct llama_context_params params);
+
+    // Exact memory in bytes that llama_init_from_model would allocate with the given parameters
+    // The context is built as a dry run: the KV cache is laid out and the worst-case graphs are reserved, but no buffer is allocated
+    // Returns false if the context can not be created, or if the model was loaded with meta_only
+    LLAMA_API bool llama_model_measure_memory(
+            const struct llama_model * model,
+            struct llama_context_params params,
+            struct llama_memory_estimate * res);
+
+    // Largest n_ctx up to params.n_ctx (the training context if 0) for which the weights and the context fit in budget bytes
+    // Uses llama_model_measure_memory, or llama_model_estimate_memory for models loaded with meta_only
+    // Returns 0 if even the smallest context does not fit
+    LLAMA_API uint32_t llama_model_fit_n_ctx(
+            const struct llama_model * model,
+            struct llama_context_params params,
+            uint64_t budget);
+
     // Returns 0 on success
     LLAMA_API uint32_t llama_model_quantize(
             const char * fname_inp,
@@ -963,6 +1008,15 @@ extern "C" {
     // If true, all model tensors are activated during llama_decode() to load and cache their weights.
     LLAMA_API void llama_set_warmup(struct llama_context * ctx, bool warmup);
 
+    // Warm up the context in short steps, e.g. on a background thread after loading and before the first completion
+    // The first steps read in the weights of one layer each, in graph order, then the output weights
+    // The last step decodes a single token (if the memory is empty) to build and allocate the graph of a one token decode
+    // Returns true while steps remain
+    // abort_callback (may be NULL) interrupts a step, as does the abort callback of the context, which is left in place;
+    // an interrupted step is done again by the next call and the steps already done are kept, so the caller can stop
+    // between steps to run a completion and resume later (not thread-safe with other calls on ctx)
+    LLAMA_API bool llama_warmup_step(struct llama_context * ctx, lm_ggml_abort_callback abort_callback, void * abort_callback_data);
+
     // Set abort callback
     LLAMA_API void llama_set_abort_callback(struct llama_context * ctx, lm_ggml_abort_callback abort_callback, void * abort_callback_data);
 
@@ -1086,6 +1140,18 @@ extern "C" {
                             bool   add_special,
                             bool   parse_special);
 
+    // Same as llama_tokenize, but long texts are split and merged on up to n_threads threads.
+    // The result is identical to llama_tokenize.
+    LLAMA_API int32_t llama_tokenize_parallel(
+        const struct llama_vocab * vocab,
+                      const char * text,
+                         int32_t   text_len,
+                     llama_token * tokens,
+                         int32_t   n_tokens_max,
+                            bool   add_special,
+                            bool   parse_special,
+                         int32_t   n_threads);
+
     // Token Id -> Piece.
     // Uses the vocabulary in the provided context.
     // Does not write null terminator to the buffer.
@@ -1,4 +1,7 @@
 #include "rn-llama.h"
+#include "llama-vocab.h"
+#include "gguf-hash.h"
+#include <algorithm>
 
 namespace rnllama {
 
@@ -141,15 +144,56 @@ std::string tokens_to_output_formatted_string(const llama_context *ctx, const ll
 
 std::string tokens_to_str(llama_context *ctx, const std::vector<llama_token>::const_iterator begin, const std::vector<llama_token>::const_iterator end)
 {
+    const llama_vocab * vocab = llama_model_get_vocab(llama_get_model(ctx));
     std::string ret;
     for (auto it = begin; it != end; ++it)
     {
-        ret += common_token_to_piece(ctx, *it);
+        ret += vocab->token_to_piece(*it);
     }
     return ret;
 }
 
+void completion_token_probs::clear()
+{
+    tok.clear();
+    text_end.clear();
+    probs_begin.assign(1, 0);
+    probs_tok.clear();
+    probs_prob.clear();
+}
+
+void completion_token_probs::push_back(const completion_token_output &out, size_t end)
+{
+    tok.push_back(out.tok);
+    text_end.push_back(end);
+    for (const auto &p : out.probs)
+    {
+        probs_tok.push_back(p.tok);
+        probs_prob.push_back(p.prob);
+    }
+    probs_begin.push_back(probs_tok.size());
+}
+
+size_t completion_token_probs::n_tokens_within(size_t n_text) const
+{
+    // text_end is non-decreasing, the generated text only grows while tokens are generated
+    return std::upper_bound(text_end.begin(), text_end.end(), n_text) - text_end.begin();
+}
+
+const char * completion_token_probs::piece(const llama_context *ctx, llama_token token)
+{
+    auto it = piece_offset.find(token);
+    if (it == piece_offset.end())
+    {
+        it = piece_offset.emplace(token, pieces.size()).first;
+        pieces += tokens_to_output_formatted_string(ctx, token);
+        pieces.push_back('\0');
+    }
+    return pieces.c_str() + it->second;
+}
+
 llama_rn_context::~llama_rn_context() {
+    stopWarmup();
     if (ctx_sampling != nullptr) {
         common_sampler_free(ctx_sampling);
     }
@@ -186,18 +230,38 @@ bool llama_rn_context::initSampling() {
 
 bool llama_rn_context::loadModel(common_params &params_)
 {
+    stopWarmup();
+
+    // the cached prompt tokens and token pieces belong to the vocab of the previous model
+    prompt_text.clear();
+    prompt_text_tokens.clear();
+    prompt_resume_points.clear();
+    generated_token_probs.clear();
+    generated_token_probs.pieces.clear();
+    generated_token_probs.piece_offset.clear();
+
     params = params_;
+    // the warmup is not part of the load, so that it does not delay the app and the first completion can preempt it
+    params.warmup = false;
     llama_init = common_init_from_params(params);
+    params.warmup = params_.warmup;
     model = llama_init.model.get();
     ctx = llama_init.context.get();
     if (model == nullptr)
     {
         LOG_ERROR("unable to load model: %s", params_.model.path.c_str());
+        is_warmup_done = false;
+        warmup_stop = false;
         return false;
     }
     templates = common_chat_templates_init(model, params.chat_template);
     n_ctx = llama_n_ctx(ctx);
 
+    is_warmup_done = !params.warmup;
+    if (params.warmup) {
+        startWarmup();
+    }
+
     // Initialize context shift flag
     LOG_INFO("ctx_shift: %s", params.ctx_shift ? "enabled" : "disabled");
 
@@ -207,6 +271,74 @@ bool llama_rn_context::loadModel(common_params &params_)
     return true;
 }
 
+void llama_rn_context::startWarmup() {
+    std::lock_guard<std::mutex> lock(warmup_mutex);
+    if (ctx == nullptr || is_warmup_done || warmup_thread.joinable()) {
+        return;
+    }
+
+    warmup_stop = false;
+    warmup_thread = std::thread([this]() {
+        const int64_t t_start_us = lm_ggml_time_us();
+
+        // a step in progress is interrupted as well, it is done again when the warmup is resumed
+        const auto stop_cb = [](void * data) {
+            return ((llama_rn_context *) data)->warmup_stop.load();
+        };
+
+        bool more = true;
+        while (more && !warmup_stop) {
+            more = llama_warmup_step(ctx, stop_cb, this);
+        }
+
+        if (!more) {
+            is_warmup_done = true;
+            LOG_INFO("warmup done in %.1f ms", (lm_ggml_time_us() - t_start_us)/1000.0);
+        } else {
+            LOG_INFO("warmup stopped after %.1f ms", (lm_ggml_time_us() - t_start_us)/1000.0);
+        }
+    });
+}
+
+void llama_rn_context::stopWarmup() {
+    std::lock_guard<std::mutex> lock(warmup_mutex);
+    if (!warmup_thread.joinable()) {
+        return;
+    }
+    warmup_stop = true;
+    warmup_thread.join();
+}
+
+bool llama_rn_context::loadSession(const char * path, size_t * n_token_count)
+{
+    stopWarmup();
+
+    embd.resize(params.n_ctx);
+    size_t n_token_count_out = 0;
+    if (!llama_state_load_file(ctx, path, embd.data(), embd.capacity(), &n_token_count_out)) {
+        LOG_ERROR("failed to load session from '%s'", path);
+        embd.clear();
+        return false;
+    }
+    embd.resize(n_token_count_out);
+    if (n_token_count) {
+        *n_token_count = n_token_count_out;
+    }
+    return true;
+}
+
+bool llama_rn_context::saveSession(const char * path, int size)
+{
+    stopWarmup();
+
+    const size_t n_save = size > 0 && (size_t) size <= embd.size() ? (size_t) size : embd.size();
+    if (!llama_state_save_file(ctx, path, embd.data(), n_save)) {
+        LOG_ERROR("failed to save session to '%s'", path);
+        return false;
+    }
+    return true;
+}
+
 bool llama_rn_context::validateModelChatTemplate(bool use_jinja, const char *name) const {
     const char * tmpl = llama_model_chat_template(model, name);
     if (tmpl == nullptr) {
@@ -287,8 +419,55 @@ void llama_rn_context::truncatePrompt(std::vector<llama_token> &prompt_tokens) {
     prompt_tokens = new_tokens;
 }
 
+std::vector<llama_token> llama_rn_context::tokenizePrompt() {
+    const llama_vocab * vocab = llama_model_get_vocab(model);
+    const std::string & text = params.prompt;
+
+    size_t n_common = 0;
+    const size_t n_max = std::min(text.size(), prompt_text.size());
+    while (n_common < n_max && text[n_common] == prompt_text[n_common]) {
+        n_common++;
+    }
+
+    // chat prompts grow by appending turns: resume at the last special token of the previous prompt that is
+    // still in the shared text, far enough from its end that a longer special token cannot start before it
+    bool resume_found = false;
+    std::pair<size_t, size_t> resume;
+    for (const auto & point : prompt_resume_points) {
+        if (point.first + vocab->max_token_len() > n_common) {
+            break;
+        }
+        resume = point;
+        resume_found = true;
+    }
+
+    if (!resume_found) {
+        prompt_text_tokens = vocab->tokenize(text, true, true, params.cpuparams.n_threads, prompt_resume_points);
+    } else {
+        std::vector<std::pair<size_t, size_t>> resume_points;
+        const auto tokens = vocab->tokenize(text.substr(resume.first), false, true, params.cpuparams.n_threads, resume_points);
+
+        prompt_text_tokens.resize(resume.second);
+        prompt_text_tokens.insert(prompt_text_tokens.end(), tokens.begin(), tokens.end());
+
+        while (!prompt_resume_points.empty() && prompt_resume_points.back().first >= resume.first) {
+            prompt_resume_points.pop_back();
+        }
+        for (const auto & point : resume_points) {
+            prompt_resume_points.emplace_back(resume.first + point.first, resume.second + point.second);
+        }
+
+        LOG_VERBOSE("prompt tokenization resumed at offset %zu, token %zu", resume.first, resume.second);
+    }
+    prompt_text = text;
+
+    return prompt_text_tokens;
+}
+
 void llama_rn_context::loadPrompt() {
-    std::vector<llama_token> prompt_tokens = ::common_tokenize(ctx, params.prompt, true, true);
+    stopWarmup();
+
+    std::vector<llama_token> prompt_tokens = tokenizePrompt();
     num_prompt_tokens = prompt_tokens.size();
 
     // LOG tokens
@@ -510,12 +689,12 @@ completion_token_output llama_rn_context::doCompletion()
 {
     const completion_token_output token_with_probs = nextToken();
 
-    const std::string token_text = token_with_probs.tok == -1 ? "" : common_token_to_piece(ctx, token_with_probs.tok);
+    const std::string_view token_text = token_with_probs.tok == -1 ? std::string_view() : llama_model_get_vocab(model)->token_to_piece(token_with_probs.tok);
     generated_text += token_text;
 
     if (params.sampling.n_probs > 0)
     {
-        generated_token_probs.push_back(token_with_probs);
+        generated_token_probs.push_back(token_with_probs, generated_text.size());
     }
 
     // check if there is incomplete UTF-8 character at the end
@@ -551,7 +730,7 @@ completion_token_output llama_rn_context::doCompletion()
     }
 
     LOG_VERBOSE("next token, token: %s, token_text: %s, has_next_token: %d, n_remain: %d, num_tokens_predicted: %d, stopped_eos: %d, stopped_word: %d, stopped_limit: %d, stopping_word: %s",
-        common_token_to_piece(ctx, token_with_probs.tok),
+        std::string(token_text).c_str(),
         tokens_to_output_formatted_string(ctx, token_with_probs.tok).c_str(),
         has_next_token,
         n_remain,
@@ -566,6 +745,8 @@ completion_token_output llama_rn_context::doCompletion()
 
 std::vector<float> llama_rn_context::getEmbedding(common_params &embd_params)
 {
+    stopWarmup();
+
     static const int n_embd = llama_model_n_embd(llama_get_model(ctx));
     if (!embd_params.embedding)
     {
@@ -592,6 +773,8 @@ std::vector<float> llama_rn_context::getEmbedding(common_params &embd_params)
 
 std::string llama_rn_context::bench(int pp, int tg, int pl, int nr)
 {
+    stopWarmup();
+
     if (is_predicting) {
         LOG_ERROR("cannot benchmark while predicting", "");
         return std::string("[]");
@@ -698,6 +881,8 @@ std::string llama_rn_context::bench(int pp, int tg, int pl, int nr)
 }
 
 int llama_rn_context::applyLoraAdapters(std::vector<common_adapter_lora_info> lora) {
+    stopWarmup();
+
     for (auto &la : lora) {
         la.ptr = llama_adapter_lora_init(model, la.path.c_str());
         if (la.ptr == nullptr) {
@@ -711,6 +896,7 @@ int llama_rn_context::applyLoraAdapters(std::vector<common_adapter_lora_info> lo
 }
 
 void llama_rn_context::removeLoraAdapters() {
+    stopWarmup();
     this->lora.clear();
     common_set_adapter_lora(ctx, this->lora); // apply empty list
 }
@@ -719,4 +905,312 @@ std::vector<common_adapter_lora_info> llama_rn_context::getLoadedLoraAdapters()
     return this->lora;
 }
 
+const std::vector<std::pair<std::string, std::string>> bench_tokenizer_samples = {
+    { "text",
+        "The quick brown fox jumps over the lazy dog. It's 3:45pm on 2024-05-17, "
+        "and we've got 1,234 items left (about 12.5%) -- don't forget them!\n"
+        "Mr. O'Neil said: \"We'll see.\" Then he left, closing the door behind him.\n\n" },
+    { "code",
+        "template <typename T>\nstatic void swap(std::vector<T> & v, size_t i, size_t j) {\n"
+        "    if (i != j) {\n        std::swap(v[i], v[j]);  // no-op otherwise\n    }\n}\n\n"
+        "def fib(n: int) -> int:\n    return n if n < 2 else fib(n - 1) + fib(n - 2)\n\n"
+        "\tconst x = arr.map((a) => a * 2).filter(Boolean); /* 0x7f, 1e-9 */\n" },
+    { "cjk",
+        "\xe4\xbb\x8a\xe5\xa4\xa9\xe5\xa4\xa9\xe6\xb0\x94\xe5\xbe\x88\xe5\xa5\xbd\xef\xbc\x8c"
+        "\xe6\x88\x91\xe4\xbb\xac\xe5\x8e\xbb\xe5\x85\xac\xe5\x9b\xad\xe6\x95\xa3\xe6\xad\xa5\xe5\x90\xa7\xe3\x80\x82"
+        "\xe6\x9d\xb1\xe4\xba\xac\xe3\x81\xaf\xe6\x97\xa5\xe6\x9c\xac\xe3\x81\xae\xe9\xa6\x96\xe9\x83\xbd\xe3\x81\xa7\xe3\x81\x99\xe3\x80\x82"
+        "\xed\x95\x9c\xea\xb5\xad\xec\x96\xb4\xeb\xa5\xbc \xea\xb3\xb5\xeb\xb6\x80\xed\x95\xa9\xeb\x8b\x88\xeb\x8b\xa4.\n" },
+    { "emoji",
+        "\xf0\x9f\x98\x80 \xf0\x9f\x91\x8d\xf0\x9f\x8f\xbd \xf0\x9f\x91\xa8\xe2\x80\x8d\xf0\x9f\x91\xa9\xe2\x80\x8d\xf0\x9f\x91\xa7 "
+        "\xf0\x9f\x87\xaf\xf0\x9f\x87\xb5 \xe2\x9d\xa4\xef\xb8\x8f ok\xf0\x9f\x8e\x89\xf0\x9f\x8e\x89\xf0\x9f\x8e\x89 "
+        "done \xe2\x9c\x85\n" },
+};
+
+std::string bench_tokenizer(const char * path_model, int nr)
+{
+    if (nr <= 0) {
+        nr = 1;
+    }
+
+    llama_model_params model_params = llama_model_default_params();
+    model_params.vocab_only = true;
+
+    llama_model * model = llama_model_load_from_file(path_model, model_params);
+    if (model == nullptr) {
+        LOG_ERROR("failed to load vocab from '%s'", path_model);
+        return std::string("[]");
+    }
+    const llama_vocab * vocab = llama_model_get_vocab(model);
+
+    char model_desc[128];
+    llama_model_desc(model, model_desc, sizeof(model_desc));
+
+    std::string result = std::string("[\"") + model_desc + std::string("\",") +
+        std::to_string(llama_vocab_type(vocab)) + std::string(",") +
+        std::to_string(llama_vocab_n_tokens(vocab));
+
+    std::vector<llama_token> tokens;
+    std::string detokenized;
+
+    for (const auto & sample : bench_tokenizer_samples) {
+        std::string text;
+        while (text.size() < 64*1024) {
+            text += sample.second;
+        }
+
+        int32_t n_tokens = 0;
+        double t_tokenize = 0;
+        double t_detokenize = 0;
+
+        for (int i = 0; i < nr; i++)
+        {
+            tokens.resize(text.size() + 2);
+
+            const int64_t t_tokenize_start = llama_time_us();
+            n_tokens = llama_tokenize(vocab, text.data(), text.size(), tokens.data(), tokens.size(), false, false);
+            const int64_t t_tokenize_end = llama_time_us();
+
+            if (n_tokens < 0) {
+                LOG_ERROR("llama_tokenize() failed for sample '%s'", sample.first.c_str());
+                break;
+            }
+
+            detokenized.resize(text.size() + 64);
+
+            const int64_t t_detokenize_start = llama_time_us();
+            int32_t n_chars = llama_detokenize(vocab, tokens.data(), n_tokens, &detokenized[0], detokenized.size(), false, false);
+            if (n_chars < 0) {
+                detokenized.resize(-n_chars);
+                n_chars = llama_detokenize(vocab, tokens.data(), n_tokens, &detokenized[0], detokenized.size(), false, false);
+            }
+            const int64_t t_detokenize_end = llama_time_us();
+
+            t_tokenize   += (t_tokenize_end   - t_tokenize_start)   / 1000000.0;
+            t_detokenize += (t_detokenize_end - t_detokenize_start) / 1000000.0;
+        }
+
+        if (n_tokens < 0) {
+            continue;
+        }
+
+        const double mb = text.size() * nr / (1024.0 * 1024.0);
+
+        // [name, bytes, tokens, tokenize tokens/s, tokenize MB/s, detokenize tokens/s, detokenize MB/s]
+        result += std::string(",[\"") + sample.first + std::string("\",") +
+            std::to_string(text.size()) + std::string(",") +
+            std::to_string(n_tokens) + std::string(",") +
+            std::to_string((double) n_tokens * nr / t_tokenize) + std::string(",") +
+            std::to_string(mb / t_tokenize) + std::string(",") +
+            std::to_string((double) n_tokens * nr / t_detokenize) + std::string(",") +
+            std::to_string(mb / t_detokenize) +
+            std::string("]");
+    }
+
+    llama_model_free(model);
+
+    return result + std::string("]");
+}
+
+std::string model_info(const common_params & params)
+{
+    // no device is initialized for the metadata, the sizes are those of a CPU load
+    static lm_ggml_backend_dev_t no_devices[] = { nullptr };
+
+    llama_model_params model_params = llama_model_default_params();
+    model_params.meta_only = true;
+    model_params.n_gpu_layers = 0;
+    model_params.devices = no_devices;
+
+    llama_model * model = llama_model_load_from_file(params.model.path.c_str(), model_params);
+    if (model == nullptr) {
+        LOG_ERROR("failed to load metadata from '%s'", params.model.path.c_str());
+        return std::string("{}");
+    }
+
+    char model_desc[128];
+    llama_model_desc(model, model_desc, sizeof(model_desc));
+
+    json metadata = json::object();
+    std::string key;
+    std::string val;
+    for (int32_t i = 0; i < llama_model_meta_count(model); i++) {
+        key.resize(llama_model_meta_key_by_index(model, i, nullptr, 0) + 1);
+        llama_model_meta_key_by_index(model, i, key.data(), key.size());
+        key.pop_back();
+        val.resize(llama_model_meta_val_str_by_index(model, i, nullptr, 0) + 1);
+        llama_model_meta_val_str_by_index(model, i, val.data(), val.size());
+        val.pop_back();
+        metadata[key] = val;
+    }
+
+    const char * tmpl = llama_model_chat_template(model, nullptr);
+
+    const llama_memory_estimate mem = llama_model_estimate_memory(model, common_context_params_to_llama(params));
+
+    const json info = {
+        {"desc", model_desc},
+        {"size", llama_model_size(model)},
+        {"nParams", llama_model_n_params(model)},
+        {"isChatTemplateSupported", tmpl != nullptr && common_chat_verify_template(tmpl, params.use_jinja)},
+        {"metadata", metadata},
+        {"kvSize", mem.kv},
+        {"computeSize", mem.compute},
+        {"outputSize", mem.output},
+    };
+
+    llama_model_free(model);
+
+    return info.dump();
+}
+
+std::string hash_model(const char * path_model, bool tree, bool tensors, int n_threads)
+{
+    const int64_t t_start_us = lm_ggml_time_us();
+
+    char hex[2*LM_GGUF_HASH_SIZE + 1];
+    uint8_t digest[LM_GGUF_HASH_SIZE];
+    if (!lm_gguf_hash_file(path_model, tree ? LM_GGUF_HASH_SHA256_TREE : LM_GGUF_HASH_SHA256, n_threads, digest)) {
+        LOG_ERROR("failed to hash '%s'", path_model);
+        return std::string("{}");
+    }
+    lm_gguf_hash_to_hex(digest, hex);
+
+    json result = {
+        {"type", tree ? "sha256-tree" : "sha256"},
+        {"hash", hex},
+    };
+
+    if (tensors) {
+        lm_gguf_init_params params = {
+            /*.no_alloc = */ true,
+            /*.ctx      = */ nullptr,
+        };
+        lm_gguf_context * ctx = lm_gguf_init_from_file(path_model, params);
+        if (ctx == nullptr) {
+            LOG_ERROR("failed to read the tensors of '%s'", path_model);
+            return std::string("{}");
+        }
+
+        const int64_t n_tensors = lm_gguf_get_n_tensors(ctx);
+        std::vector<uint8_t> digests(n_tensors*LM_GGUF_HASH_SIZE);
+        if (!lm_gguf_hash_tensors(path_model, ctx, n_threads, digests.data())) {
+            LOG_ERROR("failed to hash the tensors of '%s'", path_model);
+            lm_gguf_free(ctx);
+            return std::string("{}");
+        }
+
+        json tensor_hashes = json::object();
+        for (int64_t i = 0; i < n_tensors; i++) {
+            lm_gguf_hash_to_hex(digests.data() + i*LM_GGUF_HASH_SIZE, hex);
+            tensor_hashes[lm_gguf_get_tensor_name(ctx, i)] = hex;
+        }
+        result["tensors"] = tensor_hashes;
+
+        lm_gguf_free(ctx);
+    }
+
+    LOG_INFO("hashed '%s' in %.1f ms", path_model, (lm_ggml_time_us() - t_start_us)/1000.0);
+
+    return result.dump();
+}
+
+std::string bench_memory_policy(common_params params, int pp, int tg, int nr)
+{
+    static const struct {
+        const char *              name;
+        enum llama_hugepages_type hugepages;
+        bool                      prefault;
+    } policies[] = {
+        { "none",             LLAMA_HUGEPAGES_TYPE_NONE,    false },
+        { "prefault",         LLAMA_HUGEPAGES_TYPE_NONE,    true  },
+        { "thp",              LLAMA_HUGEPAGES_TYPE_THP,     false },
+        { "thp+prefault",     LLAMA_HUGEPAGES_TYPE_THP,     true  },
+        { "hugetlb+prefault", LLAMA_HUGEPAGES_TYPE_HUGETLB, true  },
+    };
+
+    // the first decode after creating the context is the one measured for latency
+    params.warmup = false;
+
+    std::string result = "[";
+
+    for (const auto & policy : policies) {
+        params.hugepages = policy.hugepages;
+        params.prefault  = policy.prefault;
+
+        common_init_result llama_init = common_init_from_params(params);
+        llama_model * model = llama_init.model.get();
+        llama_context * ctx = llama_init.context.get();
+        if (model == nullptr || ctx == nullptr) {
+            LOG_ERROR("unable to load model with the memory policy %s", policy.name);
+            continue;
+        }
+
+        const int n_pp = std::min(pp, (int) params.n_ubatch); // max n_tokens is limited by n_ubatch
+        llama_batch batch = llama_batch_init(n_pp, 0, 1);
+
+        for (int i = 0; i < n_pp; i++)
+        {
+            llama_batch_add(&batch, 0, i, {0}, false);
+        }
+        batch.logits[batch.n_tokens - 1] = 1; // true
+
+        const int64_t t_first_start = llama_time_us();
+        if (llama_decode(ctx, batch) != 0)
+        {
+            LOG_ERROR("llama_decode() failed during prompt", "");
+        }
+        const int64_t t_first_end = llama_time_us();
+
+        double tg_avg = 0;
+        double tg_std = 0;
+
+        for (int i = 0; i < nr; i++)
+        {
+            llama_kv_self_clear(ctx);
+
+            const int64_t t_tg_start = llama_time_us();
+
+            for (int j = 0; j < tg; j++)
+            {
+                llama_batch_clear(&batch);
+                llama_batch_add(&batch, 0, j, {0}, true);
+
+                if (llama_decode(ctx, batch) != 0)
+                {
+                    LOG_ERROR("llama_decode() failed during text generation", "");
+                }
+            }
+
+            const int64_t t_tg_end = llama_time_us();
+
+            const double speed_tg = tg / ((t_tg_end - t_tg_start) / 1000000.0);
+
+            tg_avg += speed_tg;
+            tg_std += speed_tg * speed_tg;
+        }
+
+        llama_batch_free(batch);
+
+        tg_avg /= nr;
+
+        if (nr > 1) {
+            tg_std = sqrt(tg_std / (nr - 1) - tg_avg * tg_avg * nr / (nr - 1));
+        } else {
+            tg_std = 0;
+        }
+
+        // [policy, first prompt ms, tg avg, tg std]
+        if (result.size() > 1) {
+            result += ",";
+        }
+        result += std::string("[\"") + policy.name + std::string("\",") +
+            std::to_string((t_first_end - t_first_start) / 1000.0) + std::string(",") +
+            std::to_string(tg_avg) + std::string(",") +
+            std::to_string(tg_std) +
+            std::string("]");
+    }
+
+    return result + std::string("]");
+}
+
 }
@@ -1,8 +1,12 @@
 #ifndef RNLLAMA_H
 #define RNLLAMA_H
 
+#include <atomic>
 #include <sstream>
 #include <iostream>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
 #include "chat.h"
 #include "common.h"
 #include "ggml.h"
@@ -22,6 +26,27 @@ std::string tokens_to_str(llama_context *ctx, const std::vector<llama_token>::co
 
 lm_ggml_type kv_cache_type_from_str(const std::string & s);
 
+// samples of the tokenizer benchmark (name, text), each is repeated up to about 64 KiB
+extern const std::vector<std::pair<std::string, std::string>> bench_tokenizer_samples;
+
+// tokenize/detokenize throughput of the vocab of a model on bench_tokenizer_samples, nr repetitions (at least 1)
+// only the vocab is loaded, returns a JSON array like llama_rn_context::bench
+std::string bench_tokenizer(const char * path_model, int nr);
+
+// the modelInfo fields of a model (desc, size, nParams, isChatTemplateSupported, metadata) read from its GGUF metadata only,
+// with the KV cache, compute and output memory estimated for n_ctx, n_batch, n_ubatch and the KV cache types of params
+// no vocab or tensor data is loaded, returns a JSON object, empty if the model can not be read
+std::string model_info(const common_params & params);
+
+// SHA-256 of a model file ("sha256", same as sha256sum) or its parallel tree hash ("sha256-tree", see gguf-hash.h),
+// and the SHA-256 of the data of each tensor when tensors is set, n_threads <= 0 uses all cores
+// returns a JSON object like {"type": "sha256", "hash": "...", "tensors": {"name": "...", ...}}, empty if the file can not be read
+std::string hash_model(const char * path_model, bool tree, bool tensors, int n_threads);
+
+// first prompt latency and decode throughput of the model under each huge pages / prefault policy
+// the model and the context are loaded again for each policy, returns a JSON array like llama_rn_context::bench
+std::string bench_memory_policy(common_params params, int pp, int tg, int nr);
+
 enum stop_type
 {
     STOP_FULL,
@@ -41,13 +66,39 @@ struct completion_token_output
     llama_token tok;
 };
 
+// probabilities of the generated tokens, stored as a struct of arrays
+// token i ends at byte text_end[i] of the generated text and its candidates are probs_tok/probs_prob[probs_begin[i], probs_begin[i + 1])
+struct completion_token_probs
+{
+    std::vector<llama_token> tok;
+    std::vector<size_t> text_end;
+    std::vector<size_t> probs_begin = {0};
+    std::vector<llama_token> probs_tok;
+    std::vector<float> probs_prob;
+
+    // formatted pieces of the tokens, resolved on first use and shared by all the completions of the context
+    // they belong to the vocab of the model, clear() keeps them and loadModel drops them
+    std::string pieces;
+    std::unordered_map<llama_token, size_t> piece_offset;
+
+    size_t size() const { return tok.size(); }
+    void clear();
+    void push_back(const completion_token_output &out, size_t end);
+
+    // number of tokens whose text lies within the first n_text bytes of the generated text
+    size_t n_tokens_within(size_t n_text) const;
+
+    // NUL-terminated formatted piece of the token, valid until the next call
+    const char * piece(const llama_context *ctx, llama_token token);
+};
+
 // Main context class
 struct llama_rn_context {
     bool is_predicting = false;
     bool is_interrupted = false;
     bool has_next_token = false;
     std::string generated_text;
-    std::vector<completion_token_output> generated_token_probs;
+    completion_token_probs generated_token_probs;
 
     size_t num_prompt_tokens = 0;
     size_t num_tokens_predicted = 0;
@@ -55,6 +106,13 @@ struct llama_rn_context {
     size_t n_remain = 0;
 
     std::vector<llama_token> embd;
+
+    // the last tokenized prompt, so that only the text appended to it is tokenized again
+    // the tokens depend only on the vocab (special tokens are always added and parsed), it is cleared by loadModel
+    std::string prompt_text;
+    std::vector<llama_token> prompt_text_tokens;
+    std::vector<std::pair<size_t, size_t>> prompt_resume_points;
+
     common_params params;
     common_init_result llama_init;
 
@@ -62,6 +120,14 @@ struct llama_rn_context {
     float loading_progress = 0;
     bool is_load_interrupted = false;
 
+    // the warmup runs after loadModel on a background thread, in steps (see llama_warmup_step)
+    // the methods that use ctx stop it first, anything else using ctx directly must call stopWarmup before;
+    // it can be resumed with startWarmup
+    std::thread warmup_thread;
+    std::atomic<bool> warmup_stop{false};
+    std::atomic<bool> is_warmup_done{false};
+    std::mutex warmup_mutex;
+
     llama_context *ctx = nullptr;
     common_sampler *ctx_sampling = nullptr;
     common_chat_templates_ptr templates;
@@ -83,6 +149,11 @@ struct llama_rn_context {
     void rewind();
     bool initSampling();
     bool loadModel(common_params &params_);
+    void startWarmup();
+    void stopWarmup();
+    // llama_state_load_file/llama_state_save_file of the context and its tokens (embd), with the warmup stopped
+    bool loadSession(const char * path, size_t * n_token_count);
+    bool saveSession(const char * path, int size);
     bool validateModelChatTemplate(bool use_jinja, const char *name) const;
     common_chat_params getFormattedChatWithJinja(
       const std::string &messages,
@@ -97,6 +168,7 @@ struct llama_rn_context {
       const std::string &chat_template
     ) const;
     void truncatePrompt(std::vector<llama_token> &prompt_tokens);
+    std::vector<llama_token> tokenizePrompt();
     void loadPrompt();
     void beginCompletion();
     completion_token_output nextToken();
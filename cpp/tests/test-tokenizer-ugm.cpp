@@ -0,0 +1,334 @@
+// Checks of the UGM tokenizer and of the tries it is built on
+//
+// usage: test-tokenizer-ugm <vocab-file>
+//
+// The vocab file is a SentencePiece vocab, e.g. llama.cpp/models/ggml-vocab-llama-spm.gguf. There is no UGM vocab in
+// the tree, so the same tokens and scores are loaded as a UGM (t5) vocab from a copy of its metadata. The test checks:
+// - double_array_trie against naive_trie, on random keys and on the token texts
+// - the UGM tokenization against a Viterbi search over a naive_trie of the tokens
+// - that the detokenization of the tokenization of texts made of tokens gives back the text
+//
+// It returns 0 on success. Build it against the library, e.g.:
+//
+//   g++ -std=c++17 -O2 -Icpp cpp/tests/test-tokenizer-ugm.cpp libllms.a -pthread -o test-tokenizer-ugm
+
+#undef NDEBUG
+
+#include "llama.h"
+#include "gguf.h"
+#include "llama-trie.h"
+
+#include <algorithm>
+#include <cfloat>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <string>
+#include <vector>
+
+static const std::string escaped_space = "\xE2\x96\x81";
+
+static size_t utf8_len(char c) {
+    static const size_t lookup[] = { 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 2, 2, 3, 4 };
+    return lookup[((uint8_t) c) >> 4];
+}
+
+static std::string replace_all(const std::string & s, const std::string & from, const std::string & to) {
+    std::string res;
+    for (size_t i = 0; i < s.size(); ) {
+        if (s.compare(i, from.size(), from) == 0) {
+            res += to;
+            i += from.size();
+        } else {
+            res += s[i++];
+        }
+    }
+    return res;
+}
+
+// every node of the naive trie is a node of the double-array trie with the same value and the same children
+static bool check_trie_node(const naive_trie & a, const double_array_trie & b, int32_t s, std::string & path) {
+    const llama_token value = a.has_value ? a.value : LLAMA_TOKEN_NULL;
+    if (b.value(s) != value) {
+        fprintf(stderr, "%s: value of '%s' is %d instead of %d\n", __func__, path.c_str(), b.value(s), value);
+        return false;
+    }
+    for (int c = 0; c < 256; ++c) {
+        const naive_trie * child_a = a.traverse((char) c);
+        const int32_t      child_b = b.traverse(s, (char) c);
+        if ((child_a != nullptr) != (child_b >= 0)) {
+            fprintf(stderr, "%s: child 0x%02x of '%s' is %s in the double-array trie\n", __func__, c, path.c_str(),
+                    child_b >= 0 ? "extra" : "missing");
+            return false;
+        }
+        if (child_a) {
+            path.push_back((char) c);
+            const bool ok = check_trie_node(*child_a, b, child_b, path);
+            path.pop_back();
+            if (!ok) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+static bool check_trie(const std::vector<std::pair<std::string, llama_token>> & keys, const std::vector<std::string> & queries) {
+    naive_trie a;
+    for (const auto & key : keys) {
+        a.insert(key.first.data(), key.first.size(), key.second);
+    }
+    double_array_trie b;
+    b.build(keys);
+
+    std::string path;
+    if (!check_trie_node(a, b, double_array_trie::root, path)) {
+        return false;
+    }
+
+    for (const auto & query : queries) {
+        const size_t len_a = a.get_longest_prefix(query.data(), query.size()).second;
+        const size_t len_b = b.get_longest_prefix(query.data(), query.size());
+        if (len_a != len_b) {
+            fprintf(stderr, "%s: longest prefix of '%s' is %zu instead of %zu\n", __func__, query.c_str(), len_b, len_a);
+            return false;
+        }
+    }
+    return true;
+}
+
+// the UGM Viterbi search of llm_tokenizer_ugm_session, over a naive trie and for texts with single spaces between
+// the words, which need no normalization other than the escaped spaces
+struct ugm_reference {
+    naive_trie tokens;
+    std::vector<double> scores;
+    double unknown_score = 0;
+    llama_token unk;
+
+    ugm_reference(const llama_vocab * vocab, llama_token unk) : unk(unk) {
+        const int n_vocab = llama_vocab_n_tokens(vocab);
+        float min_score = FLT_MAX;
+        scores.resize(n_vocab);
+        for (llama_token id = 0; id < n_vocab; ++id) {
+            const llama_token_attr attr = llama_vocab_get_attr(vocab, id);
+            const std::string text = llama_vocab_get_text(vocab, id);
+            if (attr & LLAMA_TOKEN_ATTR_NORMAL) {
+                min_score = std::min(min_score, llama_vocab_get_score(vocab, id));
+            }
+            if (attr & (LLAMA_TOKEN_ATTR_NORMAL | LLAMA_TOKEN_ATTR_USER_DEFINED | LLAMA_TOKEN_ATTR_UNUSED)) {
+                tokens.insert(text.data(), text.size(), id);
+            }
+            scores[id] = attr & LLAMA_TOKEN_ATTR_USER_DEFINED ? 0.0 : llama_vocab_get_score(vocab, id);
+        }
+        unknown_score = min_score - 10.0f;
+    }
+
+    std::vector<llama_token> tokenize(const std::string & text) const {
+        const std::string normalized = escaped_space + replace_all(text, " ", escaped_space);
+        const size_t n = normalized.size();
+
+        struct best {
+            llama_token id;
+            size_t      begin;
+            float       score;
+        };
+        std::vector<best> results(n + 1, { unk, 0, -FLT_MAX });
+        results[0] = { unk, 0, 0 };
+
+        for (size_t i = 0; i < n; ) {
+            const size_t n_cpt = std::min(utf8_len(normalized[i]), n - i);
+            bool cpt_found = false;
+            const naive_trie * node = &tokens;
+            for (size_t j = i; j < n && (node = node->traverse(normalized[j])) != nullptr; ++j) {
+                if (node->has_value) {
+                    cpt_found = cpt_found || j + 1 - i == n_cpt;
+                    const double score = results[i].score + scores[node->value];
+                    if (score > results[j + 1].score) {
+                        results[j + 1] = { node->value, i, (float) score };
+                    }
+                }
+            }
+            if (!cpt_found) {
+                const double score = results[i].score + unknown_score;
+                if (score > results[i + n_cpt].score) {
+                    results[i + n_cpt] = { unk, i, (float) score };
+                }
+            }
+            i += n_cpt;
+        }
+
+        std::vector<llama_token> res;
+        bool is_prev_unknown = false;
+        for (size_t end = n; ; end = results[end].begin) {
+            const bool is_unknown = results[end].id == unk;
+            if (!(is_prev_unknown && is_unknown)) {
+                res.push_back(results[end].id);
+            }
+            if (results[end].begin == 0) {
+                break;
+            }
+            is_prev_unknown = is_unknown;
+        }
+        std::reverse(res.begin(), res.end());
+        return res;
+    }
+};
+
+static std::vector<llama_token> tokenize(const llama_vocab * vocab, const std::string & text) {
+    std::vector<llama_token> res(text.size() + 2);
+    const int n = llama_tokenize(vocab, text.data(), text.size(), res.data(), res.size(), false, false);
+    res.resize(std::max(n, 0));
+    return res;
+}
+
+static std::string detokenize(const llama_vocab * vocab, const std::vector<llama_token> & tokens) {
+    std::string res(4*tokens.size() + 16, '\0');
+    const int n = llama_detokenize(vocab, tokens.data(), tokens.size(), &res[0], res.size(), false, false);
+    res.resize(std::max(n, 0));
+    return res;
+}
+
+int main(int argc, char ** argv) {
+    if (argc < 2) {
+        fprintf(stderr, "Usage: %s <vocab-file>\n", argv[0]);
+        return 1;
+    }
+
+    const std::string fname = argv[1];
+
+    llama_backend_init();
+
+    std::mt19937 rng(42);
+
+    // tries on random keys, with shared prefixes, duplicates, the empty key and all byte values
+    {
+        std::vector<std::pair<std::string, llama_token>> keys;
+        std::vector<std::string> queries;
+        const char alphabet[] = { 'a', 'b', 'c', '\0', '\x7f', '\x80', '\xe2', '\xff' };
+        for (int i = 0; i < 5000; ++i) {
+            std::string key(rng() % 8, '\0');
+            for (auto & c : key) {
+                c = rng() % 4 == 0 ? (char) (rng() % 256) : alphabet[rng() % sizeof(alphabet)];
+            }
+            keys.emplace_back(key, i);
+            queries.push_back(key + alphabet[rng() % sizeof(alphabet)]);
+            queries.push_back(key.substr(0, key.size()/2));
+        }
+        keys.emplace_back("", 5000);
+
+        // the double-array trie keeps the last value of a duplicate key, as naive_trie
+        if (!check_trie(keys, queries) || !check_trie({}, { "", "a" })) {
+            return 2;
+        }
+    }
+
+    // the UGM vocab: the metadata of the vocab file, with the t5 tokenizer
+    const std::string fname_ugm = fname + ".ugm.tmp.gguf";
+    llama_token unk = 2; // the default of the t5 tokenizer
+    {
+        lm_gguf_init_params params = {
+            /*.no_alloc = */ true,
+            /*.ctx      = */ NULL,
+        };
+        lm_gguf_context * src = lm_gguf_init_from_file(fname.c_str(), params);
+        if (src == NULL) {
+            fprintf(stderr, "%s: error: failed to read vocab '%s'\n", __func__, fname.c_str());
+            return 1;
+        }
+        const int64_t unk_keyidx = lm_gguf_find_key(src, "tokenizer.ggml.unknown_token_id");
+        if (unk_keyidx >= 0) {
+            unk = lm_gguf_get_val_u32(src, unk_keyidx);
+        }
+        lm_gguf_context * dst = lm_gguf_init_empty();
+        lm_gguf_set_kv(dst, src);
+        lm_gguf_set_val_str (dst, "tokenizer.ggml.model", "t5");
+        // the whitespace handling of T5, which the reference implements
+        lm_gguf_set_val_bool(dst, "tokenizer.ggml.add_space_prefix", true);
+        lm_gguf_set_val_bool(dst, "tokenizer.ggml.remove_extra_whitespaces", true);
+        const bool ok = lm_gguf_write_to_file(dst, fname_ugm.c_str(), true);
+        lm_gguf_free(dst);
+        lm_gguf_free(src);
+        if (!ok) {
+            fprintf(stderr, "%s: error: failed to write '%s'\n", __func__, fname_ugm.c_str());
+            return 1;
+        }
+    }
+
+    auto mparams = llama_model_default_params();
+    mparams.vocab_only = true;
+
+    llama_model * model = llama_model_load_from_file(fname_ugm.c_str(), mparams);
+    std::remove(fname_ugm.c_str());
+    if (model == NULL) {
+        fprintf(stderr, "%s: error: failed to load vocab '%s'\n", __func__, fname_ugm.c_str());
+        return 1;
+    }
+
+    const llama_vocab * vocab = llama_model_get_vocab(model);
+    if (llama_vocab_type(vocab) != LLAMA_VOCAB_TYPE_UGM) {
+        return 99;
+    }
+    const int n_vocab = llama_vocab_n_tokens(vocab);
+
+    // tries on the token texts
+    {
+        std::vector<std::pair<std::string, llama_token>> keys;
+        std::vector<std::string> queries;
+        for (llama_token id = 0; id < n_vocab; ++id) {
+            keys.emplace_back(llama_vocab_get_text(vocab, id), id);
+            queries.push_back(keys.back().first + llama_vocab_get_text(vocab, rng() % n_vocab));
+        }
+        if (!check_trie(keys, queries)) {
+            return 2;
+        }
+    }
+
+    // the words of the texts: the normal tokens without the escaped spaces
+    std::vector<std::string> words;
+    for (llama_token id = 0; id < n_vocab; ++id) {
+        const std::string word = replace_all(llama_vocab_get_text(vocab, id), escaped_space, "");
+        if ((llama_vocab_get_attr(vocab, id) & LLAMA_TOKEN_ATTR_NORMAL) && !word.empty() && word.find(' ') == std::string::npos) {
+            words.push_back(word);
+        }
+    }
+
+    const ugm_reference reference(vocab, unk);
+
+    std::vector<std::string> texts = {
+        "Hello world",
+        "The quick brown fox jumps over the lazy dog.",
+        "int main(int argc, char ** argv) { return 0; }",
+        "\xe4\xbd\xa0\xe5\xa5\xbd\xef\xbc\x8c\xe4\xb8\x96\xe7\x95\x8c",
+        "\xf0\x9f\x98\x80 \xf0\x9f\x91\x8d\xf0\x9f\x8f\xbd ok",
+    };
+    for (int i = 0; i < 2000; ++i) {
+        std::string text;
+        for (int j = 0, n = 1 + rng() % 12; j < n; ++j) {
+            text += (j > 0 && rng() % 3 != 0 ? " " : "") + words[rng() % words.size()];
+        }
+        texts.push_back(text);
+    }
+
+    for (size_t i = 0; i < texts.size(); ++i) {
+        const std::string & text = texts[i];
+
+        const std::vector<llama_token> tokens = tokenize(vocab, text);
+        if (tokens != reference.tokenize(text)) {
+            fprintf(stderr, "%s : error: tokenization of '%s' differs from the reference\n", __func__, text.c_str());
+            return 3;
+        }
+
+        // the texts made of words have no unknown tokens
+        const std::string check = detokenize(vocab, tokens);
+        if (i >= 5 && check != text) {
+            fprintf(stderr, "%s : error: '%s' detokenizes to '%s'\n", __func__, text.c_str(), check.c_str());
+            return 4;
+        }
+    }
+
+    llama_model_free(model);
+
+    llama_backend_free();
+
+    return 0;
+}
@@ -10,11 +10,15 @@
 #include <codecvt>
 #include <cstddef>
 #include <cstdint>
+#include <cstring>
 #include <locale>
 #include <map>
+#include <memory>
+#include <mutex>
 #include <regex>
 #include <stdexcept>
 #include <string>
+#include <thread>
 #include <unordered_map>
 #include <utility>
 #include <vector>
@@ -33,41 +37,49 @@ static std::string unicode_cpts_to_utf8(const std::vector<uint32_t> & cps) {
     return result;
 }
 
-uint32_t unicode_cpt_from_utf8(const std::string & utf8, size_t & offset) {
-    assert(offset < utf8.size());
-    if (!(utf8[offset + 0] & 0x80)) {
-        auto result = utf8[offset + 0];
-        offset += 1;
-        return result;
+// decodes the codepoint at src[offset] into cpt and returns its length in bytes, or 0 if the sequence is invalid
+static inline size_t unicode_cpt_decode_utf8(const uint8_t * src, size_t size, size_t offset, uint32_t & cpt) {
+    const uint8_t c0 = src[offset];
+    if (!(c0 & 0x80)) {
+        cpt = c0;
+        return 1;
     }
-    if (!(utf8[offset + 0] & 0x40)) {
-        throw std::invalid_argument("invalid character");
+    if (!(c0 & 0x40)) {
+        return 0;
     }
-    if (!(utf8[offset + 0] & 0x20)) {
-        if (offset + 1 >= utf8.size() || ! ((utf8[offset + 1] & 0xc0) == 0x80)) {
-            throw std::invalid_argument("invalid character");
+    if (!(c0 & 0x20)) {
+        if (offset + 1 >= size || (src[offset + 1] & 0xc0) != 0x80) {
+            return 0;
         }
-        auto result = ((utf8[offset + 0] & 0x1f) << 6) | (utf8[offset + 1] & 0x3f);
-        offset += 2;
-        return result;
+        cpt = ((c0 & 0x1f) << 6) | (src[offset + 1] & 0x3f);
+        return 2;
     }
-    if (!(utf8[offset + 0] & 0x10)) {
-        if (offset + 2 >= utf8.size() || ! ((utf8[offset + 1] & 0xc0) == 0x80) || ! ((utf8[offset + 2] & 0xc0) == 0x80)) {
-            throw std::invalid_argument("invalid character");
+    if (!(c0 & 0x10)) {
+        if (offset + 2 >= size || (src[offset + 1] & 0xc0) != 0x80 || (src[offset + 2] & 0xc0) != 0x80) {
+            return 0;
         }
-        auto result = ((utf8[offset + 0] & 0x0f) << 12) | ((utf8[offset + 1] & 0x3f) << 6) | (utf8[offset + 2] & 0x3f);
-        offset += 3;
-        return result;
+        cpt = ((c0 & 0x0f) << 12) | ((src[offset + 1] & 0x3f) << 6) | (src[offset + 2] & 0x3f);
+        return 3;
     }
-    if (!(utf8[offset + 0] & 0x08)) {
-        if (offset + 3 >= utf8.size() || ! ((utf8[offset + 1] & 0xc0) == 0x80) || ! ((utf8[offset + 2] & 0xc0) == 0x80) || !((utf8[offset + 3] & 0xc0) == 0x80)) {
-            throw std::invalid_argument("invalid character");
+    if (!(c0 & 0x08)) {
+        if (offset + 3 >= size || (src[offset + 1] & 0xc0) != 0x80 || (src[offset + 2] & 0xc0) != 0x80 || (src[offset + 3] & 0xc0) != 0x80) {
+            return 0;
         }
-        auto result = ((utf8[offset + 0] & 0x07) << 18) | ((utf8[offset + 1] & 0x3f) << 12) | ((utf8[offset + 2] & 0x3f) << 6) | (utf8[offset + 3] & 0x3f);
-        offset += 4;
-        return result;
+        cpt = ((c0 & 0x07) << 18) | ((src[offset + 1] & 0x3f) << 12) | ((src[offset + 2] & 0x3f) << 6) | (src[offset + 3] & 0x3f);
+        return 4;
     }
-    throw std::invalid_argument("failed to convert utf8 to codepoint");
+    return 0;
+}
+
+uint32_t unicode_cpt_from_utf8(const std::string & utf8, size_t & offset) {
+    assert(offset < utf8.size());
+    uint32_t cpt;
+    const size_t len = unicode_cpt_decode_utf8(reinterpret_cast<const uint8_t *>(utf8.data()), utf8.size(), offset, cpt);
+    if (len == 0) {
+        throw std::invalid_argument("invalid character");
+    }
+    offset += len;
+    return cpt;
 }
 
 //static std::vector<uint16_t> unicode_cpt_to_utf16(uint32_t cpt) {
@@ -119,6 +131,46 @@ uint32_t unicode_cpt_from_utf8(const std::string & utf8, size_t & offset) {
 //    return result;
 //}
 
+// two-level table of the codepoint flags: blocks of codepoints with the same flags are stored once,
+// which keeps the table small enough to stay in cache (about 150 KB instead of 2 MB)
+struct unicode_cpt_flags_table {
+    static constexpr uint32_t BLOCK_BITS = 7;
+    static constexpr uint32_t BLOCK_SIZE = 1u << BLOCK_BITS;
+    static constexpr uint32_t N_BLOCKS   = (MAX_CODEPOINTS + BLOCK_SIZE - 1) >> BLOCK_BITS;
+
+    unicode_cpt_flags_table(const std::vector<unicode_cpt_flags> & cpt_flags) {
+        std::map<std::vector<uint16_t>, uint16_t> block_ids;
+        std::vector<uint16_t> block(BLOCK_SIZE);
+
+        for (uint32_t i = 0; i < N_BLOCKS; ++i) {
+            for (uint32_t j = 0; j < BLOCK_SIZE; ++j) {
+                const size_t cpt = (i << BLOCK_BITS) | j;
+                block[j] = cpt < cpt_flags.size() ? cpt_flags[cpt].as_uint() : (uint16_t) unicode_cpt_flags::UNDEFINED;
+            }
+            const auto res = block_ids.emplace(block, (uint16_t) block_ids.size());
+            if (res.second) {
+                blocks.insert(blocks.end(), block.begin(), block.end());
+            }
+            index[i] = res.first->second;
+        }
+        assert(block_ids.size() <= UINT16_MAX);
+    }
+
+    unicode_cpt_flags get(uint32_t cpt) const {
+        if (cpt < BLOCK_SIZE) {
+            // ASCII, the first block
+            return unicode_cpt_flags(blocks[cpt]);
+        }
+        if (cpt >= N_BLOCKS*BLOCK_SIZE) {
+            return unicode_cpt_flags(unicode_cpt_flags::UNDEFINED);
+        }
+        return unicode_cpt_flags(blocks[((size_t) index[cpt >> BLOCK_BITS] << BLOCK_BITS) | (cpt & (BLOCK_SIZE - 1))]);
+    }
+
+    uint16_t              index[N_BLOCKS]; // codepoint block -> block id
+    std::vector<uint16_t> blocks;          // the flags of the distinct blocks
+};
+
 static std::vector<unicode_cpt_flags> unicode_cpt_flags_array() {
     std::vector<unicode_cpt_flags> cpt_flags(MAX_CODEPOINTS, unicode_cpt_flags::UNDEFINED);
 
@@ -215,24 +267,6 @@ static inline std::wstring unicode_wstring_from_utf8(const std::string & s) {
     return conv.from_bytes(s);
 }
 
-static std::vector<std::string> unicode_byte_encoding_process(const std::vector<std::string> & bpe_words) {
-    std::vector<std::string> bpe_encoded_words;
-    for (const auto & word : bpe_words) {
-        std::string text_utf;
-        auto utf_word =  unicode_cpts_from_utf8(word);
-        for (size_t i = 0; i < utf_word.size(); ++i) {
-            text_utf += unicode_cpt_to_utf8(utf_word[i]);
-        }
-
-        std::string encoded_token;
-        for (char & c : text_utf) {
-            encoded_token += unicode_byte_to_utf8(c);
-        }
-        bpe_encoded_words.emplace_back(encoded_token);
-    }
-    return bpe_encoded_words;
-}
-
 // GPT2 system regex:  's|'t|'re|'ve|'m|'ll|'d| ?\p{L}+| ?\p{N}+| ?[^\s\p{L}\p{N}]+|\s+(?!\S)|\s+
 static std::vector<size_t> unicode_regex_split_custom_gpt2(const std::string & text, const std::vector<size_t> & offsets) {
     std::vector<size_t> bpe_offsets; // store the offset of each word
@@ -552,6 +586,633 @@ static std::vector<size_t> unicode_regex_split_stl(const std::string & text, con
     return bpe_offsets;
 }
 
+// compiled matcher for the subset of ECMAScript regex used by the pre-tokenizers
+//
+// it runs on the same units as std::regex would (the collapsed text or the codepoints) and has the same
+// leftmost-first backtracking semantics, but without the overhead of the std::regex executors
+// constructs that are not supported throw at compile time and fall back to std::regex
+struct unicode_regex_matcher {
+    // set of units as sorted, non-overlapping ranges, with a bitmap for the units below 256
+    struct cls {
+        std::vector<std::pair<uint32_t, uint32_t>> ranges;
+        uint64_t lo[4] = {0, 0, 0, 0};
+
+        void add(uint32_t first, uint32_t last) {
+            ranges.emplace_back(first, last);
+        }
+
+        void add(const cls & other) {
+            ranges.insert(ranges.end(), other.ranges.begin(), other.ranges.end());
+        }
+
+        void finalize(bool negate) {
+            std::sort(ranges.begin(), ranges.end());
+            std::vector<std::pair<uint32_t, uint32_t>> merged;
+            for (const auto & r : ranges) {
+                if (!merged.empty() && r.first <= merged.back().second + 1) {
+                    merged.back().second = std::max(merged.back().second, r.second);
+                } else {
+                    merged.push_back(r);
+                }
+            }
+            if (negate) {
+                std::vector<std::pair<uint32_t, uint32_t>> inv;
+                uint32_t next = 0;
+                for (const auto & r : merged) {
+                    if (r.first > next) {
+                        inv.emplace_back(next, r.first - 1);
+                    }
+                    next = r.second + 1;
+                }
+                if (next <= MAX_UNIT) {
+                    inv.emplace_back(next, MAX_UNIT);
+                }
+                merged = std::move(inv);
+            }
+            ranges = std::move(merged);
+            for (const auto & r : ranges) {
+                for (uint32_t u = r.first; u <= std::min<uint32_t>(r.second, 255); ++u) {
+                    lo[u >> 6] |= 1ull << (u & 63);
+                }
+            }
+        }
+
+        bool has(uint32_t u) const {
+            if (u < 256) {
+                return (lo[u >> 6] >> (u & 63)) & 1;
+            }
+            auto it = std::upper_bound(ranges.begin(), ranges.end(), std::make_pair(u, UINT32_MAX));
+            return it != ranges.begin() && (it - 1)->second >= u;
+        }
+    };
+
+    enum inst_op {
+        OP_CLASS, // x: class
+        OP_SPLIT, // try x, then y
+        OP_JMP,   // x: target
+        OP_BOL,
+        OP_EOL,
+        OP_LOOK,  // x: program, y: 1 if negative
+        OP_MATCH,
+    };
+
+    struct inst {
+        inst_op op;
+        int x;
+        int y;
+    };
+
+    static constexpr uint32_t MAX_UNIT = 0x10FFFF;
+
+    std::vector<cls> classes;
+    std::vector<std::vector<inst>> progs; // progs[0] is the whole regex, the others are lookaheads
+
+    explicit unicode_regex_matcher(const std::vector<uint32_t> & pattern) {
+        parser p(*this, pattern);
+        node root = p.parse_disjunction();
+        if (p.pos != pattern.size()) {
+            throw std::runtime_error("unexpected ')'");
+        }
+        compile(root);
+    }
+
+    // anchored match at pos within [begin, end), returns the end of the match or -1
+    int64_t match(const uint32_t * units, size_t begin, size_t end, size_t pos, bool not_null, std::vector<std::pair<int, size_t>> & stack) const {
+        return run(0, units, begin, end, pos, not_null, stack);
+    }
+
+    // split the segments like unicode_regex_split_stl
+    std::vector<size_t> split(const std::vector<uint32_t> & units, const std::vector<size_t> & offsets) const {
+        std::vector<size_t> bpe_offsets; // store the offset of each word
+        bpe_offsets.reserve(offsets.size()); // Reserve memory for the approximate size
+
+        std::vector<std::pair<int, size_t>> stack;
+
+        size_t start = 0;
+        for (auto offset : offsets) {
+            const size_t end = start + offset;
+
+            // same iteration as std::regex_iterator, including the handling of empty matches
+            size_t start_idx = start;
+            size_t search = start;
+            bool not_null = false;
+            while (true) {
+                int64_t m_end = -1;
+                size_t m_pos = search;
+                if (not_null) {
+                    // after an empty match, look for a non-empty match at the same position first
+                    m_end = match(units.data(), start, end, search, true, stack);
+                    if (m_end < 0) {
+                        if (search == end) {
+                            break;
+                        }
+                        ++search;
+                    }
+                }
+                if (m_end < 0) {
+                    for (m_pos = search; m_pos <= end; ++m_pos) {
+                        m_end = match(units.data(), start, end, m_pos, false, stack);
+                        if (m_end >= 0) {
+                            break;
+                        }
+                    }
+                    if (m_end < 0) {
+                        break;
+                    }
+                }
+
+                if (m_pos > start_idx) {
+                    bpe_offsets.emplace_back(m_pos - start_idx);
+                }
+                bpe_offsets.emplace_back(m_end - m_pos);
+                start_idx = m_end;
+                search = m_end;
+                not_null = (size_t) m_end == m_pos;
+                if (not_null && search == end) {
+                    break;
+                }
+            }
+
+            if (start_idx < end) {
+                bpe_offsets.emplace_back(end - start_idx);
+            }
+            start = end;
+        }
+
+        return bpe_offsets;
+    }
+
+private:
+    struct node {
+        enum { EMPTY, CLASS, CAT, ALT, REPEAT, BOL, EOL, LOOK } type = EMPTY;
+        std::vector<node> children;
+        int cls = -1;
+        int min = 0;
+        int max = 0; // -1 for unbounded
+        bool greedy = true;
+        bool negative = false;
+
+        bool nullable() const {
+            switch (type) {
+                case CLASS:  return false;
+                case CAT:    return std::all_of(children.begin(), children.end(), [](const node & n) { return n.nullable(); });
+                case ALT:    return std::any_of(children.begin(), children.end(), [](const node & n) { return n.nullable(); });
+                case REPEAT: return min == 0 || children[0].nullable();
+                default:     return true;
+            }
+        }
+    };
+
+    struct parser {
+        unicode_regex_matcher & re;
+        const std::vector<uint32_t> & pat;
+        size_t pos = 0;
+
+        parser(unicode_regex_matcher & matcher, const std::vector<uint32_t> & pattern) : re(matcher), pat(pattern) {}
+
+        bool peek(uint32_t c) const {
+            return pos < pat.size() && pat[pos] == c;
+        }
+
+        int add_class(cls c, bool negate) {
+            c.finalize(negate);
+            re.classes.push_back(std::move(c));
+            return (int) re.classes.size() - 1;
+        }
+
+        node parse_disjunction() {
+            node alt;
+            alt.type = node::ALT;
+            alt.children.push_back(parse_alternative());
+            while (peek('|')) {
+                ++pos;
+                alt.children.push_back(parse_alternative());
+            }
+            return alt.children.size() == 1 ? std::move(alt.children[0]) : alt;
+        }
+
+        node parse_alternative() {
+            node cat;
+            cat.type = node::CAT;
+            while (pos < pat.size() && pat[pos] != '|' && pat[pos] != ')') {
+                cat.children.push_back(parse_term());
+            }
+            return cat;
+        }
+
+        node parse_term() {
+            node atom;
+            bool quantifiable = true;
+
+            const uint32_t c = pat[pos++];
+            switch (c) {
+                case '^': atom.type = node::BOL; quantifiable = false; break;
+                case '$': atom.type = node::EOL; quantifiable = false; break;
+                case '(':
+                    {
+                        if (peek('?')) {
+                            ++pos;
+                            if (peek(':')) {
+                                ++pos;
+                                atom = parse_disjunction();
+                            } else if (peek('=') || peek('!')) {
+                                atom.negative = pat[pos++] == '!';
+                                atom.type = node::LOOK;
+                                atom.children.push_back(parse_disjunction());
+                                quantifiable = false;
+                            } else {
+                                throw std::runtime_error("unsupported group");
+                            }
+                        } else {
+                            atom = parse_disjunction();
+                        }
+                        if (!peek(')')) {
+                            throw std::runtime_error("missing ')'");
+                        }
+                        ++pos;
+                    } break;
+                case '[':
+                    atom.type = node::CLASS;
+                    atom.cls  = parse_class();
+                    break;
+                case '.':
+                    {
+                        cls any;
+                        any.add('\n', '\n');
+                        any.add('\r', '\r');
+                        any.add(0x2028, 0x2029);
+                        atom.type = node::CLASS;
+                        atom.cls  = add_class(std::move(any), true);
+                    } break;
+                case '\\':
+                    {
+                        cls esc;
+                        bool negate = false;
+                        parse_escape(esc, negate, false);
+                        atom.type = node::CLASS;
+                        atom.cls  = add_class(std::move(esc), negate);
+                    } break;
+                case '*': case '+': case '?': case '{': case ')': case ']': case '}': case '|':
+                    throw std::runtime_error("unexpected character");
+                default:
+                    {
+                        cls lit;
+                        lit.add(c, c);
+                        atom.type = node::CLASS;
+                        atom.cls  = add_class(std::move(lit), false);
+                    } break;
+            }
+
+            int min = -1;
+            int max = -1;
+            if (peek('*')) {
+                ++pos; min = 0; max = -1;
+            } else if (peek('+')) {
+                ++pos; min = 1; max = -1;
+            } else if (peek('?')) {
+                ++pos; min = 0; max = 1;
+            } else if (peek('{')) {
+                ++pos;
+                min = parse_int();
+                max = min;
+                if (peek(',')) {
+                    ++pos;
+                    max = peek('}') ? -1 : parse_int();
+                }
+                if (!peek('}') || (max >= 0 && max < min)) {
+                    throw std::runtime_error("invalid quantifier");
+                }
+                ++pos;
+            }
+
+            if (min < 0) {
+                return atom;
+            }
+            if (!quantifiable) {
+                throw std::runtime_error("unsupported quantified assertion");
+            }
+            if (max < 0 && atom.nullable()) {
+                throw std::runtime_error("unsupported unbounded repetition of an empty match");
+            }
+
+            node rep;
+            rep.type = node::REPEAT;
+            rep.min = min;
+            rep.max = max;
+            if (peek('?')) {
+                ++pos;
+                rep.greedy = false;
+            }
+            rep.children.push_back(std::move(atom));
+            return rep;
+        }
+
+        int parse_int() {
+            if (pos >= pat.size() || pat[pos] < '0' || pat[pos] > '9') {
+                throw std::runtime_error("invalid quantifier");
+            }
+            int res = 0;
+            while (pos < pat.size() && pat[pos] >= '0' && pat[pos] <= '9') {
+                res = res*10 + (pat[pos++] - '0');
+                if (res > 1000) {
+                    throw std::runtime_error("quantifier too large");
+                }
+            }
+            return res;
+        }
+
+        uint32_t parse_hex(int n) {
+            uint32_t res = 0;
+            for (int i = 0; i < n; ++i) {
+                if (pos >= pat.size()) {
+                    throw std::runtime_error("invalid escape");
+                }
+                const uint32_t c = pat[pos++];
+                if      (c >= '0' && c <= '9') { res = res*16 + (c - '0'); }
+                else if (c >= 'a' && c <= 'f') { res = res*16 + (c - 'a' + 10); }
+                else if (c >= 'A' && c <= 'F') { res = res*16 + (c - 'A' + 10); }
+                else { throw std::runtime_error("invalid escape"); }
+            }
+            return res;
+        }
+
+        // the escape after '\', either a set (\s, \d, \w and their negations) or a single unit
+        // returns false for a set
+        bool parse_escape(cls & out, bool & negate, bool in_class) {
+            if (pos >= pat.size()) {
+                throw std::runtime_error("trailing '\\'");
+            }
+            const uint32_t c = pat[pos++];
+            uint32_t u;
+            switch (c) {
+                case 'd': case 'D':
+                    out.add('0', '9');
+                    negate = c == 'D';
+                    return false;
+                case 's': case 'S':
+                    out.add('\t', '\r');
+                    out.add(' ', ' ');
+                    negate = c == 'S';
+                    return false;
+                case 'w': case 'W':
+                    out.add('0', '9');
+                    out.add('A', 'Z');
+                    out.add('_', '_');
+                    out.add('a', 'z');
+                    negate = c == 'W';
+                    return false;
+                case 'r': u = '\r'; break;
+                case 'n': u = '\n'; break;
+                case 't': u = '\t'; break;
+                case 'v': u = '\v'; break;
+                case 'f': u = '\f'; break;
+                case '0': u = 0;    break;
+                case 'x': u = parse_hex(2); break;
+                case 'u': u = parse_hex(4); break;
+                case 'b':
+                    if (!in_class) {
+                        throw std::runtime_error("unsupported word boundary");
+                    }
+                    u = '\b';
+                    break;
+                default:
+                    if ((c >= '0' && c <= '9') || (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z')) {
+                        throw std::runtime_error("unsupported escape");
+                    }
+                    u = c;
+                    break;
+            }
+            out.add(u, u);
+            return true;
+        }
+
+        int parse_class() {
+            cls res;
+            bool negate = false;
+            if (peek('^')) {
+                ++pos;
+                negate = true;
+            }
+
+            bool first = true;
+            while (true) {
+                if (pos >= pat.size()) {
+                    throw std::runtime_error("missing ']'");
+                }
+                if (pat[pos] == ']') {
+                    if (first) {
+                        throw std::runtime_error("unsupported empty class");
+                    }
+                    ++pos;
+                    break;
+                }
+                first = false;
+
+                // one atom of the class, a single unit or a set
+                cls atom;
+                bool atom_negate = false;
+                bool single = true;
+                if (pat[pos] == '\\') {
+                    ++pos;
+                    single = parse_escape(atom, atom_negate, true);
+                } else {
+                    atom.add(pat[pos], pat[pos]);
+                    ++pos;
+                }
+
+                if (single && peek('-') && pos + 1 < pat.size() && pat[pos + 1] != ']') {
+                    // range
+                    ++pos;
+                    cls last;
+                    bool last_negate = false;
+                    if (pat[pos] == '\\') {
+                        ++pos;
+                        if (!parse_escape(last, last_negate, true)) {
+                            throw std::runtime_error("invalid class range");
+                        }
+                    } else {
+                        last.add(pat[pos], pat[pos]);
+                        ++pos;
+                    }
+                    if (last.ranges[0].first < atom.ranges[0].first) {
+                        throw std::runtime_error("invalid class range");
+                    }
+                    res.add(atom.ranges[0].first, last.ranges[0].first);
+                    continue;
+                }
+
+                if (atom_negate) {
+                    atom.finalize(true);
+                }
+                res.add(atom);
+            }
+
+            return add_class(std::move(res), negate);
+        }
+    };
+
+    void compile(const node & root) {
+        progs.emplace_back();
+        emit(0, root);
+        progs[0].push_back({OP_MATCH, 0, 0});
+    }
+
+    void emit(size_t pi, const node & n) {
+        switch (n.type) {
+            case node::EMPTY:
+                break;
+            case node::CLASS:
+                progs[pi].push_back({OP_CLASS, n.cls, 0});
+                break;
+            case node::BOL:
+                progs[pi].push_back({OP_BOL, 0, 0});
+                break;
+            case node::EOL:
+                progs[pi].push_back({OP_EOL, 0, 0});
+                break;
+            case node::CAT:
+                for (const auto & child : n.children) {
+                    emit(pi, child);
+                }
+                break;
+            case node::ALT:
+                {
+                    std::vector<size_t> jumps;
+                    for (size_t i = 0; i < n.children.size(); ++i) {
+                        size_t split = 0;
+                        if (i + 1 < n.children.size()) {
+                            split = progs[pi].size();
+                            progs[pi].push_back({OP_SPLIT, (int) split + 1, 0});
+                        }
+                        emit(pi, n.children[i]);
+                        if (i + 1 < n.children.size()) {
+                            jumps.push_back(progs[pi].size());
+                            progs[pi].push_back({OP_JMP, 0, 0});
+                            progs[pi][split].y = (int) progs[pi].size();
+                        }
+                    }
+                    for (size_t j : jumps) {
+                        progs[pi][j].x = (int) progs[pi].size();
+                    }
+                } break;
+            case node::REPEAT:
+                {
+                    for (int i = 0; i < n.min; ++i) {
+                        emit(pi, n.children[0]);
+                    }
+                    if (n.max < 0) {
+                        const size_t split = progs[pi].size();
+                        progs[pi].push_back({OP_SPLIT, 0, 0});
+                        emit(pi, n.children[0]);
+                        progs[pi].push_back({OP_JMP, (int) split, 0});
+                        set_split(pi, split, (int) split + 1, (int) progs[pi].size(), n.greedy);
+                    } else {
+                        std::vector<size_t> splits;
+                        for (int i = n.min; i < n.max; ++i) {
+                            splits.push_back(progs[pi].size());
+                            progs[pi].push_back({OP_SPLIT, 0, 0});
+                            emit(pi, n.children[0]);
+                        }
+                        for (size_t split : splits) {
+                            set_split(pi, split, (int) split + 1, (int) progs[pi].size(), n.greedy);
+                        }
+                    }
+                } break;
+            case node::LOOK:
+                {
+                    const size_t sub = progs.size();
+                    progs.emplace_back();
+                    emit(sub, n.children[0]);
+                    progs[sub].push_back({OP_MATCH, 0, 0});
+                    progs[pi].push_back({OP_LOOK, (int) sub, n.negative ? 1 : 0});
+                } break;
+        }
+    }
+
+    void set_split(size_t pi, size_t split, int body, int out, bool greedy) {
+        progs[pi][split].x = greedy ? body : out;
+        progs[pi][split].y = greedy ? out  : body;
+    }
+
+    int64_t run(size_t pi, const uint32_t * units, size_t begin, size_t end, size_t pos, bool not_null, std::vector<std::pair<int, size_t>> & stack) const {
+        const auto & prog = progs[pi];
+        const size_t base  = stack.size();
+        const size_t start = pos;
+
+        int pc = 0;
+        while (true) {
+            const inst & in = prog[pc];
+            bool ok = true;
+            switch (in.op) {
+                case OP_CLASS:
+                    if (pos < end && classes[in.x].has(units[pos])) {
+                        ++pos;
+                        ++pc;
+                    } else {
+                        ok = false;
+                    }
+                    break;
+                case OP_SPLIT:
+                    stack.emplace_back(in.y, pos);
+                    pc = in.x;
+                    break;
+                case OP_JMP:
+                    pc = in.x;
+                    break;
+                case OP_BOL:
+                    ok = pos == begin;
+                    ++pc;
+                    break;
+                case OP_EOL:
+                    ok = pos == end;
+                    ++pc;
+                    break;
+                case OP_LOOK:
+                    ok = (run(in.x, units, begin, end, pos, false, stack) >= 0) != (in.y != 0);
+                    ++pc;
+                    break;
+                case OP_MATCH:
+                    if (not_null && pos == start) {
+                        ok = false;
+                        break;
+                    }
+                    stack.resize(base);
+                    return (int64_t) pos;
+            }
+
+            if (!ok) {
+                if (stack.size() == base) {
+                    return -1;
+                }
+                pc  = stack.back().first;
+                pos = stack.back().second;
+                stack.pop_back();
+            }
+        }
+    }
+};
+
+// compiled matchers are shared by all the vocabs, nullptr if the regex is not supported by unicode_regex_matcher
+static std::shared_ptr<const unicode_regex_matcher> unicode_regex_matcher_get(const std::vector<uint32_t> & pattern) {
+    static std::mutex mutex;
+    static std::map<std::vector<uint32_t>, std::shared_ptr<const unicode_regex_matcher>> cache;
+
+    std::lock_guard<std::mutex> lock(mutex);
+
+    auto it = cache.find(pattern);
+    if (it == cache.end()) {
+        std::shared_ptr<const unicode_regex_matcher> matcher;
+        try {
+            matcher = std::make_shared<const unicode_regex_matcher>(pattern);
+        } catch (const std::runtime_error &) {
+            matcher = nullptr;
+        }
+        it = cache.emplace(pattern, std::move(matcher)).first;
+    }
+
+    return it->second;
+}
+
 static std::vector<size_t> unicode_regex_split_custom(const std::string & text, const std::string & regex_expr, const std::vector<size_t> & offsets) {
     std::vector<size_t> bpe_offsets;
 
@@ -567,6 +1228,9 @@ static std::vector<size_t> unicode_regex_split_custom(const std::string & text,
     return bpe_offsets;
 }
 
+// minimum number of codepoints for each thread building the words in unicode_regex_split
+#define UNICODE_SPLIT_MIN_CPTS_PER_THREAD 16384
+
 //
 // interface
 //
@@ -614,26 +1278,51 @@ std::vector<uint32_t> unicode_cpts_normalize_nfd(const std::vector<uint32_t> & c
 }
 
 std::vector<uint32_t> unicode_cpts_from_utf8(const std::string & utf8) {
-    std::vector<uint32_t> result;
-    result.reserve(utf8.size());
+    const uint8_t * src = reinterpret_cast<const uint8_t *>(utf8.data());
+    const size_t size = utf8.size();
+
+    // at most one codepoint per byte, the result is shrunk at the end
+    std::vector<uint32_t> result(size);
+    uint32_t * dst = result.data();
+
     size_t offset = 0;
-    while (offset < utf8.size()) {
-        try {
-            result.push_back(unicode_cpt_from_utf8(utf8, offset));
+    while (offset < size) {
+        // ASCII fast path: widen 8 bytes at a time while none of them has the high bit set
+        while (offset + 8 <= size) {
+            uint64_t chunk;
+            memcpy(&chunk, src + offset, sizeof(chunk));
+            if (chunk & 0x8080808080808080ull) {
+                break;
+            }
+            for (size_t i = 0; i < 8; ++i) {
+                dst[i] = src[offset + i];
+            }
+            dst    += 8;
+            offset += 8;
+        }
+        if (offset >= size) {
+            break;
         }
-        catch (const std::invalid_argument & /*ex*/) {
+
+        uint32_t cpt;
+        const size_t len = unicode_cpt_decode_utf8(src, size, offset, cpt);
+        if (len == 0) {
             // Silently ignore invalid UTF-8 input to avoid leaking the exception beyond llama_tokenize
             ++offset;
-            result.emplace_back(0xFFFD); // replacement character
+            *dst++ = 0xFFFD; // replacement character
+        } else {
+            offset += len;
+            *dst++ = cpt;
         }
     }
+
+    result.resize(dst - result.data());
     return result;
 }
 
 unicode_cpt_flags unicode_cpt_flags_from_cpt(const uint32_t cpt) {
-    static const unicode_cpt_flags undef(unicode_cpt_flags::UNDEFINED);
-    static const auto cpt_flags = unicode_cpt_flags_array();
-    return cpt < cpt_flags.size() ? cpt_flags[cpt] : undef;
+    static const unicode_cpt_flags_table cpt_flags(unicode_cpt_flags_array());
+    return cpt_flags.get(cpt);
 }
 
 unicode_cpt_flags unicode_cpt_flags_from_utf8(const std::string & utf8) {
@@ -667,7 +1356,7 @@ uint32_t unicode_tolower(uint32_t cpt) {
     return cpt;  // Return the original code point if no lowercase mapping is found
 }
 
-std::vector<std::string> unicode_regex_split(const std::string & text, const std::vector<std::string> & regex_exprs) {
+std::vector<std::string> unicode_regex_split(const std::string & text, const std::vector<std::string> & regex_exprs, int n_threads) {
     // unicode categories
     static const std::map<std::string, int> k_ucat_enum = {
         { "\\p{N}", unicode_cpt_flags::NUMBER },
@@ -737,6 +1426,9 @@ std::vector<std::string> unicode_regex_split(const std::string & text, const std
 
     std::vector<size_t> bpe_offsets = { cpts.size() };
 
+    // text_collapsed as units for unicode_regex_matcher, built on first use
+    std::vector<uint32_t> units_collapsed;
+
     for (const auto & regex_expr : regex_exprs) {
         // first, see if we have an efficient custom regex implementation
         auto tmp = unicode_regex_split_custom(text, regex_expr, bpe_offsets);
@@ -809,7 +1501,17 @@ std::vector<std::string> unicode_regex_split(const std::string & text, const std
 
                 //printf("text_collapsed: %s\n", text_collapsed.c_str());
                 //printf("regex_expr_collapsed: %s\n", regex_expr_collapsed.c_str());
-                bpe_offsets = unicode_regex_split_stl(text_collapsed, regex_expr_collapsed, bpe_offsets);
+                const auto matcher = unicode_regex_matcher_get(std::vector<uint32_t>(
+                            (const unsigned char *) regex_expr_collapsed.data(),
+                            (const unsigned char *) regex_expr_collapsed.data() + regex_expr_collapsed.size()));
+                if (matcher) {
+                    if (units_collapsed.empty() && !text_collapsed.empty()) {
+                        units_collapsed.assign((const unsigned char *) text_collapsed.data(), (const unsigned char *) text_collapsed.data() + text_collapsed.size());
+                    }
+                    bpe_offsets = matcher->split(units_collapsed, bpe_offsets);
+                } else {
+                    bpe_offsets = unicode_regex_split_stl(text_collapsed, regex_expr_collapsed, bpe_offsets);
+                }
             } else {
                 // no unicode category used, we can use std::wregex directly
                 const std::wstring wregex_expr = unicode_wstring_from_utf8(regex_expr);
@@ -824,7 +1526,12 @@ std::vector<std::string> unicode_regex_split(const std::string & text, const std
 
                 //printf("text: %s\n", text.c_str());
                 //printf("regex_expr: %s\n", regex_expr.c_str());
-                bpe_offsets = unicode_regex_split_stl(wtext, wregex_expr, bpe_offsets);
+                const auto matcher = unicode_regex_matcher_get(std::vector<uint32_t>(wregex_expr.begin(), wregex_expr.end()));
+                if (matcher) {
+                    bpe_offsets = matcher->split(std::vector<uint32_t>(wtext.begin(), wtext.end()), bpe_offsets);
+                } else {
+                    bpe_offsets = unicode_regex_split_stl(wtext, wregex_expr, bpe_offsets);
+                }
             }
         } catch (std::regex_error & e) {
             fprintf(stderr, "Failed to process regex: '%s'\n", regex_expr.c_str());
@@ -833,17 +1540,49 @@ std::vector<std::string> unicode_regex_split(const std::string & text, const std
         }
     }
 
-    std::vector<std::string> bpe_words;
-    bpe_words.reserve(bpe_offsets.size()); // reserve memory for the approximate size
+    std::vector<size_t> bpe_starts(bpe_offsets.size() + 1, 0);
+    for (size_t i = 0; i < bpe_offsets.size(); ++i) {
+        bpe_starts[i + 1] = bpe_starts[i] + bpe_offsets[i];
+    }
 
-    size_t start = 0;
-    for (size_t & offset : bpe_offsets) {
-        bpe_words.emplace_back();
-        for (size_t i = start; i < start + offset; ++i) {
-            bpe_words.back() += unicode_cpt_to_utf8(cpts[i]);
+    // build the byte-encoded words [i0, i1)
+    std::vector<std::string> bpe_words(bpe_offsets.size());
+    const auto encode_words = [&](size_t i0, size_t i1) {
+        std::string text_utf;
+        for (size_t i = i0; i < i1; ++i) {
+            text_utf.clear();
+            for (size_t j = bpe_starts[i]; j < bpe_starts[i + 1]; ++j) {
+                text_utf += unicode_cpt_to_utf8(cpts[j]);
+            }
+
+            std::string & encoded_token = bpe_words[i];
+            for (char c : text_utf) {
+                encoded_token += unicode_byte_to_utf8(c);
+            }
+        }
+    };
+
+    // the words are independent, split long texts in ranges of words with about the same number of codepoints
+    const size_t n_workers = std::min<size_t>(std::max(n_threads, 1), cpts.size() / UNICODE_SPLIT_MIN_CPTS_PER_THREAD);
+    if (n_workers <= 1) {
+        encode_words(0, bpe_offsets.size());
+    } else {
+        std::vector<size_t> bounds = { 0 };
+        for (size_t t = 1; t < n_workers; ++t) {
+            const size_t target = cpts.size() * t / n_workers;
+            bounds.push_back(std::lower_bound(bpe_starts.begin() + bounds.back(), bpe_starts.end() - 1, target) - bpe_starts.begin());
+        }
+        bounds.push_back(bpe_offsets.size());
+
+        std::vector<std::thread> workers;
+        for (size_t t = 1; t < n_workers; ++t) {
+            workers.emplace_back(encode_words, bounds[t], bounds[t + 1]);
+        }
+        encode_words(bounds[0], bounds[1]);
+        for (auto & worker : workers) {
+            worker.join();
         }
-        start += offset;
     }
 
-    return unicode_byte_encoding_process(bpe_words);
+    return bpe_words;
 }
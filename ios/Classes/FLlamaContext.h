@@ -13,6 +13,7 @@
     fllama::fllama_context * llama;
 }
 
++ (NSDictionary *)modelInfo:(NSString *)path skip:(NSArray *)skip params:(NSDictionary *)params;
 + (instancetype)initWithParams:(NSDictionary *)params onProgress:(void (^)(unsigned int progress))onProgress;
 - (bool)isMetalEnabled;
 - (NSString *)reasonNoMetal;
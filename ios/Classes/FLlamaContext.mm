@@ -1,10 +1,282 @@
 #import <Metal/Metal.h>
 #import "FLlamaContext.h"
 
+#include <algorithm>
+#include <string>
+
 // === Llama ===
 
 @implementation FLlamaContext
 
+static NSString * gguf_data_to_str(enum lm_gguf_type type, const void * data, int i) {
+    switch (type) {
+        case LM_GGUF_TYPE_UINT8:   return [NSString stringWithFormat:@"%u", ((const uint8_t *)data)[i]];
+        case LM_GGUF_TYPE_INT8:    return [NSString stringWithFormat:@"%d", ((const int8_t *)data)[i]];
+        case LM_GGUF_TYPE_UINT16:  return [NSString stringWithFormat:@"%u", ((const uint16_t *)data)[i]];
+        case LM_GGUF_TYPE_INT16:   return [NSString stringWithFormat:@"%d", ((const int16_t *)data)[i]];
+        case LM_GGUF_TYPE_UINT32:  return [NSString stringWithFormat:@"%u", ((const uint32_t *)data)[i]];
+        case LM_GGUF_TYPE_INT32:   return [NSString stringWithFormat:@"%d", ((const int32_t *)data)[i]];
+        case LM_GGUF_TYPE_UINT64:  return [NSString stringWithFormat:@"%llu", (unsigned long long)((const uint64_t *)data)[i]];
+        case LM_GGUF_TYPE_INT64:   return [NSString stringWithFormat:@"%lld", (long long)((const int64_t *)data)[i]];
+        case LM_GGUF_TYPE_FLOAT32: return [NSString stringWithFormat:@"%f", ((const float *)data)[i]];
+        case LM_GGUF_TYPE_FLOAT64: return [NSString stringWithFormat:@"%f", ((const double *)data)[i]];
+        case LM_GGUF_TYPE_BOOL:    return ((const bool *)data)[i] ? @"true" : @"false";
+        default:                   return [NSString stringWithFormat:@"unknown type %d", type];
+    }
+}
+
+// arrays longer than this (the tokenizer vocab, scores and merges) are given as their length in the metadata
+static const int model_info_max_arr_n = 256;
+
+// a numeric value of the GGUF metadata, the element il of a per-layer array (or its largest element if il < 0)
+static bool gguf_get_u32(const struct lm_gguf_context * ctx, const std::string & key, uint32_t & out, int il = -1) {
+    const int i = lm_gguf_find_key(ctx, key.c_str());
+    if (i < 0) {
+        return false;
+    }
+    enum lm_gguf_type type = lm_gguf_get_kv_type(ctx, i);
+    const void * data = nullptr;
+    int n = 1;
+    if (type == LM_GGUF_TYPE_ARRAY) {
+        type = lm_gguf_get_arr_type(ctx, i);
+        data = lm_gguf_get_arr_data(ctx, i);
+        n = lm_gguf_get_arr_n(ctx, i);
+    } else {
+        data = lm_gguf_get_val_data(ctx, i);
+    }
+    if (n == 0) {
+        return false;
+    }
+    uint64_t res = 0;
+    for (int j = il >= 0 ? std::min(il, n - 1) : 0; j < (il >= 0 ? std::min(il, n - 1) + 1 : n); j++) {
+        uint64_t v = 0;
+        switch (type) {
+            case LM_GGUF_TYPE_UINT8:  v = ((const uint8_t  *)data)[j]; break;
+            case LM_GGUF_TYPE_INT8:   v = std::max<int8_t> (0, ((const int8_t  *)data)[j]); break;
+            case LM_GGUF_TYPE_UINT16: v = ((const uint16_t *)data)[j]; break;
+            case LM_GGUF_TYPE_INT16:  v = std::max<int16_t>(0, ((const int16_t *)data)[j]); break;
+            case LM_GGUF_TYPE_UINT32: v = ((const uint32_t *)data)[j]; break;
+            case LM_GGUF_TYPE_INT32:  v = std::max<int32_t>(0, ((const int32_t *)data)[j]); break;
+            case LM_GGUF_TYPE_UINT64: v = ((const uint64_t *)data)[j]; break;
+            case LM_GGUF_TYPE_INT64:  v = std::max<int64_t>(0, ((const int64_t *)data)[j]); break;
+            default: return false;
+        }
+        res = std::max(res, v);
+    }
+    out = (uint32_t) res;
+    return true;
+}
+
+static enum lm_ggml_type kv_cache_type_from_str(NSString *name) {
+    if (name != nil && [name isKindOfClass:[NSString class]]) {
+        for (int i = 0; i < LM_GGML_TYPE_COUNT; i++) {
+            const char * type_name = lm_ggml_type_name((enum lm_ggml_type) i);
+            if (type_name && strcmp(type_name, [name UTF8String]) == 0) {
+                return (enum lm_ggml_type) i;
+            }
+        }
+    }
+    return LM_GGML_TYPE_F16;
+}
+
+static NSString * ftype_name(uint32_t ftype) {
+    switch (ftype) {
+        case LLAMA_FTYPE_ALL_F32:        return @"all F32";
+        case LLAMA_FTYPE_MOSTLY_F16:     return @"F16";
+        case LLAMA_FTYPE_MOSTLY_BF16:    return @"BF16";
+        case LLAMA_FTYPE_MOSTLY_Q4_0:    return @"Q4_0";
+        case LLAMA_FTYPE_MOSTLY_Q4_1:    return @"Q4_1";
+        case LLAMA_FTYPE_MOSTLY_Q5_0:    return @"Q5_0";
+        case LLAMA_FTYPE_MOSTLY_Q5_1:    return @"Q5_1";
+        case LLAMA_FTYPE_MOSTLY_Q8_0:    return @"Q8_0";
+        case LLAMA_FTYPE_MOSTLY_Q2_K:    return @"Q2_K - Medium";
+        case LLAMA_FTYPE_MOSTLY_Q2_K_S:  return @"Q2_K - Small";
+        case LLAMA_FTYPE_MOSTLY_Q3_K_S:  return @"Q3_K - Small";
+        case LLAMA_FTYPE_MOSTLY_Q3_K_M:  return @"Q3_K - Medium";
+        case LLAMA_FTYPE_MOSTLY_Q3_K_L:  return @"Q3_K - Large";
+        case LLAMA_FTYPE_MOSTLY_Q4_K_S:  return @"Q4_K - Small";
+        case LLAMA_FTYPE_MOSTLY_Q4_K_M:  return @"Q4_K - Medium";
+        case LLAMA_FTYPE_MOSTLY_Q5_K_S:  return @"Q5_K - Small";
+        case LLAMA_FTYPE_MOSTLY_Q5_K_M:  return @"Q5_K - Medium";
+        case LLAMA_FTYPE_MOSTLY_Q6_K:    return @"Q6_K";
+        case LLAMA_FTYPE_MOSTLY_IQ4_NL:  return @"IQ4_NL - 4.5 bpw";
+        case LLAMA_FTYPE_MOSTLY_IQ4_XS:  return @"IQ4_XS - 4.25 bpw";
+        default:                         return @"unknown, may not work";
+    }
+}
+
+// the fields of -modelInfo read from the GGUF header only, no tensor data is loaded and no context is created,
+// with the memory of a context with params n_ctx (0 for the training context), n_batch, cache_type_k and cache_type_v
+// (kvSize, computeSize and outputSize, estimated like llama_model_estimate_memory, not given for recurrent models)
++ (NSDictionary *)modelInfo:(NSString *)path skip:(NSArray *)skip params:(NSDictionary *)params {
+    struct lm_ggml_context * meta = NULL;
+    struct lm_gguf_init_params gguf_params = {
+        /*.no_alloc = */ true,
+        /*.ctx      = */ &meta,
+    };
+
+    struct lm_gguf_context * ctx = lm_gguf_init_from_file([path UTF8String], gguf_params);
+    if (!ctx) {
+        NSLog(@"%s: failed to load '%s'", __func__, [path UTF8String]);
+        return @{};
+    }
+
+    NSMutableDictionary *metadata = [NSMutableDictionary dictionary];
+
+    const int n_kv = lm_gguf_get_n_kv(ctx);
+    for (int i = 0; i < n_kv; i++) {
+        NSString *key = [NSString stringWithUTF8String:lm_gguf_get_key(ctx, i)];
+        if (skip && [skip containsObject:key]) {
+            continue;
+        }
+
+        const enum lm_gguf_type type = lm_gguf_get_kv_type(ctx, i);
+        NSString *val = nil;
+        if (type == LM_GGUF_TYPE_STRING) {
+            val = [NSString stringWithUTF8String:lm_gguf_get_val_str(ctx, i)];
+        } else if (type == LM_GGUF_TYPE_ARRAY && lm_gguf_get_arr_n(ctx, i) > model_info_max_arr_n) {
+            val = [NSString stringWithFormat:@"%d", lm_gguf_get_arr_n(ctx, i)];
+        } else if (type == LM_GGUF_TYPE_ARRAY) {
+            const enum lm_gguf_type arr_type = lm_gguf_get_arr_type(ctx, i);
+            const int arr_n = lm_gguf_get_arr_n(ctx, i);
+            NSMutableArray *items = [NSMutableArray arrayWithCapacity:arr_n];
+            for (int j = 0; j < arr_n; j++) {
+                if (arr_type == LM_GGUF_TYPE_STRING) {
+                    NSString *item = [NSString stringWithUTF8String:lm_gguf_get_arr_str(ctx, i, j)];
+                    item = [item stringByReplacingOccurrencesOfString:@"\\" withString:@"\\\\"];
+                    item = [item stringByReplacingOccurrencesOfString:@"\"" withString:@"\\\""];
+                    [items addObject:[NSString stringWithFormat:@"\"%@\"", item ?: @""]];
+                } else if (arr_type == LM_GGUF_TYPE_ARRAY) {
+                    [items addObject:@"???"];
+                } else {
+                    [items addObject:gguf_data_to_str(arr_type, lm_gguf_get_arr_data(ctx, i), j)];
+                }
+            }
+            val = [NSString stringWithFormat:@"[%@]", [items componentsJoinedByString:@", "]];
+        } else {
+            val = gguf_data_to_str(type, lm_gguf_get_val_data(ctx, i), 0);
+        }
+        metadata[key] = val ?: @"";
+    }
+
+    // size and nParams, from the tensor infos
+    uint64_t size = 0;
+    uint64_t n_params = 0;
+    for (struct lm_ggml_tensor * t = lm_ggml_get_first_tensor(meta); t != NULL; t = lm_ggml_get_next_tensor(meta, t)) {
+        size     += lm_ggml_nbytes(t);
+        n_params += lm_ggml_nelements(t);
+    }
+
+    const int arch_idx = lm_gguf_find_key(ctx, "general.architecture");
+    const std::string arch = arch_idx >= 0 ? lm_gguf_get_val_str(ctx, arch_idx) : "";
+    const int size_label_idx = lm_gguf_find_key(ctx, "general.size_label");
+    uint32_t ftype = LLAMA_FTYPE_ALL_F32;
+    gguf_get_u32(ctx, "general.file_type", ftype);
+
+    NSString *desc = [NSString stringWithFormat:@"%s %s %@", arch.c_str(),
+                      size_label_idx >= 0 ? lm_gguf_get_val_str(ctx, size_label_idx) : "?B", ftype_name(ftype)];
+
+    NSMutableDictionary *info = [NSMutableDictionary dictionaryWithDictionary:@{
+        @"desc": desc,
+        @"size": @(size),
+        @"nParams": @(n_params),
+        @"isChatTemplateSupported": @(lm_gguf_find_key(ctx, "tokenizer.chat_template") >= 0),
+        @"version": @(lm_gguf_get_version(ctx)),
+        @"alignment": @(lm_gguf_get_alignment(ctx)),
+        @"dataOffset": @(lm_gguf_get_data_offset(ctx)),
+        @"nTensors": @(lm_gguf_get_n_tensors(ctx)),
+        @"metadata": metadata
+    }];
+
+    // the memory of a context, for the hyperparameters of a transformer
+    uint32_t n_layer = 0;
+    uint32_t n_embd = 0;
+    uint32_t n_head = 0;
+    const bool is_recurrent = lm_gguf_find_key(ctx, (arch + ".ssm.conv_kernel").c_str()) >= 0 ||
+        arch.rfind("rwkv", 0) == 0 || arch.rfind("arwkv", 0) == 0 || arch.rfind("mamba", 0) == 0;
+
+    if (!is_recurrent &&
+        gguf_get_u32(ctx, arch + ".block_count", n_layer) &&
+        gguf_get_u32(ctx, arch + ".embedding_length", n_embd) &&
+        gguf_get_u32(ctx, arch + ".attention.head_count", n_head) && n_head > 0) {
+        uint32_t n_ctx_train = 0;
+        gguf_get_u32(ctx, arch + ".context_length", n_ctx_train);
+
+        uint32_t n_vocab = 0;
+        if (!gguf_get_u32(ctx, arch + ".vocab_size", n_vocab)) {
+            const int tokens_idx = lm_gguf_find_key(ctx, "tokenizer.ggml.tokens");
+            n_vocab = tokens_idx >= 0 ? lm_gguf_get_arr_n(ctx, tokens_idx) : 0;
+        }
+
+        uint32_t n_embd_head_k = n_embd / n_head;
+        uint32_t n_embd_head_v = n_embd / n_head;
+        gguf_get_u32(ctx, arch + ".attention.key_length", n_embd_head_k);
+        gguf_get_u32(ctx, arch + ".attention.value_length", n_embd_head_v);
+
+        uint32_t n_expert = 0;
+        uint32_t n_expert_used = 0;
+        uint32_t n_ff_exp = 0;
+        gguf_get_u32(ctx, arch + ".expert_count", n_expert);
+        gguf_get_u32(ctx, arch + ".expert_used_count", n_expert_used);
+        gguf_get_u32(ctx, arch + ".expert_feed_forward_length", n_ff_exp);
+
+        // the context sizes, as resolved by the llama_context constructor (no flash attention in this build)
+        uint32_t n_ctx = [params[@"n_ctx"] isKindOfClass:[NSNumber class]] ? [params[@"n_ctx"] unsignedIntValue] : 512;
+        if (n_ctx == 0) {
+            n_ctx = n_ctx_train;
+        }
+        n_ctx = LM_GGML_PAD(n_ctx, 32);
+        uint32_t n_batch = [params[@"n_batch"] isKindOfClass:[NSNumber class]] ? [params[@"n_batch"] unsignedIntValue] : 512;
+        n_batch = std::max<uint32_t>(std::min(n_ctx, n_batch), LM_GGML_KQ_MASK_PAD);
+        const uint32_t n_ubatch = std::min<uint32_t>(n_batch, 512);
+
+        const enum lm_ggml_type type_k = kv_cache_type_from_str(params[@"cache_type_k"]);
+        const enum lm_ggml_type type_v = kv_cache_type_from_str(params[@"cache_type_v"]);
+
+        uint64_t kv = 0;
+        uint32_t n_head_max = 0;
+        uint32_t n_ff_max = 0;
+        uint32_t n_embd_max = n_embd;
+        for (uint32_t il = 0; il < n_layer; il++) {
+            uint32_t n_head_il = n_head;
+            uint32_t n_head_kv_il = 0;
+            uint32_t n_ff_il = 0;
+            gguf_get_u32(ctx, arch + ".attention.head_count", n_head_il, il);
+            if (!gguf_get_u32(ctx, arch + ".attention.head_count_kv", n_head_kv_il, il)) {
+                n_head_kv_il = n_head_il;
+            }
+            gguf_get_u32(ctx, arch + ".feed_forward_length", n_ff_il, il);
+
+            const uint32_t n_embd_k_gqa = n_embd_head_k*n_head_kv_il;
+            const uint32_t n_embd_v_gqa = n_embd_head_v*n_head_kv_il;
+
+            kv += lm_ggml_row_size(type_k, (int64_t) n_embd_k_gqa*n_ctx);
+            kv += lm_ggml_row_size(type_v, (int64_t) n_embd_v_gqa*n_ctx);
+
+            n_head_max = std::max(n_head_max, n_head_il);
+            n_ff_max   = std::max(n_ff_max, n_ff_il);
+            n_embd_max = std::max(n_embd_max, std::max(n_embd_k_gqa, n_embd_v_gqa));
+        }
+
+        const uint64_t n_tokens = n_ubatch;
+        const uint64_t act  = 4*(uint64_t) n_embd_max*n_tokens;
+        const uint64_t attn = (uint64_t) (n_embd_head_k + n_embd_head_v)*n_head_max*n_tokens*2 + 2*(uint64_t) n_ctx*n_tokens*n_head_max;
+        const uint64_t ffn  = n_expert_used > 0 ?
+            3*(uint64_t) (n_ff_exp ? n_ff_exp : n_ff_max)*n_expert_used*n_tokens + (uint64_t) n_expert*n_tokens :
+            3*(uint64_t) n_ff_max*n_tokens;
+        const uint64_t out  = (uint64_t) n_vocab*n_tokens;
+
+        info[@"kvSize"] = @(kv);
+        info[@"computeSize"] = @(std::max(act + std::max(attn, ffn), act + out)*sizeof(float));
+        info[@"outputSize"] = @((uint64_t) n_vocab*sizeof(float));
+    }
+
+    lm_gguf_free(ctx);
+    lm_ggml_free(meta);
+
+    return info;
+}
+
 + (instancetype)initWithParams:(NSDictionary *)params onProgress:(void (^)(unsigned int progress))onProgress {
     // llama_backend_init(false);
     common_params defaultParams;
@@ -192,23 +464,23 @@
     return [NSString stringWithUTF8String:formatted_chat.c_str()];
 }
 
-- (NSArray *)tokenProbsToDict:(std::vector<fllama::completion_token_output>)probs {
-    NSMutableArray *out = [[NSMutableArray alloc] init];
+- (NSArray *)tokenProbsToDict:(size_t)begin end:(size_t)end {
+    fllama::completion_token_probs &probs = llama->generated_token_probs;
+
+    NSMutableArray *out = [[NSMutableArray alloc] initWithCapacity:end - begin];
 
-    for (const auto &prob : probs) {
-        NSMutableArray *probsForToken = [[NSMutableArray alloc] init];
+    for (size_t i = begin; i < end; ++i) {
+        NSMutableArray *probsForToken = [[NSMutableArray alloc] initWithCapacity:probs.probs_begin[i + 1] - probs.probs_begin[i]];
 
-        for (const auto &p : prob.probs) {
-            std::string tokStr = fllama::tokens_to_output_formatted_string(llama->ctx, p.tok);
+        for (size_t j = probs.probs_begin[i]; j < probs.probs_begin[i + 1]; ++j) {
             [probsForToken addObject:@{
-                 @"tok_str": [NSString stringWithUTF8String:tokStr.c_str()],
-                 @"prob": [NSNumber numberWithDouble:p.prob]
+                 @"tok_str": [NSString stringWithUTF8String:probs.piece(llama->ctx, probs.probs_tok[j])],
+                 @"prob": [NSNumber numberWithDouble:probs.probs_prob[j]]
             }];
         }
 
-        std::string tokStr = fllama::tokens_to_output_formatted_string(llama->ctx, prob.tok);
         [out addObject:@{
-             @"content": [NSString stringWithUTF8String:tokStr.c_str()],
+             @"content": [NSString stringWithUTF8String:probs.piece(llama->ctx, probs.tok[i])],
              @"probs": probsForToken
         }];
     }
@@ -392,23 +664,17 @@
 
             sent_count += to_send.size();
 
-            std::vector<fllama::completion_token_output> probs_output = {};
-
             NSMutableDictionary *tokenResult = [[NSMutableDictionary alloc] init];
             tokenResult[@"token"] = [NSString stringWithUTF8String:to_send.c_str()];
 
             if (llama->params.sparams.n_probs > 0) {
-                const std::vector<llama_token> to_send_toks = common_tokenize(llama->ctx, to_send, false);
+                // the tokens whose text has been sent so far, without tokenizing the text again
                 size_t probs_pos = std::min(sent_token_probs_index, llama->generated_token_probs.size());
-                size_t probs_stop_pos = std::min(sent_token_probs_index + to_send_toks.size(), llama->generated_token_probs.size());
-
-                if (probs_pos < probs_stop_pos) {
-                    probs_output = std::vector<fllama::completion_token_output>(llama->generated_token_probs.begin() + probs_pos, llama->generated_token_probs.begin() + probs_stop_pos);
-                }
+                size_t probs_stop_pos = std::max(probs_pos, llama->generated_token_probs.n_tokens_within(sent_count));
 
                 sent_token_probs_index = probs_stop_pos;
 
-                tokenResult[@"completion_probabilities"] = [self tokenProbsToDict:probs_output];
+                tokenResult[@"completion_probabilities"] = [self tokenProbsToDict:probs_pos end:probs_stop_pos];
             }
 
             onToken(tokenResult);
@@ -420,7 +686,7 @@
 
     return @{
         @"text": [NSString stringWithUTF8String:llama->generated_text.c_str()],
-        @"completion_probabilities": [self tokenProbsToDict:llama->generated_token_probs],
+        @"completion_probabilities": [self tokenProbsToDict:0 end:llama->generated_token_probs.size()],
         @"tokens_predicted": @(llama->num_tokens_predicted),
         @"tokens_evaluated": @(llama->num_prompt_tokens),
         @"truncated": @(llama->truncated),
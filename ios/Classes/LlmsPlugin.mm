@@ -1,5 +1,9 @@
 #import <CommonCrypto/CommonDigest.h>
 #import <Metal/Metal.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
 #include <sys/sysctl.h>
 #include <sys/types.h>
 #import "LlmsPlugin.h"
@@ -57,6 +61,8 @@ dispatch_queue_t llamaDQueue;
         [self handleGetCpuInfo:call result:result];
     } else if ([@"getFileSHA256" isEqualToString:call.method]) {
         [self handleGetFileSHA256:call result:result];
+    } else if ([@"modelInfo" isEqualToString:call.method]) {
+        [self handleModelInfo:call result:result];
     } else {
         result(FlutterMethodNotImplemented);
     }
@@ -123,6 +129,35 @@ dispatch_queue_t llamaDQueue;
     }
 }
 
+- (void)handleModelInfo:(FlutterMethodCall *)call result:(FlutterResult)result {
+    @try {
+        NSDictionary *arguments = call.arguments;
+        NSString *path = arguments[@"path"];
+        NSArray *skip = arguments[@"skip"];
+        if ([skip isKindOfClass:[NSNull class]]) {
+            skip = nil;
+        }
+
+        // only the GGUF header is read, it does not wait for the contexts on llamaDQueue
+        dispatch_async(dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0), ^{
+            @try {
+                @autoreleasepool {
+                    NSDictionary *info = [FLlamaContext modelInfo:path skip:skip params:arguments];
+                    if ([info count] == 0) {
+                        result([FlutterError errorWithCode:@"505" message:@"Failed to read the model" details:nil]);
+                    } else {
+                        result(info);
+                    }
+                }
+            } @catch (NSException *exception) {
+                result([FlutterError errorWithCode:@"500" message:exception.reason details:exception]);
+            }
+        });
+    } @catch (NSException *exception) {
+        result([FlutterError errorWithCode:@"505" message:exception.reason details:exception]);
+    }
+}
+
 - (void)handleGetFormattedChat:(FlutterMethodCall *)call result:(FlutterResult)result {
     @try {
         NSDictionary *arguments = call.arguments;
@@ -490,26 +525,46 @@ dispatch_queue_t llamaDQueue;
 }
 
 - (NSString *)calculateFileSHA256:(NSString *)filePath {
-    CC_SHA256_CTX sha256;
+    // stream the file through a large buffer, so that memory use does not depend on the model size
+    const int fd = open([filePath fileSystemRepresentation], O_RDONLY);
+    if (fd < 0) {
+        NSLog(@"Failed to open file: %s", strerror(errno));
+        return nil;
+    }
+    fcntl(fd, F_RDAHEAD, 1);
+
+    const size_t step = 16 * 1024 * 1024;
+    uint8_t *buf = (uint8_t *)malloc(step);
+    if (buf == NULL) {
+        close(fd);
+        return nil;
+    }
 
+    CC_SHA256_CTX sha256;
     CC_SHA256_Init(&sha256);
-    NSInputStream *inputStream = [NSInputStream inputStreamWithFileAtPath:filePath];
-    [inputStream open];
-    uint8_t buffer[8192]; // 8KB buffer
-    NSInteger bytesRead;
-
-    while ([inputStream hasBytesAvailable]) {
-        bytesRead = [inputStream read:buffer maxLength:sizeof(buffer)];
-
-        if (bytesRead < 0) {
-            NSLog(@"Failed to read file: %@", [inputStream streamError].localizedDescription);
-            [inputStream close];
-            return nil;
-        }
 
-        CC_SHA256_Update(&sha256, buffer, (CC_LONG)bytesRead);
+    bool ok = true;
+    for (;;) {
+        const ssize_t n = read(fd, buf, step);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            NSLog(@"Failed to read file: %s", strerror(errno));
+            ok = false;
+            break;
+        }
+        if (n == 0) {
+            break;
+        }
+        CC_SHA256_Update(&sha256, buf, (CC_LONG)n);
+    }
+    free(buf);
+    close(fd);
+    if (!ok) {
+        return nil;
     }
-    [inputStream close];
+
     unsigned char hash[CC_SHA256_DIGEST_LENGTH];
     CC_SHA256_Final(hash, &sha256);
     NSMutableString *hashString = [NSMutableString stringWithCapacity:CC_SHA256_DIGEST_LENGTH * 2];
@@ -1,6 +1,7 @@
 #ifndef FLLAMA_H
 #define FLLAMA_H
 
+#include <algorithm>
 #include <sstream>
 #include <iostream>
 #include "common.h"
@@ -130,6 +131,64 @@ static std::string tokens_to_output_formatted_string(const llama_context *ctx, c
     return out;
 }
 
+// probabilities of the generated tokens, stored as a struct of arrays
+// token i ends at byte text_end[i] of the generated text and its candidates are probs_tok/probs_prob[probs_begin[i], probs_begin[i + 1])
+struct completion_token_probs
+{
+    std::vector<llama_token> tok;
+    std::vector<size_t> text_end;
+    std::vector<size_t> probs_begin = {0};
+    std::vector<llama_token> probs_tok;
+    std::vector<float> probs_prob;
+
+    // formatted pieces of the tokens, resolved on first use and shared by all the completions of the context
+    std::string pieces;
+    std::unordered_map<llama_token, size_t> piece_offset;
+
+    size_t size() const { return tok.size(); }
+
+    void clear()
+    {
+        tok.clear();
+        text_end.clear();
+        probs_begin.assign(1, 0);
+        probs_tok.clear();
+        probs_prob.clear();
+    }
+
+    void push_back(const completion_token_output &out, size_t end)
+    {
+        tok.push_back(out.tok);
+        text_end.push_back(end);
+        for (const auto &p : out.probs)
+        {
+            probs_tok.push_back(p.tok);
+            probs_prob.push_back(p.prob);
+        }
+        probs_begin.push_back(probs_tok.size());
+    }
+
+    // number of tokens whose text lies within the first n_text bytes of the generated text
+    size_t n_tokens_within(size_t n_text) const
+    {
+        // text_end is non-decreasing, the generated text only grows while tokens are generated
+        return std::upper_bound(text_end.begin(), text_end.end(), n_text) - text_end.begin();
+    }
+
+    // NUL-terminated formatted piece of the token, valid until the next call
+    const char * piece(const llama_context *ctx, llama_token token)
+    {
+        auto it = piece_offset.find(token);
+        if (it == piece_offset.end())
+        {
+            it = piece_offset.emplace(token, pieces.size()).first;
+            pieces += tokens_to_output_formatted_string(ctx, token);
+            pieces.push_back('\0');
+        }
+        return pieces.c_str() + it->second;
+    }
+};
+
 template <class Iter>
 static std::string tokens_to_str(llama_context *ctx, Iter begin, Iter end)
 {
@@ -147,7 +206,7 @@ struct fllama_context
     bool is_interrupted = false;
     bool has_next_token = false;
     std::string generated_text;
-    std::vector<completion_token_output> generated_token_probs;
+    completion_token_probs generated_token_probs;
 
     size_t num_prompt_tokens = 0;
     size_t num_tokens_predicted = 0;
@@ -463,7 +522,7 @@ struct fllama_context
 
         if (params.sparams.n_probs > 0)
         {
-            generated_token_probs.push_back(token_with_probs);
+            generated_token_probs.push_back(token_with_probs, generated_text.size());
         }
 
         // check if there is incomplete UTF-8 character at the end
@@ -26,6 +26,34 @@ class Llms {
     return llmsPlatform.instance.getCpuInfo();
   }
 
+  /// Reads the fields of the context's model info from its GGUF header,
+  /// without loading it, with the memory a context of [nCtx] (0 for the
+  /// training context), [nBatch] and cache types [typeK]/[typeV] would take.
+  /// The large tokenizer arrays are skipped unless [skip] is given, and are
+  /// otherwise given as their length.
+  Future<Map<Object?, dynamic>?> modelInfo(String path,
+      {List<String>? skip = const [
+        "tokenizer.ggml.tokens",
+        "tokenizer.ggml.token_type",
+        "tokenizer.ggml.merges",
+        "tokenizer.ggml.scores",
+      ],
+      int nCtx = 512,
+      int nBatch = 512,
+      String typeK = "f16",
+      String typeV = "f16"}) {
+    if (File(path).existsSync()) {
+      return llmsPlatform.instance.modelInfo(path,
+          skip: skip,
+          nCtx: nCtx,
+          nBatch: nBatch,
+          typeK: typeK,
+          typeV: typeV);
+    } else {
+      throw ArgumentError("Model not found !");
+    }
+  }
+
   Future<Map<Object?, dynamic>?> initContext(String model,
       {bool embedding = false,
       int nCtx = 512,
@@ -30,6 +30,24 @@ class MethodChannelllms extends llmsPlatform {
   }
 
   // === LLama ===
+  @override
+  Future<Map<Object?, dynamic>?> modelInfo(String path,
+      {List<String>? skip,
+      int nCtx = 512,
+      int nBatch = 512,
+      String typeK = "f16",
+      String typeV = "f16"}) async {
+    return await methodChannel.invokeMethod<Map<Object?, dynamic>>(
+        "modelInfo", {
+      "path": path,
+      "skip": skip,
+      "n_ctx": nCtx,
+      "n_batch": nBatch,
+      "cache_type_k": typeK,
+      "cache_type_v": typeV,
+    });
+  }
+
   @override
   Future<Map<Object?, dynamic>?> initContext(String model,
       {int modelType = 1,
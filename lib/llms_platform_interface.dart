@@ -37,6 +37,16 @@ abstract class llmsPlatform extends PlatformInterface {
         "Method getFileSHA256(String filePath) has not been implemented.");
   }
 
+  Future<Map<Object?, dynamic>?> modelInfo(String path,
+      {List<String>? skip,
+      int nCtx = 512,
+      int nBatch = 512,
+      String typeK = "f16",
+      String typeV = "f16"}) {
+    throw UnimplementedError(
+        "Method modelInfo(String path, {List<String>? skip}) has not been implemented.");
+  }
+
   Future<Map<Object?, dynamic>?> initContext(String model,
       {bool embedding = false,
       int nCtx = 768,